@@ -26,27 +26,172 @@
 
 
 #include "checksum.h"
+#include <string.h>
 
-uint32_t add_checksum(void *buffer, uint16_t length) {
-        uint32_t sum = 0;
-        uint16_t * buff = (uint16_t *) buffer;
-        uint16_t count = length;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+/* All of the implementations below compute the same ones-complement sum of
+ * the buffer, treated as a sequence of 16 bit words in host byte order. The
+ * result is always folded back down to 16 bits (without being complemented)
+ * so that callers can safely add several partial sums together before
+ * passing the total to finish_checksum().
+ */
+
+static inline uint32_t fold_checksum64(uint64_t sum) {
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint32_t)sum;
+}
+
+/* Sums whatever is left over once the wide loops have run out of full
+ * words. A trailing odd byte is treated as if it were padded with a zero,
+ * exactly as RFC 1071 describes. */
+static inline uint64_t add_checksum_tail(const uint8_t *buff, uint16_t count) {
+	uint64_t sum = 0;
 	uint16_t val;
 
-        while(count > 1 ) {
-                val = *buff;
+	while (count > 1) {
+		memcpy(&val, buff, sizeof(val));
 		sum += val;
-		buff ++;
-                count = count -2;
-        }
-
-        if(count > 0) {
-		sum += *(uint8_t *)buff;
-        }
+		buff += 2;
+		count -= 2;
+	}
 
+	if (count > 0) {
+		val = 0;
+		memcpy(&val, buff, 1);
+		sum += val;
+	}
 	return sum;
 }
 
+/* Portable version: accumulate 64 bits at a time with end-around carry */
+static uint32_t add_checksum_wide(void *buffer, uint16_t length) {
+	const uint8_t *buff = (const uint8_t *)buffer;
+	uint64_t sum = 0;
+	uint64_t word;
+	uint64_t tail;
+
+	while (length >= 32) {
+		uint64_t w[4];
+		memcpy(w, buff, sizeof(w));
+		sum += w[0];
+		sum += (sum < w[0]);
+		sum += w[1];
+		sum += (sum < w[1]);
+		sum += w[2];
+		sum += (sum < w[2]);
+		sum += w[3];
+		sum += (sum < w[3]);
+		buff += 32;
+		length -= 32;
+	}
+
+	while (length >= 8) {
+		memcpy(&word, buff, sizeof(word));
+		sum += word;
+		sum += (sum < word);
+		buff += 8;
+		length -= 8;
+	}
+
+	tail = add_checksum_tail(buff, length);
+	sum += tail;
+	sum += (sum < tail);
+	return fold_checksum64(sum);
+}
+
+#ifdef CHECKSUM_X86_DISPATCH
+
+/* Each 16 byte block is widened into 32 bit lanes, so every lane receives
+ * two 16 bit words per block. With lengths capped at 65535 bytes none of the
+ * lanes can overflow before the final horizontal add.
+ */
+__attribute__((target("sse2")))
+static uint32_t add_checksum_sse2(void *buffer, uint16_t length) {
+	const uint8_t *buff = (const uint8_t *)buffer;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	uint32_t lanes[4];
+	uint64_t sum;
+
+	while (length >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)buff);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		buff += 16;
+		length -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	sum += add_checksum_tail(buff, length);
+	return fold_checksum64(sum);
+}
+
+__attribute__((target("avx2")))
+static uint32_t add_checksum_avx2(void *buffer, uint16_t length) {
+	const uint8_t *buff = (const uint8_t *)buffer;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	int i;
+
+	while (length >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)buff);
+		acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+		acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+		buff += 32;
+		length -= 32;
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for (i = 0; i < 8; i++)
+		sum += lanes[i];
+	sum += add_checksum_tail(buff, length);
+	return fold_checksum64(sum);
+}
+
+#endif
+
+static uint32_t add_checksum_resolve(void *buffer, uint16_t length);
+
+/* Starts out pointing at the resolver, which replaces itself with the best
+ * implementation for this CPU on first use. Every candidate produces the
+ * same answer so a race between two threads resolving at once is harmless.
+ */
+static uint32_t (*add_checksum_impl)(void *, uint16_t) = add_checksum_resolve;
+
+static uint32_t add_checksum_resolve(void *buffer, uint16_t length) {
+	uint32_t (*impl)(void *, uint16_t) = add_checksum_wide;
+
+#ifdef CHECKSUM_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = add_checksum_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = add_checksum_sse2;
+#endif
+	add_checksum_impl = impl;
+	return impl(buffer, length);
+}
+
+uint32_t add_checksum(void *buffer, uint16_t length) {
+	/* Short buffers (pseudo header fields etc.) are not worth an
+	 * indirect call */
+	if (length < 16)
+		return fold_checksum64(add_checksum_tail(
+				(const uint8_t *)buffer, length));
+	return add_checksum_impl(buffer, length);
+}
+
 uint16_t finish_checksum(uint32_t sum) {
         while (sum>>16) {
                 sum = (sum & 0xffff) + (sum >> 16);
@@ -99,4 +244,34 @@ uint32_t ipv6_pseudo_checksum(libtrace_ip6_t *ip) {
 
 }
 
+/* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+static void update_checksum(void *csum, uint32_t old_sum,
+		uint32_t new_sum) {
+	uint16_t cur;
+	uint32_t sum;
+
+	/* csum usually points into a packed header */
+	memcpy(&cur, csum, sizeof(cur));
+	sum = (uint16_t)~cur;
+	sum += (uint16_t)~fold_checksum64(old_sum);
+	sum += fold_checksum64(new_sum);
+	cur = finish_checksum(sum);
+	memcpy(csum, &cur, sizeof(cur));
+}
 
+DLLEXPORT void trace_checksum_update16(void *csum, uint16_t oldval,
+		uint16_t newval) {
+	update_checksum(csum, oldval, newval);
+}
+
+DLLEXPORT void trace_checksum_update32(void *csum, uint32_t oldval,
+		uint32_t newval) {
+	update_checksum(csum, (oldval >> 16) + (oldval & 0xffff),
+			(newval >> 16) + (newval & 0xffff));
+}
+
+DLLEXPORT void trace_checksum_update_buffer(void *csum,
+		const void *oldbuf, const void *newbuf, uint16_t length) {
+	update_checksum(csum, add_checksum((void *)oldbuf, length),
+			add_checksum((void *)newbuf, length));
+}
@@ -27,121 +27,109 @@
 
 #include "libtrace.h"
 #include "libtrace_int.h"
-#include "data-struct/deque.h"
+#include "data-struct/result_ring.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* TODO hook up configuration option for sequentual packets again */
 
 static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	int i = 0;
 	assert(trace_get_perpkt_threads(t) > 0);
-	libtrace_queue_t *queues;
-	c->queues = calloc(sizeof(libtrace_queue_t), trace_get_perpkt_threads(t));
-	queues = c->queues;
+	libtrace_result_ring_t *queues;
+	size_t size = RESULT_RING_SIZE;
+
+	if (size < t->config.reporter_thold * 4)
+		size = t->config.reporter_thold * 4;
+	if (posix_memalign((void **) &queues, CACHE_LINE_SIZE,
+			sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t)) != 0)
+		return -1;
+	memset(queues, 0, sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t));
+	c->queues = queues;
 	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
-		libtrace_deque_init(&queues[i], sizeof(libtrace_result_t));
+		if (libtrace_result_ring_init(&queues[i], size) != 0)
+			return -1;
 	}
 	return 0;
 }
 
 static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
-	libtrace_queue_t *queue = &((libtrace_queue_t*)c->queues)[t_id];
-	//while (libtrace_deque_get_size(&t->deque) >= 1000)
-	//	sched_yield();
-	libtrace_deque_push_back(queue, res); // Automatically locking for us :)
+	libtrace_result_ring_t *queue = &((libtrace_result_ring_t*)c->queues)[t_id];
 
-	if (libtrace_deque_get_size(queue) >= trace->config.reporter_thold) {
+	/* The reporter can't drain this queue until every other thread has
+	 * published something, so never block here. A full ring spills into
+	 * its overflow queue instead. */
+	libtrace_result_ring_push(queue, res);
+
+	if ((queue->head + queue->spilled) % trace->config.reporter_thold == 0) {
 		trace_post_reporter(trace);
 	}
 }
 
-inline static int peek_queue(libtrace_t *trace, libtrace_combine_t *c,
-                libtrace_queue_t *v, uint64_t *key, libtrace_result_t *peeked) {
-
-        libtrace_result_t r;
-        if (!peeked) {
-                libtrace_deque_peek_front(v, (void *) &r);
-                peeked = &r;
-        }
-
-        /* Ticks are a bit tricky, because we can get TS
-         * ticks in amongst packets indexed by their cardinal
-         * order and vice versa. Also, every thread will
-         * produce an equivalent tick and we should really
-         * combine those into a single tick for the reporter
-         * thread.
-         */
-
-        if (peeked->type == RESULT_TICK_INTERVAL) {
-                if (peeked->key > c->last_ts_tick) {
-                        c->last_ts_tick = peeked->key;
-
-                        /* Pass straight to reporter */
-                        libtrace_generic_t gt = {.res = peeked};
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        send_message(trace, &trace->reporter_thread,
-                                        MESSAGE_RESULT, gt,
-                                        &trace->reporter_thread);
-                        return 0;
+/* Returns the key of the next result on a queue, passing on or discarding
+ * any ticks found along the way. Returns 0 if the queue is empty */
+inline static int next_message(libtrace_t *trace, libtrace_combine_t *c,
+                libtrace_result_ring_t *v, uint64_t *key) {
+
+        libtrace_result_t *peeked;
+
+        while ((peeked = libtrace_result_ring_peek(v)) != NULL) {
+                libtrace_result_t r = *peeked;
+                libtrace_generic_t gt = {.res = &r};
+
+                /* Ticks are a bit tricky, because we can get TS
+                 * ticks in amongst packets indexed by their cardinal
+                 * order and vice versa. Also, every thread will
+                 * produce an equivalent tick and we should really
+                 * combine those into a single tick for the reporter
+                 * thread.
+                 */
+                if (peeked->type == RESULT_TICK_INTERVAL) {
+                        libtrace_result_ring_pop(v);
+                        if (r.key > c->last_ts_tick) {
+                                c->last_ts_tick = r.key;
 
-                } else {
-                        /* Duplicate -- pop it */
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        return 0;
+                                /* Pass straight to reporter */
+                                send_message(trace, &trace->reporter_thread,
+                                                MESSAGE_RESULT, gt,
+                                                &trace->reporter_thread);
+                        }
+                        /* Otherwise it's a duplicate -- drop it */
+                        continue;
                 }
-        }
 
-        if (peeked->type == RESULT_TICK_COUNT) {
-                if (peeked->key > c->last_count_tick) {
-                        c->last_count_tick = peeked->key;
+                if (peeked->type == RESULT_TICK_COUNT) {
+                        if (r.key <= c->last_count_tick) {
+                                /* Duplicate -- pop it */
+                                libtrace_result_ring_pop(v);
+                                continue;
+                        }
+                        c->last_count_tick = r.key;
 
                         /* Tick doesn't match packet order */
                         if (trace_is_parallel(trace)) {
                                 /* Pass straight to reporter */
-                                libtrace_generic_t gt = {.res = peeked};
-                                ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
+                                libtrace_result_ring_pop(v);
                                 send_message(trace, &trace->reporter_thread,
                                                 MESSAGE_RESULT, gt,
                                                 &trace->reporter_thread);
-                                return 0;
+                                continue;
                         }
                         /* Tick matches packet order */
-                        *key = peeked->key;
-                        return 1;
-
-                        /* Tick doesn't match packet order */
-                } else {
-                        /* Duplicate -- pop it */
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        return 0;
-                }
-        }
-
-        *key = peeked->key;
-        return 1;
-}
-
-inline static uint64_t next_message(libtrace_t *trace, libtrace_combine_t *c,
-                libtrace_queue_t *v) {
-
-        libtrace_result_t r;
-        uint64_t nextkey = 0;
-
-        do {
-                if (libtrace_deque_peek_front(v, (void *) &r) == 0) {
-                        return 0;
                 }
-        } while (peek_queue(trace, c, v, &nextkey, &r) == 0);
 
-        return nextkey;
+                *key = peeked->key;
+                return 1;
+        }
+        return 0;
 }
 
 
 inline static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const bool final){
 	int i;
 	int live_count = 0;
-        libtrace_queue_t *queues = c->queues;
+        libtrace_result_ring_t *queues = c->queues;
 	bool allactive = true;
         bool live[trace_get_perpkt_threads(trace)]; // Set if a trace is alive
 	uint64_t key[trace_get_perpkt_threads(trace)]; // Cached keys
@@ -151,13 +139,12 @@ inline static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const
 
 	/* Loop through check all are alive (have data) and find the smallest */
         for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-		libtrace_queue_t *v = &queues[i];
-                if (libtrace_deque_get_size(v) != 0 &&
-                                peek_queue(trace, c, v, &peeked, NULL)) {
+		libtrace_result_ring_t *v = &queues[i];
+                if (next_message(trace, c, v, &peeked)) {
                         live_count ++;
                         live[i] = true;
                         key[i] = peeked;
-                        if (i == 0 || min_key > peeked) {
+                        if (min_queue == -1 || min_key > peeked) {
                                 min_key = peeked;
                                 min_queue = i;
                         }
@@ -173,20 +160,17 @@ inline static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const
 	 * value or less than the previous */
         while (allactive || (live_count && final)) {
 		/* Get the minimum queue and then do stuff */
-		libtrace_result_t r;
+		libtrace_result_t r = *libtrace_result_ring_peek(&queues[min_queue]);
 		libtrace_generic_t gt = {.res = &r};
 
-		ASSERT_RET (libtrace_deque_pop_front(&queues[min_queue], (void *) &r), == 1);
-
-                //printf("%lu %lu %lu %lu %d\n", key[0], key[1], key[2], key[3], min_queue);
+		libtrace_result_ring_pop(&queues[min_queue]);
 
                 send_message(trace, &trace->reporter_thread,
                                 MESSAGE_RESULT, gt,
                                 NULL);
 
 		// Now update the one we just removed
-                peeked = next_message(trace, c, &queues[min_queue]);
-                if (peeked != 0) {
+                if (next_message(trace, c, &queues[min_queue], &peeked)) {
 
                         key[min_queue] = peeked;
                         // We are still the smallest, might be out of order :(
@@ -226,13 +210,13 @@ static void read(libtrace_t *trace, libtrace_combine_t *c) {
 
 static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
         int empty = 0, i;
-        libtrace_queue_t *q = c->queues;
+        libtrace_result_ring_t *q = c->queues;
 
         do {
                 read_internal(trace, c, true);
                 empty = 0;
 		for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-                        if (libtrace_deque_get_size(&q[i]) == 0)
+                        if (libtrace_result_ring_get_size(&q[i]) == 0)
                                 empty ++;
                 }
         }
@@ -241,10 +225,10 @@ static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
 
 static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
 	int i;
-	libtrace_queue_t *queues = c->queues;
+	libtrace_result_ring_t *queues = c->queues;
 
 	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		assert(libtrace_deque_get_size(&queues[i]) == 0);
+		libtrace_result_ring_destroy(&queues[i]);
 	}
 	free(queues);
 	queues = NULL;
@@ -252,10 +236,10 @@ static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
 
 
 static void pause(libtrace_t *trace, libtrace_combine_t *c) {
-	libtrace_queue_t *queues = c->queues;
+	libtrace_result_ring_t *queues = c->queues;
 	int i;
 	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		libtrace_deque_apply_function(&queues[i], (deque_data_fn) libtrace_make_result_safe);
+		libtrace_result_ring_apply_function(&queues[i], (deque_data_fn) libtrace_make_result_safe);
 	}
 }
 
@@ -0,0 +1,267 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "data-struct/result_ring.h"
+#include "data-struct/deque.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The lateness window used if none is configured, in milliseconds */
+#define DEFAULT_WINDOW_MS 1000
+
+struct timestamp_combiner {
+	libtrace_result_ring_t *queues;
+	/* For each thread, the oldest timestamp it is still expected to
+	 * publish */
+	uint64_t *marks;
+	/* The newest timestamp seen from any thread */
+	uint64_t latest;
+	/* The newest timestamp passed on to the reporter */
+	uint64_t released;
+	/* How far behind the newest timestamp a result may be held back, as
+	 * an ERF timestamp */
+	uint64_t window;
+	/* Tick intervals waiting on the results before them */
+	libtrace_queue_t ticks;
+};
+
+static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
+	int i = 0;
+	assert(trace_get_perpkt_threads(t) > 0);
+	struct timestamp_combiner *st;
+	size_t size = RESULT_RING_SIZE;
+	uint64_t window_ms = c->configuration.uint64;
+
+	if (window_ms == 0)
+		window_ms = DEFAULT_WINDOW_MS;
+	if (size < t->config.reporter_thold * 4)
+		size = t->config.reporter_thold * 4;
+	st = calloc(1, sizeof(struct timestamp_combiner));
+	if (!st)
+		return -1;
+	if (posix_memalign((void **) &st->queues, CACHE_LINE_SIZE,
+			sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t)) != 0) {
+		free(st);
+		return -1;
+	}
+	memset(st->queues, 0, sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t));
+	st->marks = calloc(trace_get_perpkt_threads(t), sizeof(uint64_t));
+	st->window = (window_ms << 32) / 1000;
+	libtrace_deque_init(&st->ticks, sizeof(uint64_t));
+	c->queues = st;
+	if (!st->marks)
+		return -1;
+	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
+		if (libtrace_result_ring_init(&st->queues[i], size) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
+	struct timestamp_combiner *st = c->queues;
+	libtrace_result_ring_t *queue = &st->queues[t_id];
+
+	/* Like the ordered combiner the reporter may be waiting on another
+	 * thread, so never block here */
+	libtrace_result_ring_push(queue, res);
+
+	if ((queue->head + queue->spilled) % trace->config.reporter_thold == 0) {
+		trace_post_reporter(trace);
+	}
+}
+
+/* Returns the timestamp of the next result on a thread's queue, taking any
+ * ticks found along the way. Returns 0 if the queue is empty */
+static int next_result(libtrace_t *trace, libtrace_combine_t *c, int t_id,
+                       uint64_t *key) {
+	struct timestamp_combiner *st = c->queues;
+	libtrace_result_ring_t *v = &st->queues[t_id];
+	libtrace_result_t *peeked;
+
+	while ((peeked = libtrace_result_ring_peek(v)) != NULL) {
+		libtrace_result_t r = *peeked;
+		libtrace_generic_t gt = {.res = &r};
+
+		if (r.type == RESULT_TICK_INTERVAL) {
+			libtrace_result_ring_pop(v);
+			/* Every thread publishes the same tick, keep one to
+			 * pass on once the results before it have gone */
+			if (r.key > c->last_ts_tick) {
+				c->last_ts_tick = r.key;
+				libtrace_deque_push_back(&st->ticks, &r.key);
+			}
+			/* The tick is the time now on a live capture, the
+			 * thread may still have older packets to get
+			 * through but not by more than the window */
+			if (trace->format->info.live) {
+				if (r.key > st->latest)
+					st->latest = r.key;
+				if (r.key > st->window &&
+				    r.key - st->window > st->marks[t_id])
+					st->marks[t_id] = r.key - st->window;
+			}
+			continue;
+		}
+
+		if (r.type == RESULT_TICK_COUNT) {
+			/* Counts have nothing to do with time, pass
+			 * these straight on */
+			libtrace_result_ring_pop(v);
+			if (r.key > c->last_count_tick) {
+				c->last_count_tick = r.key;
+				send_message(trace, &trace->reporter_thread,
+				             MESSAGE_RESULT, gt,
+				             &trace->reporter_thread);
+			}
+			continue;
+		}
+
+		if (r.key > st->marks[t_id])
+			st->marks[t_id] = r.key;
+		if (r.key > st->latest)
+			st->latest = r.key;
+		*key = r.key;
+		return 1;
+	}
+	return 0;
+}
+
+/* Passes on the ticks up to and including the given timestamp */
+static void release_ticks(libtrace_t *trace, struct timestamp_combiner *st,
+                          uint64_t upto) {
+	libtrace_result_t r;
+	libtrace_generic_t gt = {.res = &r};
+	uint64_t tick;
+
+	while (libtrace_deque_peek_front(&st->ticks, &tick) && tick <= upto) {
+		libtrace_deque_pop_front(&st->ticks, &tick);
+		memset(&r, 0, sizeof(r));
+		r.type = RESULT_TICK_INTERVAL;
+		r.key = tick;
+		send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
+		             gt, &trace->reporter_thread);
+	}
+}
+
+/* Merges the results by timestamp. The oldest result is passed on once no
+ * thread is waiting to publish anything older, either as every thread has
+ * published something newer (or been ticked past it), or as it is more
+ * than the window behind the newest result. Unless final, when everything
+ * goes. */
+static void read_internal(libtrace_t *trace, libtrace_combine_t *c,
+                          const bool final) {
+	struct timestamp_combiner *st = c->queues;
+	uint64_t min_key;
+	uint64_t bound;
+	uint64_t key;
+	int min_queue;
+	int i;
+
+	for (;;) {
+		min_key = UINT64_MAX;
+		min_queue = -1;
+		/* The oldest that a thread with nothing queued might publish */
+		bound = UINT64_MAX;
+		for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
+			if (next_result(trace, c, i, &key)) {
+				if (min_queue == -1 || key < min_key) {
+					min_key = key;
+					min_queue = i;
+				}
+			} else if (st->marks[i] < bound) {
+				bound = st->marks[i];
+			}
+		}
+		if (st->latest > st->window &&
+		    st->latest - st->window > bound)
+			bound = st->latest - st->window;
+		if (min_queue == -1 || (!final && min_key > bound))
+			break;
+
+		libtrace_result_t r = *libtrace_result_ring_peek(&st->queues[min_queue]);
+		libtrace_generic_t gt = {.res = &r};
+
+		libtrace_result_ring_pop(&st->queues[min_queue]);
+		release_ticks(trace, st, r.key);
+		if (r.key < st->released)
+			trace->reporter_thread.runtime.stats.combiner_late++;
+		else
+			st->released = r.key;
+		send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
+		             gt, NULL);
+	}
+	release_ticks(trace, st, final ? UINT64_MAX : bound);
+}
+
+static void read(libtrace_t *trace, libtrace_combine_t *c) {
+	read_internal(trace, c, false);
+}
+
+static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
+	read_internal(trace, c, true);
+}
+
+static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
+	struct timestamp_combiner *st = c->queues;
+	uint64_t tick;
+	int i;
+
+	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
+		libtrace_result_ring_destroy(&st->queues[i]);
+	}
+	while (libtrace_deque_pop_front(&st->ticks, &tick))
+		;
+	free(st->queues);
+	free(st->marks);
+	free(st);
+}
+
+static void pause(libtrace_t *trace, libtrace_combine_t *c) {
+	struct timestamp_combiner *st = c->queues;
+	int i;
+	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
+		libtrace_result_ring_apply_function(&st->queues[i], (deque_data_fn) libtrace_make_result_safe);
+	}
+}
+
+DLLEXPORT const libtrace_combine_t combiner_timestamp = {
+	init_combiner,	/* initialise */
+	destroy,		/* destroy */
+	publish,		/* publish */
+	read,			/* read */
+	read_final,		/* read_final */
+	pause,			/* pause */
+	NULL,			/* queues */
+	0,			/* last_count_tick */
+	0,			/* last_ts_tick */
+	{0}			/* opts */
+};
@@ -27,42 +27,69 @@
 
 #include "libtrace.h"
 #include "libtrace_int.h"
-#include "data-struct/deque.h"
+#include "data-struct/result_ring.h"
 #include <assert.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* How many times a full ring makes the publishing thread yield to the
+ * reporter before the result is spilled into the overflow queue */
+#define PUBLISH_MAX_YIELDS 1000
 
 static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	int i = 0;
 	assert(trace_get_perpkt_threads(t) > 0);
-	libtrace_queue_t *queues;
-	c->queues = calloc(sizeof(libtrace_queue_t), trace_get_perpkt_threads(t));
-	queues = c->queues;
+	libtrace_result_ring_t *queues;
+	size_t size = RESULT_RING_SIZE;
+
+	if (size < t->config.reporter_thold * 4)
+		size = t->config.reporter_thold * 4;
+	if (posix_memalign((void **) &queues, CACHE_LINE_SIZE,
+			sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t)) != 0)
+		return -1;
+	memset(queues, 0, sizeof(libtrace_result_ring_t) * trace_get_perpkt_threads(t));
+	c->queues = queues;
 	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
-		libtrace_deque_init(&queues[i], sizeof(libtrace_result_t));
+		if (libtrace_result_ring_init(&queues[i], size) != 0)
+			return -1;
 	}
 	return 0;
 }
 
 static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
-	libtrace_queue_t *queue = &((libtrace_queue_t*)c->queues)[t_id];
-	libtrace_deque_push_back(queue, res); // Automatically locking for us :)
+	libtrace_result_ring_t *queue = &((libtrace_result_ring_t*)c->queues)[t_id];
+	int yields = 0;
+
+	/* The reporter always drains everything it can see, so if we have
+	 * got ahead of it wait for it to catch up rather than queueing more */
+	while (!libtrace_result_ring_try_push(queue, res)) {
+		if (yields == 0)
+			trace_post_reporter(trace);
+		if (++yields > PUBLISH_MAX_YIELDS) {
+			libtrace_result_ring_push(queue, res);
+			break;
+		}
+		sched_yield();
+	}
 
-	if (libtrace_deque_get_size(queue) >= trace->config.reporter_thold) {
+	if ((queue->head + queue->spilled) % trace->config.reporter_thold == 0) {
 		trace_post_reporter(trace);
 	}
 }
 
 static void read(libtrace_t *trace, libtrace_combine_t *c){
-	libtrace_queue_t *queues = c->queues;
+	libtrace_result_ring_t *queues = c->queues;
+	libtrace_result_t *peeked;
 	int i;
 
 	/* Loop through and read all that are here */
 	for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-		libtrace_queue_t *v = &queues[i];
-		while (libtrace_deque_get_size(v) != 0) {
-			libtrace_result_t r;
+		libtrace_result_ring_t *v = &queues[i];
+		while ((peeked = libtrace_result_ring_peek(v)) != NULL) {
+			libtrace_result_t r = *peeked;
                         libtrace_generic_t gt = {.res = &r};
-			ASSERT_RET (libtrace_deque_pop_front(v, (void *) &r), == 1);
+			libtrace_result_ring_pop(v);
                         /* Ignore any ticks that we've already seen */
                         if (r.type == RESULT_TICK_INTERVAL) {
                                 if (r.key <= c->last_ts_tick)
@@ -83,10 +110,10 @@ static void read(libtrace_t *trace, libtrace_combine_t *c){
 
 static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
 	int i;
-	libtrace_queue_t *queues = c->queues;
+	libtrace_result_ring_t *queues = c->queues;
 
 	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		assert(libtrace_deque_get_size(&queues[i]) == 0);
+		libtrace_result_ring_destroy(&queues[i]);
 	}
 	free(queues);
 	queues = NULL;
@@ -49,7 +49,7 @@ DLLEXPORT libtrace_bucket_t *libtrace_bucket_init() {
 
         b->nextid = 199999;
         b->node = NULL;
-        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t));
+        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t *));
 
         pthread_mutex_init(&b->lock, NULL);
         pthread_cond_init(&b->cond, NULL);
@@ -76,7 +76,7 @@ DLLEXPORT void libtrace_bucket_destroy(libtrace_bucket_t *b) {
 
 DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
 
-        libtrace_bucket_node_t tmp;
+        libtrace_bucket_node_t *tmp;
         libtrace_bucket_node_t *bnode = (libtrace_bucket_node_t *)malloc(
                         sizeof(libtrace_bucket_node_t));
 
@@ -127,8 +127,6 @@ DLLEXPORT uint64_t libtrace_push_into_bucket(libtrace_bucket_t *b) {
                 while (b->packets[b->nextid] != NULL) {
                         /* No more packet slots available! */
                         pthread_cond_wait(&b->cond, &b->lock);
-                        pthread_mutex_unlock(&b->lock);
-
                 }
                 b->node->startindex = b->nextid;
                 b->node->activemembers = 1;
@@ -161,8 +159,6 @@ DLLEXPORT uint64_t libtrace_push_into_bucket(libtrace_bucket_t *b) {
         while (b->packets[b->nextid] != NULL) {
                 /* No more packet slots available! */
                 pthread_cond_wait(&b->cond, &b->lock);
-                pthread_mutex_unlock(&b->lock);
-
         }
         b->packets[b->nextid] = b->node;
         b->node->activemembers ++;
@@ -180,7 +176,7 @@ DLLEXPORT void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id) {
         uint16_t s, i;
         libtrace_bucket_node_t *bnode, *front;
         libtrace_list_node_t *lnode;
-        libtrace_bucket_node_t tmp;
+        libtrace_bucket_node_t *tmp;
 
         assert(id != 0);
 
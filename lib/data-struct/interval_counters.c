@@ -0,0 +1,282 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "interval_counters.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+DLLEXPORT int libtrace_interval_counters_init(libtrace_interval_counters_t *ic,
+		uint64_t length, int ncounters, int nthreads, size_t nbuckets) {
+	size_t i;
+	int j;
+
+	memset(ic, 0, sizeof(*ic));
+	if (length == 0 || ncounters <= 0 || nthreads <= 0 || nbuckets == 0)
+		return -1;
+
+	ic->length = length;
+	ic->ncounters = ncounters;
+	ic->nthreads = nthreads;
+	ic->active = nthreads;
+	ic->nbuckets = nbuckets;
+	if (posix_memalign((void **)&ic->threads, CACHE_LINE_SIZE,
+			sizeof(libtrace_interval_thread_t) * nthreads) != 0) {
+		ic->threads = NULL;
+		return -1;
+	}
+	memset(ic->threads, 0, sizeof(libtrace_interval_thread_t) * nthreads);
+	ic->storage = calloc(nbuckets * nthreads * ncounters, sizeof(uint64_t));
+
+	for (j = 0; j < nthreads; j++) {
+		libtrace_interval_thread_t *th = &ic->threads[j];
+
+		th->buckets = malloc(sizeof(libtrace_interval_bucket_t) * nbuckets);
+		if (!th->buckets || !ic->storage) {
+			libtrace_interval_counters_destroy(ic);
+			return -1;
+		}
+		th->progress.thread = j;
+		th->progress.counters = NULL;
+		for (i = 0; i < nbuckets; i++) {
+			th->buckets[i].interval = 0;
+			th->buckets[i].thread = j;
+			th->buckets[i].counters = ic->storage +
+					(j * nbuckets + i) * ncounters;
+		}
+	}
+	return 0;
+}
+
+DLLEXPORT void libtrace_interval_counters_destroy(libtrace_interval_counters_t *ic) {
+	int j;
+
+	if (ic->threads) {
+		for (j = 0; j < ic->nthreads; j++)
+			free(ic->threads[j].buckets);
+		free(ic->threads);
+	}
+	free(ic->storage);
+	free(ic->window);
+	memset(ic, 0, sizeof(*ic));
+}
+
+/* Limits the threads that the reporter waits for to those that the trace
+ * has started, which is only known once the processing threads are running */
+static void note_threads(libtrace_interval_counters_t *ic, libtrace_t *trace) {
+	int active = trace_get_perpkt_threads(trace);
+
+	if (active > ic->nthreads)
+		active = ic->nthreads;
+	if (active != __atomic_load_n(&ic->active, __ATOMIC_RELAXED))
+		__atomic_store_n(&ic->active, active, __ATOMIC_RELEASE);
+}
+
+/* Closes the thread's current bucket, publishing it if anything was counted
+ * in it, and starts counting into a bucket for the given interval */
+static void advance(libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t, libtrace_interval_thread_t *th,
+		uint64_t interval, uint64_t watermark) {
+	libtrace_generic_t value;
+	libtrace_interval_bucket_t *next = th->current;
+
+	note_threads(ic, trace);
+	if (th->current && th->dirty) {
+		value.ptr = th->current;
+		th->head ++;
+		next = &th->buckets[th->head % ic->nbuckets];
+	} else {
+		/* Nothing to merge, but the reporter still needs to know
+		 * that we have moved on */
+		value.ptr = &th->progress;
+	}
+	trace_publish_result(trace, t, watermark, value, RESULT_USER);
+	trace_post_reporter(trace);
+
+	if (watermark == UINT64_MAX)
+		return;
+
+	/* Only wait if the reporter is a whole ring behind us */
+	while (th->head - __atomic_load_n(&th->tail, __ATOMIC_ACQUIRE) >=
+			ic->nbuckets) {
+		trace_post_reporter(trace);
+		sched_yield();
+	}
+
+	if (next == NULL)
+		next = &th->buckets[th->head % ic->nbuckets];
+	memset(next->counters, 0, sizeof(uint64_t) * ic->ncounters);
+	next->interval = interval;
+	th->current = next;
+	th->dirty = 0;
+}
+
+static void open_first(libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_interval_thread_t *th, uint64_t interval) {
+	note_threads(ic, trace);
+	th->current = &th->buckets[th->head % ic->nbuckets];
+	memset(th->current->counters, 0, sizeof(uint64_t) * ic->ncounters);
+	th->current->interval = interval;
+	th->dirty = 0;
+}
+
+DLLEXPORT uint64_t *libtrace_interval_counters_get(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t, uint64_t ts) {
+	libtrace_interval_thread_t *th =
+			&ic->threads[trace_get_perpkt_thread_id(t)];
+	uint64_t interval = ts / ic->length;
+
+	if (th->current == NULL)
+		open_first(ic, trace, th, interval);
+	else if (interval > th->current->interval)
+		advance(ic, trace, t, th, interval, interval);
+
+	th->dirty = 1;
+	return th->current->counters;
+}
+
+DLLEXPORT void libtrace_interval_counters_tick(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t, uint64_t ts) {
+	libtrace_interval_thread_t *th =
+			&ic->threads[trace_get_perpkt_thread_id(t)];
+	uint64_t interval = ts / ic->length;
+
+	if (th->current == NULL || interval > th->current->interval)
+		advance(ic, trace, t, th, interval, interval);
+}
+
+DLLEXPORT void libtrace_interval_counters_finish(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t) {
+	libtrace_interval_thread_t *th =
+			&ic->threads[trace_get_perpkt_thread_id(t)];
+
+	advance(ic, trace, t, th, 0, UINT64_MAX);
+	th->current = NULL;
+}
+
+static inline uint64_t *window_slot(libtrace_interval_counters_t *ic,
+		uint64_t interval) {
+	size_t pos = (ic->window_first + (interval - ic->window_start)) &
+			(ic->window_size - 1);
+	return ic->window + pos * ic->ncounters;
+}
+
+/* Extends the window to include the given interval. Slots outside of the
+ * window are always kept zeroed. */
+static int window_cover(libtrace_interval_counters_t *ic, uint64_t interval) {
+	uint64_t lo, hi, i;
+	size_t size;
+	uint64_t *window;
+
+	if (!ic->started) {
+		ic->window_start = interval;
+		ic->started = 1;
+	}
+	lo = interval < ic->window_start ? interval : ic->window_start;
+	hi = ic->window_start + ic->window_count;
+	if (interval >= hi)
+		hi = interval + 1;
+
+	if (hi - lo > ic->window_size) {
+		size = ic->window_size ? ic->window_size : 16;
+		while (size < hi - lo)
+			size <<= 1;
+		window = calloc(size * ic->ncounters, sizeof(uint64_t));
+		if (!window)
+			return -1;
+		for (i = 0; i < ic->window_count; i++) {
+			memcpy(window + (ic->window_start - lo + i) * ic->ncounters,
+				window_slot(ic, ic->window_start + i),
+				sizeof(uint64_t) * ic->ncounters);
+		}
+		free(ic->window);
+		ic->window = window;
+		ic->window_size = size;
+		ic->window_first = 0;
+	} else {
+		ic->window_first = (ic->window_first - (ic->window_start - lo)) &
+				(ic->window_size - 1);
+	}
+	ic->window_start = lo;
+	ic->window_count = hi - lo;
+	return 0;
+}
+
+DLLEXPORT void libtrace_interval_counters_merge(
+		libtrace_interval_counters_t *ic, libtrace_result_t *result) {
+	libtrace_interval_bucket_t *bucket = result->value.ptr;
+	libtrace_interval_thread_t *th = &ic->threads[bucket->thread];
+	uint64_t interval;
+	uint64_t *slot;
+	int i;
+
+	if (bucket->counters) {
+		interval = bucket->interval;
+		/* Intervals that have already been reported can't be
+		 * reopened, so count anything late in the oldest one left */
+		if (ic->reported && interval < ic->window_start)
+			interval = ic->window_start;
+		if (window_cover(ic, interval) == 0) {
+			slot = window_slot(ic, interval);
+			for (i = 0; i < ic->ncounters; i++)
+				slot[i] += bucket->counters[i];
+		}
+		/* Hand the bucket back to the thread */
+		__atomic_store_n(&th->tail, th->tail + 1, __ATOMIC_RELEASE);
+	}
+	if (result->key > th->watermark)
+		th->watermark = result->key;
+}
+
+DLLEXPORT int libtrace_interval_counters_next(libtrace_interval_counters_t *ic,
+		uint64_t *interval, uint64_t *counters, int flush) {
+	uint64_t *slot;
+	int j, active;
+
+	if (ic->window_count == 0)
+		return 0;
+
+	if (!flush) {
+		active = __atomic_load_n(&ic->active, __ATOMIC_ACQUIRE);
+		for (j = 0; j < active; j++) {
+			if (ic->threads[j].watermark <= ic->window_start)
+				return 0;
+		}
+	}
+
+	slot = window_slot(ic, ic->window_start);
+	*interval = ic->window_start;
+	memcpy(counters, slot, sizeof(uint64_t) * ic->ncounters);
+	memset(slot, 0, sizeof(uint64_t) * ic->ncounters);
+	ic->window_first = (ic->window_first + 1) & (ic->window_size - 1);
+	ic->window_start ++;
+	ic->window_count --;
+	ic->reported = 1;
+	return 1;
+}
@@ -0,0 +1,186 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "../libtrace.h"
+#include "../libtrace_parallel.h"
+
+#ifndef LIBTRACE_INTERVAL_COUNTERS_H
+#define LIBTRACE_INTERVAL_COUNTERS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters bucketed into fixed length time intervals, counted by the
+ * processing threads and merged by the reporter.
+ *
+ * Each processing thread counts into a ring of preallocated buckets, one
+ * bucket per interval. When a thread moves on to a later interval, either
+ * because it has seen a packet from that interval or because it has been
+ * told the time by a tick message, it closes its current bucket and
+ * publishes it to the reporter as a RESULT_USER result. Every result also
+ * carries the thread's watermark: the thread will count nothing more in
+ * any interval before it.
+ *
+ * The reporter merges buckets as they arrive and hands back complete
+ * intervals, in order, once every thread's watermark has passed them. An
+ * idle thread therefore only holds up the reporter until its next tick, so
+ * tools should enable tick intervals (or tick counts for live formats) and
+ * pass the ticks on with libtrace_interval_counters_tick().
+ *
+ * Intervals are aligned to multiples of the interval length since the
+ * epoch. Packets that arrive after their thread has closed their interval
+ * are counted in the thread's current interval instead.
+ *
+ * Buckets are handed back to their thread by the reporter without any
+ * locking, and a thread only waits for the reporter if its whole ring is
+ * waiting to be merged.
+ */
+
+/** The default number of buckets in each processing thread's ring */
+#define LIBTRACE_INTERVAL_DEFAULT_BUCKETS 64
+
+/** A closed bucket, as published to the reporter */
+typedef struct libtrace_interval_bucket {
+	uint64_t interval;	/**< Start of the interval / interval length */
+	int thread;		/**< The processing thread that counted it */
+	uint64_t *counters;	/**< ncounters counters, or NULL if the bucket
+				  only announces a new watermark */
+} libtrace_interval_bucket_t;
+
+typedef struct libtrace_interval_thread {
+	libtrace_interval_bucket_t *buckets;
+	/* Published when the watermark moves on but nothing was counted */
+	libtrace_interval_bucket_t progress;
+	/* The bucket being counted into, or NULL before the first packet */
+	libtrace_interval_bucket_t *current;
+	/* Whether anything has been counted into the current bucket */
+	int dirty;
+	/* Buckets published by this thread, written by this thread only */
+	uint64_t head;
+	/* Buckets merged by the reporter, written by the reporter only */
+	volatile uint64_t tail ALIGN_STRUCT(CACHE_LINE_SIZE);
+	/* The watermark most recently received by the reporter */
+	uint64_t watermark;
+} ALIGN_STRUCT(CACHE_LINE_SIZE) libtrace_interval_thread_t;
+
+typedef struct libtrace_interval_counters {
+	uint64_t length;	/* In ERF timestamp units */
+	int ncounters;
+	int nthreads;
+	/* The number of threads the trace actually started, which may be
+	 * fewer than nthreads */
+	int active;
+	size_t nbuckets;
+	libtrace_interval_thread_t *threads;
+	uint64_t *storage;
+
+	/* Reporter state: merged counters for the intervals
+	 * [window_start, window_start + window_count), stored in a circular
+	 * array of window_size intervals beginning at window_first */
+	uint64_t *window;
+	size_t window_size;
+	size_t window_first;
+	size_t window_count;
+	uint64_t window_start;
+	int started;
+	int reported;
+} libtrace_interval_counters_t;
+
+/**
+ * Initialises a set of interval counters.
+ *
+ * @param ic		The counters to initialise
+ * @param length	The length of each interval, as an ERF timestamp
+ * (seconds in the upper 32 bits, fractions of a second in the lower 32)
+ * @param ncounters	The number of counters in each interval
+ * @param nthreads	The most processing threads that will count, usually
+ * the number passed to trace_set_perpkt_threads(). Some formats start fewer
+ * threads than were asked for, so the reporter only waits for the threads
+ * that the trace actually started.
+ * @param nbuckets	The number of buckets in each thread's ring
+ * @return 0 on success, -1 on failure
+ */
+DLLEXPORT int libtrace_interval_counters_init(libtrace_interval_counters_t *ic,
+		uint64_t length, int ncounters, int nthreads, size_t nbuckets);
+DLLEXPORT void libtrace_interval_counters_destroy(libtrace_interval_counters_t *ic);
+
+/* Called by the processing threads */
+
+/**
+ * Returns the counters for the interval containing ts, which can be updated
+ * until the thread next calls any of the processing thread functions.
+ *
+ * If ts is past the thread's current interval, the current bucket is closed
+ * and published first.
+ *
+ * @param ts	An ERF timestamp, usually that of the packet being counted
+ */
+DLLEXPORT uint64_t *libtrace_interval_counters_get(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t, uint64_t ts);
+
+/** Tells the counters that the thread will not see anything before the ERF
+ * timestamp ts, e.g. on receiving MESSAGE_TICK_INTERVAL */
+DLLEXPORT void libtrace_interval_counters_tick(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t, uint64_t ts);
+
+/** Publishes the thread's last bucket, should be called when the thread is
+ * stopping */
+DLLEXPORT void libtrace_interval_counters_finish(
+		libtrace_interval_counters_t *ic, libtrace_t *trace,
+		libtrace_thread_t *t);
+
+/* Called by the reporter */
+
+/** Merges a result published by the processing thread functions above */
+DLLEXPORT void libtrace_interval_counters_merge(
+		libtrace_interval_counters_t *ic, libtrace_result_t *result);
+
+/**
+ * Retrieves the next complete interval, which is then forgotten.
+ *
+ * Empty intervals between two intervals with counts are returned as well,
+ * with all of their counters zero.
+ *
+ * @param[out] interval	Set to the index of the interval, so it starts at
+ * the ERF timestamp interval * length
+ * @param[out] counters	Filled with the ncounters counters for the interval
+ * @param flush		If set, also return intervals that are not yet
+ * complete. Use this once the trace has finished.
+ * @return 1 if an interval was returned, 0 if there are no more intervals
+ * ready to be reported
+ */
+DLLEXPORT int libtrace_interval_counters_next(libtrace_interval_counters_t *ic,
+		uint64_t *interval, uint64_t *counters, int flush);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
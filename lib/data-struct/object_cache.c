@@ -25,6 +25,7 @@
  */
 #include "config.h"
 #include "object_cache.h"
+#include "../libtrace_probes.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,6 +42,9 @@ struct local_cache {
 	size_t used;
 	void **cache;
 	bool invalid;
+	// Buffers allocated from this cache, and those which it couldn't supply
+	uint64_t hits;
+	uint64_t misses;
 };
 
 struct mem_stats {
@@ -203,6 +207,8 @@ static inline struct local_cache * find_cache(libtrace_ocache_t *oc) {
 		lcs->t_mem_caches[lcs->t_mem_caches_used].total = oc->thread_cache_size;
 		lcs->t_mem_caches[lcs->t_mem_caches_used].cache = malloc(sizeof(void*) * oc->thread_cache_size);
 		lcs->t_mem_caches[lcs->t_mem_caches_used].invalid = false;
+		lcs->t_mem_caches[lcs->t_mem_caches_used].hits = 0;
+		lcs->t_mem_caches[lcs->t_mem_caches_used].misses = 0;
 		lc = &lcs->t_mem_caches[lcs->t_mem_caches_used];
 		// Register it with the underlying ring_buffer
 		register_thread(lc->oc, lc);
@@ -316,6 +322,7 @@ static inline size_t libtrace_ocache_alloc_cache(libtrace_ocache_t *oc, void *va
 		// Copy all from cache
 		memcpy(values, &lc->cache[lc->used - nb_buffers], sizeof(void *) * nb_buffers);
 		lc->used -= nb_buffers;
+		lc->hits += nb_buffers;
 #ifdef ENABLE_MEM_STATS
 		mem_hits.read.cache_hit += nb_buffers;
 		mem_hits.readbulk.cache_hit += 1;
@@ -336,6 +343,7 @@ static inline size_t libtrace_ocache_alloc_cache(libtrace_ocache_t *oc, void *va
 		// Empty the cache and re-fill it and then see what we're left with
 		i = lc->used;
 		memcpy(values, lc->cache, sizeof(void *) * lc->used);
+		lc->hits += i;
 #ifdef ENABLE_MEM_STATS
 		mem_hits.read.cache_hit += i;
 #endif
@@ -373,6 +381,7 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 	struct local_cache *lc = find_cache(oc);
 	size_t i;
 	size_t min;
+	uint64_t hits = lc ? lc->hits : 0;
 	bool try_alloc = !(oc->max_allocations && oc->max_allocations <= oc->current_allocations);
 
 	assert(oc->max_allocations ? nb_buffers < oc->max_allocations : 1);
@@ -410,9 +419,26 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 		}
 	}
 	assert(i >= min_nb_buffers);
+	if (lc)
+		lc->misses += i - (lc->hits - hits);
+	LT_PROBE3(ocache_alloc, oc, nb_buffers, i);
 	return i;
 }
 
+/**
+ * Returns how many buffers the calling thread has allocated from its local
+ * cache, and how many had to come from the shared ringbuffer or be newly
+ * allocated. Both are 0 if oc has no thread local caches.
+ */
+DLLEXPORT void libtrace_ocache_get_thread_counts(libtrace_ocache_t *oc,
+                                                 uint64_t *hits,
+                                                 uint64_t *misses) {
+	struct local_cache *lc = find_cache(oc);
+
+	*hits = lc ? lc->hits : 0;
+	*misses = lc ? lc->misses : 0;
+}
+
 
 static inline size_t libtrace_ocache_free_cache(libtrace_ocache_t *oc, void *values[], size_t nb_buffers, size_t min_nb_buffers,
 											struct local_cache *lc) {
@@ -499,6 +525,7 @@ DLLEXPORT size_t libtrace_ocache_free(libtrace_ocache_t *oc, void *values[], siz
 			oc->free(values[i]);
 		}
 	}
+	LT_PROBE3(ocache_free, oc, nb_buffers, i);
 	return i;
 }
 
@@ -51,4 +51,7 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 DLLEXPORT size_t libtrace_ocache_free(libtrace_ocache_t *oc, void *values[], size_t nb_buffers, size_t min_nb_buffers);
 DLLEXPORT void libtrace_zero_ocache(libtrace_ocache_t *oc);
 DLLEXPORT void libtrace_ocache_unregister_thread(libtrace_ocache_t *oc);
+DLLEXPORT void libtrace_ocache_get_thread_counts(libtrace_ocache_t *oc,
+                                                 uint64_t *hits,
+                                                 uint64_t *misses);
 #endif // LIBTRACE_OBJECT_CACHE_H
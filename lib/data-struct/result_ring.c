@@ -0,0 +1,179 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "result_ring.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/**
+ * Initialises a result ring.
+ *
+ * @param rr A pointer to the result ring structure.
+ * @param size The number of results the ring can hold before spilling, this
+ *             is rounded up to the next power of two.
+ * @return 0 if successful, -1 upon failure.
+ */
+DLLEXPORT int libtrace_result_ring_init(libtrace_result_ring_t *rr, size_t size)
+{
+	size_t capacity = 2;
+
+	while (capacity < size)
+		capacity <<= 1;
+
+	rr->elements = malloc(capacity * sizeof(libtrace_result_t));
+	if (!rr->elements)
+		return -1;
+	rr->mask = capacity - 1;
+	libtrace_deque_init(&rr->overflow, sizeof(libtrace_result_t));
+
+	rr->head = 0;
+	rr->spilled = 0;
+	rr->cached_tail = 0;
+	rr->cached_unspilled = 0;
+
+	rr->tail = 0;
+	rr->cached_head = 0;
+	rr->unspilled = 0;
+	rr->front_spilled = 0;
+	return 0;
+}
+
+DLLEXPORT void libtrace_result_ring_destroy(libtrace_result_ring_t *rr)
+{
+	assert(libtrace_result_ring_get_size(rr) == 0);
+	free(rr->elements);
+	rr->elements = NULL;
+	ASSERT_RET(pthread_mutex_destroy(&rr->overflow.lock), == 0);
+}
+
+/**
+ * Pushes a result onto the ring, only to be called by the producer.
+ *
+ * @return 1 if the result was queued, or 0 if the ring is full (or results
+ * are still waiting in the overflow queue) in which case nothing is done.
+ */
+DLLEXPORT int libtrace_result_ring_try_push(libtrace_result_ring_t *rr, libtrace_result_t *res)
+{
+	size_t head = rr->head;
+
+	/* Anything in the ring has to be older than everything in the
+	 * overflow, so stay off the ring until the overflow has drained */
+	if (rr->spilled != rr->cached_unspilled) {
+		rr->cached_unspilled = LOAD_ACQUIRE(rr->unspilled);
+		if (rr->spilled != rr->cached_unspilled)
+			return 0;
+	}
+
+	if (head - rr->cached_tail > rr->mask) {
+		rr->cached_tail = LOAD_ACQUIRE(rr->tail);
+		if (head - rr->cached_tail > rr->mask)
+			return 0;
+	}
+
+	rr->elements[head & rr->mask] = *res;
+	STORE_RELEASE(rr->head, head + 1);
+	return 1;
+}
+
+/**
+ * Pushes a result, spilling into the overflow queue if the ring is full.
+ * Only to be called by the producer.
+ */
+DLLEXPORT void libtrace_result_ring_push(libtrace_result_ring_t *rr, libtrace_result_t *res)
+{
+	if (libtrace_result_ring_try_push(rr, res))
+		return;
+
+	libtrace_deque_push_back(&rr->overflow, res);
+	STORE_RELEASE(rr->spilled, rr->spilled + 1);
+}
+
+/**
+ * Returns the oldest result without removing it, or NULL if there are none.
+ * Only to be called by the consumer, the pointer is valid until the next
+ * call to libtrace_result_ring_pop().
+ */
+DLLEXPORT libtrace_result_t *libtrace_result_ring_peek(libtrace_result_ring_t *rr)
+{
+	size_t tail = rr->tail;
+
+	if (rr->front_spilled)
+		return &rr->spill_front;
+
+	if (tail == rr->cached_head)
+		rr->cached_head = LOAD_ACQUIRE(rr->head);
+	if (tail != rr->cached_head)
+		return &rr->elements[tail & rr->mask];
+
+	/* The ring is empty, so the front of the overflow is next. It stays
+	 * counted as spilled until it is popped. */
+	if (LOAD_ACQUIRE(rr->spilled) != rr->unspilled) {
+		ASSERT_RET(libtrace_deque_pop_front(&rr->overflow,
+				(void *) &rr->spill_front), == 1);
+		rr->front_spilled = 1;
+		return &rr->spill_front;
+	}
+	return NULL;
+}
+
+/**
+ * Removes the oldest result, which must have been returned by a prior call
+ * to libtrace_result_ring_peek(). Only to be called by the consumer.
+ */
+DLLEXPORT void libtrace_result_ring_pop(libtrace_result_ring_t *rr)
+{
+	if (rr->front_spilled) {
+		rr->front_spilled = 0;
+		STORE_RELEASE(rr->unspilled, rr->unspilled + 1);
+	} else {
+		assert(rr->tail != rr->cached_head);
+		STORE_RELEASE(rr->tail, rr->tail + 1);
+	}
+}
+
+/**
+ * Returns the number of results queued, this is only a snapshot if the
+ * other side is running.
+ */
+DLLEXPORT size_t libtrace_result_ring_get_size(libtrace_result_ring_t *rr)
+{
+	return (LOAD_ACQUIRE(rr->head) - LOAD_ACQUIRE(rr->tail)) +
+		(LOAD_ACQUIRE(rr->spilled) - LOAD_ACQUIRE(rr->unspilled));
+}
+
+DLLEXPORT void libtrace_result_ring_apply_function(libtrace_result_ring_t *rr, deque_data_fn fn)
+{
+	size_t i;
+
+	if (rr->front_spilled)
+		(*fn)(&rr->spill_front);
+	for (i = rr->tail; i != rr->head; i++)
+		(*fn)(&rr->elements[i & rr->mask]);
+	libtrace_deque_apply_function(&rr->overflow, fn);
+}
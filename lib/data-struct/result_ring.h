@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "../libtrace.h"
+#include "../libtrace_parallel.h"
+#include "deque.h"
+
+#ifndef LIBTRACE_RESULT_RING_H
+#define LIBTRACE_RESULT_RING_H
+
+/** The default capacity of the rings used by the combiners */
+#define RESULT_RING_SIZE 4096
+
+/**
+ * A fixed capacity, single producer single consumer queue of results.
+ *
+ * Results are copied into a preallocated array so publishing a result
+ * never allocates or takes a lock. If the consumer falls far enough behind
+ * that the ring fills up, further results spill into an unbounded deque
+ * until the consumer has caught up again, so the producer can never be
+ * deadlocked by a consumer that is waiting for results elsewhere.
+ *
+ * Every result in the ring is always older than every result in the
+ * overflow deque, so results are consumed in the order they were pushed.
+ */
+typedef struct libtrace_result_ring {
+	libtrace_result_t *elements;
+	size_t mask;
+	libtrace_queue_t overflow;
+
+	/* Written by the producer only */
+	volatile size_t head ALIGN_STRUCT(CACHE_LINE_SIZE);
+	volatile size_t spilled;
+	size_t cached_tail;
+	size_t cached_unspilled;
+
+	/* Written by the consumer only */
+	volatile size_t tail ALIGN_STRUCT(CACHE_LINE_SIZE);
+	size_t cached_head;
+	volatile size_t unspilled;
+	int front_spilled;
+	libtrace_result_t spill_front;
+} libtrace_result_ring_t;
+
+DLLEXPORT int libtrace_result_ring_init(libtrace_result_ring_t *rr, size_t size);
+DLLEXPORT void libtrace_result_ring_destroy(libtrace_result_ring_t *rr);
+
+DLLEXPORT int libtrace_result_ring_try_push(libtrace_result_ring_t *rr, libtrace_result_t *res);
+DLLEXPORT void libtrace_result_ring_push(libtrace_result_ring_t *rr, libtrace_result_t *res);
+
+DLLEXPORT libtrace_result_t *libtrace_result_ring_peek(libtrace_result_ring_t *rr);
+DLLEXPORT void libtrace_result_ring_pop(libtrace_result_ring_t *rr);
+DLLEXPORT size_t libtrace_result_ring_get_size(libtrace_result_ring_t *rr);
+
+// Apply a given function to every queued result, the producer must not be
+// running at the time
+DLLEXPORT void libtrace_result_ring_apply_function(libtrace_result_ring_t *rr, deque_data_fn fn);
+
+#endif
@@ -146,6 +146,20 @@ DLLEXPORT int libtrace_ringbuffer_is_full(const libtrace_ringbuffer_t * rb) {
 	return rb->start == ((rb->end + 1) % rb->size);
 }
 
+/**
+ * Returns the number of items in the ringbuffer, when using multiple
+ * threads this is only a snapshot and may be out of date on return.
+ */
+DLLEXPORT size_t libtrace_ringbuffer_get_count(const libtrace_ringbuffer_t * rb) {
+	size_t start = rb->start;
+	size_t end = rb->end;
+
+	if (end < start)
+		return end + rb->size - start;
+	else
+		return end - start;
+}
+
 static inline size_t libtrace_ringbuffer_nb_full(const libtrace_ringbuffer_t *rb) {
 	if (rb->end < rb->start)
 		return rb->end + rb->size - rb->start;
@@ -62,6 +62,7 @@ DLLEXPORT void libtrace_zero_ringbuffer(libtrace_ringbuffer_t * rb);
 DLLEXPORT void libtrace_ringbuffer_destroy(libtrace_ringbuffer_t * rb);
 DLLEXPORT int libtrace_ringbuffer_is_empty(const libtrace_ringbuffer_t * rb);
 DLLEXPORT int libtrace_ringbuffer_is_full(const libtrace_ringbuffer_t * rb);
+DLLEXPORT size_t libtrace_ringbuffer_get_count(const libtrace_ringbuffer_t * rb);
 
 DLLEXPORT void libtrace_ringbuffer_write(libtrace_ringbuffer_t * rb, void* value);
 DLLEXPORT int libtrace_ringbuffer_try_write(libtrace_ringbuffer_t * rb, void* value);
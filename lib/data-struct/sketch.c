@@ -0,0 +1,224 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "sketch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Finalisation step from MurmurHash3, so that every input bit affects
+ * every output bit */
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+DLLEXPORT uint64_t libtrace_sketch_hash(const void *key, size_t len) {
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0x87c37b91114253d5ULL);
+	uint64_t word;
+
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		h = mix64(h ^ word);
+		p += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, p, len);
+		h = mix64(h ^ word);
+	}
+	return mix64(h);
+}
+
+DLLEXPORT int libtrace_hll_init(libtrace_hll_t *hll, uint8_t precision) {
+	if (precision < LIBTRACE_HLL_MIN_PRECISION ||
+			precision > LIBTRACE_HLL_MAX_PRECISION)
+		return -1;
+	hll->precision = precision;
+	hll->registers = calloc((size_t)1 << precision, 1);
+	if (!hll->registers)
+		return -1;
+	return 0;
+}
+
+DLLEXPORT void libtrace_hll_destroy(libtrace_hll_t *hll) {
+	free(hll->registers);
+	hll->registers = NULL;
+	hll->precision = 0;
+}
+
+DLLEXPORT void libtrace_hll_clear(libtrace_hll_t *hll) {
+	memset(hll->registers, 0, (size_t)1 << hll->precision);
+}
+
+DLLEXPORT void libtrace_hll_add_hash(libtrace_hll_t *hll, uint64_t hash) {
+	/* The top bits pick the register, and the register remembers the
+	 * longest run of leading zeroes seen in the remaining bits */
+	size_t reg = hash >> (64 - hll->precision);
+	uint64_t rest = hash << hll->precision;
+	uint8_t rank;
+
+	if (rest == 0)
+		rank = 64 - hll->precision + 1;
+	else
+		rank = __builtin_clzll(rest) + 1;
+	if (rank > hll->registers[reg])
+		hll->registers[reg] = rank;
+}
+
+DLLEXPORT void libtrace_hll_add(libtrace_hll_t *hll, const void *key, size_t len) {
+	libtrace_hll_add_hash(hll, libtrace_sketch_hash(key, len));
+}
+
+DLLEXPORT int libtrace_hll_merge(libtrace_hll_t *hll, const libtrace_hll_t *other) {
+	size_t i, m;
+
+	if (hll->precision != other->precision)
+		return -1;
+	m = (size_t)1 << hll->precision;
+	for (i = 0; i < m; i++) {
+		if (other->registers[i] > hll->registers[i])
+			hll->registers[i] = other->registers[i];
+	}
+	return 0;
+}
+
+DLLEXPORT uint64_t libtrace_hll_estimate(const libtrace_hll_t *hll) {
+	size_t i, m = (size_t)1 << hll->precision;
+	size_t zeroes = 0;
+	double sum = 0;
+	double alpha, estimate;
+
+	for (i = 0; i < m; i++) {
+		sum += ldexp(1.0, -hll->registers[i]);
+		if (hll->registers[i] == 0)
+			zeroes ++;
+	}
+
+	switch (m) {
+		case 16: alpha = 0.673; break;
+		case 32: alpha = 0.697; break;
+		case 64: alpha = 0.709; break;
+		default: alpha = 0.7213 / (1 + 1.079 / m); break;
+	}
+	estimate = alpha * m * m / sum;
+
+	/* The raw estimate is biased for small cardinalities, where counting
+	 * the empty registers is more accurate. With a 64 bit hash there is
+	 * no need for a large range correction */
+	if (estimate <= 2.5 * m && zeroes > 0)
+		estimate = m * log((double)m / zeroes);
+	return (uint64_t)(estimate + 0.5);
+}
+
+DLLEXPORT int libtrace_cms_init(libtrace_cms_t *cms, uint32_t width, uint32_t depth) {
+	if (width == 0 || (width & (width - 1)) != 0 || depth == 0)
+		return -1;
+	cms->width = width;
+	cms->depth = depth;
+	cms->total = 0;
+	cms->counters = calloc((size_t)width * depth, sizeof(uint64_t));
+	if (!cms->counters)
+		return -1;
+	return 0;
+}
+
+DLLEXPORT void libtrace_cms_destroy(libtrace_cms_t *cms) {
+	free(cms->counters);
+	cms->counters = NULL;
+	cms->width = cms->depth = 0;
+	cms->total = 0;
+}
+
+DLLEXPORT void libtrace_cms_clear(libtrace_cms_t *cms) {
+	memset(cms->counters, 0,
+			(size_t)cms->width * cms->depth * sizeof(uint64_t));
+	cms->total = 0;
+}
+
+/* Each row uses a different hash of the key, derived from two halves of
+ * the one 64 bit hash (Kirsch & Mitzenmacher) */
+static inline uint64_t *cms_counter(const libtrace_cms_t *cms, uint64_t hash,
+		uint32_t row) {
+	uint32_t h1 = (uint32_t)hash;
+	uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+	return &cms->counters[(size_t)row * cms->width +
+			((h1 + row * h2) & (cms->width - 1))];
+}
+
+DLLEXPORT uint64_t libtrace_cms_add_hash(libtrace_cms_t *cms, uint64_t hash, uint64_t count) {
+	uint64_t estimate = UINT64_MAX;
+	uint32_t i;
+
+	cms->total += count;
+	for (i = 0; i < cms->depth; i++) {
+		uint64_t *c = cms_counter(cms, hash, i);
+		*c += count;
+		if (*c < estimate)
+			estimate = *c;
+	}
+	return estimate;
+}
+
+DLLEXPORT uint64_t libtrace_cms_add(libtrace_cms_t *cms, const void *key, size_t len, uint64_t count) {
+	return libtrace_cms_add_hash(cms, libtrace_sketch_hash(key, len),
+			count);
+}
+
+DLLEXPORT uint64_t libtrace_cms_estimate_hash(const libtrace_cms_t *cms, uint64_t hash) {
+	uint64_t estimate = UINT64_MAX;
+	uint32_t i;
+
+	for (i = 0; i < cms->depth; i++) {
+		uint64_t c = *cms_counter(cms, hash, i);
+		if (c < estimate)
+			estimate = c;
+	}
+	return estimate;
+}
+
+DLLEXPORT uint64_t libtrace_cms_estimate(const libtrace_cms_t *cms, const void *key, size_t len) {
+	return libtrace_cms_estimate_hash(cms, libtrace_sketch_hash(key, len));
+}
+
+DLLEXPORT int libtrace_cms_merge(libtrace_cms_t *cms, const libtrace_cms_t *other) {
+	size_t i, n;
+
+	if (cms->width != other->width || cms->depth != other->depth)
+		return -1;
+	n = (size_t)cms->width * cms->depth;
+	for (i = 0; i < n; i++)
+		cms->counters[i] += other->counters[i];
+	cms->total += other->total;
+	return 0;
+}
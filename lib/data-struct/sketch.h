@@ -0,0 +1,112 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include <stdint.h>
+#include <stddef.h>
+/* Need libtrace.h for DLLEXPORT defines */
+#include "../libtrace.h"
+
+#ifndef LIBTRACE_SKETCH_H
+#define LIBTRACE_SKETCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Probabilistic summaries for counting over keys that are too numerous to
+ * store individually, e.g. flows or endpoints over a multi-day capture.
+ *
+ * Both sketches are fixed size and can be merged, so each processing thread
+ * can keep its own and hand it to the reporter to be combined with the
+ * others. Merging is only possible between sketches created with the same
+ * dimensions.
+ *
+ * Keys are hashed with libtrace_sketch_hash(). Callers that update several
+ * sketches with the same key can hash it once and use the *_hash variants.
+ */
+
+/** Hashes a key for use with the sketches below */
+DLLEXPORT uint64_t libtrace_sketch_hash(const void *key, size_t len);
+
+/** The default HyperLogLog precision, 2^14 registers (~0.8% error) */
+#define LIBTRACE_HLL_DEFAULT_PRECISION 14
+#define LIBTRACE_HLL_MIN_PRECISION 4
+#define LIBTRACE_HLL_MAX_PRECISION 18
+
+/**
+ * A HyperLogLog estimator of the number of distinct keys added to it.
+ *
+ * Uses 2^precision bytes of memory, and the standard error of the estimate
+ * is about 1.04 / sqrt(2^precision).
+ */
+typedef struct libtrace_hll {
+	uint8_t precision;
+	uint8_t *registers;
+} libtrace_hll_t;
+
+DLLEXPORT int libtrace_hll_init(libtrace_hll_t *hll, uint8_t precision);
+DLLEXPORT void libtrace_hll_destroy(libtrace_hll_t *hll);
+DLLEXPORT void libtrace_hll_clear(libtrace_hll_t *hll);
+
+DLLEXPORT void libtrace_hll_add(libtrace_hll_t *hll, const void *key, size_t len);
+DLLEXPORT void libtrace_hll_add_hash(libtrace_hll_t *hll, uint64_t hash);
+
+// Returns -1 if the sketches have different precisions
+DLLEXPORT int libtrace_hll_merge(libtrace_hll_t *hll, const libtrace_hll_t *other);
+DLLEXPORT uint64_t libtrace_hll_estimate(const libtrace_hll_t *hll);
+
+/**
+ * A Count-Min sketch, estimating the total count added for each key.
+ *
+ * Estimates never undercount. With 'width' counters per row and 'depth'
+ * rows, an estimate exceeds the true count by more than e/width of the
+ * total of all counts with a probability of at most e^-depth.
+ */
+typedef struct libtrace_cms {
+	uint32_t width;		/* Always a power of two */
+	uint32_t depth;
+	uint64_t total;
+	uint64_t *counters;
+} libtrace_cms_t;
+
+DLLEXPORT int libtrace_cms_init(libtrace_cms_t *cms, uint32_t width, uint32_t depth);
+DLLEXPORT void libtrace_cms_destroy(libtrace_cms_t *cms);
+DLLEXPORT void libtrace_cms_clear(libtrace_cms_t *cms);
+
+// Both return the estimate for the key after it has been updated
+DLLEXPORT uint64_t libtrace_cms_add(libtrace_cms_t *cms, const void *key, size_t len, uint64_t count);
+DLLEXPORT uint64_t libtrace_cms_add_hash(libtrace_cms_t *cms, uint64_t hash, uint64_t count);
+
+DLLEXPORT uint64_t libtrace_cms_estimate(const libtrace_cms_t *cms, const void *key, size_t len);
+DLLEXPORT uint64_t libtrace_cms_estimate_hash(const libtrace_cms_t *cms, uint64_t hash);
+
+// Returns -1 if the sketches have different dimensions
+DLLEXPORT int libtrace_cms_merge(libtrace_cms_t *cms, const libtrace_cms_t *other);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -159,6 +159,6 @@ DLLEXPORT void libtrace_vector_apply_function(libtrace_vector_t *v, vector_data_
 
 DLLEXPORT void libtrace_vector_qsort(libtrace_vector_t *v, int (*compar)(const void *, const void*)) {
 	ASSERT_RET(pthread_mutex_lock(&v->lock), == 0);
-	qsort(v->elements, v->element_size, v->element_size, compar);
+	qsort(v->elements, v->size, v->element_size, compar);
 	ASSERT_RET(pthread_mutex_unlock(&v->lock), == 0);
 }
@@ -687,6 +687,8 @@ int dpdk_config_input (libtrace_t *libtrace,
 			FORMAT(libtrace)->rss_key = NULL;
 			return 0;
 		case HASHER_CUSTOM:
+		case HASHER_TUNNEL_BIDIRECTIONAL:
+		case HASHER_TUNNEL_UNIDIRECTIONAL:
 			// Let libtrace do this
 			return -1;
 		}
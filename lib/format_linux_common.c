@@ -154,6 +154,8 @@ int linuxcommon_config_input(libtrace_t *libtrace,
 					FORMAT_DATA->fanout_flags = PACKET_FANOUT_HASH;
 					return 0;
 				case HASHER_CUSTOM:
+				case HASHER_TUNNEL_BIDIRECTIONAL:
+				case HASHER_TUNNEL_UNIDIRECTIONAL:
 					return -1;
 			}
 			break;
@@ -0,0 +1,477 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* The mem format preloads another trace into memory and then replays it as
+ * fast as it can be consumed, so that the cost of libtrace itself and of
+ * the per-packet processing can be measured without any I/O in the way.
+ *
+ * Every packet is stored once, in an arena that is backed by huge pages
+ * where the system allows it, as a small header of normalised metadata
+ * followed by the captured bytes. A packet read from the trace points
+ * straight at those bytes. Only the header is copied into the packet's own
+ * buffer, so that the timestamps can be shifted on each pass through the
+ * trace and the capture length can be changed without touching the arena.
+ *
+ * In parallel mode each processing thread claims batches of packets by
+ * advancing a shared atomic cursor, so reading never takes a lock.
+ */
+
+#include "config.h"
+#include "common.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "format_helper.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Size of each arena chunk, a multiple of the usual 2MB huge page */
+#define MEM_CHUNK_SIZE (64 * 1024 * 1024)
+
+#define FORMAT_DATA ((struct mem_format_data_t *)libtrace->format_data)
+
+/* Precedes every packet, both in the arena and in a packet's buffer */
+typedef struct mem_header {
+	uint64_t ts;		/* ERF timestamp */
+	uint32_t caplen;
+	uint32_t wirelen;
+	int32_t linktype;	/* libtrace_linktype_t */
+	int32_t direction;	/* libtrace_direction_t */
+} mem_header_t;
+
+struct mem_chunk_t {
+	struct mem_chunk_t *next;
+	size_t size;
+	size_t used;
+};
+
+struct mem_format_data_t {
+	/* The trace to preload and how many times to replay it, zero
+	 * meaning forever */
+	char *uri;
+	uint64_t loops;
+
+	struct mem_chunk_t *chunks;
+	mem_header_t **records;
+	uint64_t count;
+	uint64_t allocated;
+	bool loaded;
+
+	/* Added to the timestamps once per pass through the trace */
+	uint64_t period;
+	/* Total number of packets to hand out over all passes */
+	uint64_t total;
+
+	/* The next packet to be handed out, counting across passes. Kept on
+	 * its own cache line as every reading thread updates it. */
+	uint64_t next ALIGN_STRUCT(CACHE_LINE_SIZE);
+};
+
+static struct mem_chunk_t *mem_alloc_chunk(void) {
+	struct mem_chunk_t *chunk = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	chunk = mmap(NULL, MEM_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (chunk == MAP_FAILED) {
+		/* No huge pages reserved, so settle for transparent ones */
+		chunk = mmap(NULL, MEM_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(chunk, MEM_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+	}
+	chunk->next = NULL;
+	chunk->size = MEM_CHUNK_SIZE;
+	chunk->used = sizeof(struct mem_chunk_t);
+	return chunk;
+}
+
+/* Copies a packet into the arena, returning its record */
+static mem_header_t *mem_store(libtrace_t *libtrace,
+		libtrace_packet_t *packet) {
+	struct mem_format_data_t *data = FORMAT_DATA;
+	struct mem_chunk_t *chunk = data->chunks;
+	libtrace_linktype_t linktype;
+	mem_header_t *rec;
+	uint32_t caplen;
+	size_t size;
+	void *buf;
+
+	buf = trace_get_packet_buffer(packet, &linktype, &caplen);
+	if (buf == NULL)
+		caplen = 0;
+	size = (sizeof(mem_header_t) + caplen + 7) & ~(size_t)7;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = mem_alloc_chunk();
+		if (chunk == NULL) {
+			trace_set_err(libtrace, errno,
+					"Unable to allocate memory for mem format");
+			return NULL;
+		}
+		chunk->next = data->chunks;
+		data->chunks = chunk;
+	}
+
+	if (data->count == data->allocated) {
+		data->allocated = data->allocated ? data->allocated * 2 : 1024;
+		data->records = realloc(data->records,
+				data->allocated * sizeof(mem_header_t *));
+		if (data->records == NULL) {
+			trace_set_err(libtrace, errno,
+					"Unable to allocate memory for mem format");
+			return NULL;
+		}
+	}
+
+	rec = (mem_header_t *)((char *)chunk + chunk->used);
+	chunk->used += size;
+	rec->ts = trace_get_erf_timestamp(packet);
+	rec->caplen = caplen;
+	rec->wirelen = trace_get_wire_length(packet);
+	rec->linktype = linktype;
+	rec->direction = trace_get_direction(packet);
+	if (caplen)
+		memcpy(rec + 1, buf, caplen);
+	data->records[data->count++] = rec;
+	return rec;
+}
+
+/* Reads the whole of the underlying trace into the arena */
+static int mem_load(libtrace_t *libtrace) {
+	struct mem_format_data_t *data = FORMAT_DATA;
+	libtrace_t *input;
+	libtrace_packet_t *packet;
+	int ret;
+
+	input = trace_create(data->uri);
+	if (trace_is_err(input) || trace_start(input) == -1) {
+		libtrace_err_t err = trace_get_err(input);
+		trace_set_err(libtrace, err.err_num, "%s: %s", data->uri,
+				err.problem);
+		trace_destroy(input);
+		return -1;
+	}
+
+	packet = trace_create_packet();
+	while ((ret = trace_read_packet(input, packet)) > 0) {
+		/* Meta-data has nothing to replay */
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		if (mem_store(libtrace, packet) == NULL)
+			break;
+	}
+	if (ret < 0) {
+		libtrace_err_t err = trace_get_err(input);
+		trace_set_err(libtrace, err.err_num, "%s: %s", data->uri,
+				err.problem);
+	}
+	trace_destroy_packet(packet);
+	trace_destroy(input);
+	if (trace_is_err(libtrace))
+		return -1;
+
+	/* Each pass starts one average packet gap after the last one ended,
+	 * so timestamps keep increasing across passes */
+	if (data->count > 1) {
+		uint64_t span = data->records[data->count - 1]->ts -
+				data->records[0]->ts;
+		data->period = span + span / (data->count - 1);
+	}
+	if (data->period == 0)
+		data->period = 1ULL << 32;
+
+	if (data->loops == 0 || data->count == 0)
+		data->total = data->count ? UINT64_MAX : 0;
+	else if (data->count > UINT64_MAX / data->loops)
+		data->total = UINT64_MAX;
+	else
+		data->total = data->count * data->loops;
+	data->loaded = true;
+	return 0;
+}
+
+static int mem_init_input(libtrace_t *libtrace) {
+	const char *uri = libtrace->uridata;
+	uint64_t loops = 1;
+
+	/* mem:[loops=N,]uri */
+	if (uri && strncmp(uri, "loops=", 6) == 0) {
+		char *end;
+
+		loops = strtoull(uri + 6, &end, 10);
+		if (*end != ',') {
+			trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+					"mem: expected loops=N,uri");
+			return -1;
+		}
+		uri = end + 1;
+	}
+	if (uri == NULL || *uri == '\0') {
+		trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+				"mem: requires an input URI");
+		return -1;
+	}
+
+	if (posix_memalign(&libtrace->format_data, CACHE_LINE_SIZE,
+				sizeof(struct mem_format_data_t)) != 0) {
+		libtrace->format_data = NULL;
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to allocate memory for mem format");
+		return -1;
+	}
+	memset(libtrace->format_data, 0, sizeof(struct mem_format_data_t));
+	FORMAT_DATA->uri = strdup(uri);
+	FORMAT_DATA->loops = loops;
+	return 0;
+}
+
+/* Used for both single threaded and parallel starts, and again on resume,
+ * which carries on from wherever the trace was paused */
+static int mem_start_input(libtrace_t *libtrace) {
+	if (FORMAT_DATA->loaded)
+		return 0;
+	return mem_load(libtrace);
+}
+
+static int mem_prepare_packet(libtrace_t *libtrace UNUSED,
+		libtrace_packet_t *packet, void *buffer,
+		libtrace_rt_types_t rt_type, uint32_t flags) {
+	if (packet->buffer != buffer &&
+			packet->buf_control == TRACE_CTRL_PACKET) {
+		free(packet->buffer);
+	}
+	if ((flags & TRACE_PREP_OWN_BUFFER) == TRACE_PREP_OWN_BUFFER)
+		packet->buf_control = TRACE_CTRL_PACKET;
+	else
+		packet->buf_control = TRACE_CTRL_EXTERNAL;
+
+	packet->buffer = buffer;
+	packet->header = buffer;
+	packet->payload = (char *)buffer + sizeof(mem_header_t);
+	packet->type = rt_type;
+	return 0;
+}
+
+/* Points a packet at the index'th packet of the replay */
+static int mem_fill_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
+		uint64_t index) {
+	struct mem_format_data_t *data = FORMAT_DATA;
+	const mem_header_t *rec = data->records[index % data->count];
+	mem_header_t *hdr;
+
+	if (!packet->buffer || packet->buf_control == TRACE_CTRL_EXTERNAL) {
+		packet->buffer = malloc((size_t)LIBTRACE_PACKET_BUFSIZE);
+		if (packet->buffer == NULL) {
+			trace_set_err(libtrace, errno,
+					"Unable to allocate packet buffer");
+			return -1;
+		}
+		packet->buf_control = TRACE_CTRL_PACKET;
+	}
+
+	hdr = (mem_header_t *)packet->buffer;
+	*hdr = *rec;
+	hdr->ts += (index / data->count) * data->period;
+
+	packet->trace = libtrace;
+	packet->header = hdr;
+	packet->payload = (void *)(rec + 1);
+	packet->type = TRACE_RT_DATA_MEM;
+	packet->order = index;
+	packet->error = sizeof(mem_header_t) + rec->caplen;
+	trace_clear_cache(packet);
+	return packet->error;
+}
+
+static int mem_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	uint64_t index = __atomic_fetch_add(&FORMAT_DATA->next, 1,
+			__ATOMIC_RELAXED);
+
+	if (index >= FORMAT_DATA->total)
+		return 0;
+	return mem_fill_packet(libtrace, packet, index);
+}
+
+static int mem_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t UNUSED,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	uint64_t first, remaining;
+	size_t i;
+
+	first = __atomic_fetch_add(&FORMAT_DATA->next, nb_packets,
+			__ATOMIC_RELAXED);
+	if (first >= FORMAT_DATA->total)
+		return 0;
+	remaining = FORMAT_DATA->total - first;
+	if (remaining < nb_packets)
+		nb_packets = remaining;
+
+	for (i = 0; i < nb_packets; i++) {
+		if (mem_fill_packet(libtrace, packets[i], first + i) < 0)
+			return -1;
+	}
+	return nb_packets;
+}
+
+static int mem_pause_input(libtrace_t *libtrace UNUSED) {
+	return 0;
+}
+
+static int mem_fin_input(libtrace_t *libtrace) {
+	struct mem_chunk_t *chunk, *next;
+
+	if (!FORMAT_DATA)
+		return 0;
+
+	for (chunk = FORMAT_DATA->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		munmap(chunk, chunk->size);
+	}
+	free(FORMAT_DATA->records);
+	free(FORMAT_DATA->uri);
+	free(libtrace->format_data);
+	libtrace->format_data = NULL;
+	return 0;
+}
+
+static libtrace_linktype_t mem_get_link_type(const libtrace_packet_t *packet) {
+	return (libtrace_linktype_t)((mem_header_t *)packet->header)->linktype;
+}
+
+static libtrace_direction_t mem_get_direction(const libtrace_packet_t *packet) {
+	return (libtrace_direction_t)((mem_header_t *)packet->header)->direction;
+}
+
+static libtrace_direction_t mem_set_direction(libtrace_packet_t *packet,
+		libtrace_direction_t direction) {
+	((mem_header_t *)packet->header)->direction = direction;
+	return direction;
+}
+
+static uint64_t mem_get_erf_timestamp(const libtrace_packet_t *packet) {
+	return ((mem_header_t *)packet->header)->ts;
+}
+
+static int mem_get_capture_length(const libtrace_packet_t *packet) {
+	return ((mem_header_t *)packet->header)->caplen;
+}
+
+static int mem_get_wire_length(const libtrace_packet_t *packet) {
+	return ((mem_header_t *)packet->header)->wirelen;
+}
+
+static int mem_get_framing_length(const libtrace_packet_t *packet UNUSED) {
+	return sizeof(mem_header_t);
+}
+
+/* Only the packet's own copy of the header changes, the arena is shared */
+static size_t mem_set_capture_length(libtrace_packet_t *packet, size_t size) {
+	mem_header_t *hdr = (mem_header_t *)packet->header;
+
+	if (size > hdr->caplen)
+		return hdr->caplen;
+	packet->capture_length = -1;
+	hdr->caplen = size;
+	return size;
+}
+
+static void mem_help(void) {
+	printf("mem format module\n");
+	printf("Supported input URIs:\n");
+	printf("\tmem:[loops=N,]uri\n");
+	printf("\n");
+	printf("\te.g.: mem:pcapfile:/traces/sample.pcap\n");
+	printf("\te.g.: mem:loops=100,erf:/traces/sample.erf.gz\n");
+	printf("\n");
+	printf("The whole input trace is loaded into memory when the trace is\n");
+	printf("started, then replayed as fast as it can be read, N times\n");
+	printf("(default 1, 0 for forever). Timestamps are shifted on each\n");
+	printf("pass so that they keep increasing. Meta-data is not replayed.\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t memformat = {
+	"mem",
+	"$Id$",
+	TRACE_FORMAT_MEM,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	mem_init_input,			/* init_input */
+	NULL,				/* config_input */
+	mem_start_input,		/* start_input */
+	mem_pause_input,		/* pause_input */
+	NULL,				/* init_output */
+	NULL,				/* config_output */
+	NULL,				/* start_output */
+	mem_fin_input,			/* fin_input */
+	NULL,				/* fin_output */
+	mem_read_packet,		/* read_packet */
+	mem_prepare_packet,		/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* write_packet */
+	mem_get_link_type,		/* get_link_type */
+	mem_get_direction,		/* get_direction */
+	mem_set_direction,		/* set_direction */
+	mem_get_erf_timestamp,		/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	NULL,				/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	mem_get_capture_length,		/* get_capture_length */
+	mem_get_wire_length,		/* get_wire_length */
+	mem_get_framing_length,		/* get_framing_length */
+	mem_set_capture_length,		/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	NULL,				/* get_statistics */
+	NULL,				/* get_fd */
+	trace_event_trace,		/* trace_event */
+	mem_help,			/* help */
+	NULL,				/* next pointer */
+	{false, -1},			/* trace info */
+	mem_start_input,		/* pstart_input */
+	mem_pread_packets,		/* pread_packets */
+	mem_pause_input,		/* ppause_input */
+	NULL,				/* pfin_input */
+	NULL,				/* pregister_thread */
+	NULL,				/* punregister_thread */
+	NULL,				/* get_thread_statistics */
+};
+
+void mem_constructor(void) {
+	register_format(&memformat);
+}
@@ -0,0 +1,650 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* The merge format presents several input traces as a single trace, with
+ * packets returned in timestamp order.
+ *
+ * Each input is read ahead of time by its own thread, which fills a small
+ * bounded queue so that a slow input (e.g. one that is being decompressed)
+ * does not stall the others. The consumer keeps a min-heap of the inputs,
+ * keyed on the ERF timestamp of the next packet from each, so choosing the
+ * next packet is O(log N) rather than a scan over every input.
+ *
+ * Packets are handed to the caller by swapping buffers with the prefetched
+ * packet, so no packet contents are copied. The returned packet belongs to
+ * the input trace it was read from, which means that all of the usual
+ * per-packet functions work exactly as if the input had been read directly.
+ */
+
+#include "config.h"
+#include "common.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "format_helper.h"
+#include "data-struct/ring_buffer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of packets each input may read ahead of the consumer. Every slot
+ * holds a full packet buffer, so keep this small - merges of hundreds of
+ * inputs are not unusual. */
+#define MERGE_PREFETCH_DEPTH (8)
+
+#define FORMAT_DATA ((struct merge_format_data_t *)libtrace->format_data)
+
+extern int libtrace_parallel;
+
+static struct libtrace_format_t mergeformat;
+
+struct merge_entry_t {
+	libtrace_packet_t *packet;
+	uint64_t ts;
+	/* Return value of read_packet: > 0 packet, 0 EOF, -1 error */
+	int status;
+};
+
+struct merge_input_t {
+	int index;
+	libtrace_t *trace;
+
+	pthread_t thread;
+	bool thread_running;
+	volatile bool stop;
+	volatile bool finished;
+
+	/* Entries circulate from free, to the prefetch thread, to full and
+	 * then back to free once the consumer is done with them */
+	libtrace_ringbuffer_t full;
+	libtrace_ringbuffer_t free;
+	struct merge_entry_t entries[MERGE_PREFETCH_DEPTH + 1];
+
+	/* The next packet from this input, NULL once it is exhausted */
+	struct merge_entry_t *head;
+};
+
+/* Remembers which input a caller's packet was last associated with */
+struct merge_assoc_t {
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+};
+
+struct merge_format_data_t {
+	struct merge_input_t *inputs;
+	int input_count;
+
+	/* Min-heap of inputs ordered by the timestamp of their head */
+	struct merge_input_t **heap;
+	int heap_size;
+	bool primed;
+
+	/* Inputs sorted by trace pointer, for trace_get_merge_input() */
+	struct merge_input_t **by_trace;
+
+	struct merge_assoc_t *assoc;
+	int assoc_count;
+	int assoc_size;
+
+	/* The first read error from an input. The failed input is dropped
+	 * and the error is only reported once the others are exhausted */
+	libtrace_err_t err;
+};
+
+static inline bool merge_before(const struct merge_input_t *a,
+		const struct merge_input_t *b) {
+	if (a->head->ts != b->head->ts)
+		return a->head->ts < b->head->ts;
+	/* Ties go to the input that was listed first */
+	return a->index < b->index;
+}
+
+static void merge_heap_down(struct merge_format_data_t *data, int i) {
+	struct merge_input_t **heap = data->heap;
+	struct merge_input_t *tmp;
+
+	for (;;) {
+		int l = 2 * i + 1;
+		int r = l + 1;
+		int smallest = i;
+
+		if (l < data->heap_size && merge_before(heap[l], heap[smallest]))
+			smallest = l;
+		if (r < data->heap_size && merge_before(heap[r], heap[smallest]))
+			smallest = r;
+		if (smallest == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/* Reads the next packet from an input. Called only by that input's
+ * prefetch thread, and deliberately bypasses trace_read_packet() so that
+ * the input trace's last_packet is left for the consumer to manage. */
+static int merge_read_input(libtrace_t *input, libtrace_packet_t *packet) {
+	int ret;
+
+	if (packet->trace == input && input->format->fin_packet)
+		input->format->fin_packet(packet);
+	trace_clear_cache(packet);
+	packet->trace = input;
+
+	ret = input->format->read_packet(input, packet);
+	if (ret > 0 && packet->buf_control != TRACE_CTRL_PACKET) {
+		/* The next read may reuse the format's buffer, which would
+		 * clobber a packet still sitting in our queue. This is free
+		 * for formats that reference count their buffers. */
+		libtrace_make_packet_safe(packet);
+	}
+	return ret;
+}
+
+static void *merge_prefetch_thread(void *arg) {
+	struct merge_input_t *in = (struct merge_input_t *)arg;
+	struct merge_entry_t *entry;
+
+	for (;;) {
+		entry = (struct merge_entry_t *)libtrace_ringbuffer_read(&in->free);
+		if (in->stop)
+			break;
+		entry->status = merge_read_input(in->trace, entry->packet);
+		if (entry->status > 0)
+			entry->ts = trace_get_erf_timestamp(entry->packet);
+		libtrace_ringbuffer_write(&in->full, entry);
+		if (entry->status <= 0)
+			break;
+	}
+	in->finished = true;
+	return NULL;
+}
+
+static int merge_compare_trace(const void *a, const void *b) {
+	const struct merge_input_t *x = *(struct merge_input_t * const *)a;
+	const struct merge_input_t *y = *(struct merge_input_t * const *)b;
+
+	if (x->trace < y->trace)
+		return -1;
+	return x->trace > y->trace;
+}
+
+/* Splits the next input URI off a merge: URI, returning NULL when there are
+ * none left. Inputs are separated by commas, and a comma or backslash within
+ * an input URI is escaped with a backslash. The URI is unescaped in place. */
+static char *merge_next_uri(char **pos) {
+	char *uri = *pos;
+	char *r, *w;
+
+	if (uri == NULL)
+		return NULL;
+
+	for (r = w = uri; *r && *r != ','; r++) {
+		if (*r == '\\' && (r[1] == ',' || r[1] == '\\'))
+			r++;
+		*w++ = *r;
+	}
+	*pos = *r ? r + 1 : NULL;
+	*w = '\0';
+	return uri;
+}
+
+static int merge_init_input(libtrace_t *libtrace) {
+	char *uris, *uri, *pos;
+	int count = 1;
+	char *scan;
+
+	if (libtrace->uridata == NULL || *libtrace->uridata == '\0') {
+		trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+				"merge: requires at least one input URI");
+		return -1;
+	}
+
+	for (scan = libtrace->uridata; *scan; scan++) {
+		if (*scan == '\\' && (scan[1] == ',' || scan[1] == '\\'))
+			scan++;
+		else if (*scan == ',')
+			count ++;
+	}
+
+	libtrace->format_data = calloc(1, sizeof(struct merge_format_data_t));
+	if (!libtrace->format_data) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to allocate memory for merge format");
+		return -1;
+	}
+	FORMAT_DATA->inputs = calloc(count, sizeof(struct merge_input_t));
+	FORMAT_DATA->heap = calloc(count, sizeof(struct merge_input_t *));
+	FORMAT_DATA->by_trace = calloc(count, sizeof(struct merge_input_t *));
+	if (!FORMAT_DATA->inputs || !FORMAT_DATA->heap ||
+			!FORMAT_DATA->by_trace) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to allocate memory for merge format");
+		return -1;
+	}
+
+	uris = strdup(libtrace->uridata);
+	pos = uris;
+	while ((uri = merge_next_uri(&pos)) != NULL) {
+		struct merge_input_t *in;
+
+		if (*uri == '\0')
+			continue;
+		in = &FORMAT_DATA->inputs[FORMAT_DATA->input_count];
+
+		in->index = FORMAT_DATA->input_count;
+		in->trace = trace_create(uri);
+		FORMAT_DATA->input_count ++;
+		if (trace_is_err(in->trace)) {
+			libtrace_err_t err = trace_get_err(in->trace);
+			trace_set_err(libtrace, err.err_num, "%s: %s", uri,
+					err.problem);
+			free(uris);
+			return -1;
+		}
+		if (in->trace->format->read_packet == NULL) {
+			trace_set_err(libtrace, TRACE_ERR_UNSUPPORTED,
+					"%s: format does not support reading "
+					"packets", uri);
+			free(uris);
+			return -1;
+		}
+		FORMAT_DATA->by_trace[in->index] = in;
+	}
+	free(uris);
+
+	if (FORMAT_DATA->input_count == 0) {
+		trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+				"merge: requires at least one input URI");
+		return -1;
+	}
+
+	qsort(FORMAT_DATA->by_trace, FORMAT_DATA->input_count,
+			sizeof(struct merge_input_t *), merge_compare_trace);
+	return 0;
+}
+
+static int merge_config_input(libtrace_t *libtrace, trace_option_t option,
+		void *value) {
+	int i;
+
+	/* Snapping and filtering are applied to the merged trace by
+	 * trace_read_packet(), everything else is passed on to each input */
+	switch (option) {
+		case TRACE_OPTION_SNAPLEN:
+		case TRACE_OPTION_FILTER:
+			return -1;
+		default:
+			break;
+	}
+
+	for (i = 0; i < FORMAT_DATA->input_count; i++) {
+		if (trace_config(FORMAT_DATA->inputs[i].trace, option,
+					value) == -1) {
+			libtrace_err_t err = trace_get_err(
+					FORMAT_DATA->inputs[i].trace);
+			trace_set_err(libtrace, err.err_num, "%s", err.problem);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int merge_start_input(libtrace_t *libtrace) {
+	int i, j;
+
+	for (i = 0; i < FORMAT_DATA->input_count; i++) {
+		struct merge_input_t *in = &FORMAT_DATA->inputs[i];
+
+		if (trace_start(in->trace) == -1) {
+			libtrace_err_t err = trace_get_err(in->trace);
+			trace_set_err(libtrace, err.err_num, "%s", err.problem);
+			return -1;
+		}
+
+		libtrace_ringbuffer_init(&in->full, MERGE_PREFETCH_DEPTH + 1,
+				LIBTRACE_RINGBUFFER_BLOCKING);
+		libtrace_ringbuffer_init(&in->free, MERGE_PREFETCH_DEPTH + 1,
+				LIBTRACE_RINGBUFFER_BLOCKING);
+		for (j = 0; j < MERGE_PREFETCH_DEPTH + 1; j++) {
+			in->entries[j].packet = trace_create_packet();
+			libtrace_ringbuffer_write(&in->free, &in->entries[j]);
+		}
+
+		if (pthread_create(&in->thread, NULL, merge_prefetch_thread,
+					in) != 0) {
+			trace_set_err(libtrace, errno,
+					"Failed to start prefetch thread");
+			return -1;
+		}
+		in->thread_running = true;
+	}
+	return 0;
+}
+
+/* Waits for the next packet from an input and places it in the heap, or
+ * drops the input if it has run out of packets or failed */
+static void merge_next_head(libtrace_t *libtrace, struct merge_input_t *in) {
+	struct merge_entry_t *entry;
+
+	entry = (struct merge_entry_t *)libtrace_ringbuffer_read(&in->full);
+	if (entry->status > 0) {
+		in->head = entry;
+		return;
+	}
+
+	/* The prefetch thread has exited, so the input is ours again */
+	in->head = NULL;
+	libtrace_ringbuffer_write(&in->free, entry);
+	if (entry->status == 0)
+		return;
+
+	/* Keep merging the other inputs, but remember what went wrong */
+	{
+		libtrace_err_t err = trace_get_err(in->trace);
+		char *problem = FORMAT_DATA->err.problem;
+		size_t room = sizeof(FORMAT_DATA->err.problem);
+		size_t plen;
+		int len;
+
+		if (FORMAT_DATA->err.err_num == TRACE_ERR_NOERROR) {
+			FORMAT_DATA->err.err_num = err.err_num;
+			/* Prefix the input's URI, keeping as much of the
+			 * message as will fit after it */
+			len = snprintf(problem, room, "%s: ",
+					in->trace->uridata ?
+					in->trace->uridata : "");
+			if (len >= 0 && (size_t) len < room) {
+				plen = strnlen(err.problem,
+						sizeof(err.problem));
+				if (plen > room - len - 1)
+					plen = room - len - 1;
+				memcpy(problem + len, err.problem, plen);
+				problem[len + plen] = '\0';
+			}
+		}
+	}
+}
+
+/* The input's last_packet is what lets trace_destroy() tidy up a packet
+ * that outlives the trace, so every packet we hand out is recorded as the
+ * last_packet of the input it came from. trace_read_packet() forgets which
+ * input that was as soon as the packet is reused, so we keep track of the
+ * associations ourselves. */
+static void merge_release(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	struct merge_format_data_t *data = FORMAT_DATA;
+	int i;
+
+	for (i = 0; i < data->assoc_count; ) {
+		struct merge_assoc_t *a = &data->assoc[i];
+
+		if (a->packet == packet && a->trace->last_packet == packet)
+			a->trace->last_packet = NULL;
+		/* Drop this entry if it has been released, either by us or
+		 * by trace_destroy_packet() */
+		if (a->trace->last_packet != a->packet) {
+			data->assoc[i] = data->assoc[--data->assoc_count];
+			continue;
+		}
+		i++;
+	}
+}
+
+static void merge_associate(libtrace_t *libtrace, libtrace_packet_t *packet,
+		libtrace_t *input) {
+	struct merge_format_data_t *data = FORMAT_DATA;
+
+	if (data->assoc_count == data->assoc_size) {
+		data->assoc_size = data->assoc_size ? data->assoc_size * 2 : 4;
+		data->assoc = realloc(data->assoc, data->assoc_size *
+				sizeof(struct merge_assoc_t));
+	}
+	data->assoc[data->assoc_count].packet = packet;
+	data->assoc[data->assoc_count].trace = input;
+	data->assoc_count ++;
+	input->last_packet = packet;
+}
+
+static int merge_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	struct merge_format_data_t *data = FORMAT_DATA;
+	struct merge_input_t *in;
+	libtrace_packet_t *next;
+	void *oldbuf;
+	int ret;
+	int i;
+
+	if (!libtrace_parallel)
+		merge_release(libtrace, packet);
+
+	/* Hand back a reference counted buffer from the previous read, as
+	 * trace_read_packet() won't finish a packet that belongs to one of
+	 * our inputs */
+	if (packet->srcbucket && packet->internalid != 0) {
+		libtrace_release_bucket_id(
+				(libtrace_bucket_t *)packet->srcbucket,
+				packet->internalid);
+		packet->srcbucket = NULL;
+		packet->internalid = 0;
+		packet->buffer = NULL;
+	}
+
+	if (!data->primed) {
+		for (i = 0; i < data->input_count; i++) {
+			in = &data->inputs[i];
+			merge_next_head(libtrace, in);
+			if (in->head)
+				data->heap[data->heap_size++] = in;
+		}
+		for (i = data->heap_size / 2 - 1; i >= 0; i--)
+			merge_heap_down(data, i);
+		data->primed = true;
+	}
+
+	if (data->heap_size == 0) {
+		if (data->err.err_num != TRACE_ERR_NOERROR) {
+			trace_set_err(libtrace, data->err.err_num, "%s",
+					data->err.problem);
+			return -1;
+		}
+		return 0;
+	}
+
+	in = data->heap[0];
+	next = in->head->packet;
+	ret = in->head->status;
+
+	/* Swap buffers: the caller gets the prefetched contents and the
+	 * prefetch thread gets the caller's old buffer to read into. A
+	 * buffer owned by an input's bucket goes along with its reference. */
+	oldbuf = packet->buf_control == TRACE_CTRL_PACKET ? packet->buffer : NULL;
+	packet->buffer = next->buffer;
+	packet->header = next->header;
+	packet->payload = next->payload;
+	packet->type = next->type;
+	packet->error = next->error;
+	packet->buf_control = next->buf_control;
+	packet->srcbucket = next->srcbucket;
+	packet->internalid = next->internalid;
+	packet->trace = in->trace;
+	trace_clear_cache(packet);
+	if (!libtrace_parallel)
+		merge_associate(libtrace, packet, in->trace);
+
+	next->buffer = oldbuf;
+	next->header = NULL;
+	next->payload = NULL;
+	next->trace = NULL;
+	next->buf_control = TRACE_CTRL_PACKET;
+	next->srcbucket = NULL;
+	next->internalid = 0;
+	trace_clear_cache(next);
+	libtrace_ringbuffer_write(&in->free, in->head);
+
+	/* Refill this input's slot in the heap */
+	merge_next_head(libtrace, in);
+	if (in->head == NULL)
+		data->heap[0] = data->heap[--data->heap_size];
+	merge_heap_down(data, 0);
+
+	return ret;
+}
+
+static void merge_stop_input(struct merge_input_t *in) {
+	struct merge_entry_t *entry;
+
+	if (!in->thread_running)
+		return;
+
+	in->stop = true;
+	if (in->head) {
+		libtrace_ringbuffer_write(&in->free, in->head);
+		in->head = NULL;
+	}
+	/* The thread may be waiting for either queue, keep both moving
+	 * until it notices that it should stop */
+	while (!in->finished) {
+		if (libtrace_ringbuffer_try_read(&in->full, (void **)&entry))
+			libtrace_ringbuffer_write(&in->free, entry);
+		else
+			sched_yield();
+	}
+	pthread_join(in->thread, NULL);
+	in->thread_running = false;
+}
+
+static int merge_fin_input(libtrace_t *libtrace) {
+	int i, j;
+
+	if (!FORMAT_DATA)
+		return 0;
+
+	for (i = 0; i < FORMAT_DATA->input_count; i++) {
+		struct merge_input_t *in = &FORMAT_DATA->inputs[i];
+
+		if (in->full.elements) {
+			merge_stop_input(in);
+			for (j = 0; j < MERGE_PREFETCH_DEPTH + 1; j++)
+				trace_destroy_packet(in->entries[j].packet);
+			libtrace_ringbuffer_destroy(&in->full);
+			libtrace_ringbuffer_destroy(&in->free);
+		}
+		if (in->trace)
+			trace_destroy(in->trace);
+	}
+
+	free(FORMAT_DATA->inputs);
+	free(FORMAT_DATA->heap);
+	free(FORMAT_DATA->by_trace);
+	free(FORMAT_DATA->assoc);
+	free(libtrace->format_data);
+	libtrace->format_data = NULL;
+	return 0;
+}
+
+DLLEXPORT int trace_get_merge_input(libtrace_t *libtrace,
+		const libtrace_packet_t *packet) {
+	struct merge_input_t key, *keyptr = &key;
+	struct merge_input_t **found;
+
+	if (libtrace->format != &mergeformat || !FORMAT_DATA || !packet)
+		return -1;
+
+	key.trace = packet->trace;
+	found = bsearch(&keyptr, FORMAT_DATA->by_trace,
+			FORMAT_DATA->input_count,
+			sizeof(struct merge_input_t *), merge_compare_trace);
+	if (!found)
+		return -1;
+	return (*found)->index;
+}
+
+static void merge_help(void) {
+	printf("merge format module\n");
+	printf("Supported input URIs:\n");
+	printf("\tmerge:uri1,uri2,...\n");
+	printf("\n");
+	printf("\te.g.: merge:erf:/traces/if0.gz,erf:/traces/if1.gz\n");
+	printf("\n");
+	printf("Packets from all of the inputs are returned in timestamp order.\n");
+	printf("Each input is read ahead by its own thread.\n");
+	printf("Escape any ',' or '\\' within an input URI with a '\\'.\n");
+	printf("If an input fails, the others are still merged and the error\n");
+	printf("is reported once they are finished.\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t mergeformat = {
+	"merge",
+	"$Id$",
+	TRACE_FORMAT_MERGE,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	merge_init_input,		/* init_input */
+	merge_config_input,		/* config_input */
+	merge_start_input,		/* start_input */
+	NULL,				/* pause_input */
+	NULL,				/* init_output */
+	NULL,				/* config_output */
+	NULL,				/* start_output */
+	merge_fin_input,		/* fin_input */
+	NULL,				/* fin_output */
+	merge_read_packet,		/* read_packet */
+	NULL,				/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* write_packet */
+	NULL,				/* get_link_type */
+	NULL,				/* get_direction */
+	NULL,				/* set_direction */
+	NULL,				/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	NULL,				/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	NULL,				/* get_capture_length */
+	NULL,				/* get_wire_length */
+	NULL,				/* get_framing_length */
+	NULL,				/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	NULL,				/* get_statistics */
+	NULL,				/* get_fd */
+	trace_event_trace,		/* trace_event */
+	merge_help,			/* help */
+	NULL,				/* next pointer */
+	NON_PARALLEL(false)
+};
+
+void merge_constructor(void) {
+	register_format(&mergeformat);
+}
@@ -46,6 +46,10 @@
 #include <sys/socket.h>
 #include <netdb.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "format_ndag.h"
 
 #define NDAG_IDLE_TIMEOUT (600)
@@ -54,6 +58,7 @@
 #define ENCAP_BUFFERS (1000)
 
 #define RECV_BATCH_SIZE (50)
+#define NDAG_EPOLL_EVENTS (64)
 
 #define FORMAT_DATA ((ndag_format_data_t *)libtrace->format_data)
 
@@ -87,6 +92,7 @@ typedef struct streamsock {
         int nextwriteind;
         int savedsize[ENCAP_BUFFERS];
 	uint64_t nextts;
+        int heapindex;
         uint32_t startidle;
         uint64_t recordcount;
 
@@ -113,8 +119,18 @@ typedef struct recvstream {
         uint64_t missing_records;
         uint64_t received_packets;
 
+        /* Min-heap of indexes into 'sources', ordered by the timestamp of
+         * the next unread ERF record. Only sources with readable data
+         * are present in the heap. */
+        uint16_t *heap;
+        uint16_t heapsize;
+
+#ifdef HAVE_SYS_EPOLL_H
+        int epollfd;
+#else
 	fd_set allsocks;
 	int maxfd;
+#endif
 } recvstream_t;
 
 typedef struct ndag_format_data {
@@ -487,8 +503,19 @@ static int ndag_start_threads(libtrace_t *libtrace, uint32_t maxthreads)
                 FORMAT_DATA->receivers[i].dropped_upstream = 0;
                 FORMAT_DATA->receivers[i].received_packets = 0;
                 FORMAT_DATA->receivers[i].missing_records = 0;
+                FORMAT_DATA->receivers[i].heap = NULL;
+                FORMAT_DATA->receivers[i].heapsize = 0;
+#ifdef HAVE_SYS_EPOLL_H
+                FORMAT_DATA->receivers[i].epollfd = epoll_create1(0);
+                if (FORMAT_DATA->receivers[i].epollfd < 0) {
+                        trace_set_err(libtrace, errno,
+                                "Failed to create epoll instance for nDAG receiver thread %u", i);
+                        return -1;
+                }
+#else
 		FD_ZERO(&(FORMAT_DATA->receivers[i].allsocks));
 		FORMAT_DATA->receivers[i].maxfd = -1;
+#endif
 
                 libtrace_message_queue_init(&(FORMAT_DATA->receivers[i].mqueue),
                                 sizeof(ndag_internal_message_t));
@@ -520,6 +547,18 @@ static void halt_ndag_receiver(recvstream_t *receiver) {
         int j, i;
         libtrace_message_queue_destroy(&(receiver->mqueue));
 
+#ifdef HAVE_SYS_EPOLL_H
+        if (receiver->epollfd >= 0) {
+                close(receiver->epollfd);
+                receiver->epollfd = -1;
+        }
+#endif
+        if (receiver->heap) {
+                free(receiver->heap);
+                receiver->heap = NULL;
+        }
+        receiver->heapsize = 0;
+
         if (receiver->sources == NULL)
                 return;
         for (i = 0; i < receiver->sourcecount; i++) {
@@ -557,6 +596,11 @@ static void halt_ndag_receiver(recvstream_t *receiver) {
 static int ndag_pause_input(libtrace_t *libtrace) {
         int i;
 
+        /* Wait for the controller to notice, so that it can't touch the
+         * trace after it has been destroyed */
+        ndag_paused = 1;
+        pthread_join(FORMAT_DATA->controlthread, NULL);
+
         /* Close the existing receiver sockets */
         for (i = 0; i < libtrace->perpkt_thread_count; i++) {
                halt_ndag_receiver(&(FORMAT_DATA->receivers[i]));
@@ -583,6 +627,110 @@ static int ndag_fin_input(libtrace_t *libtrace) {
         return 0;
 }
 
+static inline int readable_data(streamsock_t *ssock) {
+
+        if (ssock->sock == -1) {
+                return 0;
+        }
+        if (ssock->savedsize[ssock->nextreadind] == 0) {
+                return 0;
+        }
+        /*
+        if (ssock->nextread - ssock->saved[ssock->nextreadind] >=
+                        ssock->savedsize[ssock->nextreadind]) {
+                return 0;
+        }
+        */
+        return 1;
+
+
+}
+
+static inline uint64_t source_next_ts(streamsock_t *ssock) {
+        dag_record_t *daghdr;
+
+        if (ssock->nextts == 0) {
+                daghdr = (dag_record_t *)(ssock->nextread);
+                ssock->nextts = bswap_le_to_host64(daghdr->ts);
+        }
+        return ssock->nextts;
+}
+
+static inline int source_heap_less(recvstream_t *rt, uint16_t a, uint16_t b) {
+        uint64_t ats = rt->sources[a].nextts;
+        uint64_t bts = rt->sources[b].nextts;
+
+        if (ats != bts) {
+                return ats < bts;
+        }
+        return a < b;
+}
+
+static inline void source_heap_place(recvstream_t *rt, int pos, uint16_t ind) {
+        rt->heap[pos] = ind;
+        rt->sources[ind].heapindex = pos;
+}
+
+static void source_heap_sift_down(recvstream_t *rt, int pos) {
+        uint16_t ind = rt->heap[pos];
+        int child;
+
+        while ((child = pos * 2 + 1) < rt->heapsize) {
+                if (child + 1 < rt->heapsize && source_heap_less(rt,
+                                rt->heap[child + 1], rt->heap[child])) {
+                        child ++;
+                }
+                if (!source_heap_less(rt, rt->heap[child], ind)) {
+                        break;
+                }
+                source_heap_place(rt, pos, rt->heap[child]);
+                pos = child;
+        }
+        source_heap_place(rt, pos, ind);
+}
+
+/* Adds a source with readable data to the heap, keyed on the timestamp
+ * of its next ERF record. */
+static void source_heap_push(recvstream_t *rt, uint16_t ind) {
+        streamsock_t *ssock = &(rt->sources[ind]);
+        int pos, parent;
+
+        if (ssock->heapindex != -1 || !readable_data(ssock)) {
+                return;
+        }
+
+        source_next_ts(ssock);
+        pos = rt->heapsize ++;
+        while (pos > 0) {
+                parent = (pos - 1) / 2;
+                if (!source_heap_less(rt, ind, rt->heap[parent])) {
+                        break;
+                }
+                source_heap_place(rt, pos, rt->heap[parent]);
+                pos = parent;
+        }
+        source_heap_place(rt, pos, ind);
+}
+
+static void source_heap_pop(recvstream_t *rt) {
+        rt->sources[rt->heap[0]].heapindex = -1;
+        rt->heapsize --;
+        if (rt->heapsize > 0) {
+                rt->heap[0] = rt->heap[rt->heapsize];
+                source_heap_sift_down(rt, 0);
+        }
+}
+
+static void close_streamsock(recvstream_t *rt, streamsock_t *ssock) {
+#ifdef HAVE_SYS_EPOLL_H
+        epoll_ctl(rt->epollfd, EPOLL_CTL_DEL, ssock->sock, NULL);
+#else
+	FD_CLR(ssock->sock, &(rt->allsocks));
+#endif
+        close(ssock->sock);
+        ssock->sock = -1;
+}
+
 static int ndag_prepare_packet_stream(libtrace_t *libtrace,
                 recvstream_t *rt,
                 streamsock_t *ssock, libtrace_packet_t *packet,
@@ -661,6 +809,10 @@ static int ndag_prepare_packet_stream(libtrace_t *libtrace,
                 ssock->nextreadind = nr;
         }
 
+        if (rt->sourcecount > 1) {
+                source_heap_push(rt, ssock - rt->sources);
+        }
+
         packet->order = erf_get_erf_timestamp(packet);
         packet->error = rlen;
         return rlen;
@@ -710,9 +862,12 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
          */
         if (rt->sourcecount == 0) {
                 rt->sources = (streamsock_t *)malloc(sizeof(streamsock_t) * 10);
+                rt->heap = (uint16_t *)malloc(sizeof(uint16_t) * 10);
         } else if ((rt->sourcecount % 10) == 0) {
                 rt->sources = (streamsock_t *)realloc(rt->sources,
                         sizeof(streamsock_t) * (rt->sourcecount + 10));
+                rt->heap = (uint16_t *)realloc(rt->heap,
+                        sizeof(uint16_t) * (rt->sourcecount + 10));
         }
 
         ssock = &(rt->sources[rt->sourcecount]);
@@ -744,6 +899,7 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
 	ssock->bufwaiting = 0;
         ssock->startidle = 0;
 	ssock->nextts = 0;
+        ssock->heapindex = -1;
 
         for (i = 0; i < ENCAP_BUFFERS; i++) {
                 ssock->saved[i] = (char *)malloc(ENCAP_BUFSIZE);
@@ -769,11 +925,35 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
         ssock->nextreadind = 0;
         ssock->nextwriteind = 0;
         ssock->recordcount = 0;
-        rt->sourcecount += 1;
+#ifdef HAVE_SYS_EPOLL_H
+        {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = rt->sourcecount;
+                if (epoll_ctl(rt->epollfd, EPOLL_CTL_ADD, ssock->sock,
+                                &ev) < 0) {
+                        fprintf(stderr,
+                                "Failed to register %s:%u with epoll -- %s\n",
+                                ssock->groupaddr, ssock->port,
+                                strerror(errno));
+                        close(ssock->sock);
+                        return -1;
+                }
+        }
+#else
 	FD_SET(ssock->sock, &(rt->allsocks));
 	if (ssock->sock > rt->maxfd) {
 		rt->maxfd = ssock->sock;
 	}
+#endif
+        rt->sourcecount += 1;
+
+        /* The single source case bypasses the heap entirely, so seed it
+         * with the original source once a second one turns up. */
+        if (rt->sourcecount == 2) {
+                source_heap_push(rt, 0);
+        }
 
         fprintf(stderr, "Added new stream %s:%u to thread %d\n",
                         ssock->groupaddr, ssock->port, rt->threadindex);
@@ -801,25 +981,6 @@ static int receiver_read_messages(recvstream_t *rt) {
 
 }
 
-static inline int readable_data(streamsock_t *ssock) {
-
-        if (ssock->sock == -1) {
-                return 0;
-        }
-        if (ssock->savedsize[ssock->nextreadind] == 0) {
-                return 0;
-        }
-        /*
-        if (ssock->nextread - ssock->saved[ssock->nextreadind] >=
-                        ssock->savedsize[ssock->nextreadind]) {
-                return 0;
-        }
-        */
-        return 1;
-
-
-}
-
 static inline void reset_expected_seqs(recvstream_t *rt, ndag_monitor_t *mon) {
 
         int i;
@@ -880,9 +1041,7 @@ static int check_ndag_received(streamsock_t *ssock, int index,
         } else if (rectype != NDAG_PKT_ENCAPERF) {
                 fprintf(stderr, "Received invalid record on the channel for %s:%u.\n",
                                 ssock->groupaddr, ssock->port);
-		FD_CLR(ssock->sock, &(rt->allsocks));
-                close(ssock->sock);
-                ssock->sock = -1;
+                close_streamsock(rt, ssock);
                 return -1;
         }
 
@@ -930,6 +1089,10 @@ static int check_ndag_received(streamsock_t *ssock, int index,
                 ssock->nextread = ssock->saved[0] +
                         sizeof(ndag_common_t) + sizeof(ndag_encap_t);
         }
+
+        if (ssock->heapindex == -1 && rt->sourcecount > 1) {
+                source_heap_push(rt, ssock - rt->sources);
+        }
         return 1;
 
 }
@@ -986,9 +1149,7 @@ static int receive_from_single_socket(streamsock_t *ssock, struct timeval *tv,
                                         ssock->groupaddr,
                                         ssock->port);
 
-				FD_CLR(ssock->sock, &(rt->allsocks));
-                                close(ssock->sock);
-                                ssock->sock = -1;
+                                close_streamsock(rt, ssock);
                         }
                 } else {
 
@@ -996,9 +1157,7 @@ static int receive_from_single_socket(streamsock_t *ssock, struct timeval *tv,
                                 "Error receiving encapsulated records from %s:%u -- %s \n",
                                 ssock->groupaddr, ssock->port,
                                 strerror(errno));
-			FD_CLR(ssock->sock, &(rt->allsocks));
-                        close(ssock->sock);
-                        ssock->sock = -1;
+                        close_streamsock(rt, ssock);
                 }
                 return toret;
         }
@@ -1033,12 +1192,32 @@ static int receive_from_sockets(recvstream_t *rt) {
 
         int i, readybufs, gottime;
         struct timeval tv;
+#ifdef HAVE_SYS_EPOLL_H
+        struct epoll_event events[NDAG_EPOLL_EVENTS];
+        int nfds;
+#else
 	fd_set fds;
 	struct timeval zerotv;
+#endif
 
         readybufs = 0;
         gottime = 0;
 
+#ifdef HAVE_SYS_EPOLL_H
+        nfds = epoll_wait(rt->epollfd, events, NDAG_EPOLL_EVENTS, 0);
+        if (nfds == -1) {
+                if (errno == EINTR) {
+                        return 0;
+                }
+                return -1;
+        }
+
+        for (i = 0; i < nfds; i++) {
+                readybufs += receive_from_single_socket(
+                                &(rt->sources[events[i].data.u32]),
+                                &tv, &gottime, rt);
+        }
+#else
 	fds = rt->allsocks;
 
 	if (rt->maxfd == -1) {
@@ -1060,6 +1239,17 @@ static int receive_from_sockets(recvstream_t *rt) {
                 readybufs += receive_from_single_socket(&(rt->sources[i]),
                                 &tv, &gottime, rt);
         }
+#endif
+
+        /* Records that were received earlier but have not been read yet
+         * are just as usable as anything that arrived this time around */
+        if (readybufs == 0) {
+                if (rt->sourcecount == 1) {
+                        readybufs = readable_data(&(rt->sources[0]));
+                } else {
+                        readybufs = rt->heapsize;
+                }
+        }
 
         return readybufs;
 
@@ -1141,11 +1331,7 @@ static int receive_encap_records_nonblock(libtrace_t *libtrace, recvstream_t *rt
 }
 
 static streamsock_t *select_next_packet(recvstream_t *rt) {
-        int i;
-        streamsock_t *ssock = NULL;
-        uint64_t earliest = 0;
-        uint64_t currentts = 0;
-        dag_record_t *daghdr;
+        streamsock_t *ssock;
 
 	/* If we only have one source, then no need to do any
          * timestamp parsing or byteswapping.
@@ -1157,26 +1343,18 @@ static streamsock_t *select_next_packet(recvstream_t *rt) {
 		return NULL;
 	}
 
-
-        for (i = 0; i < rt->sourcecount; i ++) {
-                if (!readable_data(&(rt->sources[i]))) {
-                        continue;
-                }
-
-		if (rt->sources[i].nextts == 0) {
-               		daghdr = (dag_record_t *)(rt->sources[i].nextread);
-	                currentts = bswap_le_to_host64(daghdr->ts);
-			rt->sources[i].nextts = currentts;
-		} else {
-			currentts = rt->sources[i].nextts;
-		}
-
-                if (earliest == 0 || earliest > currentts) {
-                        earliest = currentts;
-                        ssock = &(rt->sources[i]);
+        /* The source with the earliest next record is at the top of the
+         * heap. It is removed here and pushed back with its new timestamp
+         * once the record has been consumed. Sources that were closed
+         * while sitting in the heap are discarded along the way. */
+        while (rt->heapsize > 0) {
+                ssock = &(rt->sources[rt->heap[0]]);
+                source_heap_pop(rt);
+                if (readable_data(ssock)) {
+                        return ssock;
                 }
         }
-        return ssock;
+        return NULL;
 }
 
 static int ndag_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
@@ -1222,20 +1400,25 @@ static int ndag_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
                 if (read_packets == 0) {
                         rem = receive_encap_records_block(libtrace, rt,
                                 packets[read_packets]);
-                } else {
-                        rem = receive_encap_records_nonblock(libtrace, rt,
-                                packets[read_packets]);
-                }
-
-                if (rem < 0) {
-                        return rem;
-                }
-
-                if (rem == 0) {
-                        break;
+                        if (rem <= 0) {
+                                return rem;
+                        }
                 }
 
+                /* Keep draining records that we have already received
+                 * and only go back to the sockets once they run out */
                 nextavail = select_next_packet(rt);
+                if (nextavail == NULL && read_packets > 0) {
+                        rem = receive_encap_records_nonblock(libtrace, rt,
+                                packets[read_packets]);
+                        if (rem < 0) {
+                                return rem;
+                        }
+                        if (rem == 0) {
+                                break;
+                        }
+                        nextavail = select_next_packet(rt);
+                }
                 if (nextavail == NULL) {
                         break;
                 }
@@ -415,40 +415,92 @@ static int pcapfile_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
 	return sizeof(libtrace_pcapfile_pkt_hdr_t) + bytes_to_read;
 }
 
-static int pcapfile_write_packet(libtrace_out_t *out,
-		libtrace_packet_t *packet)
+DLLEXPORT int trace_get_pcap_record(libtrace_packet_t *packet,
+		libtrace_pcap_record_t *record, void **data,
+		uint32_t *linktype)
 {
-	struct libtrace_pcapfile_pkt_hdr_t hdr;
 	struct timeval tv = trace_get_timeval(packet);
-	int numbytes;
-	int ret;
 	void *ptr;
 	uint32_t remaining;
-	libtrace_linktype_t linktype;
+	libtrace_linktype_t ltype;
 
-	ptr = trace_get_packet_buffer(packet,&linktype,&remaining);
+	ptr = trace_get_packet_buffer(packet,&ltype,&remaining);
 	
 	/* Silently discard RT metadata packets and packets with an
 	 * unknown linktype. */
-	if (linktype == TRACE_TYPE_NONDATA || linktype == TRACE_TYPE_UNKNOWN || linktype == TRACE_TYPE_ERF_META) {
+	if (ltype == TRACE_TYPE_NONDATA || ltype == TRACE_TYPE_UNKNOWN || ltype == TRACE_TYPE_ERF_META) {
 		return 0;
 	}
 
 	/* If this packet cannot be converted to a pcap linktype then
 	 * pop off the top header until it can be converted
 	 */
-	while (libtrace_to_pcap_linktype(linktype)==TRACE_DLT_ERROR) {
+	while (libtrace_to_pcap_linktype(ltype)==TRACE_DLT_ERROR) {
 		if (!demote_packet(packet)) {
-			trace_set_err_out(out, 
-				TRACE_ERR_NO_CONVERSION,
-				"pcap does not support this format");
-			assert(0);
 			return -1;
 		}
 
-		ptr = trace_get_packet_buffer(packet,&linktype,&remaining);
+		ptr = trace_get_packet_buffer(packet,&ltype,&remaining);
+	}
+
+	record->ts_sec = (uint32_t)tv.tv_sec;
+	record->ts_usec = (uint32_t)tv.tv_usec;
+	record->caplen = trace_get_capture_length(packet);
+	assert(record->caplen < LIBTRACE_PACKET_BUFSIZE);
+	/* PCAP doesn't include the FCS in its wire length value, but we do */
+	if (ltype==TRACE_TYPE_ETH) {
+		if (trace_get_wire_length(packet) >= 4) {
+			record->wirelen = trace_get_wire_length(packet)-4;
+		}
+		else {
+			record->wirelen = 0;
+		}
 	}
+	else
+		record->wirelen = trace_get_wire_length(packet);
+
+	/* Reason for removing this assert:
+	 *
+	 * There exist some packets, e.g. in IPLS II, where the wire length
+	 * is clearly corrupt. When converting to pcap, we *could* try to
+	 * adjust the wire length to something sane but for now, I'll just let
+	 * the broken length persist through the conversion.
+	 *
+	 * XXX Is setting the wire length to zero the best solution in such
+	 * cases?
+	 */
+
+	/* assert(record->wirelen < LIBTRACE_PACKET_BUFSIZE); */
 
+	/* Ensure we have a valid capture length, especially if we're going
+	 * to "remove" the FCS from the wire length */
+	if (record->caplen > record->wirelen)
+		record->caplen = record->wirelen;
+
+	*data = ptr;
+	*linktype = libtrace_to_pcap_linktype(ltype);
+	return 1;
+}
+
+static int pcapfile_write_packet(libtrace_out_t *out,
+		libtrace_packet_t *packet)
+{
+	libtrace_pcap_record_t hdr;
+	uint32_t network;
+	int numbytes;
+	int ret;
+	void *ptr;
+
+	ret = trace_get_pcap_record(packet, &hdr, &ptr, &network);
+	if (ret == 0)
+		return 0;
+	if (ret < 0) {
+		trace_set_err_out(out, 
+			TRACE_ERR_NO_CONVERSION,
+			"pcap does not support this format");
+		assert(0);
+		return -1;
+	}
 
 	/* Now we know the link type write out a header if we've not done
 	 * so already
@@ -472,48 +524,12 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 		pcaphdr.thiszone = 0;
 		pcaphdr.sigfigs = 0;
 		pcaphdr.snaplen = 65536;
-		pcaphdr.network = 
-			libtrace_to_pcap_linktype(linktype);
+		pcaphdr.network = network;
 
 		wandio_wwrite(DATAOUT(out)->file, 
 				&pcaphdr, sizeof(pcaphdr));
 	}
 
-
-	hdr.ts_sec = (uint32_t)tv.tv_sec;
-	hdr.ts_usec = (uint32_t)tv.tv_usec;
-	hdr.caplen = trace_get_capture_length(packet);
-	assert(hdr.caplen < LIBTRACE_PACKET_BUFSIZE);
-	/* PCAP doesn't include the FCS in its wire length value, but we do */
-	if (linktype==TRACE_TYPE_ETH) {
-		if (trace_get_wire_length(packet) >= 4) {
-			hdr.wirelen = trace_get_wire_length(packet)-4;
-		}
-		else {
-			hdr.wirelen = 0;
-		}
-	}
-	else
-		hdr.wirelen = trace_get_wire_length(packet);
-
-	/* Reason for removing this assert:
-	 *
-	 * There exist some packets, e.g. in IPLS II, where the wire length
-	 * is clearly corrupt. When converting to pcap, we *could* try to
-	 * adjust the wire length to something sane but for now, I'll just let
-	 * the broken length persist through the conversion.
-	 *
-	 * XXX Is setting the wire length to zero the best solution in such
-	 * cases?
-	 */
-
-	/* assert(hdr.wirelen < LIBTRACE_PACKET_BUFSIZE); */
-
-	/* Ensure we have a valid capture length, especially if we're going
-	 * to "remove" the FCS from the wire length */
-	if (hdr.caplen > hdr.wirelen)
-		hdr.caplen = hdr.wirelen;
-
 	/* Write the packet header */
 	numbytes=wandio_wwrite(DATAOUT(out)->file,
 			&hdr, sizeof(hdr));
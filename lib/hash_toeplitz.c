@@ -33,6 +33,7 @@
  * 
  */
 #include "hash_toeplitz.h"
+#include "protocols.h"
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
@@ -158,13 +159,14 @@ uint32_t toeplitz_first_hash(const toeplitz_conf_t *tc, const uint8_t *data, siz
 	return toeplitz_hash(tc, data, 0, n, 0);
 }
 
-uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf_t *cnf) {
-	uint8_t proto;
-	uint16_t eth_type;
-	uint32_t remaining;
+/**
+ * Hashes the addresses and ports of a flow given its layer 3 and transport
+ * headers. transport may be NULL if the transport header is unavailable.
+ */
+static uint32_t toeplitz_hash_headers(const toeplitz_conf_t *cnf,
+		void *layer3, uint16_t eth_type, uint32_t remaining,
+		void *transport, uint8_t proto, uint32_t trans_remaining) {
 	uint32_t res = 0; // shutup warning, logic was to complex for gcc to follow
-	void *layer3 = trace_get_layer3(pkt, &eth_type, &remaining);
-	void *transport = NULL;
 	size_t offset = 0;
 	bool accept_tcp = false, accept_udp = false;
 
@@ -205,18 +207,16 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 		}
 	}
 
-	transport = trace_get_transport(pkt, &proto, &remaining);
-
 	if (transport) {
 		switch(proto) {
 			// Hash src & dst port
 			case TRACE_IPPROTO_UDP:
-				if (accept_udp && remaining >= 4) {
+				if (accept_udp && trans_remaining >= 4) {
 					res = toeplitz_hash(cnf, (uint8_t *)transport, offset, 4, res);
 				}
 				break;
 			case TRACE_IPPROTO_TCP:
-				if (accept_tcp && remaining >= 4) {
+				if (accept_tcp && trans_remaining >= 4) {
 					res = toeplitz_hash(cnf, (uint8_t *)transport, offset, 4, res);
 				}
 				break;
@@ -225,3 +225,277 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 
 	return res;
 }
+
+uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf_t *cnf) {
+	uint8_t proto = 0;
+	uint16_t eth_type = 0;
+	uint32_t remaining = 0, trans_remaining = 0;
+	void *layer3 = trace_get_layer3(pkt, &eth_type, &remaining);
+	void *transport = trace_get_transport(pkt, &proto, &trans_remaining);
+
+	return toeplitz_hash_headers(cnf, layer3, eth_type, remaining,
+			transport, proto, trans_remaining);
+}
+
+void toeplitz_init_tunnel_config(toeplitz_tunnel_conf_t *conf,
+		bool bidirectional, uint32_t tunnels, unsigned int max_depth)
+{
+	toeplitz_init_config(&conf->toeplitz, bidirectional);
+	conf->tunnels = tunnels;
+	conf->max_depth = max_depth;
+}
+
+#define GTP_U_PORT 2152
+#define GTP_FLAG_VERSION_MASK 0xe0
+#define GTP_FLAG_VERSION_1 0x20
+#define GTP_FLAG_OPTIONAL 0x07
+#define GTP_FLAG_EXTENSION 0x04
+#define GTP_MSG_GPDU 0xff
+#define GRE_ETHERTYPE_TEB 0x6558
+
+/* Skips any VLAN, MPLS and PPPoE headers found after an Ethernet header,
+ * in the same way as trace_get_layer3(). Ethernet pseudowires carried within
+ * MPLS are also skipped if the configuration allows it.
+ */
+static void *skip_layer2_shims(const toeplitz_tunnel_conf_t *cnf, void *hdr,
+		uint16_t *ethertype, uint32_t *remaining) {
+
+	while (hdr && *remaining > 0) {
+		switch (*ethertype) {
+			case TRACE_ETHERTYPE_8021Q:
+				hdr = trace_get_payload_from_vlan(hdr, ethertype,
+						remaining);
+				continue;
+			case TRACE_ETHERTYPE_MPLS:
+				hdr = trace_get_payload_from_mpls(hdr, ethertype,
+						remaining);
+				if (hdr && *ethertype == 0) {
+					if (!(cnf->tunnels & TOEPLITZ_TUNNEL_MPLS))
+						return NULL;
+					hdr = trace_get_payload_from_ethernet(hdr,
+							ethertype, remaining);
+				}
+				continue;
+			case TRACE_ETHERTYPE_PPP_SES:
+				hdr = trace_get_payload_from_pppoe(hdr, ethertype,
+						remaining);
+				continue;
+		}
+		break;
+	}
+
+	if (*remaining == 0)
+		return NULL;
+	return hdr;
+}
+
+/* Returns the inner IP header carried by a GTPv1-U G-PDU, or NULL if this is
+ * not a G-PDU or is truncated */
+static void *get_payload_from_gtp(uint8_t *gtp, uint16_t *ethertype,
+		uint32_t *remaining) {
+	uint32_t size = 8;
+
+	if (*remaining < size)
+		return NULL;
+	if ((gtp[0] & GTP_FLAG_VERSION_MASK) != GTP_FLAG_VERSION_1 ||
+			gtp[1] != GTP_MSG_GPDU)
+		return NULL;
+
+	/* The sequence number, N-PDU number and next extension type are
+	 * present if any of the optional flags are set */
+	if (gtp[0] & GTP_FLAG_OPTIONAL) {
+		size += 4;
+		if (*remaining < size)
+			return NULL;
+		if (gtp[0] & GTP_FLAG_EXTENSION) {
+			uint8_t next = gtp[size - 1];
+			while (next != 0) {
+				/* Extension length is in units of 4 bytes and
+				 * the next type is the final byte */
+				uint32_t extlen;
+				if (*remaining < size + 1)
+					return NULL;
+				extlen = gtp[size] * 4;
+				if (extlen == 0 || *remaining < size + extlen)
+					return NULL;
+				size += extlen;
+				next = gtp[size - 1];
+			}
+		}
+	}
+
+	if (*remaining <= size)
+		return NULL;
+
+	switch (gtp[size] & 0xf0) {
+		case 0x40:
+			*ethertype = TRACE_ETHERTYPE_IP;
+			break;
+		case 0x60:
+			*ethertype = TRACE_ETHERTYPE_IPV6;
+			break;
+		default:
+			return NULL;
+	}
+	*remaining -= size;
+	return gtp + size;
+}
+
+/* Given the transport header of an IP packet returns the encapsulated layer 3
+ * header if the transport is a tunnel we are configured to look through.
+ * Otherwise NULL is returned.
+ */
+static void *get_tunnel_payload(const toeplitz_tunnel_conf_t *cnf,
+		void *transport, uint8_t proto, uint16_t *ethertype,
+		uint32_t *remaining) {
+	void *payload = NULL;
+
+	switch (proto) {
+		case TRACE_IPPROTO_IPIP:
+			if (!(cnf->tunnels & TOEPLITZ_TUNNEL_IPIP))
+				return NULL;
+			*ethertype = TRACE_ETHERTYPE_IP;
+			return transport;
+		case TRACE_IPPROTO_IPV6:
+			if (!(cnf->tunnels & TOEPLITZ_TUNNEL_IPIP))
+				return NULL;
+			*ethertype = TRACE_ETHERTYPE_IPV6;
+			return transport;
+		case TRACE_IPPROTO_GRE:
+		{
+			libtrace_gre_t *gre = (libtrace_gre_t *)transport;
+			if (!(cnf->tunnels & TOEPLITZ_TUNNEL_GRE))
+				return NULL;
+			if (*remaining < 4)
+				return NULL;
+			/* PPTP carries PPP, which we do not look through */
+			if ((ntohs(gre->flags) & LIBTRACE_GRE_FLAG_VERMASK) != 0)
+				return NULL;
+			*ethertype = ntohs(gre->ethertype);
+			payload = trace_get_payload_from_gre(gre, remaining);
+			if (payload && *ethertype == GRE_ETHERTYPE_TEB) {
+				payload = trace_get_payload_from_ethernet(payload,
+						ethertype, remaining);
+			}
+			return skip_layer2_shims(cnf, payload, ethertype,
+					remaining);
+		}
+		case TRACE_IPPROTO_UDP:
+		{
+			libtrace_udp_t *udp = (libtrace_udp_t *)transport;
+			if (*remaining < sizeof(libtrace_udp_t))
+				return NULL;
+			if ((cnf->tunnels & TOEPLITZ_TUNNEL_VXLAN)) {
+				uint32_t rem = *remaining;
+				libtrace_vxlan_t *vxlan;
+				vxlan = trace_get_vxlan_from_udp(udp, &rem);
+				if (vxlan) {
+					payload = trace_get_payload_from_vxlan(
+							vxlan, &rem);
+					if (payload)
+						payload = trace_get_payload_from_ethernet(
+								payload, ethertype, &rem);
+					*remaining = rem;
+					return skip_layer2_shims(cnf, payload,
+							ethertype, remaining);
+				}
+			}
+			if ((cnf->tunnels & TOEPLITZ_TUNNEL_GTP) &&
+					(udp->dest == htons(GTP_U_PORT) ||
+					 udp->source == htons(GTP_U_PORT))) {
+				uint32_t rem = *remaining;
+				payload = trace_get_payload_from_udp(udp, &rem);
+				if (payload) {
+					payload = get_payload_from_gtp(
+							(uint8_t *)payload,
+							ethertype, &rem);
+				}
+				if (payload)
+					*remaining = rem;
+				return payload;
+			}
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Finds the transport header following an IPv4 or IPv6 header */
+static void *get_transport_from_layer3(void *layer3, uint16_t ethertype,
+		uint8_t *proto, uint32_t *remaining) {
+	switch (ethertype) {
+		case TRACE_ETHERTYPE_IP:
+			if (*remaining < sizeof(libtrace_ip_t))
+				return NULL;
+			return trace_get_payload_from_ip((libtrace_ip_t *)layer3,
+					proto, remaining);
+		case TRACE_ETHERTYPE_IPV6:
+			if (*remaining < sizeof(libtrace_ip6_t))
+				return NULL;
+			return trace_get_payload_from_ip6((libtrace_ip6_t *)layer3,
+					proto, remaining);
+	}
+	return NULL;
+}
+
+/**
+ * Hashes a packet based on the innermost flow that we are able to find,
+ * looking through up to cnf->max_depth layers of encapsulation. If a
+ * tunnel is truncated the deepest complete flow is hashed instead.
+ */
+uint64_t toeplitz_hash_tunnel_packet(const libtrace_packet_t * pkt,
+		const toeplitz_tunnel_conf_t *cnf) {
+	uint8_t proto = 0;
+	uint16_t eth_type = 0;
+	uint32_t remaining = 0, trans_remaining = 0;
+	unsigned int depth;
+	void *layer3 = trace_get_layer3(pkt, &eth_type, &remaining);
+	void *transport = NULL;
+
+	if (!layer3)
+		return toeplitz_hash_headers(&cnf->toeplitz, NULL, 0, 0,
+				NULL, 0, 0);
+
+	/* trace_get_layer3() does not look through Ethernet pseudowires */
+	if (eth_type == 0 && (cnf->tunnels & TOEPLITZ_TUNNEL_MPLS)) {
+		layer3 = trace_get_payload_from_ethernet(layer3, &eth_type,
+				&remaining);
+		layer3 = skip_layer2_shims(cnf, layer3, &eth_type, &remaining);
+		if (!layer3)
+			return 0;
+	}
+
+	trans_remaining = remaining;
+	transport = get_transport_from_layer3(layer3, eth_type, &proto,
+			&trans_remaining);
+
+	for (depth = 0; depth < cnf->max_depth && transport; depth++) {
+		uint16_t inner_type = 0;
+		uint32_t inner_remaining = trans_remaining;
+		uint32_t inner_trans_remaining;
+		uint8_t inner_proto = 0;
+		void *inner, *inner_trans;
+
+		inner = get_tunnel_payload(cnf, transport, proto, &inner_type,
+				&inner_remaining);
+		if (!inner || inner_remaining == 0)
+			break;
+		if (inner_type != TRACE_ETHERTYPE_IP &&
+				inner_type != TRACE_ETHERTYPE_IPV6)
+			break;
+
+		inner_trans_remaining = inner_remaining;
+		inner_trans = get_transport_from_layer3(inner, inner_type,
+				&inner_proto, &inner_trans_remaining);
+
+		layer3 = inner;
+		eth_type = inner_type;
+		remaining = inner_remaining;
+		transport = inner_trans;
+		proto = inner_proto;
+		trans_remaining = inner_trans_remaining;
+	}
+
+	return toeplitz_hash_headers(&cnf->toeplitz, layer3, eth_type,
+			remaining, transport, proto, trans_remaining);
+}
@@ -53,6 +53,35 @@ typedef struct toeplitz_conf {
 	uint32_t key_cache[320];
 } toeplitz_conf_t;
 
+/**
+ * Encapsulations that toeplitz_hash_tunnel_packet() will look through
+ * to find the inner flow.
+ */
+#define TOEPLITZ_TUNNEL_GRE	0x01	/**< GRE (including Ethernet over GRE) */
+#define TOEPLITZ_TUNNEL_VXLAN	0x02	/**< VXLAN (UDP port 4789) */
+#define TOEPLITZ_TUNNEL_GTP	0x04	/**< GTPv1-U (UDP port 2152) */
+#define TOEPLITZ_TUNNEL_MPLS	0x08	/**< MPLS, including Ethernet pseudowires */
+#define TOEPLITZ_TUNNEL_IPIP	0x10	/**< IPv4/IPv6 in IPv4/IPv6 */
+#define TOEPLITZ_TUNNEL_ALL	0x1f
+
+/** The default number of encapsulations looked through */
+#define TOEPLITZ_TUNNEL_DEFAULT_DEPTH 4
+
+/**
+ * Configuration for hashing the innermost flow of tunnelled traffic.
+ *
+ * The toeplitz configuration controls which headers contribute to the hash
+ * and whether the hash is symmetric (i.e. created with a bidirectional key).
+ */
+typedef struct toeplitz_tunnel_conf {
+	toeplitz_conf_t toeplitz;
+	/** A mask of TOEPLITZ_TUNNEL_* values to look through */
+	uint32_t tunnels;
+	/** The maximum number of encapsulations to look through, 0 hashes
+	 * only the outermost headers */
+	unsigned int max_depth;
+} toeplitz_tunnel_conf_t;
+
 DLLEXPORT void toeplitz_hash_expand_key(toeplitz_conf_t *conf);
 DLLEXPORT uint32_t toeplitz_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t offset, size_t n, uint32_t result);
 DLLEXPORT uint32_t toeplitz_first_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t n);
@@ -62,6 +91,10 @@ DLLEXPORT void toeplitz_ncreate_bikey(uint8_t *key, size_t num);
 DLLEXPORT void toeplitz_create_bikey(uint8_t *key);
 DLLEXPORT void toeplitz_ncreate_unikey(uint8_t *key, size_t num);
 DLLEXPORT void toeplitz_create_unikey(uint8_t *key);
+DLLEXPORT void toeplitz_init_tunnel_config(toeplitz_tunnel_conf_t *conf,
+		bool bidirectional, uint32_t tunnels, unsigned int max_depth);
+DLLEXPORT uint64_t toeplitz_hash_tunnel_packet(const libtrace_packet_t * pkt,
+		const toeplitz_tunnel_conf_t *cnf);
 
 
 /* IPv4 Only (Input[8] = @12-15, @16-19) src dst */
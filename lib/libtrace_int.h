@@ -188,12 +188,32 @@ enum hash_owner {
         HASH_OWNED_EXTERNAL,
 };
 
+/** Latencies are timed for one in this many packets */
+#define RUNTIME_STATS_SAMPLE 64
+
+/**
+ * Runtime statistics kept by each thread, see trace_get_runtime_stats().
+ * Only the owning thread writes to these.
+ */
+struct runtime_counters {
+	libtrace_runtime_stats_t stats;
+	// Packets seen since the last latency sample
+	uint32_t sample;
+	// When the packet callback started on a sampled packet, otherwise 0
+	uint64_t dispatch_stamp;
+	// The packet count when a published result was last sampled
+	uint64_t result_sample;
+};
+
+struct perf_counters;
+
 /**
  * Information of this thread
  */
 struct libtrace_thread_t {
 	uint64_t accepted_packets; // The number of packets accepted only used if pread
 	uint64_t filtered_packets;
+	uint64_t hasher_dropped; // Written by the hasher thread
 	// is retreving packets
 	// Set to true once the first packet has been stored
 	bool recorded_first;
@@ -203,6 +223,12 @@ struct libtrace_thread_t {
 	void* format_data; // TLS for the format to use
 	libtrace_message_queue_t messages; // Message handling
 	libtrace_ringbuffer_t rbuffer; // Input
+	// Packets others may steal, see trace_set_work_stealing(). The slots
+	// [head, tail) of backlog hold them, with both indices packed into
+	// backlog_range as head << 32 | tail
+	libtrace_packet_t **backlog;
+	uint32_t backlog_slots;
+	uint64_t backlog_range;
 	libtrace_t * trace;
 	void* ret;
 	enum thread_types type;
@@ -211,6 +237,10 @@ struct libtrace_thread_t {
 	int perpkt_num; // A number from 0-X that represents this perpkt threads number
 				// in the table, intended to quickly identify this thread
 				// -1 represents NA (such as the case this is not a perpkt thread)
+	struct runtime_counters runtime; // See trace_get_runtime_stats()
+	struct perf_counters *perf; // Only set if trace_set_perf_counters()
+	bool retire; // Set to stop a paused perpkt thread, see retire_perpkt_threads()
+	size_t burst; // Packets to read at a time, see trace_set_adaptive_burst()
 } ALIGN_STRUCT(CACHE_LINE_SIZE);
 
 /**
@@ -279,6 +309,11 @@ struct user_configuration {
 	bool reporter_polling;
 	size_t reporter_thold;
 	bool debug_state;
+	size_t runtime_stats_interval;
+	bool perf_counters;
+	enum hasher_overflow_policy hasher_overflow;
+	bool work_stealing;
+	size_t adaptive_burst;
 };
 #define ZERO_USER_CONFIG(config) memset(&config, 0, sizeof(struct user_configuration));
 
@@ -339,6 +374,8 @@ struct libtrace_t {
 	pthread_cond_t perpkt_cond;
 	/** Keeps track of counts of threads in any given state */
 	int perpkt_thread_states[THREAD_STATE_MAX]; 
+	/** Set to ask the paused reporter to pass on all waiting results */
+	bool reporter_flush;
 
 	/** Set to indicate a perpkt's queue is full as such the writing perpkt cannot proceed */
 	bool perpkt_queue_full;
@@ -1241,6 +1278,10 @@ void duck_constructor(void);
 void atmhdr_constructor(void);
 /** Constructor for the network DAG format module */
 void ndag_constructor(void);
+/** Constructor for the merge format module */
+void merge_constructor(void);
+/** Constructor for the mem format module */
+void mem_constructor(void);
 #ifdef HAVE_BPF
 /** Constructor for the BPF format module */
 void bpf_constructor(void);
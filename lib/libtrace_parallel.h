@@ -117,6 +117,8 @@ struct libtrace_result_t {
 	uint64_t key;   /**< The unique key for the result */
 	libtrace_generic_t value;  /**< The result value itself */
 	int type; /**< Describes the type of result, see enum result_types */
+	uint32_t stamp; /**< @internal When a sampled result was published,
+	                  used by trace_get_runtime_stats() */
 };
 
 /** The libtrace_messages enum
@@ -254,6 +256,29 @@ enum libtrace_messages {
 	MESSAGE_USER = 1000
 };
 
+/** What the hasher thread does with a packet when the queue of the per
+ *  packet thread it hashed to is full. These can be selected using
+ *  trace_set_hasher_overflow().
+ */
+enum hasher_overflow_policy {
+	/** Wait for the thread to make room. No packets are lost but a slow
+	 *  thread stalls every other thread and, eventually, the capture.
+	 *  This is the default.
+	 */
+	HASHER_OVERFLOW_BLOCK,
+
+	/** Drop the packet and count it against the thread it hashed to,
+	 *  see the hasher_dropped statistic.
+	 */
+	HASHER_OVERFLOW_DROP,
+
+	/** Give the packet to the next thread with room in its queue, only
+	 *  waiting if every queue is full. Packets of a flow may then be
+	 *  seen by more than one thread.
+	 */
+	HASHER_OVERFLOW_SPILL
+};
+
 /** The hasher types that are available to libtrace applications.
  *  These can be selected using trace_set_hasher().
  */
@@ -286,7 +311,25 @@ enum hasher_types {
 	 * This value indicates that the hasher is a custom user-defined
          * function. 
 	 */
-	HASHER_CUSTOM
+	HASHER_CUSTOM,
+
+	/** Like HASHER_BIDIRECTIONAL, but tunnelled traffic is hashed on the
+	 * innermost flow rather than the tunnel endpoints. GRE, VXLAN,
+	 * GTP-U, MPLS and IP-in-IP encapsulations are looked through, up to
+	 * TOEPLITZ_TUNNEL_DEFAULT_DEPTH layers deep.
+	 *
+	 * This is always performed by libtrace rather than the capture
+	 * format. To change the encapsulations or the depth limit, use
+	 * HASHER_CUSTOM with toeplitz_hash_tunnel_packet() and a
+	 * toeplitz_tunnel_conf_t (see hash_toeplitz.h).
+	 */
+	HASHER_TUNNEL_BIDIRECTIONAL,
+
+	/** Like HASHER_TUNNEL_BIDIRECTIONAL, except that the opposing
+	 * directions of the same inner flow may end up on different
+	 * processing threads.
+	 */
+	HASHER_TUNNEL_UNIDIRECTIONAL
 };
 
 typedef struct libtrace_info_t {
@@ -729,10 +772,22 @@ DLLEXPORT void trace_join(libtrace_t * trace);
  */
 
 /** Set the maximum number of perpkt threads to use in a trace.
+ *
+ * This can also be changed while a trace is paused, the new number of
+ * threads is used when trace_pstart() resumes it. Every perpkt thread is
+ * stopped, calling the stopping callback, and new ones are started in their
+ * place, calling the starting callback. No packets are lost, those already
+ * read were processed when the trace was paused, and any results published
+ * as the threads stopped are passed to the reporter first. The per thread
+ * statistics begin again from zero.
+ *
+ * The trace must be paused and resumed by a thread other than the perpkt
+ * or reporter threads to change the number of threads.
  *
  * @param[in] trace The parallel input trace
  * @param[in] nb The number of threads to use. If set to 0, libtrace will
- *    try to auto-detect how many threads it can use.
+ *    try to auto-detect how many threads it can use. When paused 0 keeps
+ *    the current number of threads.
  * @return 0 if successful otherwise -1
  */
 DLLEXPORT int trace_set_perpkt_threads(libtrace_t *trace, int nb);
@@ -879,6 +934,72 @@ DLLEXPORT int trace_set_hasher_queue_size(libtrace_t *trace, size_t size);
  */
 DLLEXPORT int trace_set_hasher_polling(libtrace_t *trace, bool polling);
 
+/**
+ * Sets what the hasher thread does when a per packet thread's queue is full.
+ *
+ * By default the hasher waits, which for a live capture pushes the loss
+ * back onto the capture device. Dropping or spilling the packet instead
+ * keeps the other threads running. Packets hashed to a thread which has
+ * already stopped are always dropped, unless they can be spilled.
+ *
+ * Dropped packets are counted against the thread they were hashed to, see
+ * the hasher_dropped field from trace_get_thread_statistics().
+ *
+ * This only applies when a dedicated hasher thread is used.
+ *
+ * @param trace A parallel input trace
+ * @param policy One of enum hasher_overflow_policy. Defaults to
+ * HASHER_OVERFLOW_BLOCK.
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_hasher_overflow(libtrace_t *trace,
+                                        enum hasher_overflow_policy policy);
+
+/**
+ * Enables or disables work stealing between the processing threads.
+ *
+ * This applies when packets are not hashed and the format can't be read
+ * in parallel, so the processing threads take turns reading bursts of
+ * packets. Normally a thread processes its whole burst, even if it is stuck
+ * in a slow callback while the others are idle. With work stealing a thread
+ * keeps only half of each burst and a thread with nothing to do takes half
+ * of the packets another thread has yet to start, rather than waiting for
+ * its turn to read.
+ *
+ * This suits stateless processing where the cost per packet varies. A
+ * thread may steal packets older than those it has already processed, so
+ * its results are not published in order and the ordered combiner should
+ * not be used.
+ *
+ * @param trace A parallel input trace
+ * @param enabled If true threads steal work from each other. Defaults false.
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_work_stealing(libtrace_t *trace, bool enabled);
+
+/**
+ * Lets each processing thread tune how many packets it reads at a time.
+ *
+ * A fixed burst size either adds latency at low load, as packets wait for
+ * the rest of a large burst to be processed, or costs throughput at high
+ * load, as small bursts are read more often. With adaptive bursts each
+ * thread starts at the minimum and doubles its burst while a full burst or
+ * more is left waiting in the hasher queue (or its work stealing backlog,
+ * or for other formats the last read filled the burst), and halves it once
+ * the queue runs dry. A burst also stops growing, and is halved, if it
+ * takes the packet callbacks longer than about half a millisecond to get
+ * through it.
+ *
+ * The burst never grows beyond the size set by trace_set_burst_size(). The
+ * size each thread last chose is reported by trace_get_runtime_stats().
+ *
+ * @param trace A parallel input trace
+ * @param min The smallest burst to use, 0 disables adaptive bursts. Defaults
+ * to 0.
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_adaptive_burst(libtrace_t *trace, size_t min);
+
 /**
  * Enables or disables polling of the reporter result queue.
  *
@@ -934,6 +1055,40 @@ DLLEXPORT int trace_set_reporter_thold(libtrace_t *trace, size_t thold);
  */
 DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state);
 
+/**
+ * Periodically print the runtime statistics of a parallel trace.
+ *
+ * If enabled, libtrace will print the totals returned by
+ * trace_get_runtime_stats() to standard error at the given interval,
+ * along with a one line summary for each thread.
+ *
+ * @param trace A parallel input trace
+ * @param millisec The interval in milliseconds, 0 disables this. Defaults 0.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_runtime_stats_interval(libtrace_t *trace,
+                                               size_t millisec);
+
+/**
+ * Profile each thread of a parallel trace with hardware performance
+ * counters.
+ *
+ * If enabled, every per packet, hasher and reporter thread counts its own
+ * cycles, instructions, last level cache misses and branch misses, and
+ * notes how its time is split between reading packets, running the user's
+ * callbacks and the rest of libtrace's dispatch. Each thread prints these
+ * totals, and the figures per packet, to standard error when it stops.
+ *
+ * This is only supported on Linux, and the counters may not be available
+ * to unprivileged users (see perf_event_paranoid) or inside a virtual
+ * machine. In that case only the time breakdown is printed.
+ *
+ * @param trace A parallel input trace
+ * @param enabled If true the counters are used. Defaults false.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_perf_counters(libtrace_t *trace, bool enabled);
+
 /** Set the hasher function for a parallel trace.
  *
  * @param[in] trace The parallel trace to apply the hasher to
@@ -1235,6 +1390,115 @@ DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
                                      const libtrace_packet_t **packet,
                                      const struct timeval **tv);
 
+/** The number of buckets in a libtrace_latency_hist_t */
+#define LIBTRACE_LATENCY_BUCKETS 40
+
+/**
+ * A log-scale histogram of latencies, in nanoseconds.
+ *
+ * Bucket i counts samples in the range [2^i, 2^(i+1)), bucket 0 also counts
+ * samples of 0 and the last bucket counts everything larger.
+ */
+typedef struct libtrace_latency_hist {
+	uint64_t count; /**< The number of samples */
+	uint64_t total_ns; /**< The sum of all samples */
+	uint64_t max_ns; /**< The largest sample */
+	uint64_t buckets[LIBTRACE_LATENCY_BUCKETS]; /**< Samples per bucket */
+} libtrace_latency_hist_t;
+
+/**
+ * Counters describing where time goes inside a parallel trace.
+ *
+ * Every thread keeps its own copy of these, see trace_get_runtime_stats().
+ * Counters which don't apply to a thread are left as zero. Latencies are
+ * sampled from one in every 64 packets to keep the cost low, so the
+ * histogram counts are roughly a 64th of the packets seen.
+ */
+typedef struct libtrace_runtime_stats {
+	/** Packets passed to the packet callback, or hashed by the hasher */
+	uint64_t packets;
+	/** Non-empty batches of packets read by the per packet threads */
+	uint64_t bursts;
+	/** The burst size the thread last asked for, the largest of any
+	 * thread in a sum, see trace_set_adaptive_burst() */
+	uint64_t burst_size;
+	/** The sum of the burst sizes asked for by the bursts counted,
+	 * divide by bursts for the average */
+	uint64_t burst_size_total;
+	/** Results published, or received by the reporter */
+	uint64_t results;
+	/** Time per packet threads spent waiting on an empty hasher queue */
+	uint64_t read_blocked_ns;
+	/** Time the hasher spent waiting on a full per packet queue */
+	uint64_t write_blocked_ns;
+	/** Packets the hasher gave to another thread because the queue of
+	 * the thread they hashed to was full, see trace_set_hasher_overflow() */
+	uint64_t hasher_spilled;
+	/** Packets taken from another thread's backlog, see
+	 * trace_set_work_stealing() */
+	uint64_t stolen;
+	/** The deepest hasher queue seen when reading a batch */
+	uint64_t queue_depth_max;
+	/** The sum of the hasher queue depth, sampled once per batch */
+	uint64_t queue_depth_total;
+	/** Packets taken from the thread's local packet cache */
+	uint64_t ocache_hits;
+	/** Packets which had to come from the shared cache or be allocated */
+	uint64_t ocache_misses;
+	/** Results published but not yet passed to the reporter */
+	uint64_t combiner_backlog;
+	/** The largest backlog seen by the reporter */
+	uint64_t combiner_backlog_max;
+	/** Results passed on out of order by combiner_timestamp, because
+	 * they arrived after its lateness window */
+	uint64_t combiner_late;
+	/** From a packet being read until it is passed to the packet callback */
+	libtrace_latency_hist_t read_to_dispatch;
+	/** From the packet callback starting until it publishes a result */
+	libtrace_latency_hist_t dispatch_to_publish;
+	/** From a result being published until the reporter receives it */
+	libtrace_latency_hist_t publish_to_reporter;
+} libtrace_runtime_stats_t;
+
+/** Retrieves the runtime statistics of a parallel trace.
+ *
+ * These counters are always kept and are cheap to read, they can be polled
+ * while the trace is running to diagnose back-pressure between the hasher,
+ * per packet threads, combiner and reporter. Each counter is only written by
+ * its own thread, so the values read may be slightly stale.
+ *
+ * @param[in] libtrace The parallel input trace.
+ * @param[in] t A per packet, hasher or reporter thread, or NULL to sum the
+ * counters of every thread. The sum only counts the packets passed to the
+ * packet callback and the results published.
+ * @param[out] stats Filled with the counters upon return.
+ * @return 0 if successful, otherwise -1 if the trace has not been started
+ * with trace_pstart() or t is not a thread of this trace.
+ */
+DLLEXPORT int trace_get_runtime_stats(libtrace_t *libtrace,
+                                      libtrace_thread_t *t,
+                                      libtrace_runtime_stats_t *stats);
+
+/** Estimates a percentile of a latency histogram.
+ *
+ * @param[in] hist The histogram
+ * @param[in] percentile The percentile to find, between 0 and 100
+ * @return The upper bound of the bucket holding the percentile, in
+ * nanoseconds, this is never larger than the maximum sample. 0 if the
+ * histogram is empty.
+ */
+DLLEXPORT uint64_t trace_latency_hist_percentile(
+                const libtrace_latency_hist_t *hist, double percentile);
+
+/** Prints runtime statistics to a file stream, (which could be stdout/err).
+ *
+ * @param[in] stats The statistics to print
+ * @param[in] f The file stream to print to
+ * @return 0 if successful, otherwise -1 if an error occurred writing to f.
+ */
+DLLEXPORT int trace_print_runtime_stats(const libtrace_runtime_stats_t *stats,
+                                        FILE *f);
+
 /** Makes a packet safe, preventing the packet from becoming invalid after a
  * pausing a trace.
  *
@@ -1242,7 +1506,9 @@ DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
  *
  * This copies a packet in such a way that it will be able to survive a pause.
  * However this will not allow the packet to be used after the format is
- * destroyed.
+ * destroyed. Packets whose buffer is reference counted by the format (such
+ * as those read from rt and bpf inputs) already survive a pause and are left
+ * untouched, the buffer is returned to the format once the packet is freed.
  */
 DLLEXPORT void libtrace_make_packet_safe(libtrace_packet_t *pkt);
 
@@ -1303,6 +1569,11 @@ DLLEXPORT libtrace_info_t *trace_get_information(libtrace_t * libtrace);
  * * \b reporter_polling,\b rp see trace_set_reporter_polling() [bool]
  * * \b reporter_thold,\b rt see trace_set_reporter_thold() [size_t]
  * * \b debug_state,\b ds see trace_set_debug_state() [bool]
+ * * \b runtime_stats_interval,\b rsi see trace_set_runtime_stats_interval() [size_t]
+ * * \b perf_counters,\b pc see trace_set_perf_counters() [bool]
+ * * \b hasher_overflow,\b ho see trace_set_hasher_overflow() [block, drop or spill]
+ * * \b work_stealing,\b ws see trace_set_work_stealing() [bool]
+ * * \b adaptive_burst,\b ab see trace_set_adaptive_burst() [size_t]
  *
  * Booleans can be set as 0/1 or false/true.
  *
@@ -1387,6 +1658,30 @@ extern const libtrace_combine_t combiner_ordered;
  */
 extern const libtrace_combine_t combiner_sorted;
 
+/**
+ * Merges the results from every thread into timestamp order as the trace
+ * runs. Results must be published with the ERF timestamp of their packet as
+ * the key (see trace_get_erf_timestamp()), and each processing thread must
+ * publish its results in timestamp order, as it will when each thread reads
+ * its own capture queue. Unlike combiner_ordered, this does not rely on
+ * packets being numbered in a single global order.
+ *
+ * A result is held back until no thread is expected to publish anything
+ * older, i.e. every thread has published a newer result, or it is further
+ * behind the newest result than the lateness window. On a live capture,
+ * a thread which publishes a RESULT_TICK_INTERVAL tick from its tick
+ * interval callback also shows it is no more than the window behind the
+ * tick, so a quiet capture queue doesn't hold up the others. The ticks are
+ * passed on to the reporter in order with the results.
+ *
+ * The lateness window is set in milliseconds by the configuration passed to
+ * trace_set_combiner(), and defaults to one second if 0. A result which
+ * arrives after newer results have already been passed on is still
+ * reported, out of order, and counted in the combiner_late field of
+ * trace_get_runtime_stats().
+ */
+extern const libtrace_combine_t combiner_timestamp;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,68 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef LIBTRACE_PROBES_H_
+#define LIBTRACE_PROBES_H_
+
+#include "config.h"
+
+/* Static tracepoints on the packet path, for use with bpftrace, systemtap
+ * or perf. These are compiled in whenever sys/sdt.h is available (unless
+ * configured with --disable-probes) and cost a single nop each until a
+ * tracer attaches to them. For example:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libtrace.so:libtrace:filter_reject
+ *                { @rejected[arg1] = count(); }'
+ *
+ * All probes belong to the "libtrace" provider:
+ *
+ * read_packet(trace, packet, ret)
+ *	A format's read_packet() returned, ret is its return value
+ * pread_packets(trace, perpkt_num, ret)
+ *	A format's pread_packets() returned, ret is its return value
+ * filter_accept(trace, packet), filter_reject(trace, packet)
+ *	A packet matched, or didn't match, the trace's filter
+ * hasher_enqueue(packet, perpkt_num, hash)
+ *	The hasher thread queued a packet for a per packet thread
+ * dispatch_packet(perpkt_num, packet, order)
+ *	A packet is about to be passed to the packet callback
+ * publish_result(perpkt_num, key, type)
+ *	A per packet thread published a result
+ * combiner_emit(key, type)
+ *	The combiner passed a result to the reporter
+ * ocache_alloc(oc, requested, allocated), ocache_free(oc, requested, freed)
+ *	Buffers were taken from, or returned to, an object cache
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define LT_PROBE2(name, a, b) DTRACE_PROBE2(libtrace, name, a, b)
+#define LT_PROBE3(name, a, b, c) DTRACE_PROBE3(libtrace, name, a, b, c)
+#else
+#define LT_PROBE2(name, a, b) do {} while (0)
+#define LT_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include "perf_counters.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_COUNTER_MAX] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+#endif
+
+static const char *perf_event_names[PERF_COUNTER_MAX] = {
+	"cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+/* Only complain once if the counters are not available */
+static pthread_once_t perf_warn_once = PTHREAD_ONCE_INIT;
+static int perf_warn_errno;
+
+static void perf_warn(void) {
+	fprintf(stderr, "libtrace: hardware performance counters are "
+	        "unavailable (%s), only reporting time\n",
+	        perf_warn_errno ? strerror(perf_warn_errno) :
+	                          "not supported on this platform");
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int perf_open(int event, int group_fd) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[event].type;
+	attr.config = perf_events[event].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = group_fd == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* pid 0 and cpu -1 count the calling thread on any cpu */
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+struct perf_counters *perf_counters_create(void) {
+	struct perf_counters *pc = calloc(1, sizeof(struct perf_counters));
+	int i;
+
+	if (!pc)
+		return NULL;
+	pc->group_fd = -1;
+	for (i = 0; i < PERF_COUNTER_MAX; i++)
+		pc->fds[i] = -1;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	/* Whichever event opens first leads the group, the rest are skipped
+	 * if this cpu can't count them */
+	for (i = 0; i < PERF_COUNTER_MAX; i++) {
+		int fd = perf_open(i, pc->group_fd);
+		if (fd == -1) {
+			if (!perf_warn_errno)
+				perf_warn_errno = errno;
+			continue;
+		}
+		if (pc->group_fd == -1)
+			pc->group_fd = fd;
+		pc->fds[pc->nb_events] = fd;
+		pc->events[pc->nb_events++] = i;
+	}
+	if (pc->group_fd != -1) {
+		ioctl(pc->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(pc->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#endif
+	if (pc->nb_events != PERF_COUNTER_MAX)
+		pthread_once(&perf_warn_once, perf_warn);
+
+	/* Start the clock, nothing has been charged to a phase yet */
+	perf_counters_mark(pc, PERF_PHASE_DISPATCH);
+	pc->phase_ns[PERF_PHASE_DISPATCH] = 0;
+	return pc;
+}
+
+void perf_counters_report(struct perf_counters *pc, const char *name,
+                          const char *unit, uint64_t count, FILE *f) {
+	uint64_t values[PERF_COUNTER_MAX + 1];
+	uint64_t total = 0;
+	int i;
+
+	flockfile(f);
+	if (pc->group_fd != -1 && read(pc->group_fd, values, sizeof(uint64_t) *
+	                (pc->nb_events + 1)) > 0) {
+		fprintf(f, "%s: %s=%"PRIu64, name, unit, count);
+		for (i = 0; i < pc->nb_events; i++) {
+			fprintf(f, " %s=%"PRIu64, perf_event_names[pc->events[i]],
+			        values[i + 1]);
+			if (count)
+				fprintf(f, " (%.1f each)", (double) values[i + 1] /
+				        (double) count);
+		}
+		fprintf(f, "\n");
+	}
+
+	for (i = 0; i < PERF_PHASE_MAX; i++)
+		total += pc->phase_ns[i];
+	fprintf(f, "%s: time_ns=%"PRIu64, name, total);
+	if (count)
+		fprintf(f, " (%.1f each)", (double) total / (double) count);
+	fprintf(f, " read=%.1f%% callback=%.1f%% dispatch=%.1f%%\n",
+	        total ? 100.0 * pc->phase_ns[PERF_PHASE_READ] / total : 0.0,
+	        total ? 100.0 * pc->phase_ns[PERF_PHASE_CALLBACK] / total : 0.0,
+	        total ? 100.0 * pc->phase_ns[PERF_PHASE_DISPATCH] / total : 0.0);
+	funlockfile(f);
+}
+
+void perf_counters_destroy(struct perf_counters *pc) {
+	int i;
+
+	for (i = 0; i < pc->nb_events; i++)
+		close(pc->fds[i]);
+	free(pc);
+}
@@ -0,0 +1,84 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef LIBTRACE_PERF_COUNTERS_H_
+#define LIBTRACE_PERF_COUNTERS_H_
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Hardware performance counters for a single libtrace thread, enabled with
+ * trace_set_perf_counters(). The counters are opened by the thread itself
+ * and only count that thread, in user space.
+ *
+ * Alongside the counters, the thread's wall time is split between phases by
+ * calling perf_counters_mark() whenever it moves from one phase to the next.
+ * The time since the previous mark is charged to the phase being left. */
+
+enum perf_phase {
+	PERF_PHASE_READ,	/* Reading packets from the format */
+	PERF_PHASE_CALLBACK,	/* Running the user's callbacks */
+	PERF_PHASE_DISPATCH,	/* Everything else libtrace does */
+	PERF_PHASE_MAX
+};
+
+#define PERF_COUNTER_MAX 4
+
+struct perf_counters {
+	int group_fd;
+	int fds[PERF_COUNTER_MAX];
+	/* The events which were opened, in group order */
+	int nb_events;
+	int events[PERF_COUNTER_MAX];
+	uint64_t phase_ns[PERF_PHASE_MAX];
+	uint64_t last_ns;
+};
+
+/* Opens the counters for the calling thread and starts timing. If the
+ * counters can't be opened only the time breakdown is reported. Returns NULL
+ * if out of memory. */
+struct perf_counters *perf_counters_create(void);
+
+/* Charges the time since the last mark to phase */
+static inline void perf_counters_mark(struct perf_counters *pc,
+                                      enum perf_phase phase) {
+	struct timespec ts;
+	uint64_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+	pc->phase_ns[phase] += now - pc->last_ns;
+	pc->last_ns = now;
+}
+
+/* Prints the counters, and their value for each of the count packets or
+ * results the thread handled, followed by the time spent in each phase */
+void perf_counters_report(struct perf_counters *pc, const char *name,
+                          const char *unit, uint64_t count, FILE *f);
+
+void perf_counters_destroy(struct perf_counters *pc);
+
+#endif
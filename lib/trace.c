@@ -89,6 +89,7 @@
 #include "libtrace_int.h"
 #include "format_helper.h"
 #include "rt_protocol.h"
+#include "libtrace_probes.h"
 
 #include <pthread.h>
 #include <signal.h>
@@ -147,6 +148,8 @@ static void trace_init(void)
 		pcapng_constructor();
                 rt_constructor();
                 ndag_constructor();
+                merge_constructor();
+                mem_constructor();
 #ifdef HAVE_DAG
 		dag_constructor();
 #endif
@@ -724,6 +727,7 @@ DLLEXPORT void trace_destroy(libtrace_t *libtrace) {
 		libtrace_ocache_destroy(&libtrace->packet_freelist);
 		for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
                         libtrace_message_queue_destroy(&libtrace->perpkt_threads[i].messages);
+                        free(libtrace->perpkt_threads[i].backlog);
                 }
                 libtrace_message_queue_destroy(&libtrace->hasher_thread.messages);
                 libtrace_message_queue_destroy(&libtrace->keepalive_thread.messages);
@@ -941,6 +945,7 @@ DLLEXPORT int trace_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
 			 * structure */
 			packet->trace = libtrace;
 			ret=libtrace->format->read_packet(libtrace,packet);
+			LT_PROBE3(read_packet, libtrace, packet, (int) ret);
 			if (ret==(size_t)READ_MESSAGE ||
                             ret==(size_t)-1 || ret==0) {
                                 packet->trace = NULL;
@@ -957,10 +962,13 @@ DLLEXPORT int trace_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
                                 }
 
                                 if (filtret == 0) {
+					LT_PROBE2(filter_reject, libtrace,
+					          packet);
 					++libtrace->filtered_packets;
 					trace_fin_packet(packet);
                                         continue;
 				}
+				LT_PROBE2(filter_accept, libtrace, packet);
 			}
 			if (libtrace->snaplen>0) {
 				/* Snap the packet */
@@ -2201,6 +2209,15 @@ libtrace_stat_t *trace_get_statistics(libtrace_t *trace, libtrace_stat_t *stat)
 		stat->filtered += trace->perpkt_threads[i].filtered_packets;
 	}
 
+	if (trace_has_dedicated_hasher(trace)) {
+		stat->hasher_dropped_valid = 1;
+		stat->hasher_dropped = 0;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->hasher_dropped +=
+			        trace->perpkt_threads[i].hasher_dropped;
+		}
+	}
+
 	if (trace->format->get_statistics) {
 		trace->format->get_statistics(trace, stat);
 	}
@@ -2222,6 +2239,10 @@ void trace_get_thread_statistics(libtrace_t *trace, libtrace_thread_t *t,
 	stat->accepted = t->accepted_packets;
 	stat->filtered_valid = 1;
 	stat->filtered = t->filtered_packets;
+	if (trace_has_dedicated_hasher(trace)) {
+		stat->hasher_dropped_valid = 1;
+		stat->hasher_dropped = t->hasher_dropped;
+	}
 	if (!trace_has_dedicated_hasher(trace) && trace->format->get_thread_statistics) {
 		trace->format->get_thread_statistics(trace, t, stat);
 	}
@@ -90,13 +90,29 @@
 #include "format_helper.h"
 #include "rt_protocol.h"
 #include "hash_toeplitz.h"
+#include "perf_counters.h"
+#include "libtrace_probes.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
 
 static inline int delay_tracetime(libtrace_t *libtrace, libtrace_packet_t *packet, libtrace_thread_t *t);
+static int trace_pread_packet_work_stealing(libtrace_t *libtrace,
+                                            libtrace_thread_t *t,
+                                            libtrace_packet_t *packets[],
+                                            size_t nb_packets);
+static inline size_t backlog_count(libtrace_thread_t *t);
+static size_t backlog_take(libtrace_t *libtrace, libtrace_thread_t *t,
+                           bool steal, libtrace_packet_t *packets[],
+                           size_t nb_packets);
+static void backlog_flush(libtrace_t *libtrace, libtrace_thread_t *t);
+static int trace_start_thread(libtrace_t *trace, libtrace_thread_t *t,
+                              enum thread_types type,
+                              void *(*start_routine) (void *),
+                              int perpkt_num, const char *name);
 extern int libtrace_parallel;
 
 struct mem_stats {
@@ -167,6 +183,93 @@ static void print_memory_stats() {}
 
 static const libtrace_generic_t gen_zero = {0};
 
+/** A monotonic clock in nanoseconds, used to time the runtime statistics */
+static inline uint64_t runtime_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/** The microsecond timestamp stored against a sampled result, never 0 */
+static inline uint32_t runtime_result_stamp(uint64_t now) {
+	uint32_t stamp = (uint32_t) (now / 1000);
+	return stamp ? stamp : 1;
+}
+
+/** Returns true for one in every RUNTIME_STATS_SAMPLE packets */
+static inline bool runtime_sample(libtrace_thread_t *t) {
+	if (++t->runtime.sample < RUNTIME_STATS_SAMPLE)
+		return false;
+	t->runtime.sample = 0;
+	return true;
+}
+
+static inline void latency_hist_add(libtrace_latency_hist_t *hist,
+                                    uint64_t ns) {
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= LIBTRACE_LATENCY_BUCKETS)
+		bucket = LIBTRACE_LATENCY_BUCKETS - 1;
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->total_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+/** Stamps the packets of a burst which are sampled for latencies */
+static inline void runtime_stamp_packets(libtrace_thread_t *t,
+                                         libtrace_packet_t *packets[],
+                                         int nb_packets) {
+	uint64_t now = 0;
+	int i;
+
+	for (i = 0; i < nb_packets; i++) {
+		if (runtime_sample(t)) {
+			if (!now)
+				now = runtime_now();
+			packets[i]->read_stamp = now;
+		} else {
+			packets[i]->read_stamp = 0;
+		}
+	}
+}
+
+/** Prints and releases a thread's performance counters as it stops */
+static void report_perf_counters(libtrace_thread_t *t, const char *name,
+                                 const char *unit, uint64_t count) {
+	perf_counters_mark(t->perf, PERF_PHASE_DISPATCH);
+	perf_counters_report(t->perf, name, unit, count, stderr);
+	perf_counters_destroy(t->perf);
+	t->perf = NULL;
+}
+
+/** Notes the age of a result as it reaches the reporter */
+static inline void runtime_result_received(libtrace_thread_t *t,
+                                           const libtrace_result_t *res) {
+	t->runtime.stats.results++;
+	if (res->stamp) {
+		uint32_t now = runtime_result_stamp(runtime_now());
+		latency_hist_add(&t->runtime.stats.publish_to_reporter,
+		                 (uint64_t) (uint32_t) (now - res->stamp) * 1000);
+	}
+}
+
+/** Updates the combiner backlog, the results published but not yet seen by
+ * the reporter. Must be called from the reporter thread. */
+static void runtime_update_backlog(libtrace_t *trace) {
+	libtrace_runtime_stats_t *stats = &trace->reporter_thread.runtime.stats;
+	uint64_t published = 0;
+	int i;
+
+	for (i = 0; i < trace->perpkt_thread_count; i++)
+		published += trace->perpkt_threads[i].runtime.stats.results;
+	stats->combiner_backlog = published > stats->results ?
+	                          published - stats->results : 0;
+	if (stats->combiner_backlog > stats->combiner_backlog_max)
+		stats->combiner_backlog_max = stats->combiner_backlog;
+}
+
 /* This should optimise away the switch to nothing in the explict cases */
 inline void send_message(libtrace_t *trace, libtrace_thread_t *thread,
                 const enum libtrace_messages type,
@@ -229,6 +332,11 @@ inline void send_message(libtrace_t *trace, libtrace_thread_t *thread,
                                         thread->user_data, type, data, sender);
 		return;
 	case MESSAGE_RESULT:
+                if (thread == &trace->reporter_thread) {
+                        LT_PROBE2(combiner_emit, data.res->key,
+                                  data.res->type);
+                        runtime_result_received(thread, data.res);
+                }
                 if (cbs->message_result)
                         (*cbs->message_result)(trace, thread,
                                         trace->global_blob, thread->user_data,
@@ -378,15 +486,22 @@ static inline bool trace_supports_parallel(libtrace_t *trace)
 void libtrace_zero_thread(libtrace_thread_t * t) {
 	t->accepted_packets = 0;
 	t->filtered_packets = 0;
+	t->hasher_dropped = 0;
+	t->retire = false;
 	t->recorded_first = false;
 	t->tracetime_offset_usec = 0;
 	t->user_data = 0;
 	t->format_data = 0;
 	libtrace_zero_ringbuffer(&t->rbuffer);
+	t->backlog = NULL;
+	t->backlog_slots = 0;
+	t->backlog_range = 0;
 	t->trace = NULL;
 	t->ret = NULL;
 	t->type = THREAD_EMPTY;
 	t->perpkt_num = -1;
+	memset(&t->runtime, 0, sizeof(t->runtime));
+	t->perf = NULL;
 }
 
 // Ints are aligned int is atomic so safe to read and write at same time
@@ -420,6 +535,10 @@ static libtrace_thread_t * get_thread_descriptor(libtrace_t *libtrace) {
 }
 
 DLLEXPORT void libtrace_make_packet_safe(libtrace_packet_t *pkt) {
+	// A buffer that belongs to a bucket is reference counted and stays
+	// valid until the packet is finished with, so there is nothing to do.
+	if (pkt->srcbucket && pkt->internalid != 0)
+		return;
 	// Duplicate the packet in standard malloc'd memory and free the
 	// original, This is a 1:1 exchange so the ocache count remains unchanged.
 	if (pkt->buf_control != TRACE_CTRL_PACKET) {
@@ -453,6 +572,20 @@ static void trace_thread_pause(libtrace_t *trace, libtrace_thread_t *t) {
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
 	thread_change_state(trace, t, THREAD_PAUSED, false);
 	while (trace->state == STATE_PAUSED || trace->state == STATE_PAUSING) {
+		/* trace_pstart() is resizing the per packet threads, see
+		 * retire_perpkt_threads() */
+		if (t->retire) {
+			ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
+			return;
+		}
+		if (t == &trace->reporter_thread && trace->reporter_flush) {
+			ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
+			trace->combiner.read_final(trace, &trace->combiner);
+			ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
+			trace->reporter_flush = false;
+			pthread_cond_broadcast(&trace->perpkt_cond);
+			continue;
+		}
 		ASSERT_RET(pthread_cond_wait(&trace->perpkt_cond, &trace->libtrace_lock), == 0);
 	}
 	thread_change_state(trace, t, THREAD_RUNNING, false);
@@ -485,8 +618,22 @@ static inline int dispatch_packet(libtrace_t *trace,
                 if (!IS_LIBTRACE_META_PACKET((*packet))) {
         		t->accepted_packets++;
                 }
+		t->runtime.stats.packets++;
+		if ((*packet)->read_stamp) {
+			uint64_t now = runtime_now();
+			latency_hist_add(&t->runtime.stats.read_to_dispatch,
+			                 now - (*packet)->read_stamp);
+			t->runtime.dispatch_stamp = now;
+		}
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_DISPATCH);
+		LT_PROBE3(dispatch_packet, t->perpkt_num, *packet,
+		          (*packet)->order);
 		if (trace->perpkt_cbs->message_packet)
 			*packet = (*trace->perpkt_cbs->message_packet)(trace, t, trace->global_blob, t->user_data, *packet);
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_CALLBACK);
+		t->runtime.dispatch_stamp = 0;
 		trace_fin_packet(*packet);
 	} else {
 		assert((*packet)->error == READ_TICK);
@@ -567,6 +714,18 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 	ASSERT_RET(dispatch_packets(trace, t, packets, nb_packets, empty,
 	                            offset, false), == 0);
 
+	/* Then those left in our backlog, unless another thread steals them */
+	if (trace->pread == trace_pread_packet_work_stealing) {
+		while (backlog_take(trace, t, false, &packet, 1)) {
+			if (packet->error > 0)
+				store_first_packet(trace, packet, t);
+			ASSERT_RET(dispatch_packet(trace, t, &packet, false), == 0);
+			if (packet)
+				libtrace_ocache_free(&trace->packet_freelist, (void **) &packet, 1, 1);
+		}
+		packet = NULL;
+	}
+
 	libtrace_ocache_alloc(&trace->packet_freelist, (void **) &packet, 1, 1);
 	/* If a hasher thread is running, empty input queues so we don't lose data */
 	if (trace_has_dedicated_hasher(trace)) {
@@ -599,10 +758,54 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 
 	/* Now we do the actual pause, this returns when we resumed */
 	trace_thread_pause(trace, t);
+	if (t->retire)
+		return 1;
 	send_message(trace, t, MESSAGE_RESUMING, gen_zero, t);
 	return 1;
 }
 
+/* How long a burst may take to process before an adaptive burst stops
+ * growing, see trace_set_adaptive_burst() */
+#define ADAPTIVE_BURST_TARGET_NS 500000
+
+/**
+ * Picks the size of the next burst from how the last one went, see
+ * trace_set_adaptive_burst().
+ *
+ * @param nb_read The number of packets in the last burst
+ * @param elapsed_ns How long the last burst took to process
+ */
+static void adapt_burst(libtrace_t *trace, libtrace_thread_t *t, size_t min,
+                        int nb_read, uint64_t elapsed_ns) {
+	size_t burst = t->burst;
+	size_t waiting;
+
+	if (trace_has_dedicated_hasher(trace)) {
+		waiting = libtrace_ringbuffer_get_count(&t->rbuffer);
+	} else if (trace->pread == trace_pread_packet_work_stealing) {
+		/* We only keep half of each burst we read */
+		waiting = backlog_count(t) * 2;
+	} else {
+		/* The format's own queue is hidden from us, but reading a
+		 * full burst suggests there is more waiting */
+		waiting = (size_t) nb_read >= burst ? burst : 0;
+	}
+
+	if (elapsed_ns > ADAPTIVE_BURST_TARGET_NS ||
+	    (waiting == 0 && (size_t) nb_read < burst / 2)) {
+		burst /= 2;
+		if (burst < min)
+			burst = min;
+	} else if (waiting >= burst &&
+	           elapsed_ns * 2 <= ADAPTIVE_BURST_TARGET_NS) {
+		burst *= 2;
+		if (burst > trace->config.burst_size)
+			burst = trace->config.burst_size;
+	}
+	t->burst = burst;
+	t->runtime.stats.burst_size = burst;
+}
+
 /**
  * The is the entry point for our packet processing threads.
  */
@@ -620,6 +823,10 @@ static void* perpkt_threads_entry(void *data) {
 	/* The offset to the first NULL packet upto offset */
 	int empty = 0;
         int j;
+	/* The smallest adaptive burst, or 0 if the burst size is fixed */
+	size_t burst_min = 0;
+	/* When the last burst was read, only if adaptive */
+	uint64_t burst_start = 0;
 
 	/* Wait until trace_pstart has been completed */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -639,6 +846,16 @@ static void* perpkt_threads_entry(void *data) {
 			pthread_exit(NULL);
 		}
 	}
+	if (trace->config.perf_counters)
+		t->perf = perf_counters_create();
+
+	t->burst = trace->config.burst_size;
+	if (trace->pread && trace->config.adaptive_burst &&
+	    trace->config.adaptive_burst < t->burst) {
+		burst_min = trace->config.adaptive_burst;
+		t->burst = burst_min;
+	}
+	t->runtime.stats.burst_size = trace->pread ? t->burst : 1;
 
 	/* Fill our buffer with empty packets */
 	memset(&packets, 0, sizeof(void*) * trace->config.burst_size);
@@ -664,6 +881,8 @@ static void* perpkt_threads_entry(void *data) {
 						goto eof;
 					} else if (ret == READ_ERROR) {
 						goto error;
+					} else if (t->retire) {
+						goto retire;
 					}
 					assert(ret == 1);
 					continue;
@@ -686,7 +905,16 @@ static void* perpkt_threads_entry(void *data) {
 						      (void **) &packets[empty],
 						      nb_packets - empty,
 						      nb_packets - empty);
+				libtrace_ocache_get_thread_counts(
+				                &trace->packet_freelist,
+				                &t->runtime.stats.ocache_hits,
+				                &t->runtime.stats.ocache_misses);
 			}
+			if (burst_min && nb_packets > 0)
+				adapt_burst(trace, t, burst_min, nb_packets,
+				            runtime_now() - burst_start);
+			if (t->perf)
+				perf_counters_mark(t->perf, PERF_PHASE_DISPATCH);
 			if (!trace->pread) {
 				assert(packets[0]);
 				ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -696,10 +924,23 @@ static void* perpkt_threads_entry(void *data) {
 				if (nb_packets > 0)
 					nb_packets = 1;
 			} else {
-				nb_packets = trace->pread(trace, t, packets, trace->config.burst_size);
+				nb_packets = trace->pread(trace, t, packets, t->burst);
+				if (burst_min)
+					burst_start = runtime_now();
 			}
+			if (t->perf)
+				perf_counters_mark(t->perf, PERF_PHASE_READ);
 			offset = 0;
 			empty = 0;
+			if (nb_packets > 0) {
+				t->runtime.stats.bursts++;
+				t->runtime.stats.burst_size_total +=
+				                t->runtime.stats.burst_size;
+				/* The hasher stamps packets as it reads them */
+				if (!trace_has_dedicated_hasher(trace))
+					runtime_stamp_packets(t, packets,
+					                      nb_packets);
+			}
 		}
 
 		/* Handle error/message cases */
@@ -741,6 +982,8 @@ eof:
 
 	// Let the per_packet function know we have stopped
 	send_message(trace, t, MESSAGE_PAUSING, gen_zero, t);
+retire:
+	/* When retired we have already told it we are pausing */
 	send_message(trace, t, MESSAGE_STOPPING, gen_zero, t);
 
 	// Free any remaining packets
@@ -750,12 +993,23 @@ eof:
 			packets[i] = NULL;
 		}
 	}
+	if (trace->pread == trace_pread_packet_work_stealing)
+		backlog_flush(trace, t);
 
-	thread_change_state(trace, t, THREAD_FINISHED, true);
+	if (t->retire) {
+		/* Not counted as finished, the trace carries on without us */
+		ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
+		--trace->perpkt_thread_states[t->state];
+		t->state = THREAD_FINISHED;
+		pthread_cond_broadcast(&trace->perpkt_cond);
+		ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
+	} else {
+		thread_change_state(trace, t, THREAD_FINISHED, true);
 
-	/* Make sure the reporter sees we have finished */
-	if (trace_has_reporter(trace))
-		trace_post_reporter(trace);
+		/* Make sure the reporter sees we have finished */
+		if (trace_has_reporter(trace))
+			trace_post_reporter(trace);
+	}
 
 	// Release all ocache memory before unregistering with the format
 	// because this might(it does in DPDK) unlink the formats mempool
@@ -764,6 +1018,12 @@ eof:
 	if (trace->format->punregister_thread) {
 		trace->format->punregister_thread(trace, t);
 	}
+	if (t->perf) {
+		char name[24];
+		snprintf(name, sizeof(name), "perpkt-%d", t->perpkt_num);
+		report_perf_counters(t, name, "packets",
+		                     t->runtime.stats.packets);
+	}
 	print_memory_stats();
 
 	pthread_exit(NULL);
@@ -774,6 +1034,53 @@ eof:
  * and hash a packet from a data source and queue it against the correct
  * core to process it.
  */
+/**
+ * Queues a hashed packet against a per packet thread, applying the
+ * trace_set_hasher_overflow() policy if its queue is full.
+ *
+ * Returns true if the packet was queued, or false if it was dropped and can
+ * be reused. The caller counts the drop against the thread it was hashed to.
+ */
+static bool hasher_queue_packet(libtrace_t *trace, libtrace_thread_t *t,
+                                libtrace_packet_t *packet, int thread) {
+	libtrace_thread_t *target = &trace->perpkt_threads[thread];
+	bool finished = target->state == THREAD_FINISHED;
+	uint64_t start;
+	int i;
+
+	if (!finished && libtrace_ringbuffer_try_write(&target->rbuffer, packet))
+		return true;
+
+	switch (trace->config.hasher_overflow) {
+	case HASHER_OVERFLOW_DROP:
+		return false;
+	case HASHER_OVERFLOW_SPILL:
+		/* Hand it to the next thread with room, this breaks flow
+		 * affinity for this packet only */
+		for (i = 1; i < trace->perpkt_thread_count; i++) {
+			libtrace_thread_t *other = &trace->perpkt_threads[
+			                (thread + i) % trace->perpkt_thread_count];
+			if (other->state != THREAD_FINISHED &&
+			    libtrace_ringbuffer_try_write(&other->rbuffer, packet)) {
+				t->runtime.stats.hasher_spilled++;
+				return true;
+			}
+		}
+		/* Everyone is full, fall back to waiting */
+		break;
+	case HASHER_OVERFLOW_BLOCK:
+		break;
+	}
+
+	/* No one will ever read a finished thread's queue */
+	if (finished)
+		return false;
+	start = runtime_now();
+	libtrace_ringbuffer_write(&target->rbuffer, packet);
+	t->runtime.stats.write_blocked_ns += runtime_now() - start;
+	return true;
+}
+
 static void* hasher_entry(void *data) {
 	libtrace_t *trace = (libtrace_t *)data;
 	libtrace_thread_t * t;
@@ -798,6 +1105,8 @@ static void* hasher_entry(void *data) {
 	if (trace->format->pregister_thread) {
 		trace->format->pregister_thread(trace, t, true);
 	}
+	if (trace->config.perf_counters)
+		t->perf = perf_counters_create();
 
 	/* Read all packets in then hash and queue against the correct thread */
 	while (1) {
@@ -833,7 +1142,12 @@ static void* hasher_entry(void *data) {
 			continue;
 		}
 
-		if ((packet->error = trace_read_packet(trace, packet)) <1) {
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_DISPATCH);
+		packet->error = trace_read_packet(trace, packet);
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_READ);
+		if (packet->error < 1) {
 			if (packet->error == READ_MESSAGE) {
 				pkt_skipped = 1;
 				continue;
@@ -842,13 +1156,23 @@ static void* hasher_entry(void *data) {
 			}
 		}
 
+		t->runtime.stats.packets++;
+		if (runtime_sample(t)) {
+			packet->read_stamp = runtime_now();
+			libtrace_ocache_get_thread_counts(&trace->packet_freelist,
+			                                  &t->runtime.stats.ocache_hits,
+			                                  &t->runtime.stats.ocache_misses);
+		} else {
+			packet->read_stamp = 0;
+		}
+
 		/* We are guaranteed to have a hash function i.e. != NULL */
 		trace_packet_set_hash(packet, (*trace->hasher)(packet, trace->hasher_data));
 		thread = trace_packet_get_hash(packet) % trace->perpkt_thread_count;
-		/* Blocking write to the correct queue - I'm the only writer */
-		if (trace->perpkt_threads[thread].state != THREAD_FINISHED) {
+		LT_PROBE3(hasher_enqueue, packet, thread, packet->hash);
+		/* Write to the correct queue - I'm the only writer */
+		if (hasher_queue_packet(trace, t, packet, thread)) {
 			uint64_t order = trace_packet_get_order(packet);
-			libtrace_ringbuffer_write(&trace->perpkt_threads[thread].rbuffer, packet);
 			if (trace->config.tick_count && order % trace->config.tick_count == 0) {
 				// Write ticks to everyone else
 				libtrace_packet_t * pkts[trace->perpkt_thread_count];
@@ -862,7 +1186,7 @@ static void* hasher_entry(void *data) {
 			}
 			pkt_skipped = 0;
 		} else {
-			assert(!"Dropping a packet!!");
+			trace->perpkt_threads[thread].hasher_dropped++;
 			pkt_skipped = 1; // Reuse that packet no one read it
 		}
 	}
@@ -876,13 +1200,21 @@ hasher_eof:
 			libtrace_ocache_alloc(&trace->packet_freelist, (void **) &bcast, 1, 1);
 			bcast->error = packet->error;
 		}
-		ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
-		if (trace->perpkt_threads[i].state != THREAD_FINISHED) {
-			libtrace_ringbuffer_write(&trace->perpkt_threads[i].rbuffer, bcast);
-		} else {
-			libtrace_ocache_free(&trace->packet_freelist, (void **) &bcast, 1, 1);
+		/* Don't block while holding the lock, a thread may still need
+		 * it to start before it can empty its queue */
+		while (1) {
+			bool done = true;
+			ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
+			if (trace->perpkt_threads[i].state == THREAD_FINISHED) {
+				libtrace_ocache_free(&trace->packet_freelist, (void **) &bcast, 1, 1);
+			} else if (!libtrace_ringbuffer_try_write(&trace->perpkt_threads[i].rbuffer, bcast)) {
+				done = false;
+			}
+			ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
+			if (done)
+				break;
+			sched_yield();
 		}
-		ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 	}
 
 	// We don't need to free the packet
@@ -892,28 +1224,28 @@ hasher_eof:
 	if (trace->format->punregister_thread) {
 		trace->format->punregister_thread(trace, t);
 	}
+	if (t->perf)
+		report_perf_counters(t, "hasher", "packets",
+		                     t->runtime.stats.packets);
 	print_memory_stats();
 
 	// TODO remove from TTABLE t sometime
 	pthread_exit(NULL);
 }
 
-/* Our simplest case when a thread becomes ready it can obtain an exclusive
- * lock to read packets from the underlying trace.
+/* Reads up to nb_packets from the underlying trace, the caller must hold
+ * read_packet_lock.
  */
-static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
-                                                    libtrace_thread_t *t,
-                                                    libtrace_packet_t *packets[],
-                                                    size_t nb_packets) {
+static int read_packets_locked(libtrace_t *libtrace, libtrace_thread_t *t,
+                               libtrace_packet_t *packets[],
+                               size_t nb_packets) {
 	size_t i = 0;
 	//bool tick_hit = false;
 
-	ASSERT_RET(pthread_mutex_lock(&libtrace->read_packet_lock), == 0);
 	/* Read nb_packets */
 	for (i = 0; i < nb_packets; ++i) {
 		if (libtrace_message_queue_count(&t->messages) > 0) {
 			if ( i==0 ) {
-				ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
 				return READ_MESSAGE;
 			} else {
 				break;
@@ -924,7 +1256,6 @@ static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
 		if (packets[i]->error <= 0) {
 			/* We'll catch this next time if we have already got packets */
 			if ( i==0 ) {
-				ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
 				return packets[i]->error;
 			} else {
 				break;
@@ -941,7 +1272,6 @@ static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
 		        store_first_packet(libtrace, packets[0], t);
                 }
 	}
-	ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
 	/* XXX TODO this needs to be inband with packets, or we don't bother in this case
 	if (tick_hit) {
 		libtrace_message_t tick;
@@ -952,6 +1282,184 @@ static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
 	return i;
 }
 
+/* Our simplest case when a thread becomes ready it can obtain an exclusive
+ * lock to read packets from the underlying trace.
+ */
+static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
+                                                    libtrace_thread_t *t,
+                                                    libtrace_packet_t *packets[],
+                                                    size_t nb_packets) {
+	int ret;
+
+	ASSERT_RET(pthread_mutex_lock(&libtrace->read_packet_lock), == 0);
+	ret = read_packets_locked(libtrace, t, packets, nb_packets);
+	ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
+	return ret;
+}
+
+#define BACKLOG_HEAD(range) ((uint32_t) ((range) >> 32))
+#define BACKLOG_TAIL(range) ((uint32_t) (range))
+#define BACKLOG_RANGE(head, tail) (((uint64_t) (head) << 32) | (uint32_t) (tail))
+
+static inline size_t backlog_count(libtrace_thread_t *t) {
+	uint64_t range = __atomic_load_n(&t->backlog_range, __ATOMIC_RELAXED);
+	return (uint32_t) (BACKLOG_TAIL(range) - BACKLOG_HEAD(range));
+}
+
+/* Moves half of the packets waiting in a thread's backlog, but no more than
+ * nb_packets, into packets[] replacing those already there. The owner takes
+ * the oldest from the head and a thief the newest from the tail, either
+ * way they are returned in the order they were read.
+ *
+ * The packets are copied out before the range is claimed with a CAS, which
+ * fails if anyone else got there first. The indices only ever grow, so a
+ * claim can't succeed against slots that have since been refilled.
+ */
+static size_t backlog_take(libtrace_t *libtrace, libtrace_thread_t *t,
+                           bool steal, libtrace_packet_t *packets[],
+                           size_t nb_packets) {
+	libtrace_packet_t *taken[nb_packets];
+	uint64_t range, claimed;
+	uint32_t head, tail, first;
+	size_t i, n;
+
+	range = __atomic_load_n(&t->backlog_range, __ATOMIC_ACQUIRE);
+	do {
+		head = BACKLOG_HEAD(range);
+		tail = BACKLOG_TAIL(range);
+		n = ((uint32_t) (tail - head) + 1) / 2;
+		if (n == 0)
+			return 0;
+		if (n > nb_packets)
+			n = nb_packets;
+		first = steal ? tail - n : head;
+		for (i = 0; i < n; i++)
+			taken[i] = __atomic_load_n(&t->backlog[(first + i) &
+			                           (t->backlog_slots - 1)],
+			                           __ATOMIC_RELAXED);
+		claimed = steal ? BACKLOG_RANGE(head, tail - n) :
+		                  BACKLOG_RANGE(head + n, tail);
+	} while (!__atomic_compare_exchange_n(&t->backlog_range, &range,
+	                                      claimed, false, __ATOMIC_ACQUIRE,
+	                                      __ATOMIC_ACQUIRE));
+
+	for (i = 0; i < n; i++) {
+		if (packets[i])
+			libtrace_ocache_free(&libtrace->packet_freelist,
+			                     (void **) &packets[i], 1, 1);
+		packets[i] = taken[i];
+	}
+	return n;
+}
+
+/* Makes packets available to steal, only ever called by the owner once its
+ * backlog is empty. Nothing else moves the range while it is empty. */
+static void backlog_fill(libtrace_thread_t *t, libtrace_packet_t *packets[],
+                         size_t nb_packets) {
+	uint64_t range = __atomic_load_n(&t->backlog_range, __ATOMIC_RELAXED);
+	uint32_t tail = BACKLOG_TAIL(range);
+	size_t i;
+
+	assert(BACKLOG_HEAD(range) == tail);
+	assert(nb_packets <= t->backlog_slots);
+	for (i = 0; i < nb_packets; i++) {
+		__atomic_store_n(&t->backlog[(tail + i) & (t->backlog_slots - 1)],
+		                 packets[i], __ATOMIC_RELAXED);
+		packets[i] = NULL;
+	}
+	__atomic_store_n(&t->backlog_range,
+	                 BACKLOG_RANGE(tail, tail + nb_packets),
+	                 __ATOMIC_RELEASE);
+}
+
+/* Steals from the thread with the largest backlog */
+static size_t backlog_steal(libtrace_t *libtrace, libtrace_thread_t *t,
+                            libtrace_packet_t *packets[], size_t nb_packets) {
+	libtrace_thread_t *victim = NULL;
+	size_t most = 0;
+	size_t n;
+	int i;
+
+	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
+		libtrace_thread_t *other = &libtrace->perpkt_threads[i];
+		size_t size;
+		if (other == t)
+			continue;
+		size = backlog_count(other);
+		if (size > most) {
+			most = size;
+			victim = other;
+		}
+	}
+	if (!victim)
+		return 0;
+	n = backlog_take(libtrace, victim, true, packets, nb_packets);
+	t->runtime.stats.stolen += n;
+	return n;
+}
+
+/* Like first in first served, but a thread only keeps half of each burst it
+ * reads, leaving the rest in its backlog. Rather than wait while another
+ * thread reads a thread steals from the largest backlog, so a thread stuck
+ * in a slow callback doesn't sit on packets that an idle thread could be
+ * processing.
+ */
+static int trace_pread_packet_work_stealing(libtrace_t *libtrace,
+                                            libtrace_thread_t *t,
+                                            libtrace_packet_t *packets[],
+                                            size_t nb_packets) {
+	size_t keep;
+	size_t i;
+	int ret;
+
+	if (libtrace_message_queue_count(&t->messages) > 0)
+		return READ_MESSAGE;
+
+	ret = backlog_take(libtrace, t, false, packets, nb_packets);
+	if (ret > 0)
+		return ret;
+
+	if (pthread_mutex_trylock(&libtrace->read_packet_lock) != 0) {
+		ret = backlog_steal(libtrace, t, packets, nb_packets);
+		if (ret > 0)
+			return ret;
+		ASSERT_RET(pthread_mutex_lock(&libtrace->read_packet_lock), == 0);
+	}
+	/* Packets previously moved to the backlog leave gaps */
+	for (i = 0; i < nb_packets; i++) {
+		if (!packets[i])
+			libtrace_ocache_alloc(&libtrace->packet_freelist,
+			                      (void **) &packets[i], 1, 1);
+	}
+	ret = read_packets_locked(libtrace, t, packets, nb_packets);
+	ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
+
+	/* Help finish off the others before stopping */
+	if (ret == READ_EOF) {
+		size_t stolen = backlog_steal(libtrace, t, packets, nb_packets);
+		if (stolen > 0)
+			return stolen;
+	}
+	if (ret <= 1)
+		return ret;
+	keep = (ret + 1) / 2;
+	if ((size_t) ret - keep > t->backlog_slots)
+		keep = ret - t->backlog_slots;
+	backlog_fill(t, packets + keep, ret - keep);
+	return keep;
+}
+
+/* Drains a thread's backlog when it stops, so no packets are left behind */
+static void backlog_flush(libtrace_t *libtrace, libtrace_thread_t *t) {
+	libtrace_packet_t *packet = NULL;
+
+	while (backlog_take(libtrace, t, false, &packet, 1)) {
+		libtrace_ocache_free(&libtrace->packet_freelist,
+		                     (void **) &packet, 1, 1);
+		packet = NULL;
+	}
+}
+
 /**
  * For the case that we have a dedicated hasher thread
  * 1. We read a packet from our buffer
@@ -962,16 +1470,26 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
                                                    libtrace_packet_t *packets[],
                                                    size_t nb_packets) {
 	size_t i;
+	size_t depth;
 
 	/* We store the last error message here */
 	if (t->format_data) {
 		return ((libtrace_packet_t *)t->format_data)->error;
 	}
 
+	depth = libtrace_ringbuffer_get_count(&t->rbuffer);
+	t->runtime.stats.queue_depth_total += depth;
+	if (depth > t->runtime.stats.queue_depth_max)
+		t->runtime.stats.queue_depth_max = depth;
+
 	// Always grab at least one
 	if (packets[0]) // Recycle the old get the new
 		libtrace_ocache_free(&libtrace->packet_freelist, (void **) packets, 1, 1);
-	packets[0] = libtrace_ringbuffer_read(&t->rbuffer);
+	if (!libtrace_ringbuffer_try_read(&t->rbuffer, (void **) &packets[0])) {
+		uint64_t start = runtime_now();
+		packets[0] = libtrace_ringbuffer_read(&t->rbuffer);
+		t->runtime.stats.read_blocked_ns += runtime_now() - start;
+	}
 
 	if (packets[0]->error <= 0 && packets[0]->error != READ_TICK) {
 		return packets[0]->error;
@@ -986,7 +1504,7 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
 		}
 
 		/* We will return an error or EOF the next time around */
-		if (packets[i]->error <= 0 && packets[0]->error != READ_TICK) {
+		if (packets[i]->error <= 0 && packets[i]->error != READ_TICK) {
 			/* The message case will be checked automatically -
 			   However other cases like EOF and error will only be
 			   sent once*/
@@ -1102,6 +1620,177 @@ DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
 }
 
 
+static void latency_hist_merge(libtrace_latency_hist_t *a,
+                               const libtrace_latency_hist_t *b) {
+	int i;
+
+	a->count += b->count;
+	a->total_ns += b->total_ns;
+	if (b->max_ns > a->max_ns)
+		a->max_ns = b->max_ns;
+	for (i = 0; i < LIBTRACE_LATENCY_BUCKETS; i++)
+		a->buckets[i] += b->buckets[i];
+}
+
+static void runtime_stats_merge(libtrace_runtime_stats_t *a,
+                                const libtrace_runtime_stats_t *b) {
+	a->packets += b->packets;
+	a->bursts += b->bursts;
+	if (b->burst_size > a->burst_size)
+		a->burst_size = b->burst_size;
+	a->burst_size_total += b->burst_size_total;
+	a->results += b->results;
+	a->read_blocked_ns += b->read_blocked_ns;
+	a->write_blocked_ns += b->write_blocked_ns;
+	a->hasher_spilled += b->hasher_spilled;
+	a->stolen += b->stolen;
+	if (b->queue_depth_max > a->queue_depth_max)
+		a->queue_depth_max = b->queue_depth_max;
+	a->queue_depth_total += b->queue_depth_total;
+	a->ocache_hits += b->ocache_hits;
+	a->ocache_misses += b->ocache_misses;
+	a->combiner_late += b->combiner_late;
+	latency_hist_merge(&a->read_to_dispatch, &b->read_to_dispatch);
+	latency_hist_merge(&a->dispatch_to_publish, &b->dispatch_to_publish);
+	latency_hist_merge(&a->publish_to_reporter, &b->publish_to_reporter);
+}
+
+DLLEXPORT int trace_get_runtime_stats(libtrace_t *libtrace,
+                                      libtrace_thread_t *t,
+                                      libtrace_runtime_stats_t *stats)
+{
+	libtrace_runtime_stats_t hasher;
+	libtrace_runtime_stats_t reporter;
+	int i;
+
+	if (!libtrace->perpkt_threads)
+		return -1;
+
+	if (t) {
+		if (t->trace != libtrace || (t->type != THREAD_PERPKT &&
+		                t->type != THREAD_HASHER &&
+		                t->type != THREAD_REPORTER))
+			return -1;
+		*stats = t->runtime.stats;
+		return 0;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < libtrace->perpkt_thread_count; i++)
+		runtime_stats_merge(stats, &libtrace->perpkt_threads[i].runtime.stats);
+	/* The hasher counts the packets it hashed and the reporter counts the
+	 * results it received, the total only counts those which reached the
+	 * packet callback and were published */
+	if (trace_has_dedicated_hasher(libtrace)) {
+		hasher = libtrace->hasher_thread.runtime.stats;
+		hasher.packets = 0;
+		runtime_stats_merge(stats, &hasher);
+	}
+	reporter = libtrace->reporter_thread.runtime.stats;
+	stats->combiner_backlog = stats->results > reporter.results ?
+	                          stats->results - reporter.results : 0;
+	stats->combiner_backlog_max = reporter.combiner_backlog_max;
+	if (stats->combiner_backlog > stats->combiner_backlog_max)
+		stats->combiner_backlog_max = stats->combiner_backlog;
+	reporter.results = 0;
+	runtime_stats_merge(stats, &reporter);
+	return 0;
+}
+
+DLLEXPORT uint64_t trace_latency_hist_percentile(
+                const libtrace_latency_hist_t *hist, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	target = (uint64_t) ((double) hist->count * percentile / 100.0);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < LIBTRACE_LATENCY_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			uint64_t bound = (2ull << i) - 1;
+			return bound < hist->max_ns ? bound : hist->max_ns;
+		}
+	}
+	return hist->max_ns;
+}
+
+static int print_latency_hist(const char *name,
+                              const libtrace_latency_hist_t *hist, FILE *f)
+{
+	if (hist->count == 0)
+		return 0;
+	if (fprintf(f, "%s: count=%"PRIu64" mean=%"PRIu64"ns p50=%"PRIu64"ns "
+	            "p99=%"PRIu64"ns max=%"PRIu64"ns\n", name, hist->count,
+	            hist->total_ns / hist->count,
+	            trace_latency_hist_percentile(hist, 50),
+	            trace_latency_hist_percentile(hist, 99),
+	            hist->max_ns) < 0)
+		return -1;
+	return 0;
+}
+
+DLLEXPORT int trace_print_runtime_stats(const libtrace_runtime_stats_t *stats,
+                                        FILE *f)
+{
+#define PRINT_FIELD(x) \
+	if (fprintf(f, "%s: %"PRIu64"\n", #x, stats->x) < 0) \
+		return -1;
+	PRINT_FIELD(packets)
+	PRINT_FIELD(bursts)
+	PRINT_FIELD(burst_size)
+	PRINT_FIELD(burst_size_total)
+	PRINT_FIELD(results)
+	PRINT_FIELD(read_blocked_ns)
+	PRINT_FIELD(write_blocked_ns)
+	PRINT_FIELD(hasher_spilled)
+	PRINT_FIELD(stolen)
+	PRINT_FIELD(queue_depth_max)
+	PRINT_FIELD(queue_depth_total)
+	PRINT_FIELD(ocache_hits)
+	PRINT_FIELD(ocache_misses)
+	PRINT_FIELD(combiner_backlog)
+	PRINT_FIELD(combiner_backlog_max)
+	PRINT_FIELD(combiner_late)
+#undef PRINT_FIELD
+	if (print_latency_hist("read_to_dispatch", &stats->read_to_dispatch, f) ||
+	    print_latency_hist("dispatch_to_publish", &stats->dispatch_to_publish, f) ||
+	    print_latency_hist("publish_to_reporter", &stats->publish_to_reporter, f))
+		return -1;
+	return 0;
+}
+
+/** Prints the runtime statistics of every thread, for
+ * trace_set_runtime_stats_interval() */
+static void dump_runtime_stats(libtrace_t *trace) {
+	libtrace_runtime_stats_t stats;
+	int i;
+
+	for (i = 0; i < trace->perpkt_thread_count; i++) {
+		libtrace_thread_t *t = &trace->perpkt_threads[i];
+		fprintf(stderr, "perpkt-%d: packets=%"PRIu64" results=%"PRIu64
+		        " read_blocked_ns=%"PRIu64" queue_depth_max=%"PRIu64
+		        " burst_size=%"PRIu64"\n",
+		        i, t->runtime.stats.packets, t->runtime.stats.results,
+		        t->runtime.stats.read_blocked_ns,
+		        t->runtime.stats.queue_depth_max,
+		        t->runtime.stats.burst_size);
+	}
+	if (trace_has_dedicated_hasher(trace))
+		fprintf(stderr, "hasher: packets=%"PRIu64" write_blocked_ns=%"
+		        PRIu64" spilled=%"PRIu64"\n",
+		        trace->hasher_thread.runtime.stats.packets,
+		        trace->hasher_thread.runtime.stats.write_blocked_ns,
+		        trace->hasher_thread.runtime.stats.hasher_spilled);
+	if (trace_get_runtime_stats(trace, NULL, &stats) == 0)
+		trace_print_runtime_stats(&stats, stderr);
+}
+
 DLLEXPORT uint64_t tv_to_usec(const struct timeval *tv)
 {
 	return (uint64_t) tv->tv_sec*1000000ull + (uint64_t) tv->tv_usec;
@@ -1133,6 +1822,8 @@ static void* reporter_entry(void *data) {
 	if (trace->format->pregister_thread) {
 		trace->format->pregister_thread(trace, t, false);
 	}
+	if (trace->config.perf_counters)
+		t->perf = perf_counters_create();
 
 	send_message(trace, t, MESSAGE_STARTING, (libtrace_generic_t){0}, t);
 	send_message(trace, t, MESSAGE_RESUMING, (libtrace_generic_t){0}, t);
@@ -1144,9 +1835,12 @@ static void* reporter_entry(void *data) {
 		} else {
 			libtrace_message_queue_get(&t->messages, &message);
 		}
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_READ);
 		switch (message.code) {
 			// Check for results
 			case MESSAGE_POST_REPORTER:
+				runtime_update_backlog(trace);
 				trace->combiner.read(trace, &trace->combiner);
 				break;
 			case MESSAGE_DO_PAUSE:
@@ -1162,6 +1856,8 @@ static void* reporter_entry(void *data) {
                         send_message(trace, t, message.code, message.data,
                                         message.sender);
 		}
+		if (t->perf)
+			perf_counters_mark(t->perf, PERF_PHASE_CALLBACK);
 	}
 
 	// Flush out whats left now all our threads have finished
@@ -1172,6 +1868,9 @@ static void* reporter_entry(void *data) {
         send_message(trace, t, MESSAGE_STOPPING,(libtrace_generic_t) {0}, t);
 
 	thread_change_state(trace, &trace->reporter_thread, THREAD_FINISHED, true);
+	if (t->perf)
+		report_perf_counters(t, "reporter", "results",
+		                     t->runtime.stats.results);
 	print_memory_stats();
 	return NULL;
 }
@@ -1182,6 +1881,8 @@ static void* keepalive_entry(void *data) {
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	libtrace_t *trace = (libtrace_t *)data;
 	uint64_t next_release;
+	uint64_t next_dump = UINT64_MAX;
+	uint64_t wake;
 	libtrace_thread_t *t = &trace->keepalive_thread;
 
 	/* Wait until all threads are started */
@@ -1195,13 +1896,19 @@ static void* keepalive_entry(void *data) {
 
 	gettimeofday(&prev, NULL);
 	message.code = MESSAGE_TICK_INTERVAL;
+	if (trace->config.runtime_stats_interval)
+		next_dump = tv_to_usec(&prev) +
+		            trace->config.runtime_stats_interval * 1000;
 
 	while (trace->state != STATE_FINISHED) {
 		fd_set rfds;
-		next_release = tv_to_usec(&prev) + (trace->config.tick_interval * 1000);
+		next_release = UINT64_MAX;
+		if (trace->config.tick_interval)
+			next_release = tv_to_usec(&prev) + (trace->config.tick_interval * 1000);
+		wake = next_release < next_dump ? next_release : next_dump;
 		gettimeofday(&next, NULL);
-		if (next_release > tv_to_usec(&next)) {
-			next = usec_to_tv(next_release - tv_to_usec(&next));
+		if (wake > tv_to_usec(&next)) {
+			next = usec_to_tv(wake - tv_to_usec(&next));
 			// Wait for timeout or a message
 			FD_ZERO(&rfds);
 			FD_SET(libtrace_message_queue_get_fd(&t->messages), &rfds);
@@ -1212,6 +1919,12 @@ static void* keepalive_entry(void *data) {
 				goto done;
 			}
 		}
+		if (wake == next_dump) {
+			if (trace->state == STATE_RUNNING)
+				dump_runtime_stats(trace);
+			next_dump += trace->config.runtime_stats_interval * 1000;
+			continue;
+		}
 		prev = usec_to_tv(next_release);
 		if (trace->state == STATE_RUNNING) {
 			message.data.uint64 = ((((uint64_t)prev.tv_sec) << 32) +
@@ -1299,10 +2012,12 @@ static inline size_t filter_packets(libtrace_t *trace,
 		packets[i]->trace = trace;
 		if (trace_apply_filter(trace->filter, packets[i])) {
 			libtrace_packet_t *tmp;
+			LT_PROBE2(filter_accept, trace, packets[i]);
 			tmp = packets[offset];
 			packets[offset++] = packets[i];
 			packets[i] = tmp;
 		} else {
+			LT_PROBE2(filter_reject, trace, packets[i]);
 			trace_fin_packet(packets[i]);
 		}
 	}
@@ -1349,6 +2064,7 @@ static int trace_pread_packet_wrapper(libtrace_t *libtrace,
 			ret=libtrace->format->pread_packets(libtrace, t,
 			                                    packets,
 			                                    nb_packets);
+			LT_PROBE3(pread_packets, libtrace, t->perpkt_num, ret);
 			/* Error, EOF or message? */
 			if (ret <= 0) {
 				return ret;
@@ -1384,10 +2100,148 @@ static int trace_pread_packet_wrapper(libtrace_t *libtrace,
  * Typically with a parallel trace the threads are not
  * killed rather.
  */
+/* Picks how the per packet threads read from a format which can't be read
+ * in parallel, when there is no hasher thread */
+static void set_nonparallel_pread(libtrace_t *libtrace) {
+	if (libtrace->perpkt_thread_count > 1) {
+		if (libtrace->config.work_stealing)
+			libtrace->pread = trace_pread_packet_work_stealing;
+		else
+			libtrace->pread = trace_pread_packet_first_in_first_served;
+		/* Don't wait for a burst of packets if the format is
+		 * live as this could block ring based formats and
+		 * introduces delay. */
+		if (libtrace->format->info.live) {
+			libtrace->config.burst_size = 1;
+		}
+	}
+	else {
+		/* Use standard read_packet */
+		libtrace->pread = NULL;
+	}
+}
+
+/* Allocates and starts perpkt_thread_count per packet threads, the caller
+ * must hold libtrace_lock so they wait until the trace is running */
+static int start_perpkt_threads(libtrace_t *libtrace) {
+	char name[24];
+	int i;
+
+	libtrace->perpkt_threads = calloc(sizeof(libtrace_thread_t),
+	                                  libtrace->perpkt_thread_count);
+	if (!libtrace->perpkt_threads) {
+		trace_set_err(libtrace, errno, "trace_pstart "
+		              "failed to allocate memory.");
+		return -1;
+	}
+	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
+		snprintf(name, sizeof(name), "perpkt-%d", i);
+		libtrace_zero_thread(&libtrace->perpkt_threads[i]);
+		if (trace_start_thread(libtrace, &libtrace->perpkt_threads[i],
+		                   THREAD_PERPKT, perpkt_threads_entry, i,
+		                   name) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Stops every per packet thread of a paused trace so that trace_pstart() can
+ * start a different number of them.
+ *
+ * Pausing has already emptied the hasher queues, the threads are told they
+ * are stopping and the reporter is then asked to pass on any results they
+ * published, before the combiner is destroyed. The caller must hold
+ * libtrace_lock, which is released while waiting for the threads.
+ */
+static void retire_perpkt_threads(libtrace_t *libtrace) {
+	libtrace_packet_t *packet;
+	int i;
+
+	for (i = 0; i < libtrace->perpkt_thread_count; i++)
+		libtrace->perpkt_threads[i].retire = true;
+	pthread_cond_broadcast(&libtrace->perpkt_cond);
+	while (libtrace->perpkt_thread_states[THREAD_PAUSED]) {
+		ASSERT_RET(pthread_cond_wait(&libtrace->perpkt_cond, &libtrace->libtrace_lock), == 0);
+	}
+	ASSERT_RET(pthread_mutex_unlock(&libtrace->libtrace_lock), == 0);
+
+	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
+		libtrace_thread_t *t = &libtrace->perpkt_threads[i];
+		ASSERT_RET(pthread_join(t->tid, NULL), == 0);
+		if (trace_has_dedicated_hasher(libtrace)) {
+			while (libtrace_ringbuffer_try_read(&t->rbuffer, (void **) &packet))
+				libtrace_ocache_free(&libtrace->packet_freelist, (void **) &packet, 1, 1);
+			libtrace_ringbuffer_destroy(&t->rbuffer);
+		}
+		libtrace_message_queue_destroy(&t->messages);
+		free(t->backlog);
+		t->backlog = NULL;
+	}
+
+	ASSERT_RET(pthread_mutex_lock(&libtrace->libtrace_lock), == 0);
+	if (trace_has_reporter(libtrace)) {
+		libtrace->reporter_flush = true;
+		pthread_cond_broadcast(&libtrace->perpkt_cond);
+		while (libtrace->reporter_flush) {
+			ASSERT_RET(pthread_cond_wait(&libtrace->perpkt_cond, &libtrace->libtrace_lock), == 0);
+		}
+		if (libtrace->combiner.destroy)
+			libtrace->combiner.destroy(libtrace, &libtrace->combiner);
+		libtrace->combiner.queues = NULL;
+	}
+
+	free(libtrace->perpkt_threads);
+	libtrace->perpkt_threads = NULL;
+	free(libtrace->first_packets.packets);
+	libtrace->first_packets.packets = NULL;
+	libtrace->perpkt_thread_count = 0;
+}
+
+/* Starts the per packet threads again after retire_perpkt_threads(), along
+ * with the hasher thread if there is now more than one of them */
+static int restart_perpkt_threads(libtrace_t *libtrace) {
+	sigset_t sig_before, sig_block_all;
+	int ret = -1;
+
+	sigemptyset(&sig_block_all);
+	ASSERT_RET(pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before), == 0);
+
+	if (libtrace->hasher && libtrace->perpkt_thread_count > 1 &&
+	    !trace_has_dedicated_hasher(libtrace) &&
+	    !trace_is_parallel(libtrace)) {
+		libtrace->hasher_thread.type = THREAD_EMPTY;
+		if (trace_start_thread(libtrace, &libtrace->hasher_thread,
+		                       THREAD_HASHER, hasher_entry, -1,
+		                       "hasher-thread") != 0)
+			goto done;
+		libtrace->pread = trace_pread_packet_hasher_thread;
+	}
+
+	if (start_perpkt_threads(libtrace) != 0)
+		goto done;
+	libtrace->perpkt_thread_states[THREAD_RUNNING] = libtrace->perpkt_thread_count;
+
+	libtrace->first_packets.packets = calloc(libtrace->perpkt_thread_count,
+	                                         sizeof(*libtrace->first_packets.packets));
+	if (libtrace->first_packets.packets == NULL) {
+		trace_set_err(libtrace, errno, "trace_pstart "
+		              "failed to allocate memory.");
+		goto done;
+	}
+	if (trace_has_reporter(libtrace) && libtrace->combiner.initialise)
+		libtrace->combiner.initialise(libtrace, &libtrace->combiner);
+	ret = 0;
+done:
+	ASSERT_RET(pthread_sigmask(SIG_SETMASK, &sig_before, NULL), == 0);
+	return ret;
+}
+
 static int trace_prestart(libtrace_t * libtrace, void *global_blob,
                           libtrace_callback_set_t *per_packet_cbs, 
                           libtrace_callback_set_t *reporter_cbs) {
 	int i, err = 0;
+	bool resize = false;
 	if (libtrace->state != STATE_PAUSED) {
 		trace_set_err(libtrace, TRACE_ERR_BAD_STATE,
 			"trace(%s) is not currently paused",
@@ -1398,6 +2252,15 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 	assert(libtrace_parallel);
 	assert(!libtrace->perpkt_thread_states[THREAD_RUNNING]);
 
+	if (libtrace->config.perpkt_threads > 0 &&
+	    (int) libtrace->config.perpkt_threads != libtrace->perpkt_thread_count) {
+		if (get_thread_table(libtrace)) {
+			fprintf(stderr, "The number of perpkt threads cannot be changed from a perpkt or reporter thread, ignoring\n");
+		} else {
+			resize = true;
+		}
+	}
+
 	/* Reset first packets */
 	pthread_spin_lock(&libtrace->first_packets.lock);
 	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
@@ -1424,6 +2287,7 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
 		libtrace->perpkt_threads[i].accepted_packets = 0;
 		libtrace->perpkt_threads[i].filtered_packets = 0;
+		libtrace->perpkt_threads[i].hasher_dropped = 0;
 	}
 	libtrace->accepted_packets = 0;
 	libtrace->filtered_packets = 0;
@@ -1449,6 +2313,14 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
                                 sizeof(libtrace_callback_set_t));
         }
 
+	if (resize) {
+		retire_perpkt_threads(libtrace);
+		libtrace->perpkt_thread_count = libtrace->config.perpkt_threads;
+		if (!trace_is_parallel(libtrace) &&
+		    !trace_has_dedicated_hasher(libtrace) && !libtrace->hasher)
+			set_nonparallel_pread(libtrace);
+	}
+
 	if (trace_is_parallel(libtrace)) {
 		err = libtrace->format->pstart_input(libtrace);
 	} else {
@@ -1457,6 +2329,10 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 		}
 	}
 
+	/* The format may have lowered the thread count to what it supports */
+	if (err == 0 && resize)
+		err = restart_perpkt_threads(libtrace);
+
 	if (err == 0) {
 		libtrace->started = true;
 		libtrace_change_state(libtrace, STATE_RUNNING, false);
@@ -1584,6 +2460,17 @@ static int trace_start_thread(libtrace_t *trace,
 		                                 LIBTRACE_RINGBUFFER_POLLING:
 		                                 LIBTRACE_RINGBUFFER_BLOCKING);
 	}
+	if (trace->pread == trace_pread_packet_work_stealing &&
+	    type == THREAD_PERPKT) {
+		/* A thread keeps at least half of each burst. A power of two
+		 * so that slots stay put when the indices wrap. */
+		t->backlog_slots = 1;
+		while (t->backlog_slots < trace->config.burst_size)
+			t->backlog_slots <<= 1;
+		t->backlog = calloc(t->backlog_slots,
+		                    sizeof(libtrace_packet_t *));
+		t->backlog_range = 0;
+	}
 #if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__linux__)
 	if(name)
 		pthread_setname_np(t->tid, name);
@@ -1677,7 +2564,6 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
                            libtrace_callback_set_t *reporter_cbs) {
 	int i;
 	int ret = -1;
-	char name[24];
 	sigset_t sig_before, sig_block_all;
 	assert(libtrace);
 
@@ -1761,19 +2647,7 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 		if (libtrace->format->start_input) {
 			ret = libtrace->format->start_input(libtrace);
 		}
-		if (libtrace->perpkt_thread_count > 1) {
-			libtrace->pread = trace_pread_packet_first_in_first_served;
-			/* Don't wait for a burst of packets if the format is
-			 * live as this could block ring based formats and
-			 * introduces delay. */
-			if (libtrace->format->info.live) {
-				libtrace->config.burst_size = 1;
-			}
-		}
-		else {
-			/* Use standard read_packet */
-			libtrace->pread = NULL;
-		}
+		set_nonparallel_pread(libtrace);
 	}
 
 	if (ret != 0) {
@@ -1801,22 +2675,9 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 	}
 
 	/* Start up our perpkt threads */
-	libtrace->perpkt_threads = calloc(sizeof(libtrace_thread_t),
-	                                  libtrace->perpkt_thread_count);
-	if (!libtrace->perpkt_threads) {
-		trace_set_err(libtrace, errno, "trace_pstart "
-		              "failed to allocate memory.");
+	ret = start_perpkt_threads(libtrace);
+	if (ret != 0)
 		goto cleanup_threads;
-	}
-	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
-		snprintf(name, sizeof(name), "perpkt-%d", i);
-		libtrace_zero_thread(&libtrace->perpkt_threads[i]);
-		ret = trace_start_thread(libtrace, &libtrace->perpkt_threads[i],
-		                   THREAD_PERPKT, perpkt_threads_entry, i,
-		                   name);
-		if (ret != 0)
-			goto cleanup_threads;
-	}
 
 	/* Start the reporter thread */
 	if (reporter_cbs) {
@@ -1830,7 +2691,8 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 	}
 
 	/* Start the keepalive thread */
-	if (libtrace->config.tick_interval > 0) {
+	if (libtrace->config.tick_interval > 0 ||
+	    libtrace->config.runtime_stats_interval > 0) {
 		ret = trace_start_thread(libtrace, &libtrace->keepalive_thread,
 		                   THREAD_KEEPALIVE, keepalive_entry, -1,
 		                   "keepalive_thread");
@@ -2177,7 +3039,9 @@ DLLEXPORT int trace_set_hasher(libtrace_t *trace, enum hasher_types type, fn_has
 	// Try push this to hardware - NOTE hardware could do custom if
 	// there is a more efficient way to apply it, in this case
 	// it will simply grab the function out of libtrace_t
-	if (trace_supports_parallel(trace) && trace->format->config_input)
+	if (trace_supports_parallel(trace) && trace->format->config_input &&
+			type != HASHER_TUNNEL_BIDIRECTIONAL &&
+			type != HASHER_TUNNEL_UNIDIRECTIONAL)
 		ret = trace->format->config_input(trace, TRACE_OPTION_HASHER, &type);
 
 	if (ret == -1) {
@@ -2198,6 +3062,15 @@ DLLEXPORT int trace_set_hasher(libtrace_t *trace, enum hasher_types type, fn_has
 					trace->hasher_data = calloc(1, sizeof(toeplitz_conf_t));
 					toeplitz_init_config(trace->hasher_data, 0);
 					return 0;
+				case HASHER_TUNNEL_BIDIRECTIONAL:
+				case HASHER_TUNNEL_UNIDIRECTIONAL:
+					trace->hasher = (fn_hasher) toeplitz_hash_tunnel_packet;
+					trace->hasher_data = calloc(1, sizeof(toeplitz_tunnel_conf_t));
+					toeplitz_init_tunnel_config(trace->hasher_data,
+						type == HASHER_TUNNEL_BIDIRECTIONAL,
+						TOEPLITZ_TUNNEL_ALL,
+						TOEPLITZ_TUNNEL_DEFAULT_DEPTH);
+					return 0;
 			}
 			return -1;
 		}
@@ -2355,9 +3228,31 @@ DLLEXPORT int trace_message_perpkts(libtrace_t * libtrace, libtrace_message_t *
  */
 DLLEXPORT void trace_publish_result(libtrace_t *libtrace, libtrace_thread_t *t, uint64_t key, libtrace_generic_t value, int type) {
 	libtrace_result_t res;
+	struct runtime_counters *rc = &t->runtime;
+	uint64_t now = 0;
+
 	res.type = type;
 	res.key = key;
 	res.value = value;
+	res.stamp = 0;
+
+	/* Time results published straight from a sampled packet, and
+	 * otherwise at most one result in every RUNTIME_STATS_SAMPLE packets */
+	if (rc->dispatch_stamp) {
+		now = runtime_now();
+		latency_hist_add(&rc->stats.dispatch_to_publish,
+		                 now - rc->dispatch_stamp);
+		rc->dispatch_stamp = 0;
+	}
+	if (rc->stats.packets - rc->result_sample >= RUNTIME_STATS_SAMPLE ||
+	    rc->stats.results == 0) {
+		if (!now)
+			now = runtime_now();
+		res.stamp = runtime_result_stamp(now);
+		rc->result_sample = rc->stats.packets;
+	}
+	rc->stats.results++;
+	LT_PROBE3(publish_result, t->perpkt_num, key, type);
 	assert(libtrace->combiner.publish);
 	libtrace->combiner.publish(libtrace, t->perpkt_num, &libtrace->combiner, &res);
 	return;
@@ -2498,6 +3393,43 @@ DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_runtime_stats_interval(libtrace_t *trace,
+                                               size_t millisec) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.runtime_stats_interval = millisec;
+	return 0;
+}
+
+DLLEXPORT int trace_set_perf_counters(libtrace_t *trace, bool enabled) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.perf_counters = enabled;
+	return 0;
+}
+
+DLLEXPORT int trace_set_hasher_overflow(libtrace_t *trace,
+                                        enum hasher_overflow_policy policy) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.hasher_overflow = policy;
+	return 0;
+}
+
+DLLEXPORT int trace_set_work_stealing(libtrace_t *trace, bool enabled) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.work_stealing = enabled;
+	return 0;
+}
+
+DLLEXPORT int trace_set_adaptive_burst(libtrace_t *trace, size_t min) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.adaptive_burst = min;
+	return 0;
+}
+
 static bool config_bool_parse(char *value, size_t nvalue) {
 	if (strncmp(value, "true", nvalue) == 0)
 		return true;
@@ -2507,6 +3439,18 @@ static bool config_bool_parse(char *value, size_t nvalue) {
 		return strtoll(value, NULL, 10) != 0;
 }
 
+static enum hasher_overflow_policy config_overflow_parse(char *value,
+                                                         size_t nvalue) {
+	if (strncmp(value, "block", nvalue) == 0)
+		return HASHER_OVERFLOW_BLOCK;
+	else if (strncmp(value, "drop", nvalue) == 0)
+		return HASHER_OVERFLOW_DROP;
+	else if (strncmp(value, "spill", nvalue) == 0)
+		return HASHER_OVERFLOW_SPILL;
+	else
+		return strtoll(value, NULL, 10);
+}
+
 /* Note update documentation on trace_set_configuration */
 static void config_string(struct user_configuration *uc, char *key, size_t nkey, char *value, size_t nvalue) {
 	assert(key);
@@ -2548,6 +3492,21 @@ static void config_string(struct user_configuration *uc, char *key, size_t nkey,
 	} else if (strncmp(key, "debug_state", nkey) == 0
 	           || strncmp(key, "ds", nkey) == 0) {
 		uc->debug_state = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "runtime_stats_interval", nkey) == 0
+	           || strncmp(key, "rsi", nkey) == 0) {
+		uc->runtime_stats_interval = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "perf_counters", nkey) == 0
+	           || strncmp(key, "pc", nkey) == 0) {
+		uc->perf_counters = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "hasher_overflow", nkey) == 0
+	           || strncmp(key, "ho", nkey) == 0) {
+		uc->hasher_overflow = config_overflow_parse(value, nvalue);
+	} else if (strncmp(key, "work_stealing", nkey) == 0
+	           || strncmp(key, "ws", nkey) == 0) {
+		uc->work_stealing = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "adaptive_burst", nkey) == 0
+	           || strncmp(key, "ab", nkey) == 0) {
+		uc->adaptive_burst = strtoll(value, NULL, 10);
 	} else {
 		fprintf(stderr, "No matching option %s(=%s), ignoring\n", key, value);
 	}
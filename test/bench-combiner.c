@@ -0,0 +1,188 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Measures how many results per second each combiner can move from the
+ * processing threads to the reporter. Each processing thread publishes a
+ * fixed number of results as fast as it can from its starting callback,
+ * with keys interleaved across threads so that the ordered, sorted and
+ * timestamp combiners have to merge them, e.g.
+ *
+ *   ./bench-combiner -c ordered -t 1,2,4,8,16,32
+ *
+ * This is not run as part of do-tests.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "bench.h"
+
+static uint64_t results_per_thread = 1000000;
+static int nthreads = 1;
+
+struct report_state {
+	uint64_t count;
+	uint64_t last;
+	uint64_t disorder;
+};
+
+static void *start_cb(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED) {
+	uint64_t id = trace_get_perpkt_thread_id(t);
+	uint64_t i;
+
+	for (i = 0; i < results_per_thread; i++) {
+		trace_publish_result(trace, t, i * nthreads + id + 1,
+				(libtrace_generic_t){.uint64 = id},
+				RESULT_USER);
+	}
+	return NULL;
+}
+
+static libtrace_packet_t *packet_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_packet_t *packet) {
+	return packet;
+}
+
+static void result_cb(libtrace_t *trace UNUSED, libtrace_thread_t *sender UNUSED,
+		void *global, void *tls UNUSED, libtrace_result_t *res) {
+	struct report_state *state = (struct report_state *)global;
+
+	if (res->key < state->last)
+		state->disorder ++;
+	state->last = res->key;
+	state->count ++;
+}
+
+static int run(const char *uri, const libtrace_combine_t *combiner,
+		const char *name) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *pktcbs, *repcbs;
+	struct report_state state;
+	double start, elapsed;
+	char params[64];
+	uint64_t expected = results_per_thread * nthreads;
+
+	memset(&state, 0, sizeof(state));
+	trace = trace_create(uri);
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "Opening trace");
+		return -1;
+	}
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, start_cb);
+	trace_set_packet_cb(pktcbs, packet_cb);
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, result_cb);
+
+	trace_set_perpkt_threads(trace, nthreads);
+	trace_set_combiner(trace, combiner, (libtrace_generic_t){0});
+
+	start = bench_wall_secs();
+	if (trace_pstart(trace, &state, pktcbs, repcbs) == -1) {
+		trace_perror(trace, "Starting trace");
+		return -1;
+	}
+	trace_join(trace);
+	elapsed = bench_wall_secs() - start;
+
+	snprintf(params, sizeof(params), "combiner=%s threads=%d", name,
+			nthreads);
+	bench_report("combiner", params, state.count, elapsed);
+	if (state.count != expected)
+		fprintf(stderr, "%s: MISSING %" PRIu64 " results\n", params,
+				expected - state.count);
+	if (combiner != &combiner_unordered && state.disorder) {
+		fprintf(stderr, "%s: OUT OF ORDER %" PRIu64 " results\n",
+				params, state.disorder);
+		return -1;
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	return state.count == expected ? 0 : -1;
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-c ordered|unordered|sorted|timestamp] [-t threads,...] "
+			"[-n results per thread] [uri]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "erf:traces/100_packets.erf";
+	const char *combiner = NULL;
+	char *threadlist = strdup("1,2,4,8,16,32");
+	char *tok, *saveptr = NULL;
+	int opt, err = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:n:h")) != -1) {
+		switch (opt) {
+			case 'c': combiner = optarg; break;
+			case 't':
+				free(threadlist);
+				threadlist = strdup(optarg);
+				break;
+			case 'n':
+				results_per_thread = strtoull(optarg, NULL, 10);
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		uri = argv[optind];
+	if (combiner && strcmp(combiner, "ordered") != 0 &&
+			strcmp(combiner, "unordered") != 0 &&
+			strcmp(combiner, "sorted") != 0 &&
+			strcmp(combiner, "timestamp") != 0)
+		usage(argv[0]);
+
+	for (tok = strtok_r(threadlist, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		nthreads = atoi(tok);
+		if (nthreads < 1)
+			usage(argv[0]);
+		if (!combiner || strcmp(combiner, "unordered") == 0)
+			err |= run(uri, &combiner_unordered, "unordered");
+		if (!combiner || strcmp(combiner, "ordered") == 0)
+			err |= run(uri, &combiner_ordered, "ordered");
+		if (!combiner || strcmp(combiner, "sorted") == 0)
+			err |= run(uri, &combiner_sorted, "sorted");
+		if (!combiner || strcmp(combiner, "timestamp") == 0)
+			err |= run(uri, &combiner_timestamp, "timestamp");
+	}
+
+	free(threadlist);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Micro benchmarks for the pieces that sit on every packet's path: reading
+ * each input format, applying a BPF filter, Toeplitz hashing, and moving
+ * pointers through a ring buffer and an object cache, e.g.
+ *
+ *   ./bench-micro -b read,hash pcapfile:bench.pcap erf:bench.erf
+ *
+ * The filter and hash benchmarks run over packets from the first trace,
+ * preloaded into memory so that only the operation itself is timed. This
+ * is not run as part of do-tests.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "libtrace.h"
+#include "hash_toeplitz.h"
+#include "data-struct/ring_buffer.h"
+#include "data-struct/object_cache.h"
+#include "bench.h"
+
+#define MAX_PRELOAD 100000
+#define BURST 32
+
+/* Per-packet operations are far slower than moving pointers around, so
+ * they get separate counts */
+static uint64_t ops = 2000000;
+static uint64_t struct_ops = 20000000;
+static volatile uint64_t sink;
+/* Copied packets still refer to their trace, so it stays open until the
+ * benchmarks using them are done */
+static libtrace_t *preload_trace = NULL;
+static libtrace_packet_t *preloaded[MAX_PRELOAD];
+static int npreloaded = 0;
+
+/* Names the format of a URI for the results, e.g. "pcapfile" */
+static void uri_format(const char *uri, char *name, size_t len) {
+	const char *colon = strchr(uri, ':');
+	size_t n = colon ? (size_t)(colon - uri) : strlen(uri);
+
+	if (n >= len)
+		n = len - 1;
+	memcpy(name, uri, n);
+	name[n] = '\0';
+}
+
+static libtrace_t *open_trace(const char *uri) {
+	libtrace_t *trace = trace_create(uri);
+
+	if (trace_is_err(trace) || trace_start(trace) == -1) {
+		trace_perror(trace, "%s", uri);
+		trace_destroy(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+static int bench_read(const char *uri) {
+	libtrace_t *trace;
+	libtrace_packet_t *packet = trace_create_packet();
+	uint64_t count = 0, bytes = 0;
+	char params[64], format[32];
+	double start;
+
+	start = bench_wall_secs();
+	if ((trace = open_trace(uri)) == NULL)
+		return -1;
+	while (trace_read_packet(trace, packet) > 0) {
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		bytes += trace_get_capture_length(packet);
+		count ++;
+	}
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "Reading %s", uri);
+		return -1;
+	}
+
+	uri_format(uri, format, sizeof(format));
+	snprintf(params, sizeof(params), "format=%s bytes=%" PRIu64, format,
+			bytes);
+	bench_report("read", params, count, bench_wall_secs() - start);
+	trace_destroy(trace);
+	trace_destroy_packet(packet);
+	return 0;
+}
+
+static int preload(const char *uri) {
+	libtrace_packet_t *packet = trace_create_packet();
+
+	if ((preload_trace = open_trace(uri)) == NULL)
+		return -1;
+	while (npreloaded < MAX_PRELOAD &&
+			trace_read_packet(preload_trace, packet) > 0) {
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		preloaded[npreloaded++] = trace_copy_packet(packet);
+	}
+	trace_destroy_packet(packet);
+	if (npreloaded == 0) {
+		fprintf(stderr, "No packets in %s to preload\n", uri);
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_filter(const char *expr) {
+	libtrace_filter_t *filter = trace_create_filter(expr);
+	uint64_t i, matched = 0;
+	char params[160];
+	double start;
+
+	if (filter == NULL) {
+		/* Built without BPF support, which isn't a regression */
+		fprintf(stderr, "Skipping the filter benchmark\n");
+		return 0;
+	}
+	if (trace_apply_filter(filter, preloaded[0]) == -1) {
+		fprintf(stderr, "Failed to compile filter: %s\n", expr);
+		trace_destroy_filter(filter);
+		return -1;
+	}
+
+	start = bench_wall_secs();
+	for (i = 0; i < ops; i++)
+		matched += trace_apply_filter(filter,
+				preloaded[i % npreloaded]) > 0;
+	snprintf(params, sizeof(params), "matched_pct=%.1f",
+			100.0 * matched / ops);
+	bench_report("filter", params, ops, bench_wall_secs() - start);
+	trace_destroy_filter(filter);
+	return 0;
+}
+
+static int bench_hash(void) {
+	toeplitz_conf_t conf;
+	toeplitz_tunnel_conf_t tunnel;
+	uint64_t i, sum = 0;
+	double start;
+
+	memset(&conf, 0, sizeof(conf));
+	memset(&tunnel, 0, sizeof(tunnel));
+	toeplitz_init_config(&conf, true);
+	start = bench_wall_secs();
+	for (i = 0; i < ops; i++)
+		sum += toeplitz_hash_packet(preloaded[i % npreloaded], &conf);
+	bench_report("hash", "kind=toeplitz", ops, bench_wall_secs() - start);
+
+	toeplitz_init_tunnel_config(&tunnel, true, TOEPLITZ_TUNNEL_ALL,
+			TOEPLITZ_TUNNEL_DEFAULT_DEPTH);
+	start = bench_wall_secs();
+	for (i = 0; i < ops; i++)
+		sum += toeplitz_hash_tunnel_packet(preloaded[i % npreloaded],
+				&tunnel);
+	bench_report("hash", "kind=toeplitz-tunnel", ops,
+			bench_wall_secs() - start);
+
+	/* Keep the compiler from discarding the hashing */
+	sink = sum;
+	return 0;
+}
+
+struct ring_args {
+	libtrace_ringbuffer_t *rb;
+	int burst;
+};
+
+static void *ring_producer(void *data) {
+	struct ring_args *args = (struct ring_args *)data;
+	void *values[BURST];
+	uint64_t i;
+	int j;
+
+	if (args->burst == 1) {
+		for (i = 1; i <= struct_ops; i++)
+			libtrace_ringbuffer_write(args->rb, (void *)(uintptr_t)i);
+		return NULL;
+	}
+	for (i = 1; i <= struct_ops; i += args->burst) {
+		size_t done = 0;
+
+		for (j = 0; j < args->burst; j++)
+			values[j] = (void *)(uintptr_t)(i + j);
+		while (done < (size_t)args->burst)
+			done += libtrace_ringbuffer_write_bulk(args->rb,
+					values + done, args->burst - done, 1);
+	}
+	return NULL;
+}
+
+/* One producer and one consumer, moving single pointers or bursts */
+static int bench_ring(int mode, int burst) {
+	libtrace_ringbuffer_t rb;
+	struct ring_args args = { &rb, burst };
+	pthread_t producer;
+	void *values[BURST];
+	uint64_t received = 0, bad = 0, expected = 1;
+	char params[64];
+	double start;
+
+	libtrace_ringbuffer_init(&rb, 1024, mode);
+	start = bench_wall_secs();
+	pthread_create(&producer, NULL, ring_producer, &args);
+	while (received < struct_ops) {
+		size_t i, n = libtrace_ringbuffer_read_bulk(&rb, values,
+				burst, 1);
+
+		for (i = 0; i < n; i++)
+			bad += (uintptr_t)values[i] != expected++;
+		received += n;
+	}
+	pthread_join(producer, NULL);
+	snprintf(params, sizeof(params), "mode=%s burst=%d",
+			mode == LIBTRACE_RINGBUFFER_POLLING ? "polling" :
+			"blocking", burst);
+	bench_report("ringbuffer", params, received,
+			bench_wall_secs() - start);
+	libtrace_ringbuffer_destroy(&rb);
+	if (bad) {
+		fprintf(stderr, "%s: %" PRIu64 " values out of order\n",
+				params, bad);
+		return -1;
+	}
+	return 0;
+}
+
+static void *ocache_new(void) {
+	return malloc(64);
+}
+
+/* Allocates and frees batches on a single thread, which is the common case
+ * of a processing thread recycling its own packets */
+static int bench_ocache(int burst) {
+	libtrace_ocache_t oc;
+	void *values[BURST];
+	uint64_t i;
+	char params[32];
+	double start;
+
+	libtrace_ocache_init(&oc, ocache_new, free, 64, 1024, false);
+	start = bench_wall_secs();
+	for (i = 0; i < struct_ops; i += burst) {
+		libtrace_ocache_alloc(&oc, values, burst, burst);
+		libtrace_ocache_free(&oc, values, burst, burst);
+	}
+	snprintf(params, sizeof(params), "burst=%d", burst);
+	bench_report("ocache", params, i, bench_wall_secs() - start);
+	libtrace_ocache_unregister_thread(&oc);
+	libtrace_ocache_destroy(&oc);
+	return 0;
+}
+
+static int selected(const char *list, const char *name) {
+	size_t len = strlen(name);
+	const char *p = list;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == list || p[-1] == ',') &&
+				(p[len] == ',' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-b read,filter,hash,ringbuffer,ocache] "
+			"[-n packet ops] [-N ringbuffer/ocache ops] "
+			"[-f filter] uri...\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *benches = "read,filter,hash,ringbuffer,ocache";
+	const char *filterexpr = "tcp and port 443";
+	int opt, i, err = 0;
+
+	while ((opt = getopt(argc, argv, "b:n:N:f:h")) != -1) {
+		switch (opt) {
+			case 'b': benches = optarg; break;
+			case 'n': ops = strtoull(optarg, NULL, 10); break;
+			case 'N':
+				struct_ops = strtoull(optarg, NULL, 10);
+				break;
+			case 'f': filterexpr = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (ops == 0 || struct_ops == 0)
+		usage(argv[0]);
+	/* Whole bursts, so the ring buffer producer never overshoots */
+	struct_ops = (struct_ops + BURST - 1) / BURST * BURST;
+	if (optind >= argc && (selected(benches, "read") ||
+			selected(benches, "filter") || selected(benches, "hash")))
+		usage(argv[0]);
+
+	if (selected(benches, "read")) {
+		for (i = optind; i < argc; i++)
+			err |= bench_read(argv[i]);
+	}
+	if (selected(benches, "filter") || selected(benches, "hash")) {
+		if (preload(argv[optind]) == -1)
+			return 1;
+		if (selected(benches, "filter"))
+			err |= bench_filter(filterexpr);
+		if (selected(benches, "hash"))
+			err |= bench_hash();
+		for (i = 0; i < npreloaded; i++)
+			trace_destroy_packet(preloaded[i]);
+		trace_destroy(preload_trace);
+	}
+	if (selected(benches, "ringbuffer")) {
+		err |= bench_ring(LIBTRACE_RINGBUFFER_POLLING, 1);
+		err |= bench_ring(LIBTRACE_RINGBUFFER_POLLING, BURST);
+		err |= bench_ring(LIBTRACE_RINGBUFFER_BLOCKING, BURST);
+	}
+	if (selected(benches, "ocache")) {
+		err |= bench_ocache(1);
+		err |= bench_ocache(BURST);
+	}
+	return err ? 1 : 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Synthetic nDAG benchmark. A sender thread multicasts a beacon and a
+ * number of encapsulated ERF streams over the loopback interface, while an
+ * ndag: input reads them back with one or more processing threads. The
+ * receiver CPU time per packet is reported so that the cost of merging
+ * many streams can be compared as the source count grows, e.g.
+ *
+ *   for s in 1 4 16 64 256; do ./bench-ndag -s $s; done
+ *
+ * This is not run as part of do-tests.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "dagformat.h"
+#include "format_ndag.h"
+#include "bench.h"
+
+#define ERF_ETH_TYPE 2
+#define FRAME_SIZE 60
+#define RECORD_SIZE (dag_record_size + 2 + FRAME_SIZE)
+#define RECORDS_PER_DGRAM 16
+#define MAX_THREADS 64
+
+static const char *group = "225.100.0.1";
+static const char *iface = "lo";
+static uint16_t baseport = 9001;
+static int sources = 16;
+static int threads = 1;
+static uint64_t packets = 100000;
+
+static volatile int sending_done = 0;
+static uint64_t sent_total = 0;
+
+struct thread_result {
+	volatile uint64_t count;
+	uint64_t cpu_start;
+	uint64_t cpu_ns;
+	char pad[40];
+};
+
+static struct thread_result results[MAX_THREADS];
+
+static uint64_t thread_cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_sender(void) {
+	struct in_addr local;
+	unsigned char loop = 1;
+	unsigned char ttl = 0;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+	local.s_addr = htonl(INADDR_LOOPBACK);
+	if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local,
+				sizeof(local)) < 0 ||
+			setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+				sizeof(loop)) < 0 ||
+			setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+				sizeof(ttl)) < 0) {
+		perror("setsockopt");
+		exit(1);
+	}
+	return sock;
+}
+
+static void send_to(int sock, uint16_t port, void *buf, size_t len) {
+	struct sockaddr_in dst;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_port = htons(port);
+	inet_pton(AF_INET, group, &dst.sin_addr);
+
+	while (sendto(sock, buf, len, 0, (struct sockaddr *)&dst,
+				sizeof(dst)) < 0) {
+		if (errno != ENOBUFS && errno != EAGAIN) {
+			perror("sendto");
+			exit(1);
+		}
+		usleep(10);
+	}
+}
+
+static void send_beacon(int sock) {
+	char buf[sizeof(ndag_common_t) + sizeof(uint16_t) * 1024];
+	ndag_common_t *hdr = (ndag_common_t *)buf;
+	uint16_t *ptr = (uint16_t *)(buf + sizeof(ndag_common_t));
+	int i;
+
+	hdr->magic = htonl(NDAG_MAGIC_NUMBER);
+	hdr->version = NDAG_EXPORT_VERSION;
+	hdr->type = NDAG_PKT_BEACON;
+	hdr->monitorid = htons(1);
+	*(ptr++) = htons(sources);
+	for (i = 0; i < sources; i++)
+		*(ptr++) = htons(baseport + 1 + i);
+
+	send_to(sock, baseport, buf, (char *)ptr - buf);
+}
+
+static void *sender_run(void *arg) {
+	char buf[sizeof(ndag_common_t) + sizeof(ndag_encap_t) +
+		RECORD_SIZE * RECORDS_PER_DGRAM];
+	ndag_common_t *hdr = (ndag_common_t *)buf;
+	ndag_encap_t *encap = (ndag_encap_t *)(buf + sizeof(ndag_common_t));
+	uint32_t *seqnos;
+	uint64_t sent = 0, ts = 1ULL << 32;
+	int sock = open_sender();
+	int i, r;
+
+	(void)arg;
+
+	/* Give the control thread a chance to hand every stream to a
+	 * receiver before the data starts. Joining groups gets slower as
+	 * the number of memberships grows, so allow more time for lots of
+	 * sources. */
+	for (i = 0; i < 10 + sources / 20; i++) {
+		send_beacon(sock);
+		usleep(100000);
+	}
+
+	seqnos = calloc(sources, sizeof(uint32_t));
+	memset(buf, 0, sizeof(buf));
+	hdr->magic = htonl(NDAG_MAGIC_NUMBER);
+	hdr->version = NDAG_EXPORT_VERSION;
+	hdr->type = NDAG_PKT_ENCAPERF;
+	hdr->monitorid = htons(1);
+	encap->started = htobe64(1);
+	encap->recordcount = htons(RECORDS_PER_DGRAM);
+
+	while (sent < packets * sources) {
+		for (i = 0; i < sources; i++) {
+			char *rec = buf + sizeof(ndag_common_t) +
+				sizeof(ndag_encap_t);
+
+			for (r = 0; r < RECORDS_PER_DGRAM; r++) {
+				dag_record_t *erf = (dag_record_t *)rec;
+
+				/* Interleave the streams so that the
+				 * receiver has to merge them */
+				ts += 1 + (i * 7919 + r) % 13;
+				erf->ts = htole64(ts);
+				erf->type = ERF_ETH_TYPE;
+				erf->rlen = htons(RECORD_SIZE);
+				erf->wlen = htons(FRAME_SIZE + 4);
+				erf->lctr = 0;
+				rec += RECORD_SIZE;
+			}
+			encap->seqno = htonl(++seqnos[i]);
+			encap->streamid = htons(i);
+			send_to(sock, baseport + 1 + i, buf, sizeof(buf));
+			sent += RECORDS_PER_DGRAM;
+		}
+		/* Don't let the sender overrun the socket buffers on the
+		 * receive side too badly */
+		if ((sent / RECORDS_PER_DGRAM) % 256 == 0)
+			usleep(200);
+	}
+
+	free(seqnos);
+	close(sock);
+	sent_total = sent;
+	sending_done = 1;
+	return NULL;
+}
+
+static void *start_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED) {
+	return NULL;
+}
+
+static libtrace_packet_t *packet_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t, void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	struct thread_result *res = &results[trace_get_perpkt_thread_id(t)];
+
+	/* Don't count the time spent waiting for the streams to start */
+	if (res->count == 0)
+		res->cpu_start = thread_cpu_ns();
+	res->count ++;
+	return packet;
+}
+
+static void stop_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED) {
+	struct thread_result *res = &results[trace_get_perpkt_thread_id(t)];
+
+	if (res->count > 0)
+		res->cpu_ns = thread_cpu_ns() - res->cpu_start;
+}
+
+static uint64_t total_received(void) {
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < threads; i++)
+		total += results[i].count;
+	return total;
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-s sources] [-p packets per source] "
+			"[-t threads] [-g group] [-i interface] [-P port]\n",
+			argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *pktcbs;
+	pthread_t sender;
+	char uri[256], params[160];
+	uint64_t received, last = 0, cpu = 0;
+	double start = 0, lastchange = 0, done = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "s:p:t:g:i:P:h")) != -1) {
+		switch (opt) {
+			case 's': sources = atoi(optarg); break;
+			case 'p': packets = strtoull(optarg, NULL, 10); break;
+			case 't': threads = atoi(optarg); break;
+			case 'g': group = optarg; break;
+			case 'i': iface = optarg; break;
+			case 'P': baseport = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (sources < 1 || sources > 1024 || threads < 1 ||
+			threads > MAX_THREADS)
+		usage(argv[0]);
+
+	snprintf(uri, sizeof(uri), "ndag:%s,%s,%u", iface, group, baseport);
+	trace = trace_create(uri);
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "Opening trace");
+		return 1;
+	}
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, start_cb);
+	trace_set_packet_cb(pktcbs, packet_cb);
+	trace_set_stopping_cb(pktcbs, stop_cb);
+	trace_set_perpkt_threads(trace, threads);
+
+	if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+		trace_perror(trace, "Starting trace");
+		return 1;
+	}
+
+	pthread_create(&sender, NULL, sender_run, NULL);
+
+	/* Stop once the sender is finished and nothing new has turned up
+	 * for a while */
+	while (1) {
+		usleep(50000);
+		received = total_received();
+		if (received != last) {
+			if (last == 0)
+				start = bench_wall_secs();
+			last = received;
+			lastchange = bench_wall_secs();
+		} else if (sending_done) {
+			if (done == 0)
+				done = bench_wall_secs();
+			if (bench_wall_secs() - (lastchange > done ? lastchange :
+						done) > 1.0)
+				break;
+		}
+		if (sending_done && received >= sent_total)
+			break;
+	}
+
+	pthread_join(sender, NULL);
+	trace_pstop(trace);
+	trace_join(trace);
+
+	received = total_received();
+	for (i = 0; i < threads; i++)
+		cpu += results[i].cpu_ns;
+
+	snprintf(params, sizeof(params), "sources=%d threads=%d sent=%"
+			PRIu64 " received_pct=%.1f cpu_per_pkt_ns=%.1f",
+			sources, threads, sent_total,
+			100.0 * received / sent_total,
+			received ? (double)cpu / received : 0.0);
+	bench_report("ndag", params, received, lastchange - start);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(pktcbs);
+	return 0;
+}
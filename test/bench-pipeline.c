@@ -0,0 +1,215 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* End-to-end benchmark of the parallel pipeline, reading a trace with an
+ * increasing number of processing threads:
+ *
+ *   count    each thread counts its packets, reporting once at the end
+ *   hash     as count, but distributed by the bidirectional hasher thread
+ *   ordered  every packet publishes a result through the ordered combiner
+ *
+ * e.g.
+ *
+ *   ./bench-pipeline -m count,ordered -t 1,2,4,8 pcapfile:bench.pcap
+ *
+ * Every run must see the same number of packets. This is not run as part
+ * of do-tests.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "bench.h"
+
+enum { MODE_COUNT, MODE_HASH, MODE_ORDERED };
+
+static const char *mode_names[] = { "count", "hash", "ordered" };
+
+struct thread_count {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct report_state {
+	int mode;
+	uint64_t packets;
+	uint64_t last;
+	uint64_t disorder;
+};
+
+static void *start_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED) {
+	return calloc(1, sizeof(struct thread_count));
+}
+
+static libtrace_packet_t *packet_cb(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *tls, libtrace_packet_t *packet) {
+	struct report_state *state = (struct report_state *)global;
+	struct thread_count *count = (struct thread_count *)tls;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+	count->packets ++;
+	count->bytes += trace_get_capture_length(packet);
+	if (state->mode == MODE_ORDERED)
+		trace_publish_result(trace, t, trace_packet_get_order(packet),
+				(libtrace_generic_t){.uint64 = 1},
+				RESULT_USER);
+	return packet;
+}
+
+static void stop_cb(libtrace_t *trace, libtrace_thread_t *t, void *global,
+		void *tls) {
+	struct report_state *state = (struct report_state *)global;
+	struct thread_count *count = (struct thread_count *)tls;
+
+	if (state->mode != MODE_ORDERED)
+		trace_publish_result(trace, t, 0,
+				(libtrace_generic_t){.uint64 = count->packets},
+				RESULT_USER);
+	free(count);
+}
+
+static void result_cb(libtrace_t *trace UNUSED, libtrace_thread_t *sender UNUSED,
+		void *global, void *tls UNUSED, libtrace_result_t *res) {
+	struct report_state *state = (struct report_state *)global;
+
+	if (state->mode == MODE_ORDERED) {
+		if (res->key < state->last)
+			state->disorder ++;
+		state->last = res->key;
+	}
+	state->packets += res->value.uint64;
+}
+
+static int run(const char *uri, int mode, int nthreads, uint64_t *expected) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *pktcbs, *repcbs;
+	struct report_state state;
+	char params[64];
+	double start, elapsed;
+
+	memset(&state, 0, sizeof(state));
+	state.mode = mode;
+	trace = trace_create(uri);
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "Opening trace");
+		return -1;
+	}
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, start_cb);
+	trace_set_packet_cb(pktcbs, packet_cb);
+	trace_set_stopping_cb(pktcbs, stop_cb);
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, result_cb);
+
+	trace_set_perpkt_threads(trace, nthreads);
+	if (mode == MODE_HASH)
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	trace_set_combiner(trace, mode == MODE_ORDERED ? &combiner_ordered :
+			&combiner_unordered, (libtrace_generic_t){0});
+
+	start = bench_wall_secs();
+	if (trace_pstart(trace, &state, pktcbs, repcbs) == -1) {
+		trace_perror(trace, "Starting trace");
+		return -1;
+	}
+	trace_join(trace);
+	elapsed = bench_wall_secs() - start;
+	if (trace_is_err(trace))
+		trace_perror(trace, "Reading packets");
+
+	snprintf(params, sizeof(params), "mode=%s threads=%d",
+			mode_names[mode], nthreads);
+	bench_report("pipeline", params, state.packets, elapsed);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+
+	if (*expected == 0)
+		*expected = state.packets;
+	if (state.packets != *expected) {
+		fprintf(stderr, "%s: saw %" PRIu64 " packets, expected %"
+				PRIu64 "\n", params, state.packets, *expected);
+		return -1;
+	}
+	if (state.disorder) {
+		fprintf(stderr, "%s: OUT OF ORDER %" PRIu64 " results\n",
+				params, state.disorder);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-m count,hash,ordered] [-t threads,...] "
+			"uri\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *modes = "count,hash,ordered";
+	char *threadlist = strdup("1,2,4,8");
+	char *tok, *saveptr = NULL;
+	uint64_t expected = 0;
+	int opt, mode, err = 0;
+
+	while ((opt = getopt(argc, argv, "m:t:h")) != -1) {
+		switch (opt) {
+			case 'm': modes = optarg; break;
+			case 't':
+				free(threadlist);
+				threadlist = strdup(optarg);
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	for (tok = strtok_r(threadlist, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		int nthreads = atoi(tok);
+
+		if (nthreads < 1)
+			usage(argv[0]);
+		for (mode = MODE_COUNT; mode <= MODE_ORDERED; mode++) {
+			if (strstr(modes, mode_names[mode]) == NULL)
+				continue;
+			err |= run(argv[optind], mode, nthreads, &expected);
+		}
+	}
+
+	free(threadlist);
+	return err ? 1 : 0;
+}
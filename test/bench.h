@@ -0,0 +1,59 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Helpers shared by the benchmarks. Every measurement is printed as a
+ * single line of space separated key=value pairs, starting with the name
+ * of the benchmark and ending with the work done, the time it took and the
+ * resulting rate, e.g.
+ *
+ *   bench=read format=pcapfile threads=1 ops=1000000 secs=0.412 rate=2427184
+ *
+ * so that run-bench.sh can compare the rates against an earlier run.
+ */
+
+#ifndef LIBTRACE_TEST_BENCH_H
+#define LIBTRACE_TEST_BENCH_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+static inline double bench_wall_secs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* params holds any key=value pairs that identify this measurement */
+static inline void bench_report(const char *name, const char *params,
+		uint64_t ops, double secs) {
+	printf("bench=%s %s%sops=%" PRIu64 " secs=%.6f rate=%.0f\n", name,
+			params ? params : "", params && *params ? " " : "",
+			ops, secs, secs > 0 ? ops / secs : 0.0);
+	fflush(stdout);
+}
+
+#endif
@@ -50,6 +50,9 @@ do_test ./test-format-parallel rawerf
 echo \* Read pcapng
 do_test ./test-format-parallel pcapng
 
+echo \* Read mem
+do_test ./test-format-parallel mem
+
 echo \* Read testing hasher function
 do_test ./test-format-parallel-hasher erf
 
@@ -68,6 +71,27 @@ do_test ./test-format-parallel-reporter erf
 echo \* Testing Trace-Time Playback
 do_test ./test-tracetime-parallel
 
+echo \* Testing interval counters with idle threads
+do_test ./test-interval-counters
+
+echo \* Testing runtime statistics
+do_test ./test-runtime-stats
+
+echo \* Testing hasher overflow policies
+do_test ./test-hasher-overflow
+
+echo \* Testing work stealing between processing threads
+do_test ./test-work-stealing
+
+echo \* Testing resizing the perpkt threads while paused
+do_test ./test-resize-threads
+
+echo \* Testing adaptive burst sizes
+do_test ./test-adaptive-burst
+
+echo \* Testing merging results by timestamp
+do_test ./test-combiner-timestamp
+
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
@@ -274,6 +274,18 @@ do_test ./test-autodetect traces/5_packets.erf.xz
 echo " * VXLan decode"
 do_test ./test-vxlan
 
+echo " * Tunnel-aware flow hashing"
+do_test ./test-tunnel-hash
+
+echo " * Incremental checksum updates"
+do_test ./test-checksum
+
+echo " * Timestamp merge of several inputs"
+do_test ./test-merge
+
+echo " * Replay of a trace preloaded into memory"
+do_test ./test-mem
+
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
@@ -0,0 +1,439 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Writes a deterministic synthetic trace for the benchmarks, so that every
+ * run (and every machine) measures exactly the same packets. Packets belong
+ * to a fixed number of flows, and each flow is consistently VLAN tagged,
+ * MPLS labelled, VXLAN tunnelled or IPv6 according to the requested ratios,
+ * e.g.
+ *
+ *   ./gen-trace -F pcapng -n 1000000 -f 5000 -s 64:40,576:20,1500:40 \
+ *           -v 10 -m 5 -x 5 bench.pcapng
+ *
+ * The same seed and options always produce an identical file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define MAX_SIZES 16
+#define MAX_FRAME 9000
+#define ERF_TYPE_ETH 2
+#define ERF_FLAG_VLEN 0x04
+
+enum { OUT_PCAP, OUT_ERF, OUT_PCAPNG };
+
+static struct {
+	uint32_t size;
+	uint32_t weight;
+} sizes[MAX_SIZES] = { {64, 40}, {576, 20}, {1500, 40} };
+static int nsizes = 3;
+static uint32_t total_weight = 100;
+
+static uint64_t seed = 1;
+static uint64_t packets = 1000000;
+static uint32_t flows = 10000;
+static int vlan_pct = 0, mpls_pct = 0, tunnel_pct = 0, ipv6_pct = 0;
+static uint64_t pps = 1000000;
+
+/* Everything about a flow is derived from its number, so nothing needs to
+ * be stored per flow */
+struct flow {
+	uint32_t src4, dst4;
+	uint8_t src6[16], dst6[16];
+	uint16_t sport, dport;
+	uint8_t proto;
+	int vlan, mpls, tunnel, ipv6;
+	uint16_t vid;
+	uint32_t label, vni;
+};
+
+static uint64_t splitmix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void make_flow(uint32_t id, struct flow *f) {
+	uint64_t h = splitmix64(seed ^ ((uint64_t)id << 20));
+	uint64_t h2 = splitmix64(h);
+	int i;
+
+	f->src4 = htonl(0x0a000000 | (uint32_t)(h & 0xffffff));
+	f->dst4 = htonl(0xc0a80000 | (uint32_t)((h >> 24) & 0xffff));
+	for (i = 0; i < 8; i++) {
+		f->src6[i] = f->dst6[i] = (i == 0) ? 0x20 : (i == 1 ? 0x01 : 0);
+		f->src6[8 + i] = (uint8_t)(h >> (i * 8));
+		f->dst6[8 + i] = (uint8_t)(h2 >> (i * 8));
+	}
+	f->sport = 1024 + (uint16_t)((h >> 40) % 60000);
+	f->dport = (h2 >> 16) % 4 == 0 ? 443 : 1024 + (uint16_t)((h2 >> 20) % 60000);
+	f->proto = (h2 % 10) < 7 ? 6 : 17;
+	f->vlan = (int)((h2 >> 32) % 100) < vlan_pct;
+	f->mpls = (int)((h2 >> 40) % 100) < mpls_pct;
+	f->tunnel = (int)((h2 >> 48) % 100) < tunnel_pct;
+	f->ipv6 = (int)((h2 >> 56) % 100) < ipv6_pct;
+	f->vid = 1 + (uint16_t)(id % 4094);
+	f->label = 16 + id % 100000;
+	f->vni = id & 0xffffff;
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr, int len) {
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < len; i += 2)
+		sum += (hdr[i] << 8) | hdr[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons((uint16_t)~sum);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+	v = htons(v);
+	memcpy(p, &v, 2);
+	return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+	v = htonl(v);
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+static uint8_t *put_eth(uint8_t *p, uint32_t id, uint16_t ethertype) {
+	static const uint8_t dst[6] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55};
+
+	memcpy(p, dst, 6);
+	p[6] = 0x02;
+	p[7] = 0;
+	put32(p + 8, id);
+	return put16(p + 12, ethertype);
+}
+
+/* Writes an IPv4 or IPv6 header and transport header, with the IP lengths
+ * covering 'remaining' bytes from the start of the IP header */
+static uint8_t *put_ip(uint8_t *p, const struct flow *f, int ipv6,
+		uint8_t proto, uint32_t src4, uint32_t dst4, uint16_t sport,
+		uint16_t dport, uint32_t remaining) {
+	uint8_t *ip = p;
+	uint32_t l4len;
+	uint16_t csum;
+
+	if (ipv6) {
+		p = put32(p, 0x60000000);
+		p = put16(p, (uint16_t)(remaining - 40));
+		*p++ = proto;
+		*p++ = 64;
+		memcpy(p, f->src6, 16);
+		memcpy(p + 16, f->dst6, 16);
+		p += 32;
+		l4len = remaining - 40;
+	} else {
+		*p++ = 0x45;
+		*p++ = 0;
+		p = put16(p, (uint16_t)remaining);
+		p = put32(p, 0x40000000);	/* DF, no fragment offset */
+		*p++ = 64;
+		*p++ = proto;
+		p = put16(p, 0);
+		memcpy(p, &src4, 4);
+		memcpy(p + 4, &dst4, 4);
+		p += 8;
+		csum = ip_checksum(ip, 20);
+		memcpy(ip + 10, &csum, 2);
+		l4len = remaining - 20;
+	}
+
+	p = put16(p, sport);
+	p = put16(p, dport);
+	if (proto == 6) {
+		p = put32(p, 1);
+		p = put32(p, 0);
+		*p++ = 0x50;
+		*p++ = 0x18;	/* PSH, ACK */
+		p = put16(p, 65535);
+		p = put16(p, 0);
+		p = put16(p, 0);
+	} else {
+		p = put16(p, (uint16_t)l4len);
+		p = put16(p, 0);	/* No checksum */
+	}
+	return p;
+}
+
+/* Builds a frame of (at least) the requested size, returning its length */
+static uint32_t build_packet(uint8_t *buf, uint32_t id, const struct flow *f,
+		uint32_t size) {
+	uint32_t hdrlen = 14 + (f->ipv6 ? 40 : 20) + (f->proto == 6 ? 20 : 8);
+	uint32_t iplen;
+	uint8_t *p = buf;
+
+	if (f->vlan)
+		hdrlen += 4;
+	if (f->mpls)
+		hdrlen += 8;
+	if (f->tunnel)
+		hdrlen += 20 + 8 + 8 + 14;
+	if (size < hdrlen)
+		size = hdrlen;
+	if (size > MAX_FRAME)
+		size = MAX_FRAME;
+
+	if (f->vlan) {
+		p = put_eth(p, id, 0x8100);
+		p = put16(p, f->vid);
+		p = put16(p, f->mpls ? 0x8847 : (f->tunnel || !f->ipv6 ? 0x0800 : 0x86dd));
+	} else {
+		p = put_eth(p, id, f->mpls ? 0x8847 :
+				(f->tunnel || !f->ipv6 ? 0x0800 : 0x86dd));
+	}
+	if (f->mpls) {
+		p = put32(p, (f->label << 12) | 64);
+		p = put32(p, ((f->label + 1) << 12) | 0x100 | 64);
+	}
+	iplen = size - (uint32_t)(p - buf);
+	if (f->tunnel) {
+		/* VXLAN between a handful of tunnel endpoints */
+		uint32_t vtep = htonl(0xac100000 | (id % 16));
+		uint32_t remote = htonl(0xac100100);
+
+		p = put_ip(p, f, 0, 17, vtep, remote, 49152 + (id & 0x3fff),
+				4789, iplen);
+		p = put32(p, 0x08000000);
+		p = put32(p, f->vni << 8);
+		p = put_eth(p, id, f->ipv6 ? 0x86dd : 0x0800);
+		iplen = size - (uint32_t)(p - buf);
+	}
+	p = put_ip(p, f, f->ipv6, f->proto, f->src4, f->dst4, f->sport,
+			f->dport, iplen);
+
+	/* Payload bytes that differ between packets, so nothing can shortcut
+	 * over identical data */
+	while (p < buf + size) {
+		*p = (uint8_t)(p - buf + id);
+		p++;
+	}
+	return size;
+}
+
+static int parse_sizes(char *spec) {
+	char *tok, *saveptr = NULL;
+
+	nsizes = 0;
+	total_weight = 0;
+	for (tok = strtok_r(spec, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		char *colon = strchr(tok, ':');
+
+		if (nsizes == MAX_SIZES)
+			return -1;
+		sizes[nsizes].size = strtoul(tok, NULL, 10);
+		sizes[nsizes].weight = colon ? strtoul(colon + 1, NULL, 10) : 1;
+		if (sizes[nsizes].size == 0 || sizes[nsizes].size > MAX_FRAME)
+			return -1;
+		total_weight += sizes[nsizes].weight;
+		nsizes ++;
+	}
+	return (nsizes > 0 && total_weight > 0) ? 0 : -1;
+}
+
+static uint32_t pick_size(void) {
+	uint32_t r = (uint32_t)(rng_next() % total_weight);
+	int i;
+
+	for (i = 0; i < nsizes - 1; i++) {
+		if (r < sizes[i].weight)
+			break;
+		r -= sizes[i].weight;
+	}
+	return sizes[i].size;
+}
+
+static void write_header(FILE *out, int format) {
+	if (format == OUT_PCAP) {
+		uint32_t hdr[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+		fwrite(hdr, sizeof(hdr), 1, out);
+	} else if (format == OUT_PCAPNG) {
+		/* Section header and a single Ethernet interface. Every
+		 * block carries an end of options marker, as libtrace's
+		 * reader expects at least one option */
+		uint32_t shb[8] = { 0x0A0D0D0A, 32, 0x1A2B3C4D, 0x00000001,
+				0xffffffff, 0xffffffff, 0, 32 };
+		uint32_t idb[6] = { 1, 24, 1, 65535, 0, 24 };
+		fwrite(shb, sizeof(shb), 1, out);
+		fwrite(idb, sizeof(idb), 1, out);
+	}
+}
+
+static void write_packet(FILE *out, int format, uint64_t usecs,
+		const uint8_t *buf, uint32_t len) {
+	static const uint8_t pad[8] = {0};
+
+	if (format == OUT_PCAP) {
+		uint32_t hdr[4] = { (uint32_t)(usecs / 1000000),
+				(uint32_t)(usecs % 1000000), len, len };
+		fwrite(hdr, sizeof(hdr), 1, out);
+		fwrite(buf, len, 1, out);
+	} else if (format == OUT_ERF) {
+		uint8_t hdr[18];
+		uint64_t ts = ((usecs / 1000000) << 32) +
+				(((usecs % 1000000) << 32) / 1000000);
+
+		memcpy(hdr, &ts, 8);	/* ERF timestamps are little endian */
+		hdr[8] = ERF_TYPE_ETH;
+		hdr[9] = ERF_FLAG_VLEN;
+		put16(hdr + 10, (uint16_t)(18 + len));
+		put16(hdr + 12, 0);
+		put16(hdr + 14, (uint16_t)(len + 4));	/* Includes the FCS */
+		hdr[16] = hdr[17] = 0;
+		fwrite(hdr, sizeof(hdr), 1, out);
+		fwrite(buf, len, 1, out);
+	} else {
+		uint32_t padded = (len + 3) & ~3U;
+		uint32_t blocklen = 36 + padded;
+		uint32_t epb[7] = { 6, blocklen, 0, (uint32_t)(usecs >> 32),
+				(uint32_t)usecs, len, len };
+		uint32_t trailer[2] = { 0, blocklen };
+
+		fwrite(epb, sizeof(epb), 1, out);
+		fwrite(buf, len, 1, out);
+		fwrite(pad, padded - len, 1, out);
+		fwrite(trailer, sizeof(trailer), 1, out);
+	}
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [options] outputfile\n"
+	"-F --format=pcapfile|erf|pcapng  Output format (default: pcapfile)\n"
+	"-n --packets=count         Number of packets (default: 1000000)\n"
+	"-f --flows=count           Number of distinct flows (default: 10000)\n"
+	"-s --sizes=size:weight,... Frame size mix (default: 64:40,576:20,1500:40)\n"
+	"-v --vlan=percent          Percentage of flows that are VLAN tagged\n"
+	"-m --mpls=percent          Percentage of flows with two MPLS labels\n"
+	"-x --tunnel=percent        Percentage of flows tunnelled in VXLAN\n"
+	"-6 --ipv6=percent          Percentage of flows using IPv6\n"
+	"-r --rate=pps              Packets per second of trace time (default: 1000000)\n"
+	"-S --seed=seed             Seed for flow contents and packet order\n",
+	argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static uint8_t buf[MAX_FRAME];
+	int format = OUT_PCAP;
+	uint64_t i, usecs = 1500000000ULL * 1000000;
+	struct flow f;
+	FILE *out;
+
+	while (1) {
+		int option_index;
+		struct option long_options[] = {
+			{ "format",	1, 0, 'F' },
+			{ "packets",	1, 0, 'n' },
+			{ "flows",	1, 0, 'f' },
+			{ "sizes",	1, 0, 's' },
+			{ "vlan",	1, 0, 'v' },
+			{ "mpls",	1, 0, 'm' },
+			{ "tunnel",	1, 0, 'x' },
+			{ "ipv6",	1, 0, '6' },
+			{ "rate",	1, 0, 'r' },
+			{ "seed",	1, 0, 'S' },
+			{ "help",	0, 0, 'h' },
+			{ NULL,		0, 0, 0 },
+		};
+		int c = getopt_long(argc, argv, "F:n:f:s:v:m:x:6:r:S:h",
+				long_options, &option_index);
+
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'F':
+				if (strcmp(optarg, "pcapfile") == 0 ||
+						strcmp(optarg, "pcap") == 0)
+					format = OUT_PCAP;
+				else if (strcmp(optarg, "erf") == 0)
+					format = OUT_ERF;
+				else if (strcmp(optarg, "pcapng") == 0)
+					format = OUT_PCAPNG;
+				else
+					usage(argv[0]);
+				break;
+			case 'n': packets = strtoull(optarg, NULL, 10); break;
+			case 'f': flows = strtoul(optarg, NULL, 10); break;
+			case 's':
+				if (parse_sizes(optarg) == -1)
+					usage(argv[0]);
+				break;
+			case 'v': vlan_pct = atoi(optarg); break;
+			case 'm': mpls_pct = atoi(optarg); break;
+			case 'x': tunnel_pct = atoi(optarg); break;
+			case '6': ipv6_pct = atoi(optarg); break;
+			case 'r': pps = strtoull(optarg, NULL, 10); break;
+			case 'S': seed = strtoull(optarg, NULL, 10); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || flows == 0 || pps == 0)
+		usage(argv[0]);
+
+	out = fopen(argv[optind], "wb");
+	if (!out) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	rng_state = splitmix64(seed) | 1;
+	write_header(out, format);
+	for (i = 0; i < packets; i++) {
+		uint32_t id = (uint32_t)(rng_next() % flows);
+		uint32_t len;
+
+		make_flow(id, &f);
+		len = build_packet(buf, id, &f, pick_size());
+		write_packet(out, format, usecs + i * 1000000 / pps, buf, len);
+	}
+
+	if (fclose(out) != 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	return 0;
+}
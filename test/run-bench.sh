@@ -0,0 +1,96 @@
+#!/bin/bash
+
+# Runs the benchmarks over freshly generated synthetic traces, writing one
+# key=value line per measurement to $BENCH_RESULTS (bench-results.txt by
+# default). The whole set is run BENCH_REPEAT times (default 3) and the best
+# rate for each measurement is kept, to ride out noise from the rest of the
+# machine. If BENCH_BASELINE names the results of an earlier run, every
+# rate is compared against it and the script fails if any has dropped by
+# more than BENCH_TOLERANCE percent (default 10), e.g.
+#
+#   make bench && cp bench-results.txt baseline.txt
+#   ... upgrade ...
+#   BENCH_BASELINE=baseline.txt make bench
+#
+# bench-ndag needs multicast on the loopback interface, so it is not run
+# here.
+
+libdir=../lib/.libs:../libpacketdump/.libs
+export LD_LIBRARY_PATH="$libdir:/usr/local/lib/"
+export DYLD_LIBRARY_PATH="${libdir}"
+
+PACKETS=${BENCH_PACKETS:-1000000}
+THREADS=${BENCH_THREADS:-1,2,4,8}
+RESULTS=${BENCH_RESULTS:-bench-results.txt}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+REPEAT=${BENCH_REPEAT:-3}
+GENOPTS="-n $PACKETS -f 10000 -s 64:40,576:20,1500:40 -v 10 -m 5 -x 5 -6 10"
+
+set -e
+set -o pipefail
+
+for format in pcapfile erf pcapng; do
+	echo \* Generating $format trace >&2
+	./gen-trace -F $format $GENOPTS traces/bench.$format
+done
+
+for run in $(seq $REPEAT); do
+	echo \* Run $run of $REPEAT >&2
+	./bench-micro pcapfile:traces/bench.pcapfile erf:traces/bench.erf \
+			pcapng:traces/bench.pcapng
+	./bench-combiner -t $THREADS
+	./bench-pipeline -t $THREADS pcapfile:traces/bench.pcapfile
+done | tee $RESULTS.all
+
+rm -f traces/bench.pcapfile traces/bench.erf traces/bench.pcapng
+
+# Measurements are identified by everything before ops=
+KEYFUNCS='
+function key(line) { return substr(line, 1, index(line, " ops=") - 1) }
+function rate(line) {
+	match(line, / rate=[0-9.]+/)
+	return substr(line, RSTART + 6, RLENGTH - 6) + 0
+}'
+
+awk "$KEYFUNCS"'
+/^bench=/ {
+	k = key($0)
+	if (!(k in best)) {
+		order[n++] = k
+		best[k] = $0
+	} else if (rate($0) > rate(best[k])) {
+		best[k] = $0
+	}
+}
+END { for (i = 0; i < n; i++) print best[order[i]] }' $RESULTS.all > $RESULTS
+rm -f $RESULTS.all
+
+if [ -z "$BENCH_BASELINE" ]; then
+	exit 0
+fi
+
+echo \* Comparing against $BENCH_BASELINE >&2
+awk -v tolerance=$TOLERANCE "$KEYFUNCS"'
+!/^bench=/ { next }
+NR == FNR { baseline[key($0)] = rate($0); next }
+{
+	k = key($0)
+	if (!(k in baseline) || baseline[k] == 0) {
+		printf("    new  %s\n", k)
+		next
+	}
+	change = (rate($0) - baseline[k]) * 100 / baseline[k]
+	if (change < -tolerance) {
+		printf("%+6.1f%% %s REGRESSION\n", change, k)
+		failed ++
+	} else {
+		printf("%+6.1f%% %s\n", change, k)
+	}
+}
+END {
+	if (failed) {
+		printf("%d measurements regressed by more than %s%%\n",
+				failed, tolerance)
+		exit 1
+	}
+}' $BENCH_BASELINE $RESULTS
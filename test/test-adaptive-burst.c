@@ -0,0 +1,119 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+	int delay = *(int *)global;
+
+	if (delay)
+		usleep(delay);
+	return packet;
+}
+
+static void run(size_t min, int delay) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_runtime_stats_t stats;
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+
+	trace_set_perpkt_threads(trace, 2);
+	trace_set_burst_size(trace, 32);
+	assert(trace_set_adaptive_burst(trace, min) == 0);
+	trace_pstart(trace, &delay, processing, NULL);
+	iferr(trace, TRACE);
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	assert(trace_get_runtime_stats(trace, NULL, &stats) == 0);
+	if (stats.packets != 100 || stats.bursts == 0) {
+		fprintf(stderr, "Expected 100 packets, got %" PRIu64 "\n",
+		        stats.packets);
+		exit(1);
+	}
+	if (stats.burst_size < 1 || stats.burst_size > 32) {
+		fprintf(stderr, "Burst size %" PRIu64 " is out of bounds\n",
+		        stats.burst_size);
+		exit(1);
+	}
+	if (!min) {
+		/* Fixed at the burst size */
+		assert(stats.burst_size == 32);
+		assert(stats.burst_size_total == stats.bursts * 32);
+	} else if (delay) {
+		/* Every burst takes too long, so never grows past one */
+		assert(stats.burst_size == 1);
+		assert(stats.burst_size_total == stats.bursts);
+	} else {
+		/* Reading from a file always fills the burst, so it grows */
+		if (stats.burst_size_total <= stats.bursts) {
+			fprintf(stderr, "Expected the burst to grow, %" PRIu64
+			        " bursts totalling %" PRIu64 "\n",
+			        stats.bursts, stats.burst_size_total);
+			exit(1);
+		}
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+}
+
+int main(void) {
+	run(0, 0);
+	run(1, 0);
+	run(1, 1000);
+
+	printf("success\n");
+	return 0;
+}
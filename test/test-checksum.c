@@ -0,0 +1,164 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef WIN32
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Makes the checksum match the current packet contents, so that we have a
+ * known-good starting point regardless of what was captured */
+static uint16_t *fix_checksum(libtrace_packet_t *packet, int transport) {
+	uint16_t csum;
+	uint16_t *ptr;
+
+	if (transport)
+		ptr = trace_checksum_transport(packet, &csum);
+	else
+		ptr = trace_checksum_layer3(packet, &csum);
+	if (ptr)
+		*ptr = htons(csum);
+	return ptr;
+}
+
+static int check_checksum(libtrace_packet_t *packet, int transport,
+		const char *what, int count) {
+	uint16_t csum;
+	uint16_t *ptr;
+
+	if (transport)
+		ptr = trace_checksum_transport(packet, &csum);
+	else
+		ptr = trace_checksum_layer3(packet, &csum);
+	if (ptr == NULL)
+		return 0;
+	if (ntohs(*ptr) != csum) {
+		fprintf(stderr, "Packet %d: %s checksum %04x, expected %04x\n",
+				count, what, ntohs(*ptr), csum);
+		return 1;
+	}
+	return 0;
+}
+
+/* Rewrites the addresses of every IPv4 packet in the trace, patching the
+ * checksums incrementally, and then confirms that a full recalculation
+ * agrees with the patched values.
+ */
+int main(int argc, char *argv[]) {
+	int psize = 0;
+	int error = 0;
+	int count = 0;
+	int transports = 0;
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+
+	(void)argc;
+	(void)argv;
+
+	trace = trace_create("pcapfile:traces/100_packets.pcap");
+	iferr(trace);
+
+	trace_start(trace);
+	iferr(trace);
+
+	packet=trace_create_packet();
+	for (;;) {
+		libtrace_ip_t *ip;
+		uint16_t *l3sum, *l4sum;
+		uint32_t oldsrc, olddst, newsrc, newdst;
+
+		if ((psize = trace_read_packet(trace, packet)) < 0) {
+			error = 1;
+			iferr(trace);
+			break;
+		}
+		if (psize == 0) {
+			break;
+		}
+		count ++;
+
+		ip = trace_get_ip(packet);
+		if (!ip)
+			continue;
+
+		l3sum = fix_checksum(packet, 0);
+		l4sum = fix_checksum(packet, 1);
+		if (!l3sum)
+			continue;
+
+		oldsrc = ip->ip_src.s_addr;
+		olddst = ip->ip_dst.s_addr;
+		newsrc = htonl(0x0a000000 | (count << 8) | 1);
+		newdst = htonl(0xc0a80000 | (count << 4) | 2);
+
+		ip->ip_src.s_addr = newsrc;
+		trace_checksum_update32(l3sum, oldsrc, newsrc);
+		trace_checksum_update_buffer(l3sum, &olddst, &newdst,
+				sizeof(newdst));
+		ip->ip_dst.s_addr = newdst;
+
+		if (l4sum && ip->ip_p != TRACE_IPPROTO_ICMP) {
+			trace_checksum_update32(l4sum, oldsrc, newsrc);
+			trace_checksum_update32(l4sum, olddst, newdst);
+			transports ++;
+		}
+
+		error |= check_checksum(packet, 0, "IP", count);
+		if (l4sum)
+			error |= check_checksum(packet, 1, "transport", count);
+	}
+	trace_destroy_packet(packet);
+
+	if (count != 100) {
+		fprintf(stderr, "Incorrect number of packets: %d\n", count);
+		error = 1;
+	}
+	if (transports == 0) {
+		fprintf(stderr, "No transport checksums were tested\n");
+		error = 1;
+	}
+	if (error == 0) {
+		printf("success\n");
+	} else {
+		iferr(trace);
+	}
+	trace_destroy(trace);
+	return error;
+}
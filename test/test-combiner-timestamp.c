@@ -0,0 +1,136 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+struct totals {
+	int results;
+	int disorder;
+	uint64_t last;
+};
+
+static libtrace_packet_t *per_packet(libtrace_t *trace,
+                libtrace_thread_t *t, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+	/* Hold one thread back, so its results arrive late */
+	if (trace_get_perpkt_thread_id(t) == 0)
+		usleep(5000);
+	else
+		usleep(100);
+	trace_publish_result(trace, t, trace_get_erf_timestamp(packet),
+	                     (libtrace_generic_t){.sint = 1}, RESULT_USER);
+	return packet;
+}
+
+static void report_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global, void *tls UNUSED, libtrace_result_t *res) {
+	struct totals *totals = (struct totals *)global;
+
+	if (res->key < totals->last)
+		totals->disorder++;
+	else
+		totals->last = res->key;
+	totals->results++;
+}
+
+static void run(uint64_t window) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_callback_set_t *reporter;
+	libtrace_runtime_stats_t stats;
+	struct totals totals = {0, 0, 0};
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	reporter = trace_create_callback_set();
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 4);
+	trace_set_burst_size(trace, 4);
+	/* Read results as they come, rather than all at the end */
+	trace_set_reporter_thold(trace, 1);
+	trace_set_combiner(trace, &combiner_timestamp,
+	                   (libtrace_generic_t){.uint64 = window});
+	trace_pstart(trace, &totals, processing, reporter);
+	iferr(trace, TRACE);
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	assert(trace_get_runtime_stats(trace, NULL, &stats) == 0);
+	if (totals.results != 100) {
+		fprintf(stderr, "Expected 100 results, got %d\n",
+		        totals.results);
+		exit(1);
+	}
+	/* Only results which missed the window may be out of order */
+	if ((uint64_t) totals.disorder != stats.combiner_late) {
+		fprintf(stderr, "%d results out of order but %" PRIu64
+		        " were late\n", totals.disorder, stats.combiner_late);
+		exit(1);
+	}
+	if (!window && totals.disorder) {
+		fprintf(stderr, "%d results out of order\n", totals.disorder);
+		exit(1);
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+}
+
+int main(void) {
+	/* The whole trace fits in the default window */
+	run(0);
+	/* Most of it falls outside a 1ms window */
+	run(1);
+
+	printf("success\n");
+	return 0;
+}
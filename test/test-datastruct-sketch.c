@@ -0,0 +1,91 @@
+#include "data-struct/sketch.h"
+#include <assert.h>
+#include <stdio.h>
+
+#define TEST_SIZE 200000
+#define HEAVY_KEYS 10
+
+/* Checks an estimate is within 'pct' percent of the true value */
+static int close_to(uint64_t estimate, uint64_t actual, double pct) {
+	double diff = (double)estimate - (double)actual;
+	if (diff < 0)
+		diff = -diff;
+	return diff <= actual * pct / 100.0;
+}
+
+/**
+ * Tests the HyperLogLog and Count-Min sketches, including that sketches
+ * filled separately and then merged give the same answer as one sketch
+ * that saw every key.
+ */
+int main() {
+	libtrace_hll_t all, halves[2];
+	libtrace_cms_t cms, cmshalves[2];
+	uint64_t i;
+
+	assert(libtrace_hll_init(&all, 3) == -1);
+	assert(libtrace_hll_init(&all, LIBTRACE_HLL_DEFAULT_PRECISION) == 0);
+	assert(libtrace_hll_init(&halves[0], LIBTRACE_HLL_DEFAULT_PRECISION) == 0);
+	assert(libtrace_hll_init(&halves[1], LIBTRACE_HLL_DEFAULT_PRECISION) == 0);
+	assert(libtrace_hll_estimate(&all) == 0);
+
+	/* Small counts should be almost exact */
+	for (i = 0; i < 100; i++)
+		libtrace_hll_add(&all, &i, sizeof(i));
+	assert(close_to(libtrace_hll_estimate(&all), 100, 2));
+	libtrace_hll_clear(&all);
+
+	/* Every key twice, split across the halves with some overlap */
+	for (i = 0; i < TEST_SIZE; i++) {
+		libtrace_hll_add(&all, &i, sizeof(i));
+		libtrace_hll_add(&all, &i, sizeof(i));
+		libtrace_hll_add(&halves[i % 2], &i, sizeof(i));
+		if (i % 3 == 0)
+			libtrace_hll_add(&halves[(i + 1) % 2], &i, sizeof(i));
+	}
+	assert(close_to(libtrace_hll_estimate(&all), TEST_SIZE, 5));
+	assert(libtrace_hll_merge(&halves[0], &halves[1]) == 0);
+	assert(libtrace_hll_estimate(&halves[0]) == libtrace_hll_estimate(&all));
+
+	libtrace_hll_destroy(&halves[1]);
+	assert(libtrace_hll_init(&halves[1], 10) == 0);
+	assert(libtrace_hll_merge(&halves[0], &halves[1]) == -1);
+
+	assert(libtrace_cms_init(&cms, 1000, 4) == -1);
+	assert(libtrace_cms_init(&cms, 1 << 12, 4) == 0);
+	assert(libtrace_cms_init(&cmshalves[0], 1 << 12, 4) == 0);
+	assert(libtrace_cms_init(&cmshalves[1], 1 << 12, 4) == 0);
+
+	/* A few heavy keys among many light ones */
+	for (i = 0; i < TEST_SIZE; i++) {
+		uint64_t key = i % 20 < HEAVY_KEYS ? i % 20 : i + 1000;
+		uint64_t est = libtrace_cms_add(&cms, &key, sizeof(key), 10);
+		assert(est >= 10);
+		libtrace_cms_add(&cmshalves[i % 2], &key, sizeof(key), 10);
+	}
+	assert(cms.total == (uint64_t)TEST_SIZE * 10);
+	for (i = 0; i < HEAVY_KEYS; i++) {
+		uint64_t est = libtrace_cms_estimate(&cms, &i, sizeof(i));
+		/* Never undercounts, and heavy keys are well above the noise */
+		assert(est >= TEST_SIZE / 2);
+		assert(close_to(est, TEST_SIZE / 2, 2));
+	}
+	assert(libtrace_cms_merge(&cmshalves[0], &cmshalves[1]) == 0);
+	assert(cmshalves[0].total == cms.total);
+	for (i = 0; i < TEST_SIZE; i += 997) {
+		assert(libtrace_cms_estimate(&cmshalves[0], &i, sizeof(i)) ==
+				libtrace_cms_estimate(&cms, &i, sizeof(i)));
+	}
+
+	libtrace_cms_destroy(&cmshalves[1]);
+	assert(libtrace_cms_init(&cmshalves[1], 1 << 10, 4) == 0);
+	assert(libtrace_cms_merge(&cmshalves[0], &cmshalves[1]) == -1);
+
+	libtrace_hll_destroy(&all);
+	libtrace_hll_destroy(&halves[0]);
+	libtrace_hll_destroy(&halves[1]);
+	libtrace_cms_destroy(&cms);
+	libtrace_cms_destroy(&cmshalves[0]);
+	libtrace_cms_destroy(&cmshalves[1]);
+	return 0;
+}
@@ -25,6 +25,10 @@ static void * consumer(void * a) {
 	return 0;
 }
 
+static int compare_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
 /**
  * Tests the vector data structure, first this establishes that single
  * threaded operations work correctly, then does a basic consumer producer
@@ -69,6 +73,16 @@ int main() {
 	assert(libtrace_vector_get_size(&vector2) == 0);
 	assert(libtrace_vector_remove_front(&vector));
 
+	// Sorting must cover every element, not just the first few
+	for (i = TEST_SIZE; i > 0; i--)
+		libtrace_vector_push_back(&vector, &i);
+	libtrace_vector_qsort(&vector, compare_int);
+	for (i = 0; i < TEST_SIZE; i++) {
+		assert(libtrace_vector_get(&vector, i, &value));
+		assert(value == i + 1);
+	}
+	libtrace_vector_empty(&vector);
+
 	// Test thread safety - We only really care about the single producer single
 	// consumer case
 	pthread_create(&t[0], NULL, &producer, (void *) &vector);
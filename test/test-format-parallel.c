@@ -69,6 +69,8 @@ const char *lookup_uri(const char *type) {
 		return "erf:traces/provenance.erf";
 	if (!strcmp(type,"rawerf"))
 		return "rawerf:traces/100_packets.erf";
+	if (!strcmp(type,"mem"))
+		return "mem:erf:traces/100_packets.erf";
 	if (!strcmp(type,"pcap"))
 		return "pcap:traces/100_packets.pcap";
 	if (!strcmp(type,"pcapng"))
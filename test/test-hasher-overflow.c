@@ -0,0 +1,124 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+	/* Slow enough that the small hasher queues fill up */
+	usleep(500);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls UNUSED) {
+	libtrace_stat_t *stat = trace_create_statistics();
+
+	/* Each thread can see the packets dropped on its behalf */
+	trace_get_thread_statistics(trace, t, stat);
+	assert(stat->accepted_valid);
+	assert(stat->hasher_dropped_valid);
+	free(stat);
+}
+
+static void run(enum hasher_overflow_policy policy, const char *config) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_stat_t *stat;
+	libtrace_runtime_stats_t rstats;
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_cb(processing, per_packet);
+
+	trace_set_perpkt_threads(trace, 2);
+	trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	trace_set_hasher_queue_size(trace, 2);
+	if (config)
+		trace_set_configuration(trace, config);
+	else
+		assert(trace_set_hasher_overflow(trace, policy) == 0);
+	trace_pstart(trace, NULL, processing, NULL);
+	iferr(trace, TRACE);
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	stat = trace_get_statistics(trace, NULL);
+	assert(stat->accepted_valid && stat->hasher_dropped_valid);
+	if (stat->accepted + stat->hasher_dropped != 100) {
+		fprintf(stderr, "Expected 100 packets, %" PRIu64 " accepted and %"
+		        PRIu64 " dropped\n", stat->accepted, stat->hasher_dropped);
+		exit(1);
+	}
+	if ((policy == HASHER_OVERFLOW_DROP) != (stat->hasher_dropped > 0)) {
+		fprintf(stderr, "Policy %d dropped %" PRIu64 " packets\n",
+		        (int) policy, stat->hasher_dropped);
+		exit(1);
+	}
+	assert(trace_get_runtime_stats(trace, NULL, &rstats) == 0);
+	if (policy != HASHER_OVERFLOW_SPILL && rstats.hasher_spilled != 0) {
+		fprintf(stderr, "Policy %d spilled packets\n", (int) policy);
+		exit(1);
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+}
+
+int main(void) {
+	run(HASHER_OVERFLOW_BLOCK, NULL);
+	run(HASHER_OVERFLOW_DROP, NULL);
+	run(HASHER_OVERFLOW_SPILL, NULL);
+	run(HASHER_OVERFLOW_DROP, "hasher_overflow=drop");
+
+	printf("success\n");
+	return 0;
+}
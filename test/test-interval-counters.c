@@ -0,0 +1,243 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+#include "data-struct/interval_counters.h"
+
+/* traces/100_seconds.pcap has one packet a second, starting just after
+ * t=1s, so packet n (counting from 1) arrives a little after t=n */
+#define TRACE_PACKETS 100
+#define INTERVAL_SECONDS 10
+#define THREADS 4
+
+static libtrace_interval_counters_t counters;
+
+struct report {
+	uint64_t next_interval;
+	uint64_t packets;
+	int idle_progress;
+};
+
+static void check_interval(struct report *r, uint64_t interval,
+		uint64_t *values) {
+	uint64_t expected;
+
+	/* Intervals must be reported in order with none skipped */
+	assert(interval == r->next_interval);
+	r->next_interval ++;
+
+	if (interval == 0)
+		expected = INTERVAL_SECONDS - 1;
+	else if (interval == TRACE_PACKETS / INTERVAL_SECONDS)
+		expected = 1;
+	else
+		expected = INTERVAL_SECONDS;
+	assert(values[0] == expected);
+	assert(values[1] > 0);
+	r->packets += values[0];
+}
+
+static void *report_start(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct report));
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls, libtrace_result_t *res) {
+	struct report *r = (struct report *)tls;
+	uint64_t interval;
+	uint64_t values[2];
+	libtrace_interval_bucket_t *bucket = res->value.ptr;
+
+	assert(res->type == RESULT_USER);
+	/* The idle threads can only move their watermarks on using ticks */
+	if (bucket->thread >= 2 && res->key > 0 && res->key != UINT64_MAX)
+		r->idle_progress = 1;
+
+	libtrace_interval_counters_merge(&counters, res);
+	while (libtrace_interval_counters_next(&counters, &interval, values,
+			0))
+		check_interval(r, interval, values);
+}
+
+static void report_end(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls) {
+	struct report *r = (struct report *)tls;
+	uint64_t interval;
+	uint64_t values[2];
+
+	/* Every thread has finished, so nothing can be left over */
+	assert(!libtrace_interval_counters_next(&counters, &interval, values, 1));
+	assert(r->packets == TRACE_PACKETS);
+	assert(r->next_interval == TRACE_PACKETS / INTERVAL_SECONDS + 1);
+	assert(r->idle_progress);
+	free(r);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	uint64_t *values = libtrace_interval_counters_get(&counters, trace, t,
+			trace_get_erf_timestamp(packet));
+
+	values[0] ++;
+	values[1] += trace_get_wire_length(packet);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED) {
+	libtrace_interval_counters_finish(&counters, trace, t);
+}
+
+static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED, uint64_t order) {
+	/* Every packet after this tick arrives after t=order seconds */
+	libtrace_interval_counters_tick(&counters, trace, t, order << 32);
+}
+
+/* Packets 31-60 go to thread 1 and the rest to thread 0, so that thread 1
+ * sits idle at either end of the trace. Threads 2 and 3 never see a
+ * packet. */
+static uint64_t custom_hash(const libtrace_packet_t *packet UNUSED,
+		void *data) {
+	int *count = (int *)data;
+
+	*count += 1;
+	return (*count > 30 && *count <= 60) ? 1 : 0;
+}
+
+static void merge_bucket(libtrace_interval_counters_t *ic, int thread,
+		uint64_t interval, uint64_t *values, uint64_t watermark) {
+	libtrace_interval_bucket_t bucket = {interval, thread, values};
+	libtrace_result_t res;
+
+	res.key = watermark;
+	res.value.ptr = &bucket;
+	res.type = RESULT_USER;
+	libtrace_interval_counters_merge(ic, &res);
+}
+
+/* Drives the reporter side by hand, checking that intervals are only
+ * handed out once both threads have moved past them */
+static void test_merge(void) {
+	libtrace_interval_counters_t ic;
+	uint64_t a[2] = {3, 300}, b[2] = {4, 400}, c[2] = {5, 500};
+	uint64_t values[2], interval;
+
+	assert(libtrace_interval_counters_init(&ic, 1ULL << 32, 2, 2, 4) == 0);
+
+	merge_bucket(&ic, 0, 5, a, 7);
+	/* Thread 1 hasn't said anything yet */
+	assert(!libtrace_interval_counters_next(&ic, &interval, values, 0));
+
+	/* Thread 1 may still count in interval 4, which comes first */
+	merge_bucket(&ic, 1, 4, b, 6);
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 0));
+	assert(interval == 4 && values[0] == 4 && values[1] == 400);
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 0));
+	assert(interval == 5 && values[0] == 3 && values[1] == 300);
+	assert(!libtrace_interval_counters_next(&ic, &interval, values, 0));
+
+	/* A progress only result, then a gap before interval 9 */
+	merge_bucket(&ic, 1, 0, NULL, 8);
+	merge_bucket(&ic, 0, 9, c, 10);
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 0));
+	assert(interval == 6 && values[0] == 0 && values[1] == 0);
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 0));
+	assert(interval == 7 && values[0] == 0);
+	assert(!libtrace_interval_counters_next(&ic, &interval, values, 0));
+
+	/* Flushing ignores the watermarks */
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 1));
+	assert(interval == 8 && values[0] == 0);
+	assert(libtrace_interval_counters_next(&ic, &interval, values, 1));
+	assert(interval == 9 && values[0] == 5 && values[1] == 500);
+	assert(!libtrace_interval_counters_next(&ic, &interval, values, 1));
+
+	/* Each merged bucket was handed back to its thread */
+	assert(ic.threads[0].tail == 2 && ic.threads[1].tail == 1);
+	libtrace_interval_counters_destroy(&ic);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	const char *tracename = "pcapfile:traces/100_seconds.pcap";
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing, *reporter;
+	int hashercount = 0;
+
+	test_merge();
+
+	assert(libtrace_interval_counters_init(&counters, 0, 2, THREADS, 4) == -1);
+	/* Allow for more threads than the trace starts, as happens when a
+	 * format lowers the thread count. The missing threads must not hold
+	 * up the reporter. */
+	assert(libtrace_interval_counters_init(&counters,
+			(uint64_t)INTERVAL_SECONDS << 32, 2, THREADS + 2, 4) == 0);
+
+	trace = trace_create(tracename);
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "%s", tracename);
+		return 1;
+	}
+
+	processing = trace_create_callback_set();
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_tick_count_cb(processing, process_tick);
+
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(reporter, report_start);
+	trace_set_stopping_cb(reporter, report_end);
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_combiner(trace, &combiner_unordered, (libtrace_generic_t){0});
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_hasher(trace, HASHER_CUSTOM, &custom_hash, &hashercount);
+	trace_set_tick_count(trace, 5);
+
+	if (trace_pstart(trace, NULL, processing, reporter) == -1) {
+		trace_perror(trace, "%s", tracename);
+		return 1;
+	}
+	trace_join(trace);
+
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "%s", tracename);
+		return 1;
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+	libtrace_interval_counters_destroy(&counters);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+
+#define SOURCE "erf:traces/100_packets.erf"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Replays a trace from memory several times and checks that every pass
+ * matches the original packets, with timestamps that keep increasing. */
+int main(int argc, char *argv[]) {
+	libtrace_packet_t *source[100];
+	libtrace_packet_t *packet, *copy = NULL;
+	libtrace_t *trace, *input;
+	uint64_t last_ts = 0, period = 0;
+	int count = 0, nsource = 0;
+	int error = 0;
+	int psize;
+
+	(void)argc;
+	(void)argv;
+
+	/* Keep the original packets to compare against */
+	input = trace_create(SOURCE);
+	iferr(input);
+	trace_start(input);
+	iferr(input);
+	packet = trace_create_packet();
+	while (nsource < 100 && trace_read_packet(input, packet) > 0)
+		source[nsource++] = trace_copy_packet(packet);
+	iferr(input);
+	trace_destroy_packet(packet);
+
+	trace = trace_create("mem:loops=3," SOURCE);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	packet = trace_create_packet();
+
+	while ((psize = trace_read_packet(trace, packet)) > 0) {
+		libtrace_packet_t *orig = source[count % nsource];
+		uint64_t ts = trace_get_erf_timestamp(packet);
+		int pass = count / nsource;
+
+		if (trace_get_capture_length(packet) !=
+				trace_get_capture_length(orig) ||
+				trace_get_wire_length(packet) !=
+				trace_get_wire_length(orig) ||
+				trace_get_link_type(packet) !=
+				trace_get_link_type(orig) ||
+				memcmp(trace_get_packet_buffer(packet, NULL, NULL),
+					trace_get_packet_buffer(orig, NULL, NULL),
+					trace_get_capture_length(orig)) != 0) {
+			fprintf(stderr, "Packet %d differs from the original\n",
+					count);
+			error = 1;
+		}
+
+		if (pass == 0 && ts != trace_get_erf_timestamp(orig)) {
+			fprintf(stderr, "Packet %d has the wrong timestamp\n",
+					count);
+			error = 1;
+		}
+		if (pass == 1 && count % nsource == 0)
+			period = ts - trace_get_erf_timestamp(orig);
+		if (pass > 0 && ts != trace_get_erf_timestamp(orig) +
+				pass * period) {
+			fprintf(stderr, "Packet %d was not shifted by a whole "
+					"period\n", count);
+			error = 1;
+		}
+		if (ts < last_ts) {
+			fprintf(stderr, "Packet %d went back in time\n", count);
+			error = 1;
+		}
+		last_ts = ts;
+
+		/* Snapping a packet must not affect later passes */
+		if (count == 0) {
+			trace_set_capture_length(packet, 20);
+			copy = trace_copy_packet(packet);
+		}
+		count ++;
+	}
+	iferr(trace);
+
+	if (count != nsource * 3) {
+		fprintf(stderr, "Incorrect number of packets: %d\n", count);
+		error = 1;
+	}
+	if (period == 0) {
+		fprintf(stderr, "Timestamps were not shifted between passes\n");
+		error = 1;
+	}
+	if (copy == NULL || trace_get_capture_length(copy) != 20 ||
+			trace_get_erf_timestamp(copy) !=
+			trace_get_erf_timestamp(source[0])) {
+		fprintf(stderr, "Copied packet is incorrect\n");
+		error = 1;
+	}
+
+	trace_destroy_packet(copy);
+	trace_destroy(trace);
+	trace_destroy_packet(packet);
+	while (nsource > 0)
+		trace_destroy_packet(source[--nsource]);
+	trace_destroy(input);
+
+	if (error == 0) {
+		printf("success\n");
+	}
+	return error;
+}
@@ -0,0 +1,189 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "libtrace.h"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Writes a copy of a trace with the last few bytes cut off, so that reading
+ * its final record fails */
+static void write_truncated(const char *src, const char *dst) {
+	char buf[65536];
+	size_t len;
+	FILE *in, *out;
+
+	in = fopen(src, "rb");
+	out = fopen(dst, "wb");
+	if (!in || !out) {
+		perror("write_truncated");
+		exit(1);
+	}
+	len = fread(buf, 1, sizeof(buf), in);
+	fwrite(buf, 1, len - 10, out);
+	fclose(in);
+	fclose(out);
+}
+
+/* Checks that a failed input is dropped without ending the merge, and that
+ * the error is still reported once the other inputs are exhausted */
+static int test_failed_input(void) {
+	const char *path = "traces/merge_truncated.erf";
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	libtrace_err_t err;
+	int count = 0;
+	int psize;
+	int error = 0;
+
+	write_truncated("traces/5_packets.erf", path);
+
+	trace = trace_create("merge:erf:traces/merge_truncated.erf,"
+			"erf:traces/100_packets.erf");
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while ((psize = trace_read_packet(trace, packet)) > 0)
+		count ++;
+
+	err = trace_get_err(trace);
+	if (psize != -1 || err.err_num == 0 ||
+			strstr(err.problem, "merge_truncated") == NULL) {
+		fprintf(stderr, "Failed input was not reported: %d %s\n",
+				psize, err.problem);
+		error = 1;
+	}
+	if (count != 104) {
+		fprintf(stderr, "Expected 104 packets despite the failed "
+				"input, got %d\n", count);
+		error = 1;
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	unlink(path);
+	return error;
+}
+
+/* Merges three inputs and checks that every packet comes out exactly once,
+ * in timestamp order, and attributed to the right input. The last input's
+ * URI contains an escaped comma. */
+int main(int argc, char *argv[]) {
+	int psize = 0;
+	int error = 0;
+	int count = 0;
+	int per_input[3] = {0, 0, 0};
+	uint64_t last_ts = 0;
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+
+	(void)argc;
+	(void)argv;
+
+	trace = trace_create("merge:erf:traces/100_packets.erf,"
+			"pcapfile:traces/100_packets.pcap,"
+			"mem:loops=1\\,erf:traces/5_packets.erf");
+	iferr(trace);
+
+	trace_start(trace);
+	iferr(trace);
+
+	packet=trace_create_packet();
+	for (;;) {
+		uint64_t ts;
+		int input;
+		libtrace_linktype_t linktype;
+		uint32_t remaining;
+
+		if ((psize = trace_read_packet(trace, packet)) < 0) {
+			error = 1;
+			iferr(trace);
+			break;
+		}
+		if (psize == 0) {
+			break;
+		}
+
+		ts = trace_get_erf_timestamp(packet);
+		if (ts < last_ts) {
+			fprintf(stderr, "Packet %d is out of order\n", count);
+			error = 1;
+		}
+		last_ts = ts;
+
+		input = trace_get_merge_input(trace, packet);
+		if (input < 0 || input > 2) {
+			fprintf(stderr, "Packet %d has bad input %d\n", count,
+					input);
+			error = 1;
+		} else {
+			per_input[input] ++;
+		}
+
+		/* Make sure the packet can still be decoded normally */
+		if (trace_get_capture_length(packet) == 0 ||
+				trace_get_layer2(packet, &linktype,
+					&remaining) == NULL) {
+			fprintf(stderr, "Packet %d could not be decoded\n",
+					count);
+			error = 1;
+		}
+		count ++;
+	}
+
+	if (count != 205 || per_input[0] != 100 || per_input[1] != 100 ||
+			per_input[2] != 5) {
+		fprintf(stderr, "Incorrect number of packets: %d (%d/%d/%d)\n",
+				count, per_input[0], per_input[1],
+				per_input[2]);
+		error = 1;
+	}
+
+	/* The packet is deliberately destroyed after the trace */
+	trace_destroy(trace);
+	trace_destroy_packet(packet);
+
+	if (test_failed_input())
+		error = 1;
+
+	if (error == 0) {
+		printf("success\n");
+	}
+	return error;
+}
@@ -0,0 +1,187 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+struct counts {
+	int started;
+	int stopped;
+	int processed;
+};
+
+struct totals {
+	int packets;
+	int stops;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global) {
+	struct counts *counts = (struct counts *)global;
+
+	__sync_fetch_and_add(&counts->started, 1);
+	return NULL;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+                void *global, void *tls UNUSED, libtrace_packet_t *packet) {
+	struct counts *counts = (struct counts *)global;
+
+	usleep(1000);
+	__sync_fetch_and_add(&counts->processed, 1);
+	trace_publish_result(trace, t, trace_packet_get_order(packet),
+	                     (libtrace_generic_t){.sint = 1}, RESULT_USER);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+                void *global, void *tls UNUSED) {
+	struct counts *counts = (struct counts *)global;
+
+	__sync_fetch_and_add(&counts->stopped, 1);
+	/* Published after the trace is paused, these must not be lost */
+	trace_publish_result(trace, t, 0, (libtrace_generic_t){.sint = 0},
+	                     RESULT_USER);
+}
+
+static void *report_start(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct totals));
+}
+
+static void report_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls, libtrace_result_t *res) {
+	struct totals *totals = (struct totals *)tls;
+
+	if (res->value.sint)
+		totals->packets++;
+	else
+		totals->stops++;
+}
+
+static void report_end(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls) {
+	struct totals *totals = (struct totals *)tls;
+
+	if (totals->packets != 100 || totals->stops != 7) {
+		fprintf(stderr, "Expected 100 packets and 7 stops, reported %d "
+		        "and %d\n", totals->packets, totals->stops);
+		exit(1);
+	}
+	free(totals);
+}
+
+/* Waits until at least count packets have been processed */
+static void wait_for(struct counts *counts, int count) {
+	while (__sync_fetch_and_add(&counts->processed, 0) < count)
+		usleep(1000);
+}
+
+static void resize(libtrace_t *trace, int threads) {
+	assert(trace_ppause(trace) == 0);
+	assert(trace_set_perpkt_threads(trace, threads) == 0);
+	assert(trace_pstart(trace, NULL, NULL, NULL) == 0);
+	iferr(trace, TRACE);
+	assert(trace_get_perpkt_threads(trace) == threads);
+}
+
+static void run(bool hasher) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_callback_set_t *reporter;
+	struct counts counts = {0, 0, 0};
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_cb(processing, per_packet);
+
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(reporter, report_start);
+	trace_set_result_cb(reporter, report_cb);
+	trace_set_stopping_cb(reporter, report_end);
+
+	trace_set_perpkt_threads(trace, 2);
+	if (hasher) {
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+		/* Otherwise the hasher reads the whole trace before we pause */
+		trace_set_hasher_queue_size(trace, 4);
+	}
+	trace_pstart(trace, &counts, processing, reporter);
+	iferr(trace, TRACE);
+
+	/* Grow, then shrink to a single thread part way through */
+	wait_for(&counts, 10);
+	resize(trace, 4);
+	wait_for(&counts, 40);
+	resize(trace, 1);
+
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	if (counts.processed != 100 || counts.started != 7 ||
+	    counts.stopped != 7) {
+		fprintf(stderr, "Expected 100 packets over 7 threads, got %d "
+		        "packets, %d started and %d stopped\n", counts.processed,
+		        counts.started, counts.stopped);
+		exit(1);
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+}
+
+int main(void) {
+	run(false);
+	run(true);
+
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+struct totals {
+	int results;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	int *count = calloc(1, sizeof(int));
+	return count;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+	int *count = (int *)tls;
+
+	(*count)++;
+	usleep(200);
+	trace_publish_result(trace, t, trace_packet_get_order(packet),
+	                     (libtrace_generic_t){.sint = 1}, RESULT_USER);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls) {
+	int *count = (int *)tls;
+	libtrace_runtime_stats_t stats;
+
+	/* Each thread's own counters match what it was given */
+	assert(trace_get_runtime_stats(trace, t, &stats) == 0);
+	assert(stats.packets == (uint64_t) *count);
+	assert(stats.results == (uint64_t) *count);
+	free(count);
+}
+
+static void *report_start(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global) {
+	return global;
+}
+
+static void report_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls, libtrace_result_t *res) {
+	struct totals *totals = (struct totals *)tls;
+
+	totals->results += res->value.sint;
+}
+
+static void check_hist(const libtrace_latency_hist_t *hist, const char *name) {
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < LIBTRACE_LATENCY_BUCKETS; i++)
+		sum += hist->buckets[i];
+	if (hist->count == 0 || sum != hist->count) {
+		fprintf(stderr, "%s: bad sample count %" PRIu64 "\n", name,
+		        hist->count);
+		exit(1);
+	}
+	if (trace_latency_hist_percentile(hist, 50) >
+	    trace_latency_hist_percentile(hist, 99) ||
+	    trace_latency_hist_percentile(hist, 99) > hist->max_ns) {
+		fprintf(stderr, "%s: bad percentiles\n", name);
+		exit(1);
+	}
+}
+
+static void run(int threads, bool hasher) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_callback_set_t *reporter;
+	libtrace_runtime_stats_t stats;
+	struct totals totals = {0};
+	FILE *out;
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_cb(processing, per_packet);
+
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(reporter, report_start);
+	trace_set_result_cb(reporter, report_cb);
+
+	/* Not started yet */
+	assert(trace_get_runtime_stats(trace, NULL, &stats) == -1);
+
+	trace_set_perpkt_threads(trace, threads);
+	if (hasher)
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	trace_set_configuration(trace, "runtime_stats_interval=20");
+	/* Also profile the threads, whether or not the counters can be opened
+	 * here the time breakdown is always printed */
+	trace_set_perf_counters(trace, true);
+	trace_pstart(trace, &totals, processing, reporter);
+	iferr(trace, TRACE);
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	assert(trace_get_runtime_stats(trace, NULL, &stats) == 0);
+	if (stats.packets != 100 || stats.results != 100 ||
+	    totals.results != 100) {
+		fprintf(stderr, "Expected 100 packets and results, got %" PRIu64
+		        " packets, %" PRIu64 " results and %d reported\n",
+		        stats.packets, stats.results, totals.results);
+		exit(1);
+	}
+	if (stats.combiner_backlog != 0) {
+		fprintf(stderr, "Results were left in the combiner\n");
+		exit(1);
+	}
+	check_hist(&stats.read_to_dispatch, "read_to_dispatch");
+	check_hist(&stats.dispatch_to_publish, "dispatch_to_publish");
+	check_hist(&stats.publish_to_reporter, "publish_to_reporter");
+	if (hasher && stats.bursts == 0) {
+		fprintf(stderr, "No bursts were read from the hasher\n");
+		exit(1);
+	}
+
+	out = fopen("/dev/null", "w");
+	assert(trace_print_runtime_stats(&stats, out) == 0);
+	fclose(out);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+}
+
+int main(void) {
+	libtrace_latency_hist_t hist;
+
+	/* 1, 2-3 and 1000 fall into buckets 0, 1 and 9 */
+	memset(&hist, 0, sizeof(hist));
+	hist.count = 4;
+	hist.max_ns = 1000;
+	hist.buckets[0] = 1;
+	hist.buckets[1] = 2;
+	hist.buckets[9] = 1;
+	assert(trace_latency_hist_percentile(&hist, 25) == 1);
+	assert(trace_latency_hist_percentile(&hist, 50) == 3);
+	assert(trace_latency_hist_percentile(&hist, 100) == 1000);
+
+	run(1, false);
+	run(2, true);
+
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2017 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef WIN32
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+#include "hash_toeplitz.h"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Every IPv4 packet in vxlan.pcap belongs to the same inner ICMP flow, but
+ * the two directions are carried between different outer UDP ports. The
+ * tunnel hasher should place both directions together, hashing only the
+ * outer headers should not.
+ */
+int main(int argc, char *argv[]) {
+	int psize = 0;
+	int error = 0;
+	int ip_count = 0;
+	uint64_t inner_hash = 0;
+	int outer_differs = 0;
+	uint64_t first_outer = 0;
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	toeplitz_tunnel_conf_t tunnel, outer;
+
+	(void)argc;
+	(void)argv;
+
+	toeplitz_init_tunnel_config(&tunnel, true, TOEPLITZ_TUNNEL_ALL,
+			TOEPLITZ_TUNNEL_DEFAULT_DEPTH);
+	/* Same key, but never looks into the tunnel */
+	memcpy(&outer, &tunnel, sizeof(outer));
+	outer.max_depth = 0;
+
+	trace = trace_create("pcapfile:traces/vxlan.pcap");
+	iferr(trace);
+
+	trace_start(trace);
+	iferr(trace);
+
+	packet=trace_create_packet();
+	for (;;) {
+		uint8_t proto;
+		uint32_t remaining;
+		void *transport;
+		libtrace_vxlan_t *vxlan;
+		libtrace_ether_t *inner;
+		uint64_t hash, outer_hash;
+
+		if ((psize = trace_read_packet(trace, packet)) < 0) {
+			error = 1;
+			iferr(trace);
+			break;
+		}
+		if (psize == 0) {
+			break;
+		}
+
+		hash = toeplitz_hash_tunnel_packet(packet, &tunnel);
+		outer_hash = toeplitz_hash_tunnel_packet(packet, &outer);
+
+		/* Without any tunnels we must match the plain hasher */
+		if (outer_hash != toeplitz_hash_packet(packet,
+					&outer.toeplitz)) {
+			fprintf(stderr, "max_depth 0 does not match "
+					"toeplitz_hash_packet\n");
+			error = 1;
+		}
+
+		transport = trace_get_transport(packet, &proto, &remaining);
+		if (!transport || proto != TRACE_IPPROTO_UDP)
+			continue;
+		vxlan = trace_get_vxlan_from_udp(transport, &remaining);
+		if (!vxlan)
+			continue;
+		inner = trace_get_payload_from_vxlan(vxlan, &remaining);
+		if (!inner || ntohs(inner->ether_type) != TRACE_ETHERTYPE_IP)
+			continue;
+
+		if (ip_count == 0) {
+			inner_hash = hash;
+			first_outer = outer_hash;
+		} else {
+			if (hash != inner_hash) {
+				fprintf(stderr, "Inner flow hashed to %"PRIu64
+					" instead of %"PRIu64"\n", hash,
+					inner_hash);
+				error = 1;
+			}
+			if (outer_hash != first_outer)
+				outer_differs = 1;
+		}
+		ip_count++;
+	}
+	trace_destroy_packet(packet);
+
+	if (ip_count != 8) {
+		fprintf(stderr, "Incorrect number of inner ip packets\n");
+		error = 1;
+	}
+	if (!outer_differs) {
+		fprintf(stderr, "Outer headers unexpectedly hashed the same\n");
+		error = 1;
+	}
+	if (error == 0) {
+		printf("success\n");
+	} else {
+		iferr(trace);
+	}
+	trace_destroy(trace);
+	return error;
+}
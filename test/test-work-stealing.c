@@ -0,0 +1,117 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define TRACE "erf:traces/100_packets.erf"
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace,
+                libtrace_thread_t *t, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+	/* One thread is much slower than the rest, so the others should
+	 * finish early and steal what it has left */
+	if (trace_get_perpkt_thread_id(t) == 0)
+		usleep(2000);
+	else
+		usleep(100);
+	trace_publish_result(trace, t, trace_packet_get_order(packet),
+	                     (libtrace_generic_t){.sint = 1}, RESULT_USER);
+	return packet;
+}
+
+static void report_cb(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global, void *tls UNUSED, libtrace_result_t *res) {
+	*(int *)global += res->value.sint;
+}
+
+static void run(bool stealing) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_callback_set_t *reporter;
+	libtrace_runtime_stats_t stats;
+	int results = 0;
+
+	trace = trace_create(TRACE);
+	iferr(trace, TRACE);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	reporter = trace_create_callback_set();
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 3);
+	if (stealing)
+		assert(trace_set_work_stealing(trace, true) == 0);
+	trace_pstart(trace, &results, processing, reporter);
+	iferr(trace, TRACE);
+	trace_join(trace);
+	iferr(trace, TRACE);
+
+	/* Every packet is processed exactly once */
+	assert(trace_get_runtime_stats(trace, NULL, &stats) == 0);
+	if (results != 100 || stats.packets != 100) {
+		fprintf(stderr, "Expected 100 packets, got %" PRIu64
+		        " and %d results\n", stats.packets, results);
+		exit(1);
+	}
+	if (stealing != (stats.stolen > 0)) {
+		fprintf(stderr, "Work stealing %s but %" PRIu64
+		        " packets were stolen\n", stealing ? "on" : "off",
+		        stats.stolen);
+		exit(1);
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+}
+
+int main(void) {
+	run(false);
+	run(true);
+
+	printf("success\n");
+	return 0;
+}
@@ -98,8 +98,140 @@ void PrefixSub::anonIPv6(uint8_t *orig, uint8_t *result) {
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
 
-CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits) :
-        Anonymiser() {
+#define CACHE_FLAT_MAX_BITS 24
+#define CACHE_TABLE_SIZE (1 << 20)
+#define CACHE_MAX_PROBES 32
+
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_WRITING,
+    SLOT_READY
+};
+
+static inline uint64_t hashPrefix(uint64_t prefix) {
+    prefix ^= prefix >> 33;
+    prefix *= 0xff51afd7ed558ccdULL;
+    prefix ^= prefix >> 33;
+    return prefix;
+}
+
+static bool tableLookup(AnonCacheSlot *table, uint64_t prefix,
+        uint64_t *mask) {
+
+    uint64_t home = hashPrefix(prefix);
+
+    for (int i = 0; i < CACHE_MAX_PROBES; i++) {
+        AnonCacheSlot *slot = &table[(home + i) & (CACHE_TABLE_SIZE - 1)];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_EMPTY)
+            return false;
+        /* Slots that are still being written are skipped over */
+        if (state == SLOT_READY && slot->prefix == prefix) {
+            *mask = slot->mask;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tableInsert(AnonCacheSlot *table, uint64_t prefix,
+        uint64_t mask) {
+
+    uint64_t home = hashPrefix(prefix);
+
+    for (int i = 0; i < CACHE_MAX_PROBES; i++) {
+        AnonCacheSlot *slot = &table[(home + i) & (CACHE_TABLE_SIZE - 1)];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_EMPTY) {
+            /* Claim the slot, then publish it once it is filled in */
+            if (__atomic_compare_exchange_n(&slot->state, &state,
+                    SLOT_WRITING, false, __ATOMIC_ACQUIRE,
+                    __ATOMIC_ACQUIRE)) {
+                slot->prefix = prefix;
+                slot->mask = mask;
+                __atomic_store_n(&slot->state, SLOT_READY,
+                        __ATOMIC_RELEASE);
+                return;
+            }
+        }
+        /* Another thread got there first */
+        if (state == SLOT_READY && slot->prefix == prefix)
+            return;
+    }
+    /* Too crowded around here, so this prefix won't be cached */
+}
+
+CryptoAnonCache::CryptoAnonCache(uint8_t cachebits) {
+
+    this->cachebits = cachebits;
+    this->ipv4_flat = NULL;
+    this->ipv4_table = NULL;
+
+    /* Masks only cover the top cachebits bits, so the lowest bit of a
+     * flat entry is free to mark it as valid. calloc leaves the pages
+     * untouched until they are needed */
+    if (cachebits <= CACHE_FLAT_MAX_BITS)
+        this->ipv4_flat = (uint32_t *)calloc((size_t)1 << cachebits,
+                sizeof(uint32_t));
+    else
+        this->ipv4_table = (AnonCacheSlot *)calloc(CACHE_TABLE_SIZE,
+                sizeof(AnonCacheSlot));
+    this->ipv6_table = (AnonCacheSlot *)calloc(CACHE_TABLE_SIZE,
+            sizeof(AnonCacheSlot));
+}
+
+CryptoAnonCache::~CryptoAnonCache() {
+    free(this->ipv4_flat);
+    free(this->ipv4_table);
+    free(this->ipv6_table);
+}
+
+bool CryptoAnonCache::lookupv4(uint32_t prefix, uint32_t *mask) {
+
+    if (this->ipv4_flat) {
+        uint32_t idx = this->cachebits ? prefix >> (32 - this->cachebits) : 0;
+        uint32_t entry = __atomic_load_n(&this->ipv4_flat[idx],
+                __ATOMIC_RELAXED);
+
+        if (entry == 0)
+            return false;
+        *mask = entry & ~1U;
+        return true;
+    } else {
+        uint64_t res;
+
+        if (!tableLookup(this->ipv4_table, prefix, &res))
+            return false;
+        *mask = (uint32_t)res;
+        return true;
+    }
+}
+
+void CryptoAnonCache::insertv4(uint32_t prefix, uint32_t mask) {
+
+    if (this->ipv4_flat) {
+        uint32_t idx = this->cachebits ? prefix >> (32 - this->cachebits) : 0;
+
+        /* Every thread computes the same mask, so racing stores are
+         * harmless */
+        __atomic_store_n(&this->ipv4_flat[idx], mask | 1, __ATOMIC_RELAXED);
+    } else {
+        tableInsert(this->ipv4_table, prefix, mask);
+    }
+}
+
+bool CryptoAnonCache::lookupv6(uint64_t prefix, uint64_t *mask) {
+    return tableLookup(this->ipv6_table, prefix, mask);
+}
+
+void CryptoAnonCache::insertv6(uint64_t prefix, uint64_t mask) {
+    tableInsert(this->ipv6_table, prefix, mask);
+}
+
+CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits,
+        CryptoAnonCache *cache) : Anonymiser() {
 
     assert(len >= 32);
     memcpy(this->key, key, 16);
@@ -110,11 +242,18 @@ CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits) :
     EVP_CIPHER_CTX_init(this->ctx);
 
     EVP_EncryptInit_ex(this->ctx, this->cipher, NULL, this->key, NULL);
+    /* We only ever encrypt whole blocks, several at a time */
+    EVP_CIPHER_CTX_set_padding(this->ctx, 0);
 
     this->cachebits = cachebits;
 
-    this->ipv4_cache = new IPv4AnonCache();
-    this->ipv6_cache = new IPv6AnonCache();
+    if (cache) {
+        this->cache = cache;
+        this->owncache = false;
+    } else {
+        this->cache = new CryptoAnonCache(cachebits);
+        this->owncache = true;
+    }
     this->recent_ipv4_cache[0][0] = 0;
     this->recent_ipv4_cache[0][1] = 0;
     this->recent_ipv4_cache[1][0] = 0;
@@ -124,7 +263,8 @@ CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits) :
 
 
 CryptoAnon::~CryptoAnon() {
-    delete(this->ipv4_cache);
+    if (this->owncache)
+        delete(this->cache);
     EVP_CIPHER_CTX_cleanup(this->ctx);
     EVP_CIPHER_CTX_free(this->ctx);
 }
@@ -202,39 +342,50 @@ void CryptoAnon::anonIPv6(uint8_t *orig, uint8_t *result) {
 
 uint32_t CryptoAnon::lookupv4Cache(uint32_t prefix) {
 
-    IPv4AnonCache::iterator it = this->ipv4_cache->find(prefix);
+    uint32_t prefmask;
 
-    if (it == this->ipv4_cache->end()) {
-        uint32_t prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
-        (*this->ipv4_cache)[prefix] = prefmask;
+    if (this->cache->lookupv4(prefix, &prefmask))
         return prefmask;
-    }
-    return it->second;
+    prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
+    this->cache->insertv4(prefix, prefmask);
+    return prefmask;
 
 }
 
 uint64_t CryptoAnon::lookupv6Cache(uint64_t prefix) {
-    IPv6AnonCache::iterator it = this->ipv6_cache->find(prefix);
 
-    if (it == this->ipv6_cache->end()) {
-        uint64_t prefmask = this->encrypt64Bits(prefix);
-        (*this->ipv6_cache)[prefix] = prefmask;
+    uint64_t prefmask;
+
+    if (this->cache->lookupv6(prefix, &prefmask))
         return prefmask;
-    }
-    return it->second;
+    prefmask = this->encrypt64Bits(prefix);
+    this->cache->insertv6(prefix, prefmask);
+    return prefmask;
 }
 
+/* Every bit of an address needs its own AES block, but the blocks only
+ * depend on the original address and the padding, never on each other's
+ * output. So all of the blocks for an address are built up front and
+ * encrypted with a single ECB call, letting the cipher pipeline them
+ * (AES-NI works on several blocks at once) instead of paying the EVP
+ * overhead and full AES latency for each bit in turn.
+ */
 uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop, 
         uint32_t res) {
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
+    uint8_t rin_output[32 * 16];
+    uint8_t rin_input[32 * 16];
     uint32_t first4pad;
-    int outl = 32;
+    int outl = sizeof(rin_output);
+    int blocks = stop - start;
+
+    if (blocks <= 0)
+        return res;
 
-    memcpy(rin_input, this->padding, 16);
     first4pad = generateFirstPad(this->padding);
 
-    for (int pos = start; pos < stop; pos ++) {
+    for (int i = 0; i < blocks; i ++) {
+        uint8_t *block = rin_input + i * 16;
+        int pos = start + i;
         uint32_t input;
 
         /* The MS bits are taken from the original address. The remaining
@@ -248,20 +399,23 @@ uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop,
                     ((first4pad << pos) >> pos);
         }
 
-        rin_input[0] = (uint8_t) (input >> 24);
-        rin_input[1] = (uint8_t) ((input << 8) >> 24);
-        rin_input[2] = (uint8_t) ((input << 16) >> 24);
-        rin_input[3] = (uint8_t) ((input << 24) >> 24);
-
-        /* Encryption: we're using AES as a pseudorandom function. For each
-         * bit in the original address, we use the first bit of the resulting
-         * encrypted output as part of an XOR mask */
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl, 
-                (unsigned char *)rin_input, 16);
+        memcpy(block, this->padding, 16);
+        block[0] = (uint8_t) (input >> 24);
+        block[1] = (uint8_t) ((input << 8) >> 24);
+        block[2] = (uint8_t) ((input << 16) >> 24);
+        block[3] = (uint8_t) ((input << 24) >> 24);
+    }
 
-        /* Put the first bit of the output into the right slot of our mask */
-        res |= (((uint32_t)rin_output[0]) >> 7) << (31 - pos);
+    /* Encryption: we're using AES as a pseudorandom function. For each
+     * bit in the original address, we use the first bit of the resulting
+     * encrypted output as part of an XOR mask */
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl, 
+            (unsigned char *)rin_input, blocks * 16);
 
+    /* Put the first bit of each output into the right slot of our mask */
+    for (int pos = start; pos < stop; pos ++) {
+        res |= (((uint32_t)rin_output[(pos - start) * 16]) >> 7) <<
+                (31 - pos);
     }
     return res;
 
@@ -270,16 +424,16 @@ uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop,
 uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
 
     /* See encrypt32Bits for more explanation of how this works */
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
+    uint8_t rin_output[64 * 16];
+    uint8_t rin_input[64 * 16];
     uint64_t first8pad;
-    int outl = 32;
+    int outl = sizeof(rin_output);
     uint64_t result = 0;
 
-    memcpy(rin_input, this->padding, 16);
     memcpy(&first8pad, this->padding, 8);
 
     for (int pos = 0; pos < 64; pos ++) {
+        uint8_t *block = rin_input + pos * 16;
         uint64_t input;
 
         if (pos == 0) {
@@ -289,12 +443,15 @@ uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
                     ((first8pad << pos) >> pos);
         }
 
-        memcpy(rin_input, &input, 8);
+        memcpy(block, this->padding, 16);
+        memcpy(block, &input, 8);
+    }
 
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
-                (unsigned char *)rin_input, 16);
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
+            (unsigned char *)rin_input, sizeof(rin_input));
 
-        result |= ((((uint64_t)rin_output[0]) >> 7) << (63 - pos));
+    for (int pos = 0; pos < 64; pos ++) {
+        result |= ((((uint64_t)rin_output[pos * 16]) >> 7) << (63 - pos));
     }
 
     return result;
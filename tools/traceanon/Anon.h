@@ -61,14 +61,46 @@ private:
 
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
-#include <map>
 
-typedef std::map<uint32_t, uint32_t> IPv4AnonCache;
-typedef std::map<uint64_t, uint64_t> IPv6AnonCache;
+typedef struct anon_cache_slot {
+    uint64_t prefix;
+    uint64_t mask;
+    uint32_t state;
+} AnonCacheSlot;
+
+/* Caches the XOR masks for address prefixes, so that the (expensive)
+ * encryption for each prefix only happens once. A single cache can be
+ * shared by the CryptoAnon in every processing thread: entries are never
+ * changed once written, so lookups don't need a lock, and a thread that
+ * misses just computes the mask itself and offers it to the cache.
+ *
+ * IPv4 prefixes of up to 24 bits are kept in a flat array indexed by the
+ * prefix. Longer IPv4 prefixes and IPv6 address halves go in fixed size
+ * hash tables, and are simply not cached once the tables fill up.
+ */
+class CryptoAnonCache {
+public:
+    CryptoAnonCache(uint8_t cachebits);
+    ~CryptoAnonCache();
+
+    bool lookupv4(uint32_t prefix, uint32_t *mask);
+    void insertv4(uint32_t prefix, uint32_t mask);
+    bool lookupv6(uint64_t prefix, uint64_t *mask);
+    void insertv6(uint64_t prefix, uint64_t mask);
+
+private:
+    uint8_t cachebits;
+
+    uint32_t *ipv4_flat;
+    AnonCacheSlot *ipv4_table;
+    AnonCacheSlot *ipv6_table;
+};
 
 class CryptoAnon : public Anonymiser {
 public:
-    CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits);
+    /* If no cache is given, the CryptoAnon creates a private one */
+    CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits,
+            CryptoAnonCache *cache = NULL);
     ~CryptoAnon();
 
     uint32_t anonIPv4(uint32_t orig);
@@ -80,8 +112,8 @@ private:
     uint8_t key[16];
     uint8_t cachebits;
 
-    IPv4AnonCache *ipv4_cache;
-    IPv6AnonCache *ipv6_cache;
+    CryptoAnonCache *cache;
+    bool owncache;
 
     uint32_t recent_ipv4_cache[2][2];
     const EVP_CIPHER *cipher;
@@ -38,6 +38,10 @@
 #include <time.h>
 #include <assert.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 enum enc_type_t {
         ENC_NONE,
@@ -50,9 +54,69 @@ bool enc_dest 	= false;
 enum enc_type_t enc_type = ENC_NONE;
 char *key = NULL;
 
+/* Number of leading IPv4 address bits whose CryptoPAn masks are cached */
+#define CRYPTOPAN_CACHE_BITS 20
+
+#ifdef HAVE_LIBCRYPTO
+/* Shared by every processing thread, so each prefix is encrypted once */
+CryptoAnonCache *anon_cache = NULL;
+#endif
+
 int level = -1;
 trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 
+enum out_mode_t {
+        OUT_REPORTER,           /* The reporter writes every packet */
+        OUT_SHARDS,             /* Each thread writes its own output file */
+        OUT_PARALLEL            /* Threads serialise, the reporter writev()s */
+};
+
+enum out_mode_t out_mode = OUT_REPORTER;
+char *output = NULL;
+
+/* Packets are serialised by the processing threads into chunks of this
+ * size. Chunks are aligned to their size so that the reporter can find the
+ * chunk that a record belongs to from the record's address alone. */
+#define CHUNK_SIZE (1 << 20)
+
+/* Maximum number of records gathered into a single writev() */
+#define WRITE_BATCH 512
+
+typedef struct out_chunk {
+        struct out_chunk *next;
+        /* Bytes of the chunk filled by the owning thread */
+        uint32_t used;
+        /* Records published but not yet written out by the reporter */
+        uint32_t pending;
+} out_chunk_t;
+
+/* A pcap record as serialised by a processing thread, immediately followed
+ * by hdr.caplen bytes of packet data */
+typedef struct out_record {
+        uint32_t linktype;
+        uint32_t length;
+        libtrace_pcap_record_t hdr;
+} out_record_t;
+
+typedef struct anon_thread {
+        Anonymiser *anon;
+        libtrace_out_t *shard;
+        out_chunk_t *chunk;
+        out_chunk_t *chunks;
+} anon_thread_t;
+
+typedef struct pcap_writer {
+        int fd;
+        bool header;
+        int count;
+        struct iovec iov[WRITE_BATCH];
+        out_record_t *records[WRITE_BATCH];
+} pcap_writer_t;
+
+/* Chunks of threads that have finished, freed once the reporter is done */
+static out_chunk_t *retired_chunks = NULL;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct libtrace_t *trace = NULL;
 
 static void cleanup_signal(int signal)
@@ -79,36 +143,25 @@ static void usage(char *argv0)
         "-t --threads=max       Use this number of threads for packet processing\n"
         "-f --filter=expr       Discard all packets that do not match the\n"
         "                       provided BPF expression\n"
+        "-S --shards            Write a separate output file from each thread\n"
+        "-w --parallel-write    Serialise packets in the processing threads\n"
+        "                       (uncompressed pcapfile output only)\n"
 	,argv0);
 	exit(1);
 }
 
-/* Incrementally update a checksum */
-static void update_in_cksum(uint16_t *csum, uint16_t old, uint16_t newval)
-{
-	uint32_t sum = (~htons(*csum) & 0xFFFF)
-		     + (~htons(old) & 0xFFFF)
-		     + htons(newval);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	*csum = htons(~(sum + (sum >> 16)));
-}
-
-UNUSED static void update_in_cksum32(uint16_t *csum, uint32_t old,
-                uint32_t newval)
-{
-	update_in_cksum(csum,(uint16_t)(old>>16),(uint16_t)(newval>>16));
-	update_in_cksum(csum,(uint16_t)(old&0xFFFF),(uint16_t)(newval&0xFFFF));
-}
-
 /* Ok this is remarkably complicated
  *
  * We want to change one, or the other IP address, while preserving
  * the checksum.  TCP and UDP both include the faux header in their
- * checksum calculations, so you have to update them too.  ICMP is
- * even worse -- it can include the original IP packet that caused the
- * error!  So anonymise that too, but remember that it's travelling in
+ * checksum calculations, so you have to update them too (see per_packet).
+ * ICMP is even worse -- it can include the original IP packet that caused
+ * the error!  So anonymise that too, but remember that it's travelling in
  * the opposite direction so we need to encrypt the destination and
  * source instead of the source and destination!
+ *
+ * All of the checksums are patched incrementally (RFC 1624) so that they
+ * remain valid for the new addresses without re-summing the packet.
  */
 static void encrypt_ips(Anonymiser *anon, struct libtrace_ip *ip,
                 bool enc_source,bool enc_dest)
@@ -116,13 +169,17 @@ static void encrypt_ips(Anonymiser *anon, struct libtrace_ip *ip,
 	libtrace_icmp_t *icmp=trace_get_icmp_from_ip(ip,NULL);
 
 	if (enc_source) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_src.s_addr)));
+		uint32_t old_ip=ip->ip_src.s_addr;
+		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(old_ip)));
 		ip->ip_src.s_addr = new_ip;
+		trace_checksum_update32(&ip->ip_sum, old_ip, new_ip);
 	}
 
 	if (enc_dest) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_dst.s_addr)));
+		uint32_t old_ip=ip->ip_dst.s_addr;
+		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(old_ip)));
 		ip->ip_dst.s_addr = new_ip;
+		trace_checksum_update32(&ip->ip_sum, old_ip, new_ip);
 	}
 
 	if (icmp) {
@@ -134,15 +191,17 @@ static void encrypt_ips(Anonymiser *anon, struct libtrace_ip *ip,
 				|| icmp->type == 5 
 				|| icmp->type == 11) {
 			char *ptr = (char *)icmp;
-			encrypt_ips(anon,
-				(struct libtrace_ip*)(ptr+
-					sizeof(struct libtrace_icmp)),
-				enc_dest,
-				enc_source);
+			struct libtrace_ip *inner = (struct libtrace_ip *)(ptr+
+					sizeof(struct libtrace_icmp));
+			struct libtrace_ip previp;
+
+			/* The ICMP checksum covers the returned header, so
+			 * account for every change made to it */
+			memcpy(&previp, inner, sizeof(previp));
+			encrypt_ips(anon, inner, enc_dest, enc_source);
+			trace_checksum_update_buffer(&icmp->checksum, &previp,
+					inner, sizeof(previp));
 		}
-
-		if (enc_source || enc_dest)
-			icmp->checksum = 0;
 	}
 }
 
@@ -163,6 +222,75 @@ static void encrypt_ipv6(Anonymiser *anon, libtrace_ip6_t *ip6,
 
 }
 
+/* Fixes a transport checksum that includes the (now anonymised) addresses
+ * in its pseudo header. old and cur point at the source and destination
+ * addresses, which are adjacent in both IPv4 and IPv6 headers. */
+static void update_pseudo_cksum(void *csum, const void *old,
+                const void *cur, uint16_t addrlen) {
+        trace_checksum_update_buffer(csum, old, cur, addrlen * 2);
+}
+
+
+/* Returns the chunk that the next len bytes of records should go into,
+ * recycling a chunk that the reporter has finished writing if possible */
+static out_chunk_t *next_chunk(anon_thread_t *at, uint32_t len) {
+        out_chunk_t *chunk = at->chunk;
+        void *mem;
+
+        if (chunk && chunk->used + len <= CHUNK_SIZE)
+                return chunk;
+
+        for (chunk = at->chunks; chunk; chunk = chunk->next) {
+                if (__atomic_load_n(&chunk->pending, __ATOMIC_ACQUIRE) == 0)
+                        break;
+        }
+
+        if (chunk == NULL) {
+                if (posix_memalign(&mem, CHUNK_SIZE, CHUNK_SIZE) != 0)
+                        return NULL;
+                chunk = (out_chunk_t *)mem;
+                chunk->pending = 0;
+                chunk->next = at->chunks;
+                at->chunks = chunk;
+        }
+
+        chunk->used = sizeof(out_chunk_t);
+        at->chunk = chunk;
+        return chunk;
+}
+
+/* Serialises a packet as a pcap record into this thread's current chunk.
+ * Returns 1 and sets *rec if the packet was serialised, 0 if the packet
+ * does not belong in a pcap file and -1 on error. */
+static int serialise_packet(anon_thread_t *at, libtrace_packet_t *packet,
+                out_record_t **rec) {
+        libtrace_pcap_record_t hdr;
+        out_chunk_t *chunk;
+        uint32_t linktype;
+        uint32_t len;
+        void *data;
+        int ret;
+
+        ret = trace_get_pcap_record(packet, &hdr, &data, &linktype);
+        if (ret <= 0)
+                return ret;
+
+        /* Keep every record 8 byte aligned within the chunk */
+        len = (sizeof(out_record_t) + hdr.caplen + 7) & ~7U;
+        if ((chunk = next_chunk(at, len)) == NULL)
+                return -1;
+
+        *rec = (out_record_t *)((uint8_t *)chunk + chunk->used);
+        (*rec)->linktype = linktype;
+        (*rec)->length = sizeof(libtrace_pcap_record_t) + hdr.caplen;
+        (*rec)->hdr = hdr;
+        memcpy(*rec + 1, data, hdr.caplen);
+        chunk->used += len;
+
+        /* The reporter releases the record once it has been written */
+        __atomic_add_fetch(&chunk->pending, 1, __ATOMIC_RELAXED);
+        return 1;
+}
 
 static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
         void *global, void *tls, libtrace_packet_t *packet) {
@@ -172,8 +300,13 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
 	libtrace_udp_t *udp = NULL;
 	libtrace_tcp_t *tcp = NULL;
         libtrace_icmp6_t *icmp6 = NULL;
-        Anonymiser *anon = (Anonymiser *)tls;
+        uint8_t prevaddrs[sizeof(struct in6_addr) * 2];
+        void *curaddrs = NULL;
+        uint16_t addrlen = 0;
+        anon_thread_t *at = (anon_thread_t *)tls;
+        Anonymiser *anon = at->anon;
         libtrace_generic_t result;
+        out_record_t *rec = NULL;
 
         if (IS_LIBTRACE_META_PACKET(packet))
                 return packet;
@@ -182,42 +315,80 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
         ip6 = trace_get_ip6(packet);
 
         if (ipptr && (enc_source || enc_dest)) {
+                memcpy(prevaddrs, &ipptr->ip_src, sizeof(uint32_t) * 2);
                 encrypt_ips(anon, ipptr,enc_source,enc_dest);
-                ipptr->ip_sum = 0;
+                curaddrs = &ipptr->ip_src;
+                addrlen = sizeof(uint32_t);
         } else if (ip6 && (enc_source || enc_dest)) {
+                memcpy(prevaddrs, &ip6->ip_src, sizeof(struct in6_addr) * 2);
                 encrypt_ipv6(anon, ip6, enc_source, enc_dest);
+                curaddrs = &ip6->ip_src;
+                addrlen = sizeof(struct in6_addr);
         }
 
-
-        /* Replace checksums so that IP encryption cannot be
-         * reversed -- TODO allow checksums to be updated and remain valid
-         * for the new addresses */
-
-        /* XXX replace with nice use of trace_get_transport() */
-
-        udp = trace_get_udp(packet);
-        if (udp && (enc_source || enc_dest)) {
-                udp->check = 0;
+        /* Patch the transport checksums so that they remain valid for the
+         * new addresses rather than revealing anything about the old ones.
+         * XXX replace with nice use of trace_get_transport() */
+
+        if (curaddrs) {
+                udp = trace_get_udp(packet);
+                if (udp && udp->check != 0) {
+                        /* A zero UDP checksum means "no checksum", so we
+                         * must not produce one by accident */
+                        update_pseudo_cksum(&udp->check, prevaddrs,
+                                        curaddrs, addrlen);
+                        if (udp->check == 0)
+                                udp->check = 0xffff;
+                }
+
+                tcp = trace_get_tcp(packet);
+                if (tcp) {
+                        update_pseudo_cksum(&tcp->check, prevaddrs,
+                                        curaddrs, addrlen);
+                }
+
+                icmp6 = trace_get_icmp6(packet);
+                if (icmp6) {
+                        update_pseudo_cksum(&icmp6->checksum, prevaddrs,
+                                        curaddrs, addrlen);
+                }
         }
 
-        tcp = trace_get_tcp(packet);
-        if (tcp && (enc_source || enc_dest)) {
-                tcp->check = 0;
+        /* TODO: Encrypt IP's in ARP packets */
+
+        if (out_mode == OUT_SHARDS) {
+                if (at->shard && trace_write_packet(at->shard, packet) == -1) {
+                        trace_perror_output(at->shard, "writer");
+                        trace_interrupt();
+                }
+                return packet;
         }
 
-        icmp6 = trace_get_icmp6(packet);
-        if (icmp6 && (enc_source || enc_dest)) {
-                icmp6->checksum = 0;
+        if (out_mode == OUT_PARALLEL) {
+                switch (serialise_packet(at, packet, &rec)) {
+                case -1:
+                        fprintf(stderr, "Unable to serialise packet as pcap\n");
+                        trace_interrupt();
+                        break;
+                case 1:
+                        result.ptr = rec;
+                        trace_publish_result(trace, t,
+                                        trace_packet_get_order(packet),
+                                        result, RESULT_USER);
+                        break;
+                }
+                /* The packet has been copied out, so it can be reused
+                 * straight away */
+                return packet;
         }
 
-        /* TODO: Encrypt IP's in ARP packets */
         result.pkt = packet;
         trace_publish_result(trace, t, trace_packet_get_order(packet), result, RESULT_PACKET);
 
         return NULL;
 }
 
-static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
+static Anonymiser *create_anon(void)
 {
         if (enc_type == ENC_PREFIX_SUBSTITUTION) {
                 PrefixSub *sub = new PrefixSub(key, NULL);
@@ -232,7 +403,8 @@ static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
 		}
 #ifdef HAVE_LIBCRYPTO                
                 CryptoAnon *anon = new CryptoAnon((uint8_t *)key,
-                        (uint8_t)strlen(key), 20);
+                        (uint8_t)strlen(key), CRYPTOPAN_CACHE_BITS,
+                        anon_cache);
                 return anon;
 #else
                 /* TODO nicer way of exiting? */
@@ -245,17 +417,50 @@ static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
         return NULL;
 }
 
+static libtrace_out_t *create_output(const char *outputname);
+
+static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
+{
+        anon_thread_t *at = (anon_thread_t *)calloc(1, sizeof(anon_thread_t));
+        char *shardname;
+
+        at->anon = create_anon();
+
+        if (out_mode == OUT_SHARDS) {
+                /* Name each shard after the thread, like tracesplit does */
+                shardname = (char *)malloc(strlen(output) + 12);
+                sprintf(shardname, "%s-%d", output,
+                                trace_get_perpkt_thread_id(t));
+                at->shard = create_output(shardname);
+                free(shardname);
+        }
+        return at;
+}
+
 static void end_anon(libtrace_t *trace, libtrace_thread_t *t, void *global,
                 void *tls) {
-        Anonymiser *anon = (Anonymiser *)tls;
-        delete(anon);
-
+        anon_thread_t *at = (anon_thread_t *)tls;
+        out_chunk_t *last;
+
+        delete(at->anon);
+        if (at->shard)
+                trace_destroy_output(at->shard);
+
+        /* The reporter may still be writing records from our chunks */
+        if (at->chunks) {
+                for (last = at->chunks; last->next; last = last->next)
+                        ;
+                pthread_mutex_lock(&retired_lock);
+                last->next = retired_chunks;
+                retired_chunks = at->chunks;
+                pthread_mutex_unlock(&retired_lock);
+        }
+        free(at);
 }
 
-static void *init_output(libtrace_t *trace, libtrace_thread_t *t, void *global)
+static libtrace_out_t *create_output(const char *outputname)
 {
         libtrace_out_t *writer = NULL;
-        char *outputname = (char *)global;
 	
         writer = trace_create_output(outputname);
 
@@ -296,6 +501,11 @@ static void *init_output(libtrace_t *trace, libtrace_thread_t *t, void *global)
 
 }
 
+static void *init_output(libtrace_t *trace, libtrace_thread_t *t, void *global)
+{
+        return create_output((char *)global);
+}
+
 static void write_packet(libtrace_t *trace, libtrace_thread_t *sender,
                       void *global, void *tls, libtrace_result_t *result) {
 	libtrace_packet_t *packet = (libtrace_packet_t*) result->value.pkt;
@@ -315,11 +525,129 @@ static void end_output(libtrace_t *trace, libtrace_thread_t *t, void *global,
         trace_destroy_output(writer);
 }
 
+/* Writes the gathered records to the output file */
+static int write_records(pcap_writer_t *pw) {
+        struct iovec *iov = pw->iov;
+        int iovcnt = pw->count;
+        ssize_t ret;
+
+        if (!pw->header) {
+                /* Matches the header written by the pcapfile format */
+                struct {
+                        uint32_t magic_number;
+                        uint16_t version_major;
+                        uint16_t version_minor;
+                        int32_t thiszone;
+                        uint32_t sigfigs;
+                        uint32_t snaplen;
+                        uint32_t network;
+                } filehdr = { 0xa1b2c3d4, 2, 4, 0, 0, 65536,
+                        pw->records[0]->linktype };
+
+                if (write(pw->fd, &filehdr, sizeof(filehdr)) !=
+                                sizeof(filehdr)) {
+                        perror("Writing pcap file header");
+                        return -1;
+                }
+                pw->header = true;
+        }
+
+        while (iovcnt > 0) {
+                ret = writev(pw->fd, iov, iovcnt);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("writev");
+                        return -1;
+                }
+                while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+                        ret -= iov->iov_len;
+                        iov ++;
+                        iovcnt --;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (uint8_t *)iov->iov_base + ret;
+                        iov->iov_len -= ret;
+                }
+        }
+        return 0;
+}
+
+/* Writes out every record gathered by the parallel writer so far, then
+ * hands the space they occupied back to the threads that serialised them.
+ * After an error, records are released without being written. */
+static void flush_records(pcap_writer_t *pw) {
+        out_chunk_t *chunk;
+        int i;
+
+        if (pw->count == 0)
+                return;
+
+        if (pw->fd != -1 && write_records(pw) == -1) {
+                if (pw->fd != STDOUT_FILENO)
+                        close(pw->fd);
+                pw->fd = -1;
+                trace_interrupt();
+        }
+
+        for (i = 0; i < pw->count; i++) {
+                chunk = (out_chunk_t *)((uintptr_t)pw->records[i] &
+                                ~(uintptr_t)(CHUNK_SIZE - 1));
+                __atomic_sub_fetch(&chunk->pending, 1, __ATOMIC_RELEASE);
+        }
+        pw->count = 0;
+}
+
+static void *init_pcap_writer(libtrace_t *trace, libtrace_thread_t *t,
+                void *global)
+{
+        pcap_writer_t *pw = (pcap_writer_t *)calloc(1, sizeof(pcap_writer_t));
+        const char *path = (char *)global + strlen("pcapfile:");
+
+        if (strcmp(path, "-") == 0) {
+                pw->fd = STDOUT_FILENO;
+        } else {
+                pw->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (pw->fd == -1) {
+                        perror("Unable to open output file");
+                        trace_interrupt();
+                }
+        }
+        return pw;
+}
+
+static void write_record(libtrace_t *trace, libtrace_thread_t *sender,
+                      void *global, void *tls, libtrace_result_t *result) {
+        pcap_writer_t *pw = (pcap_writer_t *)tls;
+        out_record_t *rec;
+
+        if (result->type != RESULT_USER)
+                return;
+
+        rec = (out_record_t *)result->value.ptr;
+        pw->records[pw->count] = rec;
+        pw->iov[pw->count].iov_base = &rec->hdr;
+        pw->iov[pw->count].iov_len = rec->length;
+        pw->count ++;
+
+        if (pw->count == WRITE_BATCH)
+                flush_records(pw);
+}
+
+static void end_pcap_writer(libtrace_t *trace, libtrace_thread_t *t,
+                void *global, void *tls) {
+        pcap_writer_t *pw = (pcap_writer_t *)tls;
+
+        flush_records(pw);
+        if (pw->fd != -1 && pw->fd != STDOUT_FILENO)
+                close(pw->fd);
+        free(pw);
+}
+
 int main(int argc, char *argv[]) 
 {
 	//struct libtrace_t *trace = 0;
 	struct sigaction sigact;
-	char *output = 0;
 	char *compress_type_str=NULL;
         int maxthreads = 4;
         libtrace_callback_set_t *pktcbs = NULL;
@@ -327,6 +655,7 @@ int main(int argc, char *argv[])
         int exitcode = 0;
         char *filterstring = NULL;
         libtrace_filter_t *filter = NULL;
+        out_chunk_t *chunk;
 
 	if (argc<2)
 		usage(argv[0]);
@@ -343,11 +672,13 @@ int main(int argc, char *argv[])
 			{ "filter",		1, 0, 'f' },
 			{ "compress-level",	1, 0, 'z' },
 			{ "compress-type",	1, 0, 'Z' },
+			{ "shards",		0, 0, 'S' },
+			{ "parallel-write",	0, 0, 'w' },
 			{ "help",        	0, 0, 'h' },
 			{ NULL,			0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "Z:z:sc:f:dp:ht:f:",
+		int c=getopt_long(argc, argv, "Z:z:sc:f:dp:ht:f:Sw",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -404,6 +735,12 @@ int main(int argc, char *argv[])
                                   if (maxthreads <= 0)
                                           maxthreads = 1;
                                   break;
+                        case 'S':
+                                  out_mode = OUT_SHARDS;
+                                  break;
+                        case 'w':
+                                  out_mode = OUT_PARALLEL;
+                                  break;
 			default:
 				fprintf(stderr,"unknown option: %c\n",c);
 				usage(argv[0]);
@@ -440,6 +777,29 @@ int main(int argc, char *argv[])
                 return 1;
         }
 
+        if (optind + 1 >= argc) {
+                if (out_mode == OUT_SHARDS) {
+                        fprintf(stderr, "An output URI is required when "
+                                        "writing per-thread shards\n");
+                        return 1;
+                }
+        } else {
+                output = argv[optind + 1];
+        }
+
+        if (out_mode == OUT_PARALLEL && (output == NULL ||
+                        strncmp(output, "pcapfile:", 9) != 0 ||
+                        compress_type != TRACE_OPTION_COMPRESSTYPE_NONE)) {
+                fprintf(stderr, "Parallel writing requires an uncompressed "
+                                "pcapfile: output\n");
+                return 1;
+        }
+
+#ifdef HAVE_LIBCRYPTO
+        if (enc_type == ENC_CRYPTOPAN)
+                anon_cache = new CryptoAnonCache(CRYPTOPAN_CACHE_BITS);
+#endif
+
 	/* open input uri */
 	trace = trace_create(argv[optind]);
 	if (trace_is_err(trace)) {
@@ -448,13 +808,11 @@ int main(int argc, char *argv[])
                 goto exitanon;
 	}
 
-	if (optind +1>= argc) {
+	if (output == NULL) {
 		/* no output specified, output in same format to
 		 * stdout 
 		 */
 		output = strdup("erf:-");
-	} else {
-		output = argv[optind +1];
 	}
 	// OK parallel changes start here
 
@@ -469,10 +827,19 @@ int main(int argc, char *argv[])
         trace_set_stopping_cb(pktcbs, end_anon);
         trace_set_starting_cb(pktcbs, start_anon);
 
-        repcbs = trace_create_callback_set();
-        trace_set_result_cb(repcbs, write_packet);
-        trace_set_stopping_cb(repcbs, end_output);
-        trace_set_starting_cb(repcbs, init_output);
+        /* Shards are written entirely by the processing threads, so
+         * there is nothing for a reporter to do */
+        if (out_mode == OUT_PARALLEL) {
+                repcbs = trace_create_callback_set();
+                trace_set_result_cb(repcbs, write_record);
+                trace_set_stopping_cb(repcbs, end_pcap_writer);
+                trace_set_starting_cb(repcbs, init_pcap_writer);
+        } else if (out_mode == OUT_REPORTER) {
+                repcbs = trace_create_callback_set();
+                trace_set_result_cb(repcbs, write_packet);
+                trace_set_stopping_cb(repcbs, end_output);
+                trace_set_starting_cb(repcbs, init_output);
+        }
 
         trace_set_perpkt_threads(trace, maxthreads);
 
@@ -510,5 +877,12 @@ exitanon:
                 trace_destroy_callback_set(repcbs);
         if (trace)
         	trace_destroy(trace);
+#ifdef HAVE_LIBCRYPTO
+        delete(anon_cache);
+#endif
+        while ((chunk = retired_chunks) != NULL) {
+                retired_chunks = chunk->next;
+                free(chunk);
+        }
 	return exitcode;
 }
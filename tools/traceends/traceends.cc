@@ -28,6 +28,8 @@
 #define __STDC_FORMAT_MACROS
 
 #include <libtrace.h>
+#include <libtrace_parallel.h>
+#include <data-struct/sketch.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -42,9 +44,25 @@
 #include <arpa/inet.h>
 #include <time.h>
 
-#include <map>
+#include <algorithm>
+#include <vector>
+
+/* Each processing thread counts endpoints into its own table, and hands
+ * the table to the reporter every flush interval (of trace time). The
+ * reporter merges them into one table which remembers the order in which
+ * endpoints were last updated, so that endpoints that have gone idle can
+ * be written out and forgotten without searching the whole table.
+ */
+
+#define NO_COUNTER UINT32_MAX
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define ENDTABLE_INITIAL_SIZE 1024
+#define FLUSH_INTERVAL 10
 
 typedef struct end_counter {
+	uint8_t addr[16];
+
 	uint64_t src_bytes;
 	uint64_t src_pbytes;
 	uint64_t src_pkts;
@@ -54,31 +72,66 @@ typedef struct end_counter {
 
 	double last_active;
 
+	/* Neighbours in the reporter's idle list. 'next' also links
+	 * counters on the free list */
+	uint32_t prev;
+	uint32_t next;
 } end_counter_t;
 
-typedef struct mac_addr {
-	uint8_t addr[6];
-} mac_addr_t;
+typedef struct end_slot {
+	uint32_t hash;
+	uint32_t counter;	/* NO_COUNTER if the slot is empty */
+} end_slot_t;
 
-struct v6comp {
-	bool operator() (const struct in6_addr &a, const struct in6_addr &b) const {
-		if (memcmp(&a, &b, sizeof(struct in6_addr)) < 0)
-			return true;
-		return false;
-	}
-};
-	
-struct maccomp {
-	bool operator() (const mac_addr_t &a, const mac_addr_t &b) const {
-		if (memcmp(&a, &b, sizeof(mac_addr_t)) < 0)
-			return true;
-		return false;
-	}
+/* An open addressing (linear probing) table of endpoints. Counters are
+ * allocated from fixed size slabs and referred to by index, so growing
+ * the table never moves them and removed counters are reused.
+ */
+typedef struct end_table {
+	end_slot_t *slots;
+	uint32_t mask;
+	uint32_t count;
+
+	end_counter_t **slabs;
+	uint32_t nslabs;
+	uint32_t used;
+	uint32_t freelist;
+
+	/* Least and most recently updated counters */
+	uint32_t oldest;
+	uint32_t newest;
+} end_table_t;
+
+/* With --approximate, endpoints are counted into sketches instead, so
+ * memory use doesn't grow with the number of endpoints. Only the busiest
+ * endpoints (by packets) can be reported, so each thread keeps a short
+ * list of candidates that the reporter ranks once everything is merged.
+ */
+#define APPROX_TOP 100
+#define APPROX_CANDIDATES (APPROX_TOP * 2)
+#define APPROX_WIDTH (1 << 14)
+#define APPROX_DEPTH 4
+
+enum {
+	SRC_PKTS,
+	SRC_BYTES,
+	SRC_PBYTES,
+	DST_PKTS,
+	DST_BYTES,
+	DST_PBYTES,
+	NUM_COUNTS
 };
 
-typedef std::map<uint32_t, end_counter_t *> IP4EndMap;
-typedef std::map<struct in6_addr, end_counter_t *, v6comp> IP6EndMap;
-typedef std::map<mac_addr_t, end_counter_t *, maccomp> MacEndMap;
+typedef struct approx_ends {
+	libtrace_hll_t distinct;
+	libtrace_cms_t counts[NUM_COUNTS];
+
+	uint8_t cand[APPROX_CANDIDATES][16];
+	uint32_t candhash[APPROX_CANDIDATES];
+	uint64_t candrank[APPROX_CANDIDATES];
+	uint32_t ncand;
+	uint32_t minidx;
+} approx_ends_t;
 
 enum {
 	MODE_MAC,
@@ -87,10 +140,19 @@ enum {
 };
 
 int mode = MODE_IPV4;
+int threadcount = 4;
+double expire = 0;
+double flush_interval = FLUSH_INTERVAL;
+bool approximate = false;
 
-IP4EndMap ipv4;
-IP6EndMap ipv6;
-MacEndMap mac;
+/* The reporter's table of every endpoint that hasn't expired yet */
+end_table_t *ends = NULL;
+/* Or, with --approximate, the reporter's merged sketches */
+approx_ends_t *approx = NULL;
+std::vector<std::vector<uint8_t> > candidates;
+uint64_t current_interval = 0;
+
+struct libtrace_t *currenttrace = NULL;
 
 static int usage(char *argv0)
 {
@@ -99,6 +161,11 @@ static int usage(char *argv0)
         "-f --filter=bpf        Only output packets that match filter\n"
         "-H --help     		Print this message\n"
         "-A --address=addr     	Specifies which address type to match (mac, v4, v6)\n"
+        "-e --expire=seconds    Write out and forget endpoints once they have\n"
+        "                       been idle for this long\n"
+        "-t --threads=max       Use this number of processing threads (default: 4)\n"
+        "-S --approximate       Estimate counts with sketches, and only report the\n"
+        "                       number of endpoints and the busiest endpoints\n"
         ,argv0);
         exit(1);
 }
@@ -109,261 +176,470 @@ static void cleanup_signal(int sig)
 {
         (void)sig;
         done=1;
-	trace_interrupt();
+        if (currenttrace)
+                trace_pstop(currenttrace);
+}
+
+static inline end_counter_t *get_counter(end_table_t *t, uint32_t idx)
+{
+	return &t->slabs[idx >> SLAB_SHIFT][idx & (SLAB_SIZE - 1)];
+}
+
+static inline uint32_t hash_addr(const uint8_t *addr)
+{
+	uint64_t words[2];
+	uint64_t h;
+
+	memcpy(words, addr, sizeof(words));
+	h = (words[0] ^ 0x9e3779b97f4a7c15ULL) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+	h = (h ^ words[1]) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 32;
+	return (uint32_t)h;
 }
 
-static end_counter_t *create_counter() {
-	end_counter_t *c = (end_counter_t *)malloc(sizeof(end_counter_t));
+static end_table_t *endtable_create(uint32_t size)
+{
+	end_table_t *t = (end_table_t *)calloc(1, sizeof(end_table_t));
+
+	assert((size & (size - 1)) == 0);
+	t->slots = (end_slot_t *)malloc(size * sizeof(end_slot_t));
+	memset(t->slots, 0xff, size * sizeof(end_slot_t));
+	t->mask = size - 1;
+	t->freelist = NO_COUNTER;
+	t->oldest = NO_COUNTER;
+	t->newest = NO_COUNTER;
+	return t;
+}
 
-	c->src_bytes = 0;
-	c->src_pbytes = 0;
-	c->src_pkts = 0;
-	c->dst_pkts = 0;
-	c->dst_bytes = 0;
-	c->dst_pbytes = 0;
+static void endtable_destroy(end_table_t *t)
+{
+	uint32_t i;
 
-	c->last_active = 0.0;
-	return c;
+	for (i = 0; i < t->nslabs; i++)
+		free(t->slabs[i]);
+	free(t->slabs);
+	free(t->slots);
+	free(t);
 }
 
-static char *mac_string(mac_addr_t m, char *str) {
-	
-	
-	snprintf(str, 80, "%02x:%02x:%02x:%02x:%02x:%02x", 
-		m.addr[0], m.addr[1], m.addr[2], m.addr[3], m.addr[4],
-		m.addr[5]);
+static uint32_t alloc_counter(end_table_t *t)
+{
+	uint32_t idx;
+
+	if (t->freelist != NO_COUNTER) {
+		idx = t->freelist;
+		t->freelist = get_counter(t, idx)->next;
+	} else {
+		idx = t->used++;
+		if ((idx >> SLAB_SHIFT) >= t->nslabs) {
+			t->slabs = (end_counter_t **)realloc(t->slabs,
+					(t->nslabs + 1) * sizeof(end_counter_t *));
+			t->slabs[t->nslabs++] = (end_counter_t *)malloc(
+					SLAB_SIZE * sizeof(end_counter_t));
+		}
+	}
+	memset(get_counter(t, idx), 0, sizeof(end_counter_t));
+	return idx;
+}
+
+static void endtable_grow(end_table_t *t)
+{
+	end_slot_t *old = t->slots;
+	uint32_t oldsize = t->mask + 1;
+	uint32_t i;
+
+	t->slots = (end_slot_t *)malloc(oldsize * 2 * sizeof(end_slot_t));
+	memset(t->slots, 0xff, oldsize * 2 * sizeof(end_slot_t));
+	t->mask = oldsize * 2 - 1;
+	for (i = 0; i < oldsize; i++) {
+		uint32_t slot;
+
+		if (old[i].counter == NO_COUNTER)
+			continue;
+		slot = old[i].hash & t->mask;
+		while (t->slots[slot].counter != NO_COUNTER)
+			slot = (slot + 1) & t->mask;
+		t->slots[slot] = old[i];
+	}
+	free(old);
+}
+
+/* Returns the slot holding the given address, or the empty slot where it
+ * belongs */
+static uint32_t find_slot(end_table_t *t, const uint8_t *addr, uint32_t hash)
+{
+	uint32_t slot = hash & t->mask;
+
+	while (t->slots[slot].counter != NO_COUNTER) {
+		if (t->slots[slot].hash == hash && memcmp(addr,
+				get_counter(t, t->slots[slot].counter)->addr,
+				16) == 0)
+			break;
+		slot = (slot + 1) & t->mask;
+	}
+	return slot;
+}
+
+static end_counter_t *endtable_get(end_table_t *t, const uint8_t *addr,
+		uint32_t *idxp)
+{
+	uint32_t hash = hash_addr(addr);
+	uint32_t slot = find_slot(t, addr, hash);
+
+	if (t->slots[slot].counter == NO_COUNTER) {
+		if ((t->count + 1) * 2 > t->mask + 1) {
+			endtable_grow(t);
+			slot = find_slot(t, addr, hash);
+		}
+		t->slots[slot].hash = hash;
+		t->slots[slot].counter = alloc_counter(t);
+		memcpy(get_counter(t, t->slots[slot].counter)->addr, addr, 16);
+		get_counter(t, t->slots[slot].counter)->prev = NO_COUNTER;
+		get_counter(t, t->slots[slot].counter)->next = NO_COUNTER;
+		t->count ++;
+	}
+	if (idxp)
+		*idxp = t->slots[slot].counter;
+	return get_counter(t, t->slots[slot].counter);
+}
+
+static void unlink_counter(end_table_t *t, uint32_t idx)
+{
+	end_counter_t *c = get_counter(t, idx);
+
+	if (c->prev != NO_COUNTER)
+		get_counter(t, c->prev)->next = c->next;
+	else if (t->oldest == idx)
+		t->oldest = c->next;
+	if (c->next != NO_COUNTER)
+		get_counter(t, c->next)->prev = c->prev;
+	else if (t->newest == idx)
+		t->newest = c->prev;
+	c->prev = c->next = NO_COUNTER;
+}
+
+/* Moves a counter to the most recently updated end of the idle list */
+static void endtable_touch(end_table_t *t, uint32_t idx)
+{
+	end_counter_t *c;
+
+	if (t->newest == idx)
+		return;
+	unlink_counter(t, idx);
+	c = get_counter(t, idx);
+	c->prev = t->newest;
+	if (t->newest != NO_COUNTER)
+		get_counter(t, t->newest)->next = idx;
+	else
+		t->oldest = idx;
+	t->newest = idx;
+}
+
+static void endtable_remove(end_table_t *t, uint32_t idx)
+{
+	end_counter_t *c = get_counter(t, idx);
+	uint32_t i = find_slot(t, c->addr, hash_addr(c->addr));
+	uint32_t j = i;
+
+	assert(t->slots[i].counter == idx);
+
+	/* Shift any following entries in the same probe sequence back, so
+	 * that lookups never need to skip over deleted slots */
+	while (1) {
+		uint32_t home;
+
+		j = (j + 1) & t->mask;
+		if (t->slots[j].counter == NO_COUNTER)
+			break;
+		home = t->slots[j].hash & t->mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+	t->slots[i].counter = NO_COUNTER;
+	t->slots[i].hash = NO_COUNTER;
+	t->count --;
+
+	unlink_counter(t, idx);
+	c->next = t->freelist;
+	t->freelist = idx;
+}
+
+static char *mac_string(const uint8_t *m, char *str) {
+
+
+	snprintf(str, 80, "%02x:%02x:%02x:%02x:%02x:%02x",
+		m[0], m[1], m[2], m[3], m[4], m[5]);
 	return str;
 }
 
-static void dump_mac_map() {
-	MacEndMap::iterator it;
-	char str[80];
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
-	
-	for (it = mac.begin(); it != mac.end(); it++) {
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%18s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				mac_string(it->first, str),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
+/* Sorts endpoints in the same order as the old std::map based output */
+static bool addr_order(const end_counter_t *a, const end_counter_t *b)
+{
+	if (mode == MODE_IPV4) {
+		uint32_t x, y;
+		memcpy(&x, a->addr, sizeof(x));
+		memcpy(&y, b->addr, sizeof(y));
+		return x < y;
 	}
+	return memcmp(a->addr, b->addr, 16) < 0;
 }
 
-static void dump_ipv4_map() {
-	IP4EndMap::iterator it;
-	struct in_addr in;
+static void dump_counters(std::vector<end_counter_t *> &counters) {
+	std::vector<end_counter_t *>::iterator it;
+	char str[128];
 	char timestr[80];
+	const char *addrstr;
 	struct tm *tm;
 	time_t t;
-	for (it = ipv4.begin(); it != ipv4.end(); it++) {
-		in.s_addr = it->first;
-		t = (time_t)(it->second->last_active);
+	int width;
+
+	std::sort(counters.begin(), counters.end(), addr_order);
+	for (it = counters.begin(); it != counters.end(); it++) {
+		end_counter_t *c = *it;
+
+		switch (mode) {
+			case MODE_MAC:
+				addrstr = mac_string(c->addr, str);
+				width = 18;
+				break;
+			case MODE_IPV6:
+				addrstr = inet_ntop(AF_INET6, c->addr, str, 128);
+				width = 40;
+				break;
+			default:
+				addrstr = inet_ntop(AF_INET, c->addr, str, 128);
+				width = 16;
+				break;
+		}
+
+		t = (time_t)(c->last_active);
 		tm = localtime(&t);
 		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%16s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntoa(in),
+		printf("%*s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n",
+				width,
+				addrstr,
 				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
+				c->src_pkts,
+				c->src_bytes,
+				c->src_pbytes,
+				c->dst_pkts,
+				c->dst_bytes,
+				c->dst_pbytes);
 	}
 }
 
-static void dump_ipv6_map() {
-	IP6EndMap::iterator it;
-	struct in6_addr in;
-	char ip6_addr[128];
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
+static approx_ends_t *approx_create(void) {
 
-	for (it = ipv6.begin(); it != ipv6.end(); it++) {
-		in = it->first;
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%40s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntop(AF_INET6, &in, ip6_addr, 128),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
+	approx_ends_t *a = (approx_ends_t *)calloc(1, sizeof(approx_ends_t));
+	int i;
+
+	libtrace_hll_init(&a->distinct, LIBTRACE_HLL_DEFAULT_PRECISION);
+	for (i = 0; i < NUM_COUNTS; i++)
+		libtrace_cms_init(&a->counts[i], APPROX_WIDTH, APPROX_DEPTH);
+	return a;
+}
+
+static void approx_destroy(approx_ends_t *a) {
+
+	int i;
+
+	libtrace_hll_destroy(&a->distinct);
+	for (i = 0; i < NUM_COUNTS; i++)
+		libtrace_cms_destroy(&a->counts[i]);
+	free(a);
+}
+
+static void find_min_candidate(approx_ends_t *a) {
+
+	uint32_t i;
+
+	a->minidx = 0;
+	for (i = 1; i < a->ncand; i++) {
+		if (a->candrank[i] < a->candrank[a->minidx])
+			a->minidx = i;
 	}
 }
 
-static void update_ipv6(libtrace_ip6_t *ip, uint16_t ip_len, uint32_t rem, 
-		uint32_t plen, 	double ts) {
+/* Keeps the endpoint in the candidate list if it is now one of the
+ * busiest seen by this thread */
+static void update_candidates(approx_ends_t *a, const uint8_t *key,
+		uint64_t hash, uint64_t rank) {
 
-	struct in6_addr key;
-	IP6EndMap::iterator it;
-	end_counter_t *c = NULL;
+	uint32_t i;
 
-	if (rem < sizeof(libtrace_ip6_t))
+	if (a->ncand == APPROX_CANDIDATES && rank <= a->candrank[a->minidx])
 		return;
-	
-	key = ip->ip_src;
-	
-	it = ipv6.find(key);
-	if (it == ipv6.end()) {
-		c = create_counter();
-		ipv6[key] = c;
-	} else {
-		c = it->second;
-	}
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip_len;
-	c->last_active = ts;
-	
-	key = ip->ip_dst;
-	
-	it = ipv6.find(key);
-	if (it == ipv6.end()) {
-		c = create_counter();
-		ipv6[key] = c;
-	} else {
-		c = it->second;
+	for (i = 0; i < a->ncand; i++) {
+		if (a->candhash[i] == (uint32_t)hash &&
+				memcmp(a->cand[i], key, 16) == 0)
+			break;
 	}
+	if (i == a->ncand) {
+		if (a->ncand < APPROX_CANDIDATES)
+			a->ncand ++;
+		else
+			i = a->minidx;
+		memcpy(a->cand[i], key, 16);
+		a->candhash[i] = (uint32_t)hash;
+	}
+	a->candrank[i] = rank;
+	if (a->ncand == APPROX_CANDIDATES && i == a->minidx)
+		find_min_candidate(a);
+}
 
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-	c->last_active = ts;
+static void update_approx(approx_ends_t *a, const uint8_t *key, bool src,
+		uint16_t ip_len, uint32_t plen) {
+
+	uint64_t hash = libtrace_sketch_hash(key, 16);
+	int base = src ? SRC_PKTS : DST_PKTS;
+	int other = src ? DST_PKTS : SRC_PKTS;
+	uint64_t rank;
+
+	libtrace_hll_add_hash(&a->distinct, hash);
+	rank = libtrace_cms_add_hash(&a->counts[base], hash, 1);
+	libtrace_cms_add_hash(&a->counts[base + 1], hash, ip_len);
+	libtrace_cms_add_hash(&a->counts[base + 2], hash, plen);
+	rank += libtrace_cms_estimate_hash(&a->counts[other], hash);
+	update_candidates(a, key, hash, rank);
 }
 
-static void update_mac(uint8_t *src, uint8_t *dst, uint16_t ip_len,
-		uint32_t plen, double ts) {
+typedef struct thread_data {
+	end_table_t *ends;
+	approx_ends_t *approx;
+	uint64_t interval;
+} thread_data_t;
 
-	mac_addr_t key;
-	end_counter_t *c = NULL;
-	MacEndMap::iterator it;
+static void update_end(thread_data_t *td, const uint8_t *addr,
+		size_t addrlen, bool src, uint16_t ip_len, uint32_t plen,
+		double ts) {
 
-	memcpy(&(key.addr), src, sizeof(key.addr));
-	it = mac.find(key);
-	
-	if (it == mac.end()) {
-		c = create_counter();
-		mac[key] = c;
-	} else {
-		c = it->second;
+	uint8_t key[16];
+	end_counter_t *c;
+
+	memset(key, 0, sizeof(key));
+	memcpy(key, addr, addrlen);
+	if (td->approx) {
+		update_approx(td->approx, key, src, ip_len, plen);
+		return;
 	}
+	c = endtable_get(td->ends, key, NULL);
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip_len;
-	c->last_active = ts;
-
-	memcpy(&key.addr, dst, sizeof(key.addr));
-	it = mac.find(key);
-	
-	if (it == mac.end()) {
-		c = create_counter();
-		mac[key] = c;
+	if (src) {
+		c->src_pkts ++;
+		c->src_pbytes += plen;
+		c->src_bytes += ip_len;
 	} else {
-		c = it->second;
+		c->dst_pkts ++;
+		c->dst_pbytes += plen;
+		c->dst_bytes += ip_len;
 	}
+	if (ts > c->last_active)
+		c->last_active = ts;
+}
 
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-	c->last_active = ts;
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+
+	thread_data_t *td = (thread_data_t *)calloc(1, sizeof(thread_data_t));
+	if (approximate)
+		td->approx = approx_create();
+	else
+		td->ends = endtable_create(ENDTABLE_INITIAL_SIZE);
+	return td;
 }
 
-static void update_ipv4(libtrace_ip_t *ip, uint16_t ip_len, uint32_t rem, 
-		uint32_t plen, 	double ts) {
+/* A thread with no endpoints still publishes an empty result, as the
+ * ordered combiner holds back every other thread's tables until it hears
+ * from us */
+static void publish_ends(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td) {
 
-	uint32_t key;
-	IP4EndMap::iterator it;
-	end_counter_t *c = NULL;
+	libtrace_generic_t res;
+	uint32_t size = td->ends->mask + 1;
 
-	if (rem < sizeof(libtrace_ip_t))
+	if (td->ends->count == 0) {
+		res.ptr = NULL;
+		trace_publish_result(trace, t, td->interval, res, RESULT_USER);
 		return;
-	
-	key = ip->ip_src.s_addr;
-	
-	it = ipv4.find(key);
-	if (it == ipv4.end()) {
-		c = create_counter();
-		ipv4[key] = c;
-	} else {
-		c = it->second;
 	}
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip->ip_len;
-        if (ts != 0)
-        	c->last_active = ts;
-	
-	key = ip->ip_dst.s_addr;
-	
-	it = ipv4.find(key);
-	if (it == ipv4.end()) {
-		c = create_counter();
-		ipv4[key] = c;
-	} else {
-		c = it->second;
-	}
+	/* The reporter owns the table as soon as it is published */
+	res.ptr = td->ends;
+	trace_publish_result(trace, t, td->interval, res, RESULT_USER);
+	trace_post_reporter(trace);
+	td->ends = endtable_create(size);
+}
+
+static void next_interval(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td, double ts) {
 
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-        if (ts != 0)
-        	c->last_active = ts;
+	uint64_t idx = (uint64_t)(ts / flush_interval);
+
+	/* Sketches are only handed over once the thread stops */
+	if (td->approx)
+		return;
+	if (idx > td->interval) {
+		publish_ends(trace, t, td);
+		td->interval = idx;
+	}
 }
 
-static int per_packet(libtrace_packet_t *packet) {
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, libtrace_packet_t *packet) {
 
+	thread_data_t *td = (thread_data_t *)tls;
 	void *header;
 	uint16_t ethertype;
 	uint32_t rem;
 	uint16_t ip_len = 0;
-	uint32_t plen = trace_get_payload_length(packet);
-	double ts = trace_get_seconds(packet);
+	uint32_t plen;
+	double ts;
 	libtrace_ip_t *ip = NULL;
 	libtrace_ip6_t *ip6 = NULL;
 	uint8_t *src_mac, *dst_mac;
 
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	ts = trace_get_seconds(packet);
+	next_interval(trace, t, td, ts);
+
 	header = trace_get_layer3(packet, &ethertype, &rem);
 
 	if (header == NULL || rem == 0)
-		return 1;
-	
+		return packet;
+
+	plen = trace_get_payload_length(packet);
+
 	if (ethertype == TRACE_ETHERTYPE_IP) {
 		ip = (libtrace_ip_t *)header;
 		if (rem < sizeof(libtrace_ip_t))
-			return 1;
+			return packet;
 		ip_len = ntohs(ip->ip_len);
-		if (mode == MODE_IPV4 && ip) {
-			update_ipv4(ip, ip_len, rem, plen, ts);
-			return 1;
+		if (mode == MODE_IPV4) {
+			update_end(td, (uint8_t *)&ip->ip_src, 4, true,
+					ip_len, plen, ts);
+			update_end(td, (uint8_t *)&ip->ip_dst, 4, false,
+					ip_len, plen, ts);
+			return packet;
 		}
 	}
 
 	if (ethertype == TRACE_ETHERTYPE_IPV6) {
 		ip6 = (libtrace_ip6_t *)header;
 		if (rem < sizeof(libtrace_ip6_t))
-			return 1;
+			return packet;
 		ip_len = ntohs(ip6->plen) + sizeof(libtrace_ip6_t);
-		if (mode == MODE_IPV6 && ip6) {
-			update_ipv6(ip6, ip_len, rem, plen, ts);
-			return 1;
+		if (mode == MODE_IPV6) {
+			update_end(td, (uint8_t *)&ip6->ip_src, 16, true,
+					ip_len, plen, ts);
+			update_end(td, (uint8_t *)&ip6->ip_dst, 16, false,
+					ip_len, plen, ts);
+			return packet;
 		}
 	}
 
@@ -372,11 +648,213 @@ static int per_packet(libtrace_packet_t *packet) {
 		dst_mac = trace_get_destination_mac(packet);
 
 		if (src_mac == NULL || dst_mac == NULL)
-			return 1;
-		update_mac(src_mac, dst_mac, ip_len, plen, ts);
+			return packet;
+		update_end(td, src_mac, 6, true, ip_len, plen, ts);
+		update_end(td, dst_mac, 6, false, ip_len, plen, ts);
+	}
+
+	return packet;
+}
+
+static void per_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, uint64_t order) {
+
+	thread_data_t *td = (thread_data_t *)tls;
+	libtrace_generic_t res;
+
+	if (td->approx)
+		return;
+	next_interval(trace, t, td,
+			(order >> 32) + (order & 0xffffffffULL) / 4294967296.0);
+
+	/* Let the reporter know we have nothing older than this, even if we
+	 * have seen no packets at all */
+	res.ptr = NULL;
+	trace_publish_result(trace, t, td->interval, res, RESULT_USER);
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+
+	thread_data_t *td = (thread_data_t *)tls;
+	libtrace_generic_t res;
+
+	if (td->approx) {
+		/* The reporter owns the sketches once they are published */
+		res.ptr = td->approx;
+		trace_publish_result(trace, t, td->interval, res, RESULT_USER);
+		trace_post_reporter(trace);
+	} else {
+		publish_ends(trace, t, td);
+		endtable_destroy(td->ends);
+	}
+	free(td);
+}
+
+/* Writes out and forgets every endpoint that hasn't been active since
+ * 'cutoff'. Endpoints are only reordered when an interval is merged, so
+ * this may leave some idle endpoints for up to one more flush interval.
+ */
+static void expire_ends(double cutoff) {
+
+	std::vector<end_counter_t *> expired;
+	std::vector<uint32_t> indexes;
+	uint32_t idx;
+
+	for (idx = ends->oldest; idx != NO_COUNTER;
+			idx = get_counter(ends, idx)->next) {
+		if (get_counter(ends, idx)->last_active >= cutoff)
+			break;
+		expired.push_back(get_counter(ends, idx));
+		indexes.push_back(idx);
+	}
+	if (expired.empty())
+		return;
+
+	dump_counters(expired);
+	for (size_t i = 0; i < indexes.size(); i++)
+		endtable_remove(ends, indexes[i]);
+}
+
+static void merge_approx(approx_ends_t *a) {
+
+	uint32_t i;
+	int j;
+
+	libtrace_hll_merge(&approx->distinct, &a->distinct);
+	for (j = 0; j < NUM_COUNTS; j++)
+		libtrace_cms_merge(&approx->counts[j], &a->counts[j]);
+	for (i = 0; i < a->ncand; i++)
+		candidates.push_back(std::vector<uint8_t>(a->cand[i],
+				a->cand[i] + 16));
+	approx_destroy(a);
+}
+
+typedef struct ranked_end {
+	uint64_t rank;
+	end_counter_t counter;
+} ranked_end_t;
+
+static bool rank_order(const ranked_end_t &a, const ranked_end_t &b) {
+	return a.rank > b.rank;
+}
+
+/* Writes out the number of endpoints, and estimated counters for the
+ * busiest of the endpoints nominated by the processing threads */
+static void dump_approx(void) {
+
+	std::vector<ranked_end_t> ranked;
+	char str[128];
+	const char *addrstr;
+	int width;
+	size_t i;
+
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()),
+			candidates.end());
+
+	for (i = 0; i < candidates.size(); i++) {
+		ranked_end_t r;
+		uint64_t est[NUM_COUNTS];
+		uint64_t hash = libtrace_sketch_hash(&candidates[i][0], 16);
+		int j;
+
+		for (j = 0; j < NUM_COUNTS; j++)
+			est[j] = libtrace_cms_estimate_hash(&approx->counts[j],
+					hash);
+		memset(&r, 0, sizeof(r));
+		memcpy(r.counter.addr, &candidates[i][0], 16);
+		r.counter.src_pkts = est[SRC_PKTS];
+		r.counter.src_bytes = est[SRC_BYTES];
+		r.counter.src_pbytes = est[SRC_PBYTES];
+		r.counter.dst_pkts = est[DST_PKTS];
+		r.counter.dst_bytes = est[DST_BYTES];
+		r.counter.dst_pbytes = est[DST_PBYTES];
+		r.rank = est[SRC_PKTS] + est[DST_PKTS];
+		ranked.push_back(r);
+	}
+	std::sort(ranked.begin(), ranked.end(), rank_order);
+	if (ranked.size() > APPROX_TOP)
+		ranked.resize(APPROX_TOP);
+
+	printf("# Endpoints (estimated): %" PRIu64 "\n",
+			libtrace_hll_estimate(&approx->distinct));
+	for (i = 0; i < ranked.size(); i++) {
+		end_counter_t *c = &ranked[i].counter;
+
+		switch (mode) {
+			case MODE_MAC:
+				addrstr = mac_string(c->addr, str);
+				width = 18;
+				break;
+			case MODE_IPV6:
+				addrstr = inet_ntop(AF_INET6, c->addr, str, 128);
+				width = 40;
+				break;
+			default:
+				addrstr = inet_ntop(AF_INET, c->addr, str, 128);
+				width = 16;
+				break;
+		}
+		printf("%*s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n",
+				width,
+				addrstr,
+				c->src_pkts,
+				c->src_bytes,
+				c->src_pbytes,
+				c->dst_pkts,
+				c->dst_bytes,
+				c->dst_pbytes);
 	}
+}
+
+static void per_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result) {
+
+	end_table_t *tends;
+	uint32_t i;
 
-	return 1;
+	if (result->type != RESULT_USER)
+		return;
+
+	if (approximate) {
+		merge_approx((approx_ends_t *)result->value.ptr);
+		return;
+	}
+
+	/* Every thread's endpoints for an interval arrive before any from a
+	 * later interval, so only check for idle endpoints once an interval
+	 * is complete */
+	if (result->key > current_interval) {
+		if (expire > 0)
+			expire_ends((current_interval + 1) * flush_interval -
+					expire);
+		current_interval = result->key;
+	}
+
+	/* An idle thread, or a tick */
+	tends = (end_table_t *)result->value.ptr;
+	if (!tends)
+		return;
+	for (i = 0; i < tends->used; i++) {
+		end_counter_t *from = get_counter(tends, i);
+		end_counter_t *c;
+		uint32_t idx;
+
+		c = endtable_get(ends, from->addr, &idx);
+		c->src_pkts += from->src_pkts;
+		c->src_bytes += from->src_bytes;
+		c->src_pbytes += from->src_pbytes;
+		c->dst_pkts += from->dst_pkts;
+		c->dst_bytes += from->dst_bytes;
+		c->dst_pbytes += from->dst_pbytes;
+		if (from->last_active > c->last_active)
+			c->last_active = from->last_active;
+		if (expire > 0)
+			endtable_touch(ends, idx);
+	}
+	endtable_destroy(tends);
 }
 
 int main(int argc, char *argv[]) {
@@ -385,18 +863,22 @@ int main(int argc, char *argv[]) {
         struct sigaction sigact;
 	struct libtrace_filter_t *filter=NULL;
         struct libtrace_t *input = NULL;
-        struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *repcbs;
+	std::vector<end_counter_t *> remaining;
 
         while(1) {
                 int option_index;
                 struct option long_options[] = {
                         { "filter",        1, 0, 'f' },
                         { "help", 	   0, 0, 'H' },
-			{ "addresses", 	   1, 0, 'A' },	
+			{ "addresses", 	   1, 0, 'A' },
+			{ "expire",	   1, 0, 'e' },
+			{ "threads",	   1, 0, 't' },
+			{ "approximate",   0, 0, 'S' },
                         { NULL,            0, 0, 0   },
                 };
 
-                int c=getopt_long(argc, argv, "A:f:H",
+                int c=getopt_long(argc, argv, "A:e:f:HSt:",
                                 long_options, &option_index);
 
                 if (c==-1)
@@ -414,12 +896,31 @@ int main(int argc, char *argv[]) {
 					return 1;
 				}
 				break;
+			case 'e':
+				expire = atof(optarg);
+				if (expire <= 0) {
+					fprintf(stderr, "Expiry time must be >0\n");
+					return 1;
+				}
+				/* Flush often enough that endpoints expire
+				 * close to on time */
+				if (expire < flush_interval)
+					flush_interval = expire;
+				break;
 
                         case 'f': filter=trace_create_filter(optarg);
                         	break;
 			case 'H':
                                 usage(argv[0]);
                                 break;
+			case 'S':
+				approximate = true;
+				break;
+			case 't':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			default:
                                 fprintf(stderr,"Unknown option: %c\n",c);
                                 usage(argv[0]);
@@ -427,6 +928,12 @@ int main(int argc, char *argv[]) {
 		}
 
 	}
+
+	if (approximate && expire > 0) {
+		fprintf(stderr, "Endpoints can't be expired when using --approximate\n");
+		return 1;
+	}
+
         sigact.sa_handler = cleanup_signal;
         sigemptyset(&sigact.sa_mask);
         sigact.sa_flags = SA_RESTART;
@@ -436,6 +943,20 @@ int main(int argc, char *argv[]) {
         sigaction(SIGPIPE, &sigact, NULL);
         sigaction(SIGHUP, &sigact, NULL);
 
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, start_processing);
+	trace_set_packet_cb(pktcbs, per_packet);
+	trace_set_tick_interval_cb(pktcbs, per_tick);
+	trace_set_stopping_cb(pktcbs, stop_processing);
+
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, per_result);
+
+	if (approximate)
+		approx = approx_create();
+	else
+		ends = endtable_create(ENDTABLE_INITIAL_SIZE);
+
 	for (i = optind; i < argc; i++) {
 		input = trace_create(argv[i]);
 
@@ -450,22 +971,24 @@ int main(int argc, char *argv[]) {
                         return 1;
                 }
 
-                if (trace_start(input)==-1) {
+		trace_set_combiner(input, &combiner_ordered,
+				(libtrace_generic_t){0});
+		trace_set_perpkt_threads(input, threadcount);
+
+		/* Make sure that idle threads still hand over their
+		 * endpoints when capturing live */
+		if (trace_get_information(input)->live)
+			trace_set_tick_interval(input,
+					(size_t)(flush_interval * 1000));
+
+		currenttrace = input;
+                if (trace_pstart(input, NULL, pktcbs, repcbs)==-1) {
                         trace_perror(input,"%s",argv[i]);
                         return 1;
                 }
 
-		while (trace_read_packet(input,packet)>0) {
-                        if (IS_LIBTRACE_META_PACKET(packet))
-                                continue;
-                        if (per_packet(packet) < 1)
-                                done = 1;
-                        if (done)
-                                break;
-                }
-
-                if (done)
-                        break;
+		trace_join(input);
+		currenttrace = NULL;
 
                 if (trace_is_err(input)) {
                         trace_perror(input,"Reading packets");
@@ -474,14 +997,25 @@ int main(int argc, char *argv[]) {
                 }
 
                 trace_destroy(input);
+
+                if (done)
+                        break;
         }
 
 	/* Dump results */
-	if (mode == MODE_IPV4)
-		dump_ipv4_map();
-	if (mode == MODE_IPV6)
-		dump_ipv6_map();
-	if (mode == MODE_MAC)
-		dump_mac_map();
+	if (approximate) {
+		dump_approx();
+		approx_destroy(approx);
+	} else {
+		for (i = 0; i < (int)ends->mask + 1; i++) {
+			if (ends->slots[i].counter != NO_COUNTER)
+				remaining.push_back(get_counter(ends,
+						ends->slots[i].counter));
+		}
+		dump_counters(remaining);
+		endtable_destroy(ends);
+	}
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
 	return 0;
 }
@@ -63,9 +63,11 @@ int main(int argc, char *argv[])
 {
 	
 	struct libtrace_out_t *output;
-	struct libtrace_t **input;
-	struct libtrace_packet_t **packet;
-	bool *live;
+	struct libtrace_t *input;
+	struct libtrace_packet_t *packet;
+	char *merge_uri;
+	char *end;
+	size_t merge_len;
 	int interfaces_per_input=0;
 	bool unique_packets=false;
 	int i=0;
@@ -188,70 +190,52 @@ int main(int argc, char *argv[])
 	sigaction(SIGINT,&sigact,NULL);
 	sigaction(SIGTERM,&sigact,NULL);
 
-	input=calloc((size_t)(argc-optind),sizeof(struct libtrace_t *));
-	packet=calloc((size_t)(argc-optind),sizeof(struct libtrace_packet_t *));
-	live=calloc((size_t)(argc-optind),sizeof(bool));
-	for(i=0;i<argc-optind;++i) {
-		libtrace_t *f;
-		libtrace_packet_t *p;
-		f=trace_create(argv[i+optind]);
-		if (trace_is_err(f)) {
-			trace_perror(f,"trace_create");
-			return 1;
-		}
-		if (trace_start(f)==-1) {
-			trace_perror(f,"trace_start");
-			return 1;
+	/* Build a merge: URI covering all of the inputs - the merge format
+	 * reads ahead on every input and keeps them in timestamp order */
+	merge_len=strlen("merge:")+1;
+	for(i=optind;i<argc;++i) {
+		/* Leave room to escape every character */
+		merge_len+=strlen(argv[i])*2+1;
+	}
+	merge_uri=malloc(merge_len);
+	strcpy(merge_uri,"merge:");
+	end=merge_uri+strlen(merge_uri);
+	for(i=optind;i<argc;++i) {
+		const char *c;
+		if (i!=optind)
+			*end++=',';
+		for(c=argv[i];*c;++c) {
+			if (*c==',' || *c=='\\')
+				*end++='\\';
+			*end++=*c;
 		}
-		p=trace_create_packet();
-		input[i]=f;
-		packet[i]=p;
-		if (trace_read_packet(f,packet[i])>0)
-			live[i]=true;
 	}
+	*end='\0';
+
+	input=trace_create(merge_uri);
+	if (trace_is_err(input)) {
+		trace_perror(input,"trace_create");
+		return 1;
+	}
+	if (trace_start(input)==-1) {
+		trace_perror(input,"trace_start");
+		return 1;
+	}
+	packet=trace_create_packet();
 
-	while(1) {
-		uint64_t oldest_ts=0;
-                uint64_t this_ts = 0;
-		int oldest=-1;
+	while(trace_read_packet(input,packet)>0) {
+		uint64_t this_ts;
 		int curr_dir;
+		int source;
+
 		if (done)
 			break;
-		for(i=0;i<argc-optind;++i) {
-			if (!live[i] && input[i]) {
-				int ret=trace_read_packet(input[i],packet[i]);
-				if (ret<0) {
-					/* Error */
-					trace_perror(input[i], "%s", argv[i+2]);
-					trace_destroy(input[i]);
-					input[i]=NULL;
-				}
-				else if (ret==0) {
-					/* EOF */
-					trace_destroy(input[i]);
-					input[i]=NULL;
-				}
-				else
-					live[i]=true;
-			}
-			if (live[i]) {
-                                this_ts = trace_get_erf_timestamp(packet[i]);
-				if (this_ts != 0 && (oldest==-1 ||
-				                oldest_ts>this_ts)) {
-        				oldest=i;
-	        			oldest_ts=this_ts;
-			        }
-                        }
-		}
-		/* We have run out of packets! */
-		if (oldest==-1) {
-			break;
-		}
 
-		live[oldest]=false;
+		this_ts = trace_get_erf_timestamp(packet);
+		source = trace_get_merge_input(input, packet);
 
-		curr_dir = trace_get_direction(packet[oldest]);
-		if (curr_dir != -1 && interfaces_per_input) {
+		curr_dir = trace_get_direction(packet);
+		if (curr_dir != -1 && interfaces_per_input && source != -1) {
 			/* If there are more interfaces than
 			 * interfaces_per_input, then clamp at the 
 			 * highest input.  This means things should
@@ -261,22 +245,28 @@ int main(int argc, char *argv[])
 				? curr_dir
 				: interfaces_per_input-1;
 
-			trace_set_direction(packet[oldest],
-					oldest*interfaces_per_input
+			trace_set_direction(packet,
+					source*interfaces_per_input
 					+curr_dir);
 		}
 
-		if (unique_packets && oldest_ts == last_ts)
+		if (unique_packets && this_ts == last_ts)
 			continue;
 
-		if (trace_write_packet(output,packet[oldest]) < 0) {
+		if (trace_write_packet(output,packet) < 0) {
 			trace_perror_output(output, "trace_write_packet");
 			break;
 		}
 
-		last_ts=oldest_ts;
+		last_ts=this_ts;
 		
 	}
+	if (trace_is_err(input))
+		trace_perror(input, "%s", merge_uri);
+
+	trace_destroy_packet(packet);
+	trace_destroy(input);
+	free(merge_uri);
 	trace_destroy_output(output);
 
 	return 0;
@@ -30,6 +30,7 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include "contain.h"
 #include <assert.h>
 
@@ -173,6 +174,111 @@ void splay_visit(const splay *tree, visitor_t pre,visitor_t inorder,visitor_t po
 	if (post) post(tree,userdata);
 }
 
+#define HASH_SET_INITIAL_SIZE 1024
+
+static uint64_t hash_key(const uint8_t *key, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint64_t word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, key, sizeof(word));
+		h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+		key += sizeof(word);
+		len -= sizeof(word);
+	}
+	while (len > 0) {
+		h = (h ^ *key++) * 0x100000001b3ULL;
+		len--;
+	}
+	h ^= h >> 29;
+	return h;
+}
+
+hash_set_t *hash_set_create(size_t keysize)
+{
+	hash_set_t *set = malloc(sizeof(hash_set_t));
+
+	set->keysize = keysize;
+	set->mask = HASH_SET_INITIAL_SIZE - 1;
+	set->count = 0;
+	set->keys = malloc(HASH_SET_INITIAL_SIZE * keysize);
+	set->used = calloc(HASH_SET_INITIAL_SIZE, 1);
+	return set;
+}
+
+void hash_set_destroy(hash_set_t *set)
+{
+	free(set->keys);
+	free(set->used);
+	free(set);
+}
+
+/* Finds the slot holding 'key', or the empty slot where it should go */
+static size_t hash_set_find(const hash_set_t *set, const void *key)
+{
+	size_t slot = hash_key(key, set->keysize) & set->mask;
+
+	while (set->used[slot] && memcmp(set->keys + slot * set->keysize,
+				key, set->keysize) != 0)
+		slot = (slot + 1) & set->mask;
+	return slot;
+}
+
+static void hash_set_grow(hash_set_t *set)
+{
+	uint8_t *oldkeys = set->keys;
+	uint8_t *oldused = set->used;
+	size_t oldsize = set->mask + 1;
+	size_t i;
+
+	set->mask = oldsize * 2 - 1;
+	set->keys = malloc(oldsize * 2 * set->keysize);
+	set->used = calloc(oldsize * 2, 1);
+	for (i = 0; i < oldsize; i++) {
+		size_t slot;
+
+		if (!oldused[i])
+			continue;
+		slot = hash_set_find(set, oldkeys + i * set->keysize);
+		memcpy(set->keys + slot * set->keysize,
+				oldkeys + i * set->keysize, set->keysize);
+		set->used[slot] = 1;
+	}
+	free(oldkeys);
+	free(oldused);
+}
+
+int hash_set_insert(hash_set_t *set, const void *key)
+{
+	size_t slot = hash_set_find(set, key);
+
+	if (set->used[slot])
+		return 0;
+
+	/* Keep the table at most half full so that probes stay short */
+	if ((set->count + 1) * 2 > set->mask + 1) {
+		hash_set_grow(set);
+		slot = hash_set_find(set, key);
+	}
+	memcpy(set->keys + slot * set->keysize, key, set->keysize);
+	set->used[slot] = 1;
+	set->count ++;
+	return 1;
+}
+
+void hash_set_merge(hash_set_t *set, const hash_set_t *other)
+{
+	size_t i;
+
+	assert(set->keysize == other->keysize);
+	for (i = 0; i <= other->mask; i++) {
+		if (other->used[i])
+			hash_set_insert(set, other->keys + i * other->keysize);
+	}
+}
+
 
 #ifdef TEST
 #include <string.h>
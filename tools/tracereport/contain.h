@@ -27,6 +27,10 @@
 
 #ifndef _CONTAIN_
 #define _CONTAIN_
+
+#include <stddef.h>
+#include <inttypes.h>
+
 /* Containers */
 
 /* Splay tree backed associative map
@@ -208,4 +212,28 @@ void splay_visit(const splay *tree, visitor_t pre,visitor_t inorder,visitor_t po
 	 	(name) && name ## _cmp((splay*)(name),(splay *)&_node)==0;\
 	 })
 
+/* Hash sets ***********************************************************/
+
+/* Open addressing set of fixed size keys. Keys are hashed and compared as
+ * raw memory, so any padding in the key type must be zeroed.
+ *
+ * hash_set_t *set = hash_set_create(sizeof(struct fivetuple_t));
+ * if (hash_set_insert(set, &ft))
+ *   printf("New flow\n");
+ */
+typedef struct hash_set {
+	uint8_t *keys;
+	uint8_t *used;
+	size_t keysize;
+	size_t mask;
+	size_t count;
+} hash_set_t;
+
+hash_set_t *hash_set_create(size_t keysize);
+void hash_set_destroy(hash_set_t *set);
+/* Returns 1 if the key was added, 0 if it was already present */
+int hash_set_insert(hash_set_t *set, const void *key);
+/* Adds every key in 'other' to 'set' */
+void hash_set_merge(hash_set_t *set, const hash_set_t *other);
+
 #endif /* _CONTAIN_ */
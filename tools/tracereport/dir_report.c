@@ -29,23 +29,47 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static uint64_t dir_bytes[8];
-static uint64_t dir_packets[8];
+struct dir_state {
+	uint64_t dir_bytes[8];
+	uint64_t dir_packets[8];
+};
 
-void dir_per_packet(struct libtrace_packet_t *packet)
+static void *dir_init(void)
 {
+	return calloc(1, sizeof(struct dir_state));
+}
+
+static void dir_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct dir_state *s = state;
+
 	if (trace_get_direction(packet)==-1)
 		return;
-	dir_bytes[trace_get_direction(packet)]+=trace_get_wire_length(packet);
-	++dir_packets[trace_get_direction(packet)];
+	s->dir_bytes[trace_get_direction(packet)]+=trace_get_wire_length(packet);
+	++s->dir_packets[trace_get_direction(packet)];
 }
 
-void dir_report(void)
+static void dir_merge(void *state, void *other)
 {
+	struct dir_state *s = state, *o = other;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		s->dir_bytes[i] += o->dir_bytes[i];
+		s->dir_packets[i] += o->dir_packets[i];
+	}
+}
+
+static void dir_report(void *state)
+{
+	struct dir_state *s = state;
+	uint64_t *dir_bytes = s->dir_bytes;
+	uint64_t *dir_packets = s->dir_packets;
 	int i;
 	FILE *out = fopen("dir.rpt", "w");
 	if (!out) {
@@ -73,3 +97,12 @@ void dir_report(void)
 	}
 	fclose(out);
 }
+
+const report_module_t dir_module = {
+	REPORT_TYPE_DIR,
+	dir_init,
+	dir_per_packet,
+	dir_merge,
+	dir_report,
+	free
+};
@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t ecn_stat[3][4] = {{{0,0}}} ;
+struct ecn_state {
+	stat_t ecn_stat[3][4];
+};
 
-void ecn_per_packet(struct libtrace_packet_t *packet)
+static void *ecn_init(void)
 {
+	return calloc(1, sizeof(struct ecn_state));
+}
+
+static void ecn_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct ecn_state *s = state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	int ecn;
@@ -48,12 +57,22 @@ void ecn_per_packet(struct libtrace_packet_t *packet)
 		dir = TRACE_DIR_OTHER;
 	
 	ecn = ip->ip_tos & 0x2;
-	ecn_stat[dir][ecn].count++;
-	ecn_stat[dir][ecn].bytes+=trace_get_wire_length(packet);
+	s->ecn_stat[dir][ecn].count++;
+	s->ecn_stat[dir][ecn].bytes+=trace_get_wire_length(packet);
+}
+
+static void ecn_merge(void *state, void *other)
+{
+	struct ecn_state *s = state, *o = other;
+
+	merge_stats(&s->ecn_stat[0][0], &o->ecn_stat[0][0],
+			sizeof(s->ecn_stat) / sizeof(stat_t));
 }
 
-void ecn_report(void)
+static void ecn_report(void *state)
 {
+	struct ecn_state *s = state;
+	stat_t (*ecn_stat)[4] = s->ecn_stat;
 	int i,j;
 	int total = 0;
 	
@@ -117,3 +136,12 @@ void ecn_report(void)
 	fprintf(out, "%s: %i\n", "Total ECN", total);
 	fclose(out);
 }
+
+const report_module_t ecn_module = {
+	REPORT_TYPE_ECN,
+	ecn_init,
+	ecn_per_packet,
+	ecn_merge,
+	ecn_report,
+	free
+};
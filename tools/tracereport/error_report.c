@@ -29,21 +29,30 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static uint64_t rx_errors = 0;
-static uint64_t ip_errors = 0;
-static uint64_t tcp_errors = 0;
+struct error_state {
+	uint64_t rx_errors;
+	uint64_t ip_errors;
+	uint64_t tcp_errors;
+};
 
-void error_per_packet(struct libtrace_packet_t *packet)
+static void *error_init(void)
 {
+	return calloc(1, sizeof(struct error_state));
+}
+
+static void error_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct error_state *s = state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	void *link = trace_get_packet_buffer(packet,NULL,NULL);
 	if (!link) {
-		++rx_errors;
+		++s->rx_errors;
 	}
 	
 	/* This isn't quite as simple as it seems.
@@ -56,25 +65,44 @@ void error_per_packet(struct libtrace_packet_t *packet)
 	 */
 	if (ip) {
 		if (ntohs(ip->ip_sum)!=0)
-			++ip_errors;
+			++s->ip_errors;
 	}
 	if (tcp) {
 		if (ntohs(tcp->check)!=0)
-			++tcp_errors;
+			++s->tcp_errors;
 	}
 }
 
-void error_report(void)
+static void error_merge(void *state, void *other)
+{
+	struct error_state *s = state, *o = other;
+
+	s->rx_errors += o->rx_errors;
+	s->ip_errors += o->ip_errors;
+	s->tcp_errors += o->tcp_errors;
+}
+
+static void error_report(void *state)
 {
+	struct error_state *s = state;
 	FILE *out = fopen("error.rpt", "w");
 	if (!out) {
 		perror("fopen");
 		return;
 	}
 	
-	fprintf(out, "RX Errors: %" PRIu64 "\n",rx_errors);
-	fprintf(out, "IP Checksum errors: %" PRIu64 "\n",ip_errors);
+	fprintf(out, "RX Errors: %" PRIu64 "\n",s->rx_errors);
+	fprintf(out, "IP Checksum errors: %" PRIu64 "\n",s->ip_errors);
 	/*printf("TCP Checksum errors: %" PRIu64 "\n",tcp_errors); */
 
 	fclose(out);
 }
+
+const report_module_t error_module = {
+	REPORT_TYPE_ERROR,
+	error_init,
+	error_per_packet,
+	error_merge,
+	error_report,
+	free
+};
@@ -30,13 +30,13 @@
 #include <lt_inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "libtrace.h"
+#include "data-struct/sketch.h"
 #include "tracereport.h"
 #include "contain.h"
 #include "report.h"
 
-static uint64_t flow_count=0;
-
 struct fivetuple_t {
 	uint32_t ipa;
 	uint32_t ipb;
@@ -45,43 +45,114 @@ struct fivetuple_t {
 	uint8_t prot;
 };
 
-static int fivetuplecmp(struct fivetuple_t a, struct fivetuple_t b)
+static void *flow_init(void)
 {
-	if (a.porta != b.porta) return a.porta-b.porta;
-	if (a.portb != b.portb) return a.portb-b.portb;
-	if (a.ipa != b.ipa) return a.ipa-b.ipa;
-	if (a.ipb != b.ipb) return a.ipb-b.ipb;
-	return a.prot - b.prot;
+	return hash_set_create(sizeof(struct fivetuple_t));
 }
 
-static int flowset_cmp(const splay *a, const splay *b);
-SET_CREATE(flowset,struct fivetuple_t,fivetuplecmp)
-
-void flow_per_packet(struct libtrace_packet_t *packet)
+static void flow_per_packet(void *state, struct libtrace_packet_t *packet)
 {
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	struct fivetuple_t ft;
 	if (!ip)
 		return;
+	/* The whole struct is hashed, so clear the padding too */
+	memset(&ft, 0, sizeof(ft));
 	ft.ipa=ip->ip_src.s_addr;
 	ft.ipb=ip->ip_dst.s_addr;
 	ft.porta=trace_get_source_port(packet);
 	ft.portb=trace_get_destination_port(packet);
 	ft.prot = 0;
 
-	if (!SET_CONTAINS(flowset,ft)) {
-		SET_INSERT(flowset,ft);
-		flow_count++;
+	hash_set_insert(state, &ft);
+}
+
+static void flow_merge(void *state, void *other)
+{
+	hash_set_merge(state, other);
+}
+
+static void flow_report(void *state)
+{
+	hash_set_t *flows = state;
+	FILE *out = fopen("flows.rpt", "w");
+	if (!out) {
+		perror("fopen");
+		return;
 	}
+	fprintf(out, "Flows: %" PRIu64 "\n", (uint64_t)flows->count);
+	fclose(out);
+}
+
+static void flow_destroy(void *state)
+{
+	hash_set_destroy(state);
+}
+
+const report_module_t flow_module = {
+	REPORT_TYPE_FLOW,
+	flow_init,
+	flow_per_packet,
+	flow_merge,
+	flow_report,
+	flow_destroy
+};
+
+/* With --approximate, distinct flows are estimated with a HyperLogLog
+ * rather than remembering every one of them */
+static void *flow_approx_init(void)
+{
+	libtrace_hll_t *hll = malloc(sizeof(libtrace_hll_t));
+
+	libtrace_hll_init(hll, LIBTRACE_HLL_DEFAULT_PRECISION);
+	return hll;
 }
 
-void flow_report(void)
+static void flow_approx_per_packet(void *state,
+		struct libtrace_packet_t *packet)
+{
+	struct libtrace_ip *ip = trace_get_ip(packet);
+	struct fivetuple_t ft;
+	if (!ip)
+		return;
+	memset(&ft, 0, sizeof(ft));
+	ft.ipa=ip->ip_src.s_addr;
+	ft.ipb=ip->ip_dst.s_addr;
+	ft.porta=trace_get_source_port(packet);
+	ft.portb=trace_get_destination_port(packet);
+	ft.prot = 0;
+
+	libtrace_hll_add(state, &ft, sizeof(ft));
+}
+
+static void flow_approx_merge(void *state, void *other)
+{
+	libtrace_hll_merge(state, other);
+}
+
+static void flow_approx_report(void *state)
 {
 	FILE *out = fopen("flows.rpt", "w");
 	if (!out) {
 		perror("fopen");
 		return;
 	}
-	fprintf(out, "Flows: %" PRIu64 "\n",flow_count);
+	fprintf(out, "Flows: %" PRIu64 " (estimated)\n",
+			libtrace_hll_estimate(state));
 	fclose(out);
 }
+
+static void flow_approx_destroy(void *state)
+{
+	libtrace_hll_destroy(state);
+	free(state);
+}
+
+const report_module_t flow_approx_module = {
+	REPORT_TYPE_FLOW,
+	flow_approx_init,
+	flow_approx_per_packet,
+	flow_approx_merge,
+	flow_approx_report,
+	flow_approx_destroy
+};
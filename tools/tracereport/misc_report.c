@@ -27,6 +27,7 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
@@ -34,24 +35,47 @@
 #include "tracereport.h"
 #include "report.h"
 
-static double starttime;
-static double endtime;
-static bool has_starttime = false;
-static bool has_endtime = false;
-static uint64_t packets = 0;
+struct misc_state {
+	double starttime;
+	double endtime;
+	bool has_starttime;
+	bool has_endtime;
+	uint64_t packets;
 
-static uint64_t capture_bytes = 0;
+	uint64_t capture_bytes;
+};
 
-void misc_per_packet(struct libtrace_packet_t *packet)
+static void *misc_init(void)
 {
+	return calloc(1, sizeof(struct misc_state));
+}
+
+static void misc_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct misc_state *s = state;
 	double ts = trace_get_seconds(packet);
-	if (ts != 0 && (!has_starttime || starttime > ts))
-		starttime = ts;
-	if (ts != 0 && (!has_endtime || endtime < ts))
-		endtime = ts;
-	has_starttime = has_endtime = true;
-	++packets;
-	capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+	if (ts != 0 && (!s->has_starttime || s->starttime > ts))
+		s->starttime = ts;
+	if (ts != 0 && (!s->has_endtime || s->endtime < ts))
+		s->endtime = ts;
+	s->has_starttime = s->has_endtime = true;
+	++s->packets;
+	s->capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+}
+
+static void misc_merge(void *state, void *other)
+{
+	struct misc_state *s = state, *o = other;
+
+	if (o->has_starttime && (!s->has_starttime ||
+				s->starttime > o->starttime))
+		s->starttime = o->starttime;
+	if (o->has_endtime && (!s->has_endtime || s->endtime < o->endtime))
+		s->endtime = o->endtime;
+	s->has_starttime = s->has_starttime || o->has_starttime;
+	s->has_endtime = s->has_endtime || o->has_endtime;
+	s->packets += o->packets;
+	s->capture_bytes += o->capture_bytes;
 }
 
 static char *ts_to_date(double ts)
@@ -97,8 +121,12 @@ static char *duration(double ts)
 	return ret;
 }
 
-void misc_report(void)
+static void misc_report(void *state)
 {
+	struct misc_state *s = state;
+	double starttime = s->starttime;
+	double endtime = s->endtime;
+	uint64_t packets = s->packets;
 	FILE *out = fopen("misc.rpt", "w");
 	if (!out) {
 		perror("fopen");
@@ -111,5 +139,14 @@ void misc_report(void)
 	fprintf(out, "Total Packets: %" PRIu64 "\n",packets);
 	fprintf(out, "Average packet rate: %.02f packets/sec\n",
 			packets/(endtime-starttime));
-	fprintf(out, "Uncompressed trace size: %" PRIu64 "\n", capture_bytes);
+	fprintf(out, "Uncompressed trace size: %" PRIu64 "\n", s->capture_bytes);
 }
+
+const report_module_t misc_module = {
+	REPORT_TYPE_MISC,
+	misc_init,
+	misc_per_packet,
+	misc_merge,
+	misc_report,
+	free
+};
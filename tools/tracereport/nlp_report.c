@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t nlp_stat[3][65536] = {{{0,0}}} ;
+struct nlp_state {
+	stat_t nlp_stat[3][65536];
+};
 
-void nlp_per_packet(struct libtrace_packet_t *packet)
+static void *nlp_init(void)
 {
+	return calloc(1, sizeof(struct nlp_state));
+}
+
+static void nlp_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct nlp_state *s = state;
 	uint16_t ethertype;
 	void *link;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -49,11 +58,22 @@ void nlp_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	nlp_stat[dir][ethertype].count++;
-	nlp_stat[dir][ethertype].bytes+=trace_get_wire_length(packet);
+	s->nlp_stat[dir][ethertype].count++;
+	s->nlp_stat[dir][ethertype].bytes+=trace_get_wire_length(packet);
 }
 
-void nlp_report(void){
+static void nlp_merge(void *state, void *other)
+{
+	struct nlp_state *s = state, *o = other;
+
+	merge_stats(&s->nlp_stat[0][0], &o->nlp_stat[0][0],
+			sizeof(s->nlp_stat) / sizeof(stat_t));
+}
+
+static void nlp_report(void *state)
+{
+	struct nlp_state *s = state;
+	stat_t (*nlp_stat)[65536] = s->nlp_stat;
 	int i,j;
 	
 	FILE *out = fopen("nlp.rpt", "w");
@@ -118,3 +138,12 @@ void nlp_report(void){
 	}
 	fclose(out);
 }
+
+const report_module_t nlp_module = {
+	REPORT_TYPE_NLP,
+	nlp_init,
+	nlp_per_packet,
+	nlp_merge,
+	nlp_report,
+	free
+};
@@ -36,12 +36,19 @@
 #include "contain.h"
 #include "report.h"
 
-stat_t *ports[3][256] = {{NULL}};
-char protn[256]={0};
-static bool suppress[3] = {true,true,true};
+struct port_state {
+	stat_t *ports[3][256];
+	char protn[256];
+};
 
-void port_per_packet(struct libtrace_packet_t *packet)
+static void *port_init(void)
 {
+	return calloc(1, sizeof(struct port_state));
+}
+
+static void port_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct port_state *s = state;
 	uint8_t proto;
 	int port;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -58,16 +65,39 @@ void port_per_packet(struct libtrace_packet_t *packet)
 		? trace_get_source_port(packet)
 		: trace_get_destination_port(packet);
 
-	if (!ports[dir][proto])
-		ports[dir][proto]=calloc(65536,sizeof(stat_t));
-	ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
-	ports[dir][proto][port].count++;
-	protn[proto]=1;
-	suppress[dir] = false;
+	if (!s->ports[dir][proto])
+		s->ports[dir][proto]=calloc(65536,sizeof(stat_t));
+	s->ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
+	s->ports[dir][proto][port].count++;
+	s->protn[proto]=1;
 }
 
+static void port_merge(void *state, void *other)
+{
+	struct port_state *s = state, *o = other;
+	int i, k;
 
-static void port_port(int i,char *prot, int j, FILE *out)
+	for (i = 0; i < 256; i++) {
+		if (!o->protn[i])
+			continue;
+		for (k = 0; k < 3; k++) {
+			if (!o->ports[k][i])
+				continue;
+			/* Steal the other thread's table if we have none */
+			if (!s->ports[k][i]) {
+				s->ports[k][i] = o->ports[k][i];
+				o->ports[k][i] = NULL;
+				continue;
+			}
+			merge_stats(s->ports[k][i], o->ports[k][i], 65536);
+		}
+		s->protn[i] = 1;
+	}
+}
+
+
+static void port_port(stat_t *(*ports)[256], int i, char *prot, int j,
+		FILE *out)
 {
 	struct servent *ent = getservbyport(htons(j),prot);
 	int k;
@@ -102,7 +132,7 @@ static void port_port(int i,char *prot, int j, FILE *out)
 	}
 }
 
-static void port_protocol(int i, FILE *out)
+static void port_protocol(stat_t *(*ports)[256], int i, FILE *out)
 {
 	int j,k;
 	struct protoent *ent = getprotobynumber(i);
@@ -111,15 +141,16 @@ static void port_protocol(int i, FILE *out)
 	for(j=0;j<65536;++j) {
 		for(k=0;k<3;k++){
 			if (ports[k][i] && ports[k][i][j].count) {
-				port_port(i,ent?ent->p_name:"",j, out);
+				port_port(ports, i, ent?ent->p_name:"", j, out);
 				break;
 			}
 		}
 	}
 }
 
-void port_report(void)
+static void port_report(void *state)
 {
+	struct port_state *s = state;
 	int i;
 	FILE *out = fopen("ports.rpt", "w");
 	if (!out) {
@@ -135,14 +166,30 @@ void port_report(void)
 	setservent(1);
 	setprotoent(1);
 	for(i=0;i<256;++i) {
-		if (protn[i]) {
-			port_protocol(i, out);
-			free(ports[0][i]);
-			free(ports[1][i]);
-			free(ports[2][i]);
-		}
+		if (s->protn[i])
+			port_protocol(s->ports, i, out);
 	}
 	endprotoent();
 	endservent();
 	fclose(out);
 }
+
+static void port_destroy(void *state)
+{
+	struct port_state *s = state;
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		for (k = 0; k < 3; k++)
+			free(s->ports[k][i]);
+	free(s);
+}
+
+const report_module_t port_module = {
+	REPORT_TYPE_PORT,
+	port_init,
+	port_per_packet,
+	port_merge,
+	port_report,
+	port_destroy
+};
@@ -29,15 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t prot_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct protocol_state {
+	stat_t prot_stat[3][256];
+};
 
-void protocol_per_packet(struct libtrace_packet_t *packet)
+static void *protocol_init(void)
 {
+	return calloc(1, sizeof(struct protocol_state));
+}
+
+static void protocol_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct protocol_state *s = state;
 	uint8_t proto;
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -47,13 +55,22 @@ void protocol_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	prot_stat[dir][proto].count++;
-	prot_stat[dir][proto].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	s->prot_stat[dir][proto].count++;
+	s->prot_stat[dir][proto].bytes+=trace_get_wire_length(packet);
+}
+
+static void protocol_merge(void *state, void *other)
+{
+	struct protocol_state *s = state, *o = other;
+
+	merge_stats(&s->prot_stat[0][0], &o->prot_stat[0][0],
+			sizeof(s->prot_stat) / sizeof(stat_t));
 }
 
-void protocol_report(void)
+static void protocol_report(void *state)
 {
+	struct protocol_state *s = state;
+	stat_t (*prot_stat)[256] = s->prot_stat;
 	int i,j;
 	FILE *out = fopen("protocol.rpt", "w");
 	if (!out) {
@@ -104,3 +121,12 @@ void protocol_report(void)
 	setprotoent(0);
 	fclose(out);
 }
+
+const report_module_t protocol_module = {
+	REPORT_TYPE_PROTO,
+	protocol_init,
+	protocol_per_packet,
+	protocol_merge,
+	protocol_report,
+	free
+};
@@ -28,35 +28,41 @@
 #ifndef REPORT_H
 #define REPORT_H
 
-void dir_per_packet(struct libtrace_packet_t *packet);
-void error_per_packet(struct libtrace_packet_t *packet);
-void flow_per_packet(struct libtrace_packet_t *packet);
-void misc_per_packet(struct libtrace_packet_t *packet);
-void port_per_packet(struct libtrace_packet_t *packet);
-void protocol_per_packet(struct libtrace_packet_t *packet);
-void tos_per_packet(struct libtrace_packet_t *packet);
-void ttl_per_packet(struct libtrace_packet_t *packet);
-void tcpopt_per_packet(struct libtrace_packet_t *packet);
-void synopt_per_packet(struct libtrace_packet_t *packet);
-void nlp_per_packet(struct libtrace_packet_t *packet);
-void ecn_per_packet(struct libtrace_packet_t *packet);
-void tcpseg_per_packet(struct libtrace_packet_t *packet);
+#include "tracereport.h"
 
-void drops_per_trace(libtrace_t *trace);
+/* A report keeps all of its statistics in a state object, so that each
+ * processing thread can count into its own copy. Once a trace has been
+ * read, the copies are merged into one state which is then written out.
+ */
+typedef struct report_module {
+	report_type_t type;
+	/* Allocates an empty state */
+	void *(*init)(void);
+	void (*per_packet)(void *state, struct libtrace_packet_t *packet);
+	/* Adds the statistics in 'other' to 'state' */
+	void (*merge)(void *state, void *other);
+	/* Writes the report file */
+	void (*report)(void *state);
+	void (*destroy)(void *state);
+} report_module_t;
 
-void dir_report(void);
-void error_report(void);
-void flow_report(void);
-void misc_report(void);
-void port_report(void);
-void protocol_report(void);
-void tos_report(void);
-void ttl_report(void);
-void tcpopt_report(void);
-void synopt_report(void);
-void nlp_report(void);
-void ecn_report(void);
-void tcpseg_report(void);
+extern const report_module_t dir_module;
+extern const report_module_t error_module;
+extern const report_module_t flow_module;
+extern const report_module_t flow_approx_module;
+extern const report_module_t misc_module;
+extern const report_module_t port_module;
+extern const report_module_t protocol_module;
+extern const report_module_t tos_module;
+extern const report_module_t ttl_module;
+extern const report_module_t tcpopt_module;
+extern const report_module_t synopt_module;
+extern const report_module_t nlp_module;
+extern const report_module_t ecn_module;
+extern const report_module_t tcpseg_module;
+
+/* Drop counters come from the trace itself rather than from packets */
+void drops_per_trace(libtrace_t *trace);
 void drops_report(void);
 
 #endif
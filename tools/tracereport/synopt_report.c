@@ -29,6 +29,7 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
@@ -61,11 +62,18 @@ struct opt_counter {
 	uint64_t other;
 };
 
-struct opt_counter syn_counts = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-struct opt_counter synack_counts = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+struct synopt_state {
+	struct opt_counter syn_counts;
+	struct opt_counter synack_counts;
 
-uint64_t total_syns = 0;
-uint64_t total_synacks = 0;
+	uint64_t total_syns;
+	uint64_t total_synacks;
+};
+
+static void *synopt_init(void)
+{
+	return calloc(1, sizeof(struct synopt_state));
+}
 
 static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 	if (!opts.mss && !opts.sack && !opts.winscale && !opts.ts && !opts.ttcp && !opts.other)
@@ -125,8 +133,9 @@ static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 		counts->other ++;	
 }
 
-void synopt_per_packet(struct libtrace_packet_t *packet)
+static void synopt_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct synopt_state *s = state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -180,17 +189,44 @@ void synopt_per_packet(struct libtrace_packet_t *packet)
 	}
 
 	if (tcp->ack) {
-		total_synacks ++;
-		classify_packet(opts_seen, &synack_counts);
+		s->total_synacks ++;
+		classify_packet(opts_seen, &s->synack_counts);
 	} else {
-		total_syns ++;
-		classify_packet(opts_seen, &syn_counts);
+		s->total_syns ++;
+		classify_packet(opts_seen, &s->syn_counts);
 	}
 }
 
+static void merge_counts(struct opt_counter *counts,
+		const struct opt_counter *other)
+{
+	uint64_t *c = (uint64_t *)counts;
+	const uint64_t *o = (const uint64_t *)other;
+	size_t i;
+
+	/* struct opt_counter is nothing but counters */
+	for (i = 0; i < sizeof(struct opt_counter) / sizeof(uint64_t); i++)
+		c[i] += o[i];
+}
+
+static void synopt_merge(void *state, void *other)
+{
+	struct synopt_state *s = state, *o = other;
+
+	merge_counts(&s->syn_counts, &o->syn_counts);
+	merge_counts(&s->synack_counts, &o->synack_counts);
+	s->total_syns += o->total_syns;
+	s->total_synacks += o->total_synacks;
+}
 
-void synopt_report(void)
+
+static void synopt_report(void *state)
 {
+	struct synopt_state *s = state;
+	struct opt_counter syn_counts = s->syn_counts;
+	struct opt_counter synack_counts = s->synack_counts;
+	uint64_t total_syns = s->total_syns;
+	uint64_t total_synacks = s->total_synacks;
 	
 	FILE *out = fopen("tcpopt_syn.rpt", "w");
 	if (!out) {
@@ -267,3 +303,12 @@ void synopt_report(void)
 	
 	fclose(out);
 }
+
+const report_module_t synopt_module = {
+	REPORT_TYPE_SYNOPT,
+	synopt_init,
+	synopt_per_packet,
+	synopt_merge,
+	synopt_report,
+	free
+};
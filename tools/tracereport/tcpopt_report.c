@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t tcpopt_stat[3][256] = {{{0,0}}};
+struct tcpopt_state {
+	stat_t tcpopt_stat[3][256];
+};
 
-void tcpopt_per_packet(struct libtrace_packet_t *packet)
+static void *tcpopt_init(void)
 {
+	return calloc(1, sizeof(struct tcpopt_state));
+}
+
+static void tcpopt_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct tcpopt_state *s = state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -61,15 +70,25 @@ void tcpopt_per_packet(struct libtrace_packet_t *packet)
 		/* I don't think we need to count NO-OPs */
 		if (type == 1)
 			continue;
-		tcpopt_stat[dir][type].count++;
-		tcpopt_stat[dir][type].bytes+= tcp_payload;
+		s->tcpopt_stat[dir][type].count++;
+		s->tcpopt_stat[dir][type].bytes+= tcp_payload;
 	}
 	
 }
 
+static void tcpopt_merge(void *state, void *other)
+{
+	struct tcpopt_state *s = state, *o = other;
+
+	merge_stats(&s->tcpopt_stat[0][0], &o->tcpopt_stat[0][0],
+			sizeof(s->tcpopt_stat) / sizeof(stat_t));
+}
+
 
-void tcpopt_report(void)
+static void tcpopt_report(void *state)
 {
+	struct tcpopt_state *s = state;
+	stat_t (*tcpopt_stat)[256] = s->tcpopt_stat;
 	
 	int i,j;
 	
@@ -144,3 +163,12 @@ void tcpopt_report(void)
 	}
 	fclose(out);
 }
+
+const report_module_t tcpopt_module = {
+	REPORT_TYPE_TCPOPT,
+	tcpopt_init,
+	tcpopt_per_packet,
+	tcpopt_merge,
+	tcpopt_report,
+	free
+};
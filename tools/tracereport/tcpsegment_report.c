@@ -29,17 +29,29 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
 #define MAX_SEG_SIZE 10000
 
-static stat_t tcpseg_stat[3][MAX_SEG_SIZE + 1] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct tcpseg_state {
+	stat_t tcpseg_stat[3][MAX_SEG_SIZE + 1];
+	bool suppress[3];
+};
 
-void tcpseg_per_packet(struct libtrace_packet_t *packet)
+static void *tcpseg_init(void)
 {
+	struct tcpseg_state *s = calloc(1, sizeof(struct tcpseg_state));
+
+	s->suppress[0] = s->suppress[1] = s->suppress[2] = true;
+	return s;
+}
+
+static void tcpseg_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct tcpseg_state *s = state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	libtrace_ip_t *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -62,13 +74,27 @@ void tcpseg_per_packet(struct libtrace_packet_t *packet)
 	}
 
 
-	tcpseg_stat[dir][ss].count++;
-	tcpseg_stat[dir][ss].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	s->tcpseg_stat[dir][ss].count++;
+	s->tcpseg_stat[dir][ss].bytes+=trace_get_wire_length(packet);
+	s->suppress[dir] = false;
 }
 
-void tcpseg_report(void)
+static void tcpseg_merge(void *state, void *other)
 {
+	struct tcpseg_state *s = state, *o = other;
+	int i;
+
+	merge_stats(&s->tcpseg_stat[0][0], &o->tcpseg_stat[0][0],
+			sizeof(s->tcpseg_stat) / sizeof(stat_t));
+	for (i = 0; i < 3; i++)
+		s->suppress[i] = s->suppress[i] && o->suppress[i];
+}
+
+static void tcpseg_report(void *state)
+{
+	struct tcpseg_state *s = state;
+	stat_t (*tcpseg_stat)[MAX_SEG_SIZE + 1] = s->tcpseg_stat;
+	bool *suppress = s->suppress;
 	int i,j;
 	FILE *out = fopen("tcpseg.rpt", "w");
 	if (!out) {
@@ -113,3 +139,12 @@ void tcpseg_report(void)
 	}
 	fclose(out);
 }
+
+const report_module_t tcpseg_module = {
+	REPORT_TYPE_TCPSEG,
+	tcpseg_init,
+	tcpseg_per_packet,
+	tcpseg_merge,
+	tcpseg_report,
+	free
+};
@@ -28,15 +28,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t tos_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct tos_state {
+	stat_t tos_stat[3][256];
+};
 
-void tos_per_packet(struct libtrace_packet_t *packet)
+static void *tos_init(void)
 {
+	return calloc(1, sizeof(struct tos_state));
+}
+
+static void tos_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct tos_state *s = state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -46,14 +54,23 @@ void tos_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	tos_stat[dir][ip->ip_tos].count++;
-	tos_stat[dir][ip->ip_tos].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	s->tos_stat[dir][ip->ip_tos].count++;
+	s->tos_stat[dir][ip->ip_tos].bytes+=trace_get_wire_length(packet);
+}
+
+static void tos_merge(void *state, void *other)
+{
+	struct tos_state *s = state, *o = other;
+
+	merge_stats(&s->tos_stat[0][0], &o->tos_stat[0][0],
+			sizeof(s->tos_stat) / sizeof(stat_t));
 }
 
 
-void tos_report(void)
+static void tos_report(void *state)
 {
+	struct tos_state *s = state;
+	stat_t (*tos_stat)[256] = s->tos_stat;
 	int i,j;
 	FILE *out = fopen("tos.rpt", "w");
 	if (!out) {
@@ -95,3 +112,12 @@ void tos_report(void)
 	}
 	fclose(out);
 }
+
+const report_module_t tos_module = {
+	REPORT_TYPE_TOS,
+	tos_init,
+	tos_per_packet,
+	tos_merge,
+	tos_report,
+	free
+};
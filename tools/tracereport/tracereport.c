@@ -40,36 +40,166 @@
 #include <inttypes.h>
 #include <signal.h>
 
-#include "libtrace.h"
+#include "libtrace_parallel.h"
 #include "tracereport.h"
 #include "report.h"
 
 struct libtrace_t *trace;
 uint32_t reports_required = 0;
-int packets_read = 0;
+static int count = -1;
+static int threadcount = 4;
+static uint64_t packets_read = 0;
+static int approximate = 0;
 
 static volatile int done=0;
 
+/* Sent to the reporter once enough packets have been read (see -c) */
+#define MESSAGE_COUNT_REACHED (MESSAGE_USER + 1)
+
+/* Every report, in the order the reports are written out */
+static const report_module_t *modules[] = {
+	&misc_module,
+	&error_module,
+	&flow_module,
+	&tos_module,
+	&protocol_module,
+	&port_module,
+	&ttl_module,
+	&tcpopt_module,
+	&synopt_module,
+	&nlp_module,
+	&dir_module,
+	&ecn_module,
+	&tcpseg_module,
+};
+
+#define MODULE_COUNT (sizeof(modules) / sizeof(modules[0]))
+
+/* The merged state for each required report, owned by the reporter */
+static void *report_states[MODULE_COUNT];
+
 static void cleanup_signal(int sig UNUSED)
 {
 	done=1;
-	trace_interrupt();
+	if (trace)
+		trace_pstop(trace);
+}
+
+static void **create_states(void)
+{
+	void **states = calloc(MODULE_COUNT, sizeof(void *));
+	size_t i;
+
+	for (i = 0; i < MODULE_COUNT; i++) {
+		if (reports_required & modules[i]->type)
+			states[i] = modules[i]->init();
+	}
+	return states;
+}
+
+static void destroy_states(void **states)
+{
+	size_t i;
+
+	for (i = 0; i < MODULE_COUNT; i++) {
+		if (states[i])
+			modules[i]->destroy(states[i]);
+	}
+	free(states);
+}
+
+static void *cb_starting(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED)
+{
+	return create_states();
+}
+
+static libtrace_packet_t *cb_packet(libtrace_t *trace,
+		libtrace_thread_t *t, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet)
+{
+	void **states = (void **)tls;
+	size_t i;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	if (count >= 0) {
+		uint64_t seen = __sync_add_and_fetch(&packets_read, 1);
+
+		/* Another thread has already claimed the last packet */
+		if (seen > (uint64_t)count)
+			return packet;
+		/* Processing threads can't pause the trace themselves, so
+		 * whoever read the last packet asks the reporter to do it */
+		if (seen == (uint64_t)count) {
+			libtrace_message_t msg;
+			msg.code = MESSAGE_COUNT_REACHED;
+			msg.data.uint64 = 0;
+			msg.sender = t;
+			trace_message_reporter(trace, &msg);
+		}
+	}
+
+	for (i = 0; i < MODULE_COUNT; i++) {
+		if (states[i])
+			modules[i]->per_packet(states[i], packet);
+	}
+	return packet;
+}
+
+static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls)
+{
+	libtrace_generic_t tmp = {.ptr = tls};
+
+	/* Hand our states over to the reporter, which frees them */
+	trace_publish_result(trace, t, 0, tmp, RESULT_USER);
+	trace_post_reporter(trace);
+}
+
+static void cb_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result)
+{
+	void **states;
+	size_t i;
+
+	if (result->type != RESULT_USER)
+		return;
+
+	states = (void **)result->value.ptr;
+	for (i = 0; i < MODULE_COUNT; i++) {
+		if (states[i])
+			modules[i]->merge(report_states[i], states[i]);
+	}
+	destroy_states(states);
+}
+
+static void cb_message(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls UNUSED, int mesg,
+		libtrace_generic_t data UNUSED, libtrace_thread_t *sender UNUSED)
+{
+	if (mesg == MESSAGE_COUNT_REACHED)
+		trace_pstop(trace);
 }
 
 /* Process a trace, counting packets that match filter(s) */
-static void run_trace(char *uri, libtrace_filter_t *filter, int count) 
+static void run_trace(char *uri, libtrace_filter_t *filter)
 {
-	struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *repcbs;
 
 	/* Already read the maximum number of packets - don't need to read
 	 * anything from this trace */
-	if ((count >= 0 && packets_read >= count) || done)
+	if ((count >= 0 && packets_read >= (uint64_t)count) || done)
 		return;
 
 	trace = trace_create(uri);
 	
 	if (trace_is_err(trace)) {
 		trace_perror(trace,"trace_create");
+		trace_destroy(trace);
+		trace = NULL;
 		return;
 	}
 
@@ -77,57 +207,38 @@ static void run_trace(char *uri, libtrace_filter_t *filter, int count)
 		trace_config(trace,TRACE_OPTION_FILTER,filter);
 	}
 
-	if (trace_start(trace)==-1) {
+	/* Every thread publishes exactly once, so order doesn't matter */
+	trace_set_combiner(trace, &combiner_unordered, (libtrace_generic_t){0});
+	trace_set_perpkt_threads(trace, threadcount);
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, cb_starting);
+	trace_set_stopping_cb(pktcbs, cb_stopping);
+	trace_set_packet_cb(pktcbs, cb_packet);
+
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, cb_result);
+	trace_set_user_message_cb(repcbs, cb_message);
+
+	if (trace_pstart(trace, NULL, pktcbs, repcbs)==-1) {
 		trace_perror(trace,"trace_start");
+		trace_destroy(trace);
+		trace = NULL;
+		trace_destroy_callback_set(pktcbs);
+		trace_destroy_callback_set(repcbs);
 		return;
 	}
 
-	while (1) {
-		int psize;
-		
-		if (count >= 0 && packets_read >= count)
-			break;
-		if (done)
-			break;
-		if ((psize = trace_read_packet(trace, packet)) <1) {
-			break;
-		}
-                if (IS_LIBTRACE_META_PACKET(packet))
-                        continue;
-
-		if (reports_required & REPORT_TYPE_MISC)
-			misc_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ERROR)
-			error_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PORT)
-			port_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PROTO)
-			protocol_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TOS)
-			tos_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TTL)
-			ttl_per_packet(packet);
-		if (reports_required & REPORT_TYPE_FLOW)
-			flow_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPOPT)
-			tcpopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_SYNOPT)
-			synopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_NLP)
-			nlp_per_packet(packet);
-		if (reports_required & REPORT_TYPE_DIR)
-			dir_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ECN)
-			ecn_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPSEG)
-			tcpseg_per_packet(packet);
-
-		packets_read ++;
-	}
+	trace_join(trace);
+
+	if (trace_is_err(trace))
+		trace_perror(trace, "%s", uri);
 	if (reports_required & REPORT_TYPE_DROPS)
 		drops_per_trace(trace);
-        trace_destroy_packet(packet);
 	trace_destroy(trace);
+	trace = NULL;
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
 }
 
 static void usage(char *argv0)
@@ -136,6 +247,9 @@ static void usage(char *argv0)
 	"%s flags traceuri [traceuri...]\n"
 	"-f --filter=bpf	\tApply BPF filter. Can be specified multiple times\n"
 	"-c --count=N		Stop after reading N packets\n"
+	"-a --approximate	Estimate counts that would otherwise need every key\n"
+	"			to be stored (currently the flow report)\n"
+	"-j --threads=N		Use N packet processing threads (default 4)\n"
 	"-e --error		Report packet errors (e.g. checksum failures, rxerrors)\n"
 	"-F --flow		Report flows\n"
 	"-m --misc		Report misc information (start/end times, duration, pps)\n"
@@ -160,13 +274,14 @@ int main(int argc, char *argv[]) {
 	int opt;
 	char *filterstring=NULL;
 	struct sigaction sigact;
-	int count = -1;
+	size_t m;
 
 	libtrace_filter_t *filter = NULL;/*trace_bpf_setfilter(filterstring); */
 
 	while (1) {
 		int option_index;
 		struct option long_options[] = {
+			{ "approximate",	0, 0, 'a' },
 			{ "count", 		1, 0, 'c' },
 			{ "ecn",		0, 0, 'C' },
 			{ "direction", 		0, 0, 'd' },
@@ -175,6 +290,7 @@ int main(int argc, char *argv[]) {
 			{ "flow", 		0, 0, 'F' },
 			{ "filter",		1, 0, 'f' },
 			{ "help",		0, 0, 'H' },
+			{ "threads",		1, 0, 'j' },
 			{ "misc",		0, 0, 'm' },
 			{ "nlp",		0, 0, 'n' },
 			{ "tcpoptions",		0, 0, 'O' },
@@ -186,12 +302,15 @@ int main(int argc, char *argv[]) {
 			{ "ttl", 		0, 0, 't' },
 			{ NULL, 		0, 0, 0 }
 		};
-		opt = getopt_long(argc, argv, "Df:HemFPpTtOondCsc:", 
+		opt = getopt_long(argc, argv, "aDf:HemFPpTtOondCsc:j:", 
 				long_options, &option_index);
 		if (opt == -1)
 			break;
 		
 		switch (opt) {
+			case 'a':
+				approximate = 1;
+				break;
 			case 'c':
 				count = atoi(optarg);
 				break;
@@ -216,6 +335,11 @@ int main(int argc, char *argv[]) {
 			case 'H':
 				usage(argv[0]);
 				break;
+			case 'j':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			case 'm':
 				reports_required |= REPORT_TYPE_MISC;
 				break;
@@ -257,7 +381,15 @@ int main(int argc, char *argv[]) {
 
 		/* Except we might want to not do the flow report, because 
 		 * that can be rather resource-intensive */
-		reports_required &= ~REPORT_TYPE_FLOW;
+		if (!approximate)
+			reports_required &= ~REPORT_TYPE_FLOW;
+	}
+
+	if (approximate) {
+		for (m = 0; m < MODULE_COUNT; m++) {
+			if (modules[m] == &flow_module)
+				modules[m] = &flow_approx_module;
+		}
 	}
 
 
@@ -273,40 +405,25 @@ int main(int argc, char *argv[]) {
 	sigaction(SIGTERM, &sigact, NULL);
 		
 	
+	for (m = 0; m < MODULE_COUNT; m++) {
+		if (reports_required & modules[m]->type)
+			report_states[m] = modules[m]->init();
+	}
+
 	for(i=optind;i<argc;++i) {
 		/* This is handy for knowing how far through the traceset
 		 * we are - printing to stderr because we use stdout for
 		 * genuine output at the moment */
 		fprintf(stderr, "Reading from trace: %s\n", argv[i]);
-		run_trace(argv[i],filter, count);
+		run_trace(argv[i],filter);
 	}
 
-	if (reports_required & REPORT_TYPE_MISC)
-		misc_report();
-	if (reports_required & REPORT_TYPE_ERROR)
-		error_report();
-	if (reports_required & REPORT_TYPE_FLOW)
-		flow_report();
-	if (reports_required & REPORT_TYPE_TOS)
-		tos_report();
-	if (reports_required & REPORT_TYPE_PROTO)
-		protocol_report();
-	if (reports_required & REPORT_TYPE_PORT)
-		port_report();
-	if (reports_required & REPORT_TYPE_TTL)
-		ttl_report();	
-	if (reports_required & REPORT_TYPE_TCPOPT)
-		tcpopt_report();
-	if (reports_required & REPORT_TYPE_SYNOPT)
-		synopt_report();
-	if (reports_required & REPORT_TYPE_NLP)
-		nlp_report();
-	if (reports_required & REPORT_TYPE_DIR)
-		dir_report();
-	if (reports_required & REPORT_TYPE_ECN)
-		ecn_report();
-	if (reports_required & REPORT_TYPE_TCPSEG)
-		tcpseg_report();
+	for (m = 0; m < MODULE_COUNT; m++) {
+		if (!report_states[m])
+			continue;
+		modules[m]->report(report_states[m]);
+		modules[m]->destroy(report_states[m]);
+	}
 	if (reports_required & REPORT_TYPE_DROPS)
 		drops_report();
 	return 0;
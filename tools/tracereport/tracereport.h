@@ -27,6 +27,7 @@
 #ifndef TRACEREPORT_H
 #define TRACEREPORT_H
 
+#include <stddef.h>
 #include "lt_inttypes.h"
 
 typedef struct {
@@ -34,6 +35,17 @@ typedef struct {
 	uint64_t bytes;
 } stat_t;
 
+/* Adds 'n' counters from 'from' to those in 'into' */
+static inline void merge_stats(stat_t *into, const stat_t *from, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		into[i].count += from[i].count;
+		into[i].bytes += from[i].bytes;
+	}
+}
+
 typedef enum {
 	REPORT_TYPE_ERROR = 1,
 	REPORT_TYPE_FLOW = 1 << 1,
@@ -28,15 +28,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t ttl_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct ttl_state {
+	stat_t ttl_stat[3][256];
+};
 
-void ttl_per_packet(struct libtrace_packet_t *packet)
+static void *ttl_init(void)
 {
+	return calloc(1, sizeof(struct ttl_state));
+}
+
+static void ttl_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct ttl_state *s = state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -46,15 +54,24 @@ void ttl_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	ttl_stat[dir][ip->ip_ttl].count++;
-	ttl_stat[dir][ip->ip_ttl].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	s->ttl_stat[dir][ip->ip_ttl].count++;
+	s->ttl_stat[dir][ip->ip_ttl].bytes+=trace_get_wire_length(packet);
+}
+
+static void ttl_merge(void *state, void *other)
+{
+	struct ttl_state *s = state, *o = other;
+
+	merge_stats(&s->ttl_stat[0][0], &o->ttl_stat[0][0],
+			sizeof(s->ttl_stat) / sizeof(stat_t));
 }
 
 	
 
-void ttl_report(void)
+static void ttl_report(void *state)
 {
+	struct ttl_state *s = state;
+	stat_t (*ttl_stat)[256] = s->ttl_stat;
 	int i,j;
 	FILE *out = fopen("ttl.rpt", "w");
 	if (!out) {
@@ -94,3 +111,12 @@ void ttl_report(void)
 	}
 	fclose(out);
 }
+
+const report_module_t ttl_module = {
+	REPORT_TYPE_TTL,
+	ttl_init,
+	ttl_per_packet,
+	ttl_merge,
+	ttl_report,
+	free
+};
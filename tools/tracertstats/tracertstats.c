@@ -53,6 +53,7 @@
 #include "output.h"
 #include "rt_protocol.h"
 #include "dagformat.h"
+#include "data-struct/interval_counters.h"
 
 #ifndef UINT32_MAX
 	#define UINT32_MAX      0xffffffffU
@@ -60,6 +61,15 @@
 
 #define DEFAULT_OUTPUT_FMT "txt"
 
+#define MESSAGE_COUNT_REACHED (MESSAGE_USER + 1)
+
+/* Positions of the statistics within each interval's counters. Each filter
+ * has a packet and a byte counter after the totals. */
+#define COUNTER_PACKETS 0
+#define COUNTER_BYTES 1
+#define COUNTER_FILTER(i) (2 + (i) * 2)
+#define NUM_COUNTERS (2 + filter_count * 2)
+
 char *output_format=NULL;
 int merge_inputs = 0;
 int threadcount = 4;
@@ -78,31 +88,42 @@ double packet_interval=UINT32_MAX;
 
 struct output_data_t *output = NULL;
 
-uint64_t count;
-uint64_t bytes;
-
 struct libtrace_t *currenttrace;
 
+static libtrace_interval_counters_t counters;
+static uint64_t packets_seen = 0;
+
 static void cleanup_signal(int signal UNUSED) {
         if (currenttrace) {
                 trace_pstop(currenttrace);
         }
 }
 
-static void report_results(double ts,uint64_t count,uint64_t bytes)
+static void report_results(uint64_t interval, uint64_t *values)
 {
 	int i=0;
-	output_set_data_time(output,0,ts);
-	output_set_data_int(output,1,count);
-	output_set_data_int(output,2,bytes);
+	output_set_data_time(output,0,
+			(double)(interval * counters.length) / 4294967296.0);
+	output_set_data_int(output,1,values[COUNTER_PACKETS]);
+	output_set_data_int(output,2,values[COUNTER_BYTES]);
 	for(i=0;i<filter_count;++i) {
-		output_set_data_int(output,i*2+3,filters[i].count);
-		output_set_data_int(output,i*2+4,filters[i].bytes);
-		filters[i].count=filters[i].bytes=0;
+		output_set_data_int(output,i*2+3,values[COUNTER_FILTER(i)]);
+		output_set_data_int(output,i*2+4,values[COUNTER_FILTER(i)+1]);
 	}
 	output_flush_row(output);
 }
 
+/* Reports every interval that no thread can add to any more */
+static void report_intervals(int flush)
+{
+	uint64_t values[NUM_COUNTERS];
+	uint64_t interval;
+
+	while (libtrace_interval_counters_next(&counters, &interval, values,
+			flush))
+		report_results(interval, values);
+}
+
 static void create_output(char *title) {
 	int i;
 	
@@ -125,76 +146,30 @@ static void create_output(char *title) {
 
 }
 
-typedef struct statistic {
-	uint64_t count;
-	uint64_t bytes;
-} statistic_t;
-
-typedef struct result {
-	struct statistic total;
-	struct statistic filters[0];
-} result_t;
+static void cb_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result) {
 
-static uint64_t glob_last_ts = 0;
-static void cb_result(libtrace_t *trace, libtrace_thread_t *sender UNUSED,
-                void *global UNUSED, void *tls UNUSED,
-                libtrace_result_t *result) {
-	uint64_t ts = 0;
-        static bool stopped = false;
-        static uint64_t packets_seen = 0;
-	int j;
-	result_t *res;
-
-        if (stopped)
-                return;
-
-        ts = result->key;
-        res = result->value.ptr;
-        if (glob_last_ts == 0)
-                glob_last_ts = ts;
-        while ((glob_last_ts >> 32) < (ts >> 32)) {
-                report_results(glob_last_ts >> 32, count, bytes);
-                count = 0;
-                bytes = 0;
-                for (j = 0; j < filter_count; j++)
-                        filters[j].count = filters[j].bytes = 0;
-                glob_last_ts = ts;
-        }
-        count += res->total.count;
-        packets_seen += res->total.count;
-        bytes += res->total.bytes;
-        for (j = 0; j < filter_count; j++) {
-                filters[j].count += res->filters[j].count;
-                filters[j].bytes += res->filters[j].bytes;
-        }
-        free(res);
+	if (result->type != RESULT_USER)
+		return;
 
-        /* Be careful to only call pstop once from within this thread! */
-        if (packets_seen > packet_count) {
-                trace_pstop(trace);
-                stopped = true;
-        }
+	libtrace_interval_counters_merge(&counters, result);
+	report_intervals(0);
 }
 
-typedef struct threadlocal {
-        result_t *results;
-        uint64_t last_key;
-} thread_data_t;
-
-static void *cb_starting(libtrace_t *trace UNUSED,
-        libtrace_thread_t *t UNUSED, void *global UNUSED)
+static void cb_message(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls UNUSED, int mesg,
+		libtrace_generic_t data UNUSED, libtrace_thread_t *sender UNUSED)
 {
-        thread_data_t *td = calloc(1, sizeof(thread_data_t));
-	td->results = calloc(1, sizeof(result_t) +
-                        sizeof(statistic_t) * filter_count);
-        return td;
+	if (mesg == MESSAGE_COUNT_REACHED)
+		trace_pstop(trace);
 }
 
 static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+                void *global UNUSED, void *tls UNUSED,
+                libtrace_packet_t *packet) {
 
-        uint64_t key;
-        thread_data_t *td = (thread_data_t *)tls;
+        uint64_t *values;
         int i;
         size_t wlen;
 
@@ -202,57 +177,56 @@ static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
                 return packet;
         }
 
-        key = trace_get_erf_timestamp(packet);
-        if ((key >> 32) >= (td->last_key >> 32) + packet_interval) {
-                libtrace_generic_t tmp = {.ptr = td->results};
-		trace_publish_result(trace, t, key,
-                                tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->last_key = key;
-                td->results = calloc(1, sizeof(result_t) +
-                                sizeof(statistic_t) * filter_count);
-        }
         wlen = trace_get_wire_length(packet);
         if (wlen == 0) {
                 /* Don't count ERF provenance and similar packets */
                 return packet;
         }
+
+        if (packet_count != UINT64_MAX) {
+                uint64_t seen = __sync_add_and_fetch(&packets_seen, 1);
+
+                /* Another thread has already claimed the last packet */
+                if (seen > packet_count)
+                        return packet;
+                /* Processing threads can't pause the trace themselves, so
+                 * whoever counted the last packet asks the reporter to */
+                if (seen == packet_count) {
+                        libtrace_message_t msg;
+                        msg.code = MESSAGE_COUNT_REACHED;
+                        msg.data.uint64 = 0;
+                        msg.sender = t;
+                        trace_message_reporter(trace, &msg);
+                }
+        }
+
+        values = libtrace_interval_counters_get(&counters, trace, t,
+                        trace_get_erf_timestamp(packet));
         for(i=0;i<filter_count;++i) {
                 if(trace_apply_filter(filters[i].filter, packet)) {
-                        td->results->filters[i].count++;
-                        td->results->filters[i].bytes+=wlen;
+                        values[COUNTER_FILTER(i)]++;
+                        values[COUNTER_FILTER(i)+1]+=wlen;
                 }
         }
 
-        td->results->total.count++;
-        td->results->total.bytes += wlen;
+        values[COUNTER_PACKETS]++;
+        values[COUNTER_BYTES] += wlen;
         return packet;
 }
 
 static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls) {
-
-        thread_data_t *td = (thread_data_t *)tls;
-        if (td->results->total.count) {
-                libtrace_generic_t tmp = {.ptr = td->results};
-                trace_publish_result(trace, t, td->last_key, tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->results = NULL;
-        }
+                void *global UNUSED, void *tls UNUSED) {
+
+        libtrace_interval_counters_finish(&counters, trace, t);
 }
 
+/* Ticks let idle threads close their intervals, so that the reporter is
+ * not left waiting on a thread that has seen no packets. Ticks are only
+ * enabled for live formats, whose tick orders are timestamps. */
 static void cb_tick(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls, uint64_t order) {
-
-        thread_data_t *td = (thread_data_t *)tls;
-        if (order > td->last_key) {
-		libtrace_generic_t tmp = {.ptr = td->results};
-                trace_publish_result(trace, t, order, tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->last_key = order;
-                td->results = calloc(1, sizeof(result_t) +
-                                sizeof(statistic_t) * filter_count);
-        }
+                void *global UNUSED, void *tls UNUSED, uint64_t order) {
+
+        libtrace_interval_counters_tick(&counters, trace, t, order);
 }
 
 /* Process a trace, counting packets that match filter(s) */
@@ -275,7 +249,19 @@ static void run_trace(char *uri)
 			output_destroy(output);
 		return;
 	}
-	trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
+	if (libtrace_interval_counters_init(&counters,
+			(uint64_t)(packet_interval * 4294967296.0),
+			NUM_COUNTERS, threadcount,
+			LIBTRACE_INTERVAL_DEFAULT_BUCKETS) == -1) {
+		fprintf(stderr, "Unable to allocate interval counters\n");
+		trace_destroy(trace);
+		if (!merge_inputs)
+			output_destroy(output);
+		return;
+	}
+	packets_seen = 0;
+
+	trace_set_combiner(trace, &combiner_unordered, (libtrace_generic_t){0});
         trace_set_perpkt_threads(trace, threadcount);
 	trace_set_burst_size(trace, burstsize);
 
@@ -286,7 +272,6 @@ static void run_trace(char *uri)
 	}
 
         pktcbs = trace_create_callback_set();
-        trace_set_starting_cb(pktcbs, cb_starting);
         trace_set_stopping_cb(pktcbs, cb_stopping);
         trace_set_packet_cb(pktcbs, cb_packet);
         trace_set_tick_count_cb(pktcbs, cb_tick);
@@ -294,10 +279,12 @@ static void run_trace(char *uri)
 
         repcbs = trace_create_callback_set();
         trace_set_result_cb(repcbs, cb_result);
+        trace_set_user_message_cb(repcbs, cb_message);
 
         currenttrace = trace;
 	if (trace_pstart(trace, NULL, pktcbs, repcbs)==-1) {
 		trace_perror(trace,"Failed to start trace");
+		libtrace_interval_counters_destroy(&counters);
 		trace_destroy(trace);
                 trace_destroy_callback_set(pktcbs);
                 trace_destroy_callback_set(repcbs);
@@ -310,8 +297,9 @@ static void run_trace(char *uri)
 	// Wait for all threads to stop
 	trace_join(trace);
 	
-	// Flush the last one out
-	report_results((glob_last_ts >> 32), count, bytes);
+	// Flush out whatever is left
+	report_intervals(1);
+	libtrace_interval_counters_destroy(&counters);
 	if (trace_is_err(trace))
 		trace_perror(trace,"%s",uri);
 
@@ -26,6 +26,7 @@
 
 
 #include <libtrace.h>
+#include <libtrace_parallel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -57,6 +58,13 @@ int compress_level=-1;
 trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 char *output_base = NULL;
 
+/* Flow fan-out mode: one output per perpkt thread, indexed by thread id */
+int flows=0;
+struct libtrace_out_t **flow_outputs = NULL;
+uint64_t *flow_counts = NULL;
+struct libtrace_t *flow_input = NULL;
+volatile int flow_error = 0;
+
 
 static char *strdupcat(char *str,char *app)
 {
@@ -83,6 +91,8 @@ static int usage(char *argv0)
 	"-s --starttime=time 	Start at time\n"
 	"-e --endtime=time	End at time\n"
 	"-m --maxfiles=n	Create a maximum of n trace files\n"
+	"-F --flows=n		Split into n files by bidirectional flow,\n"
+	"			using one thread per output file\n"
         "-j --jump=n            Jump to the nth IP header\n"
 	"-H --libtrace-help	Print libtrace runtime documentation\n"
 	"-S --snaplen		Snap packets at the specified length\n"
@@ -99,7 +109,10 @@ static void cleanup_signal(int sig)
 {
 	(void)sig;
 	done=1;
-	trace_interrupt();
+	if (flow_input)
+		trace_pstop(flow_input);
+	else
+		trace_interrupt();
 }
 
 
@@ -183,6 +196,41 @@ static libtrace_packet_t *perform_jump(libtrace_packet_t *packet, int jump)
 }
 
 
+/* Creates and starts an output trace, applying the compression options.
+ * Returns NULL (having reported the error) on failure */
+static struct libtrace_out_t *create_output(char *uri)
+{
+	struct libtrace_out_t *out=trace_create_output(uri);
+	if (trace_is_err_output(out)) {
+		trace_perror_output(out,"%s",uri);
+		trace_destroy_output(out);
+		return NULL;
+	}
+	if (compress_level!=-1) {
+		if (trace_config_output(out,
+					TRACE_OPTION_OUTPUT_COMPRESS,
+					&compress_level)==-1) {
+			trace_perror_output(out,"Unable to set compression level");
+		}
+	}
+
+        if (compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
+                if (trace_config_output(out,
+                                        TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+                                        &compress_type) == -1) {
+                        trace_perror_output(out, "Unable to set compression type");
+                }
+        }
+
+	trace_start_output(out);
+	if (trace_is_err_output(out)) {
+		trace_perror_output(out,"%s",uri);
+		trace_destroy_output(out);
+		return NULL;
+	}
+	return out;
+}
+
 /* Return values:
  *  1 = continue reading packets
  *  0 = stop reading packets, cos we're done
@@ -279,31 +327,8 @@ static int per_packet(libtrace_packet_t **packet) {
 				fprintf(stderr,"\n");
 			}
 		}
-		output=trace_create_output(buffer);
-		if (trace_is_err_output(output)) {
-			trace_perror_output(output,"%s",buffer);
-			free(buffer);
-			return -1;
-		}
-		if (compress_level!=-1) {
-			if (trace_config_output(output,
-						TRACE_OPTION_OUTPUT_COMPRESS,
-						&compress_level)==-1) {
-				trace_perror_output(output,"Unable to set compression level");
-			}
-		}
-
-                if (compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
-                        if (trace_config_output(output,
-                                                TRACE_OPTION_OUTPUT_COMPRESSTYPE,
-                                                &compress_type) == -1) {
-                                trace_perror_output(output, "Unable to set compression type");
-                        }
-                }
-
-		trace_start_output(output);
-		if (trace_is_err_output(output)) {
-			trace_perror_output(output,"%s",buffer);
+		output=create_output(buffer);
+		if (!output) {
 			free(buffer);
 			return -1;
 		}
@@ -342,6 +367,164 @@ static int per_packet(libtrace_packet_t **packet) {
 
 }
 
+/* Flow fan-out mode. Each perpkt thread owns one output file, and the
+ * bidirectional hasher ensures that both directions of a flow are always
+ * given to the same thread, so every file contains complete flows. The
+ * outputs outlive each input trace so that multiple inputs are appended to
+ * the same set of files.
+ */
+static void *flow_starting(libtrace_t *trace, libtrace_thread_t *t,
+		void *global)
+{
+	int id = trace_get_perpkt_thread_id(t);
+	char *buffer;
+	(void)global;
+
+	if (flow_outputs[id])
+		return flow_outputs[id];
+
+	buffer=strdup(output_base);
+	buffer=strdupcat(buffer,"-");
+	buffer=strdupcati(buffer,(uint64_t)id);
+	if (compress_level!=0)
+		buffer=strdupcat(buffer,".gz");
+	if (verbose>1)
+		fprintf(stderr,"%s: flow bucket %d\n",buffer,id);
+
+	flow_outputs[id]=create_output(buffer);
+	free(buffer);
+	if (!flow_outputs[id]) {
+		flow_error=1;
+		trace_pstop(trace);
+	}
+	return flow_outputs[id];
+}
+
+static libtrace_packet_t *flow_packet(libtrace_t *trace,
+		libtrace_thread_t *t, void *global, void *tls,
+		libtrace_packet_t *packet)
+{
+	struct libtrace_out_t *out = (struct libtrace_out_t *)tls;
+	libtrace_packet_t *towrite = packet;
+	(void)global;
+
+	if (out == NULL || IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	if (trace_get_link_type(packet) == -1) {
+		fprintf(stderr, "Halted due to being unable to determine linktype - input trace may be corrupt.\n");
+		flow_error=1;
+		trace_pstop(trace);
+		return packet;
+	}
+
+	if (snaplen>0) {
+		trace_set_capture_length(packet,snaplen);
+	}
+
+	/* Packets are not processed in order across threads, so we can't
+	 * stop at the end time, just ignore anything outside the window */
+	if (trace_get_seconds(packet)<starttime
+			|| trace_get_seconds(packet)>endtime) {
+		return packet;
+	}
+
+	if (trace_get_capture_length(packet)
+			> trace_get_wire_length(packet)) {
+		trace_set_capture_length(packet,
+                        trace_get_wire_length(packet));
+	}
+
+	if (jump) {
+		towrite = perform_jump(packet, jump);
+		if (!towrite)
+			return packet;
+	}
+
+	if (trace_write_packet(out, towrite)==-1) {
+		trace_perror_output(out,"write_packet");
+		flow_error=1;
+		trace_pstop(trace);
+	} else {
+		flow_counts[trace_get_perpkt_thread_id(t)]++;
+	}
+
+	if (towrite != packet)
+		trace_destroy_packet(towrite);
+	return packet;
+}
+
+/* Returns 0 on success, -1 if the split should be abandoned */
+static int run_flows(char *uri, struct libtrace_filter_t *filter)
+{
+	libtrace_callback_set_t *pktcbs;
+	int ret = 0;
+
+	flow_input = trace_create(uri);
+	if (trace_is_err(flow_input)) {
+		trace_perror(flow_input,"%s",uri);
+		trace_destroy(flow_input);
+		flow_input = NULL;
+		return -1;
+	}
+
+	if (filter && trace_config(flow_input, TRACE_OPTION_FILTER,
+				filter) == -1) {
+		trace_perror(flow_input, "Configuring filter for %s", uri);
+		trace_destroy(flow_input);
+		flow_input = NULL;
+		return -1;
+	}
+
+	trace_set_perpkt_threads(flow_input, flows);
+	if (trace_set_hasher(flow_input, HASHER_BIDIRECTIONAL, NULL,
+				NULL) == -1) {
+		trace_perror(flow_input, "Configuring flow hasher for %s", uri);
+		trace_destroy(flow_input);
+		flow_input = NULL;
+		return -1;
+	}
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, flow_starting);
+	trace_set_packet_cb(pktcbs, flow_packet);
+
+	if (trace_pstart(flow_input, NULL, pktcbs, NULL)==-1) {
+		trace_perror(flow_input,"%s",uri);
+		ret = -1;
+	} else {
+		trace_join(flow_input);
+		if (trace_is_err(flow_input)) {
+			trace_perror(flow_input,"Reading packets");
+			ret = -1;
+		}
+	}
+
+	if (verbose) {
+		libtrace_stat_t *stat = trace_get_statistics(flow_input, NULL);
+
+		if (stat->received_valid)
+			fprintf(stderr,"%" PRIu64 " packets on input\n",
+                                        stat->received);
+		if (stat->filtered_valid)
+			fprintf(stderr,"%" PRIu64 " packets filtered\n",
+                                        stat->filtered);
+		if (stat->dropped_valid)
+			fprintf(stderr,"%" PRIu64 " packets dropped\n",
+                                        stat->dropped);
+		if (stat->accepted_valid)
+			fprintf(stderr,"%" PRIu64 " packets accepted\n",
+                                        stat->accepted);
+	}
+
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy(flow_input);
+	flow_input = NULL;
+	if (flow_error)
+		ret = -1;
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	char *compress_type_str=NULL;
@@ -369,6 +552,7 @@ int main(int argc, char *argv[])
                         { "jump",          1, 0, 'j' },
 			{ "libtrace-help", 0, 0, 'H' },
 			{ "maxfiles", 	   1, 0, 'm' },
+			{ "flows",	   1, 0, 'F' },
 			{ "snaplen",	   1, 0, 'S' },
 			{ "verbose",       0, 0, 'v' },
 			{ "compress-level", 1, 0, 'z' },
@@ -376,7 +560,7 @@ int main(int argc, char *argv[])
 			{ NULL, 	   0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:S:Hvz:Z:",
+		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:F:S:Hvz:Z:",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -399,6 +583,12 @@ int main(int argc, char *argv[])
                                   break;
 			case 'm': maxfiles=atoi(optarg);
 				  break;
+			case 'F': flows=atoi(optarg);
+				  if (flows<1) {
+					usage(argv[0]);
+					exit(1);
+				  }
+				  break;
 			case 'S': snaplen=atoi(optarg);
 				  break;
 			case 'H':
@@ -462,6 +652,13 @@ int main(int argc, char *argv[])
 
 	output_base = argv[argc - 1];
 
+	if (flows && (count!=UINT64_MAX || bytes!=UINT64_MAX
+				|| interval!=UINT64_MAX)) {
+		fprintf(stderr,"--flows cannot be combined with --count, "
+				"--bytes or --interval\n");
+		return 1;
+	}
+
 	sigact.sa_handler = cleanup_signal;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = SA_RESTART;
@@ -474,6 +671,34 @@ int main(int argc, char *argv[])
 	signal(SIGINT,&cleanup_signal);
 	signal(SIGTERM,&cleanup_signal);
 
+	if (flows) {
+		int ret = 0;
+
+		flow_outputs = calloc(flows, sizeof(struct libtrace_out_t *));
+		flow_counts = calloc(flows, sizeof(uint64_t));
+
+		for (i = optind; i < argc - 1 && !done; i++) {
+			if (run_flows(argv[i], filter) == -1) {
+				ret = 1;
+				break;
+			}
+		}
+
+		for (i = 0; i < flows; i++) {
+			if (verbose && flow_outputs[i])
+				fprintf(stderr,"%" PRIu64 " packets written to "
+						"output %d\n", flow_counts[i], i);
+			if (flow_outputs[i])
+				trace_destroy_output(flow_outputs[i]);
+		}
+		free(flow_outputs);
+		free(flow_counts);
+		if (filter)
+			trace_destroy_filter(filter);
+		trace_destroy_packet(packet);
+		return ret;
+	}
+
 	for (i = optind; i < argc - 1; i++) {
 
 
@@ -27,16 +27,23 @@
 
 /* Show the top 'n' flows from a libtrace source
  *
+ * Each processing thread counts flows into its own open addressing hash
+ * table. At the end of every interval the tables are handed to the reporter,
+ * which merges them into a single table while keeping track of the largest
+ * flows in a small heap, so redrawing the screen doesn't depend on how many
+ * flows were seen.
  */
 #define __STDC_FORMAT_MACROS 1
 #include "config.h"
 #include "libtrace.h"
+#include "libtrace_parallel.h"
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
-#include <map>
-#include <queue>
+#include <algorithm>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <string.h>
@@ -57,7 +64,6 @@
 typedef enum { BITS_PER_SEC, BYTES, PERCENT } display_t;
 display_t display_as = BYTES;
 float interval=2;
-double last_report=0;
 
 bool use_sip = true;
 bool use_dip = true;
@@ -67,62 +73,14 @@ bool use_protocol = true;
 bool quit = false;
 bool fullspeed = false;
 bool wide_display = false;
+int threadcount = 4;
 
 uint64_t total_bytes=0;
 uint64_t total_packets=0;
 
-int cmp_sockaddr_in6(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b)
-{
-	if (a->sin6_port != b->sin6_port)
-		return a->sin6_port - b->sin6_port;
-	return memcmp(a->sin6_addr.s6_addr,b->sin6_addr.s6_addr,sizeof(a->sin6_addr.s6_addr));
-}
-
-int cmp_sockaddr_in(const struct sockaddr_in *a, const struct sockaddr_in *b)
-{
-	if (a->sin_port != b->sin_port)
-		return a->sin_port - b->sin_port;
-	return a->sin_addr.s_addr - b->sin_addr.s_addr;
-}
-
-#ifdef HAVE_NETPACKET_PACKET_H
-int cmp_sockaddr_ll(const struct sockaddr_ll *a, const struct sockaddr_ll *b)
-{
-	return memcmp(a->sll_addr, b->sll_addr, b->sll_halen);
-}
-#else
-int cmp_sockaddr_dl(const struct sockaddr_dl *a, const struct sockaddr_dl *b)
-{
-	return memcmp(a->sdl_data, b->sdl_data, b->sdl_alen);
-}
-
-#endif
-
-
-int cmp_sockaddr(const struct sockaddr *a, const struct sockaddr *b)
-{
-	if (a->sa_family != b->sa_family) {
-		return a->sa_family - b->sa_family;
-	}
-	switch (a->sa_family) {
-		case AF_INET:
-			return cmp_sockaddr_in((struct sockaddr_in *)a,(struct sockaddr_in*)b);
-		case AF_INET6:
-			return cmp_sockaddr_in6((struct sockaddr_in6 *)a,(struct sockaddr_in6*)b);
-#ifdef HAVE_NETPACKET_PACKET_H
-		case AF_PACKET:
-			return cmp_sockaddr_ll((struct sockaddr_ll *)a,(struct sockaddr_ll*)b);
-#else
-		case AF_LINK:
-			return cmp_sockaddr_dl((struct sockaddr_dl *)a, (struct sockaddr_dl *)b);
-#endif
-		case AF_UNSPEC:
-			return 0; /* Can't compare UNSPEC's! */
-		default:
-			fprintf(stderr,"Don't know how to compare family %d\n",a->sa_family);
-			abort();
-	}
-}
+/* ncurses isn't thread safe, and the screen is drawn by the reporter while
+ * the main thread reads the keyboard */
+pthread_mutex_t display_lock = PTHREAD_MUTEX_INITIALIZER;
 
 char *trace_sockaddr2string(const struct sockaddr *a, socklen_t salen, char *buffer, size_t bufflen)
 {
@@ -167,75 +125,276 @@ char *trace_sockaddr2string(const struct sockaddr *a, socklen_t salen, char *buf
 	return mybuf;
 }
 
-static void set_port_for_sockaddr(struct sockaddr *sa,uint16_t port)
+/* A flow key is kept as small as possible (rather than as a pair of
+ * sockaddr_storage structures) so that a whole table entry fits into a
+ * single cache line. Unused fields must be zero, as keys are hashed and
+ * compared as raw memory.
+ */
+struct flowkey_t {
+	uint8_t sip[16];
+	uint8_t dip[16];
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t sfamily;
+	uint8_t dfamily;
+	uint8_t protocol;
+	uint8_t unused;
+};
+
+#define NOT_IN_TOP UINT32_MAX
+
+struct flowentry_t {
+	flowkey_t key;
+	uint64_t packets;	/* 0 if this slot is empty */
+	uint64_t bytes;
+	uint32_t topidx;	/* Position in the top flows heap */
+	uint32_t unused;
+};
+
+/* An open addressing (linear probing) hash table of flows. The reporter's
+ * table also maintains a min-heap of the 'topmax' largest flows; as counts
+ * only ever grow within an interval, a flow that isn't in the heap only
+ * needs to be compared against the smallest flow in it.
+ */
+struct flowtable_t {
+	flowentry_t *slots;
+	uint32_t mask;
+	uint32_t count;
+	uint64_t packets;
+	uint64_t bytes;
+
+	uint32_t *top;
+	uint32_t topcount;
+	uint32_t topmax;
+};
+
+#define FLOWTABLE_INITIAL_SIZE 4096
+#define TOP_FLOWS 256
+
+/* The shared table that per-thread results are merged into */
+flowtable_t *flows = NULL;
+uint64_t current_interval = 0;
+
+static inline uint64_t hash_flowkey(const flowkey_t *key)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_port = htons(port);
-			break;
-		case AF_INET6:
-			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
-			break;
+	uint64_t words[sizeof(flowkey_t) / sizeof(uint64_t)];
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	size_t i;
+
+	memcpy(words, key, sizeof(words));
+	for (i = 0; i < sizeof(words) / sizeof(uint64_t); i++) {
+		h ^= words[i];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
 	}
+	return h;
 }
 
-static void clear_addr_for_sockaddr(struct sockaddr *sa)
+static flowtable_t *flowtable_create(uint32_t size, uint32_t topmax)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_addr.s_addr = 0;
-			break;
-		case AF_INET6:
-			memset((void*)&((struct sockaddr_in6 *)sa)->sin6_addr,0,sizeof(((struct sockaddr_in6 *)sa)->sin6_addr));
+	flowtable_t *t = (flowtable_t *)calloc(1, sizeof(flowtable_t));
+
+	assert((size & (size - 1)) == 0);
+	t->slots = (flowentry_t *)calloc(size, sizeof(flowentry_t));
+	t->mask = size - 1;
+	t->topmax = topmax;
+	if (topmax)
+		t->top = (uint32_t *)malloc(topmax * sizeof(uint32_t));
+	return t;
+}
+
+static void flowtable_destroy(flowtable_t *t)
+{
+	free(t->slots);
+	free(t->top);
+	free(t);
+}
+
+static void flowtable_clear(flowtable_t *t)
+{
+	if (t->count)
+		memset(t->slots, 0, (t->mask + 1) * sizeof(flowentry_t));
+	t->count = 0;
+	t->packets = 0;
+	t->bytes = 0;
+	t->topcount = 0;
+}
+
+static inline bool flow_less(const flowentry_t *a, const flowentry_t *b)
+{
+	if (a->bytes != b->bytes)
+		return a->bytes < b->bytes;
+	return a->packets < b->packets;
+}
+
+static void flowtable_grow(flowtable_t *t)
+{
+	flowentry_t *old = t->slots;
+	uint32_t oldsize = t->mask + 1;
+	uint32_t i;
+
+	t->slots = (flowentry_t *)calloc(oldsize * 2, sizeof(flowentry_t));
+	t->mask = oldsize * 2 - 1;
+	for (i = 0; i < oldsize; i++) {
+		uint32_t slot;
+
+		if (old[i].packets == 0)
+			continue;
+		slot = hash_flowkey(&old[i].key) & t->mask;
+		while (t->slots[slot].packets != 0)
+			slot = (slot + 1) & t->mask;
+		t->slots[slot] = old[i];
+		if (old[i].topidx != NOT_IN_TOP)
+			t->top[old[i].topidx] = slot;
+	}
+	free(old);
+}
+
+static inline void top_place(flowtable_t *t, uint32_t idx, uint32_t slot)
+{
+	t->top[idx] = slot;
+	t->slots[slot].topidx = idx;
+}
+
+static void top_sift_up(flowtable_t *t, uint32_t idx)
+{
+	uint32_t slot = t->top[idx];
+
+	while (idx > 0) {
+		uint32_t parent = (idx - 1) / 2;
+		if (!flow_less(&t->slots[slot], &t->slots[t->top[parent]]))
 			break;
+		top_place(t, idx, t->top[parent]);
+		idx = parent;
 	}
+	top_place(t, idx, slot);
 }
 
-static uint16_t get_port_from_sockaddr(struct sockaddr *sa)
+static void top_sift_down(flowtable_t *t, uint32_t idx)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			return ntohs(((struct sockaddr_in *)sa)->sin_port);
+	uint32_t slot = t->top[idx];
+
+	while (1) {
+		uint32_t child = idx * 2 + 1;
+		if (child >= t->topcount)
 			break;
-		case AF_INET6:
-			return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+		if (child + 1 < t->topcount && flow_less(
+				&t->slots[t->top[child + 1]],
+				&t->slots[t->top[child]]))
+			child ++;
+		if (!flow_less(&t->slots[t->top[child]], &t->slots[slot]))
 			break;
+		top_place(t, idx, t->top[child]);
+		idx = child;
 	}
-
-	return 0;
+	top_place(t, idx, slot);
 }
 
-struct flowkey_t {
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint16_t sport;
-	uint16_t dport;
-	uint8_t protocol;
-
-	bool operator <(const flowkey_t &b) const {
-		int c;
+/* Called whenever the counters for a flow have increased */
+static void top_update(flowtable_t *t, uint32_t slot)
+{
+	flowentry_t *e = &t->slots[slot];
+
+	if (e->topidx != NOT_IN_TOP) {
+		top_sift_down(t, e->topidx);
+	} else if (t->topcount < t->topmax) {
+		t->top[t->topcount] = slot;
+		top_sift_up(t, t->topcount++);
+	} else if (flow_less(&t->slots[t->top[0]], e)) {
+		t->slots[t->top[0]].topidx = NOT_IN_TOP;
+		t->top[0] = slot;
+		top_sift_down(t, 0);
+	}
+}
 
-		if (use_sip) {
-			c = cmp_sockaddr((struct sockaddr*)&sip,(struct sockaddr*)&b.sip);
-			if (c != 0) return c<0;
-		}
-		if (use_dip) {
-			c = cmp_sockaddr((struct sockaddr*)&dip,(struct sockaddr*)&b.dip);
-			if (c != 0) return c<0;
+static void flowtable_add(flowtable_t *t, const flowkey_t *key,
+		uint64_t packets, uint64_t bytes)
+{
+	uint32_t slot;
+	flowentry_t *e;
+
+	/* Keep the load factor under a half so that probes stay short */
+	if ((t->count + 1) * 2 > t->mask + 1)
+		flowtable_grow(t);
+
+	slot = hash_flowkey(key) & t->mask;
+	while (1) {
+		e = &t->slots[slot];
+		if (e->packets == 0) {
+			e->key = *key;
+			e->topidx = NOT_IN_TOP;
+			t->count ++;
+			break;
 		}
-
-		return protocol < b.protocol;
+		if (memcmp(&e->key, key, sizeof(flowkey_t)) == 0)
+			break;
+		slot = (slot + 1) & t->mask;
 	}
-};
 
-struct flowdata_t {
-	uint64_t packets;
-	uint64_t bytes;
-};
+	e->packets += packets;
+	e->bytes += bytes;
+	t->packets += packets;
+	t->bytes += bytes;
+	if (t->topmax)
+		top_update(t, slot);
+}
 
-typedef std::map<flowkey_t,flowdata_t> flows_t;
+static uint8_t compact_sockaddr(const struct sockaddr *sa, bool use_addr,
+		bool use_port, uint8_t *addr, uint16_t *port)
+{
+	switch (sa->sa_family) {
+		case AF_INET:
+			if (use_addr)
+				memcpy(addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+			if (use_port)
+				*port = ntohs(((struct sockaddr_in *)sa)->sin_port);
+			return AF_INET;
+		case AF_INET6:
+			if (use_addr)
+				memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+			if (use_port)
+				*port = ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+			return AF_INET6;
+#ifdef HAVE_NETPACKET_PACKET_H
+		case AF_PACKET:
+			if (use_addr)
+				memcpy(addr, ((struct sockaddr_ll *)sa)->sll_addr, 6);
+			return AF_PACKET;
+#else
+		case AF_LINK:
+			if (use_addr)
+				memcpy(addr, ((struct sockaddr_dl *)sa)->sdl_data, 6);
+			return AF_LINK;
+#endif
+	}
+	return AF_UNSPEC;
+}
 
-flows_t flows;
+static void expand_sockaddr(uint8_t family, const uint8_t *addr,
+		struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+	switch (family) {
+		case AF_INET:
+			memcpy(&((struct sockaddr_in *)ss)->sin_addr, addr, 4);
+			break;
+		case AF_INET6:
+			memcpy(&((struct sockaddr_in6 *)ss)->sin6_addr, addr, 16);
+			break;
+#ifdef HAVE_NETPACKET_PACKET_H
+		case AF_PACKET:
+			((struct sockaddr_ll *)ss)->sll_halen = 6;
+			memcpy(((struct sockaddr_ll *)ss)->sll_addr, addr, 6);
+			break;
+#else
+		case AF_LINK:
+			((struct sockaddr_dl *)ss)->sdl_alen = 6;
+			memcpy(((struct sockaddr_dl *)ss)->sdl_data, addr, 6);
+			break;
+#endif
+	}
+}
 
 const char *nice_bandwidth(double bytespersec)
 {
@@ -255,80 +414,131 @@ const char *nice_bandwidth(double bytespersec)
 	return ret;
 }
 
-static void per_packet(libtrace_packet_t *packet)
+struct thread_data_t {
+	flowtable_t *flows;
+	uint64_t interval;
+};
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED)
+{
+	thread_data_t *td = (thread_data_t *)calloc(1, sizeof(thread_data_t));
+
+	td->flows = flowtable_create(FLOWTABLE_INITIAL_SIZE, 0);
+	return td;
+}
+
+/* Hands the flows for the interval that has just ended to the reporter.
+ * A thread with no flows still publishes an empty result, as the ordered
+ * combiner holds back every other thread's flows until it hears from us */
+static void publish_flows(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td)
 {
-	flowkey_t flowkey;
-	flows_t::iterator it;
+	libtrace_generic_t res;
+	uint32_t size = td->flows->mask + 1;
+
+	if (td->flows->count == 0) {
+		res.ptr = NULL;
+		trace_publish_result(trace, t, td->interval, res, RESULT_USER);
+		return;
+	}
 
-        if (IS_LIBTRACE_META_PACKET(packet))
-                return;
+	/* The reporter owns the table as soon as it is published */
+	res.ptr = td->flows;
+	trace_publish_result(trace, t, td->interval, res, RESULT_USER);
+	trace_post_reporter(trace);
 
-	if (trace_get_source_address(packet,(struct sockaddr*)&flowkey.sip)==NULL)
-		flowkey.sip.ss_family = AF_UNSPEC;
+	/* Start from the size the last table grew to, as the next interval
+	 * is likely to need about as many slots */
+	td->flows = flowtable_create(size, 0);
+}
+
+static void next_interval(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td, double ts)
+{
+	uint64_t idx = (uint64_t)(ts / interval);
+
+	if (idx > td->interval) {
+		publish_flows(trace, t, td);
+		td->interval = idx;
+	}
+}
 
-	if (trace_get_destination_address(packet,(struct sockaddr*)&flowkey.dip)==NULL)
-		flowkey.dip.ss_family = AF_UNSPEC;
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, libtrace_packet_t *packet)
+{
+	thread_data_t *td = (thread_data_t *)tls;
+	struct sockaddr_storage sa;
+	flowkey_t flowkey;
 
-	if (!use_sip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.sip);
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
 
-	if (!use_dip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.dip);
+	next_interval(trace, t, td, trace_get_seconds(packet));
 
-	if (!use_sport)
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.sip,0);
+	memset(&flowkey, 0, sizeof(flowkey));
+	if (trace_get_source_address(packet,(struct sockaddr*)&sa)!=NULL)
+		flowkey.sfamily = compact_sockaddr((struct sockaddr *)&sa,
+				use_sip, use_sport, flowkey.sip,
+				&flowkey.sport);
 
-	if (!use_dport) 
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.dip,0);
+	if (trace_get_destination_address(packet,(struct sockaddr*)&sa)!=NULL)
+		flowkey.dfamily = compact_sockaddr((struct sockaddr *)&sa,
+				use_dip, use_dport, flowkey.dip,
+				&flowkey.dport);
 
 	if (use_protocol && trace_get_transport(packet,&flowkey.protocol, NULL) == NULL)
 		flowkey.protocol = 255;
 
+	flowtable_add(td->flows, &flowkey, 1, trace_get_wire_length(packet));
+	return packet;
+}
 
-	it = flows.find(flowkey);
-	if (it == flows.end()) {
-		flowdata_t flowdata = { 0, 0 };
-		flows_t::value_type insdata(flowkey,flowdata);
-		std::pair<flows_t::iterator,bool> ins= flows.insert(insdata);
-		it = ins.first;
-	}
-
-	++it->second.packets;
-	it->second.bytes+=trace_get_wire_length(packet);
+static void per_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, uint64_t order)
+{
+	thread_data_t *td = (thread_data_t *)tls;
+	libtrace_generic_t res;
 
-	++total_packets;
-	total_bytes+=trace_get_wire_length(packet);
+	next_interval(trace, t, td,
+			(order >> 32) + (order & 0xffffffffULL) / 4294967296.0);
 
+	/* Let the reporter know we have nothing older than this, even if we
+	 * have seen no packets at all */
+	res.ptr = NULL;
+	trace_publish_result(trace, t, td->interval, res, RESULT_USER);
 }
 
-struct flow_data_t {
-	uint64_t bytes;
-	uint64_t packets;
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint8_t protocol;
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls)
+{
+	thread_data_t *td = (thread_data_t *)tls;
 
-	bool operator< (const flow_data_t &b) const {
-		if (bytes != b.bytes) return bytes < b.bytes;
-		return packets < b.packets;
-	}
-};
+	publish_flows(trace, t, td);
+	flowtable_destroy(td->flows);
+	free(td);
+}
+
+static bool top_order(const flowentry_t *a, const flowentry_t *b)
+{
+	return flow_less(b, a);
+}
 
 static void do_report()
 {
-	typedef  std::priority_queue<flow_data_t> pq_t;
+	flowentry_t *top[TOP_FLOWS];
+	uint32_t i, ntop = flows->topcount;
 	int row,col;
-	pq_t pq;
-	for(flows_t::const_iterator it=flows.begin();it!=flows.end();++it) {
-		flow_data_t data;
-		data.bytes = it->second.bytes,
-		data.packets = it->second.packets,
-		data.sip = it->first.sip;
-		data.dip = it->first.dip;
-		data.protocol = it->first.protocol;
-		pq.push(data);
-	}
+
+	total_bytes = flows->bytes;
+	total_packets = flows->packets;
+	for (i = 0; i < ntop; i++)
+		top[i] = &flows->slots[flows->top[i]];
+	std::sort(top, top + ntop, top_order);
+
+	pthread_mutex_lock(&display_lock);
 	getmaxyx(stdscr,row,col);
+	(void)col;
 	move(0,0);
 	printw("Total Bytes: %10" PRIu64 " (%s)\tTotal Packets: %10" PRIu64, total_bytes, nice_bandwidth(total_bytes/interval), total_packets);
 	clrtoeol();
@@ -370,12 +580,16 @@ static void do_report()
 	attrset(A_NORMAL);
 	char sipstr[1024];
 	char dipstr[1024];
-	for(int i=1; i<row-3 && !pq.empty(); ++i) {
-		move(i+1,0);
+	for(i=0; (int)i<row-4 && i<ntop; ++i) {
+		const flowentry_t *e = top[i];
+		struct sockaddr_storage sa;
+
+		move(i+2,0);
 		if (use_sip) {
-			printw("%*s", wide_display ? 42 : 20, 
+			expand_sockaddr(e->key.sfamily, e->key.sip, &sa);
+			printw("%*s", wide_display ? 42 : 20,
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().sip,
+						(struct sockaddr*)&sa,
 						sizeof(struct sockaddr_storage),
 						sipstr,sizeof(sipstr)));
 			if (use_sport)
@@ -384,11 +598,12 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_sport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().sip));
+			printw("%-5d  ", e->key.sport);
 		if (use_dip) {
-			printw("%*s", wide_display ? 42 : 20, 
+			expand_sockaddr(e->key.dfamily, e->key.dip, &sa);
+			printw("%*s", wide_display ? 42 : 20,
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().dip,
+						(struct sockaddr*)&sa,
 						sizeof(struct sockaddr_storage),
 						dipstr,sizeof(dipstr)));
 			if (use_dport)
@@ -397,121 +612,117 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_dport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().dip));
+			printw("%-5d  ", e->key.dport);
 		if (use_protocol) {
-			struct protoent *proto = getprotobynumber(pq.top().protocol);
-			if (proto) 
+			struct protoent *proto = getprotobynumber(e->key.protocol);
+			if (proto)
 				printw("%-10s  ", proto->p_name);
 			else
-				printw("%10d  ",pq.top().protocol);
+				printw("%10d  ",e->key.protocol);
 		}
 		switch (display_as) {
 			case BYTES:
 				printw("%7" PRIu64 "\t%7" PRIu64 "\n",
-						pq.top().bytes,
-						pq.top().packets);
+						e->bytes,
+						e->packets);
 				break;
 			case BITS_PER_SEC:
 				printw("%14.03f\t%" PRIu64 "\n",
-						8.0*pq.top().bytes/interval,
-						pq.top().packets);
+						8.0*e->bytes/interval,
+						e->packets);
 				break;
 			case PERCENT:
 				printw("%6.2f%%\t%6.2f%%\n",
-						100.0*pq.top().bytes/total_bytes,
-						100.0*pq.top().packets/total_packets);
+						100.0*e->bytes/total_bytes,
+						100.0*e->packets/total_packets);
 		}
-		pq.pop();
 	}
-	flows.clear();
-	total_packets = 0;
-	total_bytes = 0;
 
 	clrtobot();
 	refresh();
+	pthread_mutex_unlock(&display_lock);
+
+	flowtable_clear(flows);
 }
 
-static void run_trace(libtrace_t *trace)
+static void per_result(libtrace_t *trace UNUSED, libtrace_thread_t *sender UNUSED,
+		void *global UNUSED, void *tls UNUSED, libtrace_result_t *result)
 {
-	libtrace_packet_t *packet = trace_create_packet();
-	libtrace_eventobj_t obj;
-	fd_set rfds;
-	struct timeval sleep_tv;
-	struct timeval *tv = NULL;
-
-	do {
-		int maxfd=0;
-		FD_ZERO(&rfds);
-		FD_SET(0, &rfds); /* stdin */
-		tv=NULL;
-		maxfd=0;
-
-		obj = trace_event(trace, packet);
-		switch(obj.type) {
-			case TRACE_EVENT_IOWAIT:
-				FD_SET(obj.fd, &rfds);
-				maxfd = obj.fd;
-				break;
+	flowtable_t *tflows = (flowtable_t *)result->value.ptr;
+	uint32_t i;
+
+	if (result->type != RESULT_USER)
+		return;
+
+	/* The ordered combiner delivers every thread's flows for an interval
+	 * before any flows for a later one */
+	if (result->key != current_interval) {
+		if (flows->count)
+			do_report();
+		current_interval = result->key;
+	}
 
-			case TRACE_EVENT_SLEEP:
-				sleep_tv.tv_sec = (int)obj.seconds;
-				sleep_tv.tv_usec = (int)((obj.seconds - sleep_tv.tv_sec)*1000000.0);
+	/* An idle thread, or a tick */
+	if (!tflows)
+		return;
 
-				tv = &sleep_tv;
-				break;;
+	for (i = 0; i <= tflows->mask; i++) {
+		const flowentry_t *e = &tflows->slots[i];
+		if (e->packets)
+			flowtable_add(flows, &e->key, e->packets, e->bytes);
+	}
+	flowtable_destroy(tflows);
+}
 
-			case TRACE_EVENT_TERMINATE:
-				trace_destroy_packet(packet);
-				return;
+static void stop_reporter(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls UNUSED)
+{
+	if (flows->count)
+		do_report();
+}
 
-			case TRACE_EVENT_PACKET:
-				if (obj.size == -1)
-					break;
-				if (trace_get_seconds(packet) - last_report >= interval) {
-					do_report();
-					last_report=trace_get_seconds(packet);
-				}
-				if (trace_read_packet(trace,packet) <= 0) {
-					obj.size = -1;
-					break;
-				}
-				per_packet(packet);
-				continue;
-		}
+/* Reads keypresses until the trace finishes or the user quits */
+static void run_keyboard(libtrace_t *trace)
+{
+	while (!trace_has_finished(trace)) {
+		struct timeval tv;
+		fd_set rfds;
 
-		if (tv && tv->tv_sec > interval) {
-			tv->tv_sec = (int)interval;
-			tv->tv_usec = 0;
-		}
+		FD_ZERO(&rfds);
+		FD_SET(0, &rfds); /* stdin */
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
 
-		select(maxfd+1, &rfds, 0, 0, tv);
-		if (FD_ISSET(0, &rfds)) {
-			switch (getch()) {
-				case '%':
-					display_as = PERCENT;
-					break;
-				case 'b':
-					display_as = BITS_PER_SEC;
-					break;
-				case 'B':
-					display_as = BYTES;
-					break;
-				case '\x1b': /* Escape */
-				case 'q':
-					quit = true;
-					trace_destroy_packet(packet);
-					return;
-				case '1': use_sip 	= !use_sip; break;
-				case '2': use_sport 	= !use_sport; break;
-				case '3': use_dip 	= !use_dip; break;
-				case '4': use_dport 	= !use_dport; break;
-				case '5': use_protocol 	= !use_protocol; break;
-			}
-		}
-	} while (obj.type != TRACE_EVENT_TERMINATE || obj.size == -1);
+		if (select(1, &rfds, 0, 0, &tv) <= 0)
+			continue;
 
-	trace_destroy_packet(packet);
-} 
+		pthread_mutex_lock(&display_lock);
+		int c = getch();
+		pthread_mutex_unlock(&display_lock);
+
+		switch (c) {
+			case '%':
+				display_as = PERCENT;
+				break;
+			case 'b':
+				display_as = BITS_PER_SEC;
+				break;
+			case 'B':
+				display_as = BYTES;
+				break;
+			case '\x1b': /* Escape */
+			case 'q':
+				quit = true;
+				trace_pstop(trace);
+				return;
+			case '1': use_sip 	= !use_sip; break;
+			case '2': use_sport 	= !use_sport; break;
+			case '3': use_dip 	= !use_dip; break;
+			case '4': use_dport 	= !use_dport; break;
+			case '5': use_protocol 	= !use_protocol; break;
+		}
+	}
+}
 
 static void usage(char *argv0)
 {
@@ -537,12 +748,16 @@ static void usage(char *argv0)
 	fprintf(stderr," --wide\n");
 	fprintf(stderr," -w\n");
 	fprintf(stderr,"\t\tExpand IP address fields to fit IPv6 addresses\n");
+	fprintf(stderr," --threads max\n");
+	fprintf(stderr," -t max\n");
+	fprintf(stderr,"\t\tUse this number of packet processing threads (default: 4)\n");
 }
 
 int main(int argc, char *argv[])
 {
 	libtrace_t *trace;
 	libtrace_filter_t *filter=NULL;
+	libtrace_callback_set_t *pktcbs, *repcbs;
 	int snaplen=-1;
 	int promisc=-1;
 
@@ -561,10 +776,11 @@ int main(int argc, char *argv[])
 			{ "interval",		1, 0, 'i' },
 			{ "fast",		0, 0, 'F' },
 			{ "wide", 		0, 0, 'w' },
+			{ "threads",		1, 0, 't' },
 			{ NULL,			0, 0, 0 }
 		};
 
-		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:w12345",
+		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:wt:12345",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -602,6 +818,11 @@ int main(int argc, char *argv[])
 			case 'w':
 				wide_display = true;
 				break;
+			case 't':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			case '1': use_sip 	= !use_sip; break;
 			case '2': use_sport 	= !use_sport; break;
 			case '3': use_dip 	= !use_dip; break;
@@ -622,6 +843,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, start_processing);
+	trace_set_packet_cb(pktcbs, per_packet);
+	trace_set_tick_interval_cb(pktcbs, per_tick);
+	trace_set_stopping_cb(pktcbs, stop_processing);
+
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, per_result);
+	trace_set_stopping_cb(repcbs, stop_reporter);
+
+	flows = flowtable_create(FLOWTABLE_INITIAL_SIZE, TOP_FLOWS);
+
 	initscr(); cbreak(); noecho();
 
 	while (!quit && optind<argc) {
@@ -647,31 +880,43 @@ int main(int argc, char *argv[])
 				trace_perror(trace,"ignoring: ");
 			}
 		}
-		if (fullspeed) {
-			int flag=1;
-			if (trace_config(trace,TRACE_OPTION_EVENT_REALTIME,&flag)) {
-				trace_perror(trace,"Setting EVENT_REALTIME option");
-			}
-		}
 
-		if (trace_start(trace)) {
+		trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
+		trace_set_perpkt_threads(trace, threadcount);
+
+		/* Make sure quiet threads still report each interval on a
+		 * live capture, otherwise replay traces at their own pace
+		 * unless asked to run as fast as possible */
+		if (trace_get_information(trace)->live)
+			trace_set_tick_interval(trace, (size_t)(interval * 1000));
+		else if (!fullspeed)
+			trace_set_tracetime(trace, true);
+
+		if (trace_pstart(trace, NULL, pktcbs, repcbs) == -1) {
 			endwin();
 			trace_perror(trace,"Starting trace");
 			trace_destroy(trace);
 			return 1;
 		}
 
-		run_trace(trace);
+		run_keyboard(trace);
+		trace_join(trace);
 
 		if (trace_is_err(trace)) {
 			trace_perror(trace,"Reading packets");
 		}
 
 		trace_destroy(trace);
+		flowtable_clear(flows);
+		current_interval = 0;
 	}
 
 	endwin();
 	endprotoent();
 
+	flowtable_destroy(flows);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+
 	return 0;
 }